@@ -0,0 +1,49 @@
+/******************************************************************************
+Arduino.h
+Host stand-in for the Arduino core
+
+Just enough of the Arduino API for the MPU-9250 DMP library to build on a
+PC. Time comes from the simulated MPU-9250 (mpu9250_sim.h): millis() and
+micros() read its clock, and delay() advances it, so the library's waits
+cost simulated time instead of real time. delay() also finishes the host
+I2C transfer engine's background transactions (see mpu9250_sim.cpp).
+
+This header is included from C (inv_mpu.c) as well as C++.
+******************************************************************************/
+#ifndef _HOST_ARDUINO_H_
+#define _HOST_ARDUINO_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define PI 3.1415926535897932384626433832795
+
+#define constrain(amt, low, high) \
+  ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+#ifndef __cplusplus
+// C++ code gets std::min; the SAMD core defines this for C only too
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+// An IAR intrinsic left in inv_mpu_dmp_motion_driver.c. The SAMD build
+// never links the function that uses it; the host build does.
+static inline void __no_operation(void)
+{
+}
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _HOST_ARDUINO_H_
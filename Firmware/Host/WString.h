@@ -0,0 +1,137 @@
+/******************************************************************************
+WString.h
+Host stand-in for the Arduino String class
+
+Implements the subset of Arduino's String used by the original String-based
+logIMUData(), following the same buffer management as the SAMD core's
+WString.cpp: every construction allocates an exactly-sized buffer, concat()
+reallocs to the exact new length, String + "..." goes through a
+StringSumHelper copy, and floats are printed with dtostrf().
+
+Every malloc/realloc is counted in stringAllocCount and stringAllocBytes, so
+benchmarks can report the heap traffic the firmware would see.
+******************************************************************************/
+#ifndef _HOST_WSTRING_H_
+#define _HOST_WSTRING_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static unsigned long stringAllocCount = 0; // malloc/realloc calls
+static unsigned long stringAllocBytes = 0; // Bytes requested by those calls
+
+// Same as the SAMD core's avr/dtostrf.c
+static inline char * dtostrf(double val, signed char width, unsigned char prec,
+                             char * sout)
+{
+  char fmt[20];
+  sprintf(fmt, "%%%d.%df", width, prec);
+  sprintf(sout, fmt, val);
+  return sout;
+}
+
+class StringSumHelper;
+
+class String
+{
+public:
+  String(const char * cstr = "") { init(); copy(cstr, strlen(cstr)); }
+  String(const String & str) { init(); copy(str.buffer, str.len); }
+  explicit String(int value) { init(); char buf[12]; sprintf(buf, "%d", value); copy(buf, strlen(buf)); }
+  explicit String(unsigned int value) { init(); char buf[12]; sprintf(buf, "%u", value); copy(buf, strlen(buf)); }
+  explicit String(long value) { init(); char buf[22]; sprintf(buf, "%ld", value); copy(buf, strlen(buf)); }
+  explicit String(unsigned long value) { init(); char buf[22]; sprintf(buf, "%lu", value); copy(buf, strlen(buf)); }
+  explicit String(float value, unsigned char decimalPlaces = 2)
+  {
+    init();
+    char buf[33];
+    dtostrf(value, decimalPlaces + 2, decimalPlaces, buf);
+    copy(buf, strlen(buf));
+  }
+  ~String() { free(buffer); }
+
+  String & operator = (const String & rhs)
+  {
+    if (this != &rhs)
+      copy(rhs.buffer, rhs.len);
+    return *this;
+  }
+  String & operator = (const char * cstr) { copy(cstr, strlen(cstr)); return *this; }
+
+  String & operator += (const String & rhs) { concat(rhs.buffer, rhs.len); return *this; }
+  String & operator += (const char * cstr) { concat(cstr, strlen(cstr)); return *this; }
+
+  friend StringSumHelper & operator + (const StringSumHelper & lhs, const char * cstr);
+
+  void remove(unsigned int index, unsigned int count)
+  {
+    if (index >= len)
+      return;
+    if (count > len - index)
+      count = len - index;
+    memmove(buffer + index, buffer + index + count, len - index - count + 1);
+    len -= count;
+  }
+
+  unsigned int length(void) const { return len; }
+  const char * c_str(void) const { return buffer; }
+
+protected:
+  void init(void) { buffer = NULL; capacity = 0; len = 0; }
+
+  bool reserve(unsigned int size)
+  {
+    if (buffer && capacity >= size)
+      return true;
+    char * newbuffer = (char *)realloc(buffer, size + 1);
+    stringAllocCount++;
+    stringAllocBytes += size + 1;
+    if (!newbuffer)
+      return false;
+    if (!buffer)
+      newbuffer[0] = '\0';
+    buffer = newbuffer;
+    capacity = size;
+    return true;
+  }
+
+  void copy(const char * cstr, unsigned int length)
+  {
+    if (!reserve(length))
+      return;
+    len = length;
+    memmove(buffer, cstr, length);
+    buffer[len] = '\0';
+  }
+
+  void concat(const char * cstr, unsigned int length)
+  {
+    unsigned int newlen = len + length;
+    if (!length || !reserve(newlen))
+      return;
+    memcpy(buffer + len, cstr, length);
+    len = newlen;
+    buffer[len] = '\0';
+  }
+
+  char * buffer;
+  unsigned int capacity;
+  unsigned int len;
+};
+
+class StringSumHelper : public String
+{
+public:
+  StringSumHelper(const String & s) : String(s) {}
+};
+
+inline StringSumHelper & operator + (const StringSumHelper & lhs,
+                                     const char * cstr)
+{
+  StringSumHelper & a = const_cast<StringSumHelper &>(lhs);
+  a.concat(cstr, strlen(cstr));
+  return a;
+}
+
+#endif // _HOST_WSTRING_H_
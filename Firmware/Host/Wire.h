@@ -0,0 +1,59 @@
+/******************************************************************************
+Wire.h
+Host stand-in for the Arduino Wire (I2C) library
+
+Implements the TwoWire calls used by arduino_mpu9250_i2c.cpp on top of the
+simulated MPU-9250 (mpu9250_sim.h). Transactions behave like the SAMD
+core's: a write is sent by endTransmission(), which returns 2 if the
+address isn't acknowledged, and requestFrom() reads into a 64-byte receive
+buffer. Each transaction advances the simulated clock by the time it would
+take on the bus at the setClock() rate (100 kHz by default). Faults set up
+with mpuSim.injectFault() or setFaultRate() show up as the SAMD core
+reports them: endTransmission() returns 2 for an address NACK, 3 for a
+data NACK and 4 for a bus error, and requestFrom() returns fewer bytes.
+The I2C transaction queue's transfer engine (arduino_i2c_dma_start()) has
+a host version in mpu9250_sim.cpp too, which bypasses this class.
+******************************************************************************/
+#ifndef _HOST_WIRE_H_
+#define _HOST_WIRE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define WIRE_BUFFER_LENGTH 64
+
+class TwoWire
+{
+public:
+  TwoWire();
+
+  void begin(void);
+  void end(void);
+  void setClock(uint32_t clock);
+
+  void beginTransmission(uint8_t address);
+  size_t write(uint8_t data);
+  // endTransmission -- Send the queued write
+  // Output: 0 on success, 2 if the address was not acknowledged, 3 if a
+  // data byte wasn't, 4 on a bus error
+  uint8_t endTransmission(bool stopBit = true);
+
+  // requestFrom -- Read quantity bytes (at most WIRE_BUFFER_LENGTH)
+  // Output: Number of bytes received, 0 if the address wasn't acknowledged
+  // or the bus is stuck
+  uint8_t requestFrom(uint8_t address, size_t quantity, bool stopBit = true);
+  int available(void);
+  int read(void);
+
+private:
+  uint8_t _txAddress;
+  uint8_t _txBuffer[WIRE_BUFFER_LENGTH];
+  size_t _txLength;
+  uint8_t _rxBuffer[WIRE_BUFFER_LENGTH];
+  size_t _rxLength;
+  size_t _rxIndex;
+};
+
+extern TwoWire Wire;
+
+#endif // _HOST_WIRE_H_
@@ -0,0 +1,305 @@
+/******************************************************************************
+async_bench.cpp
+Blocking and background FIFO reads, against the simulated MPU-9250
+
+Runs the MPU-9250 DMP library against the simulated MPU-9250, set up the
+way the firmware's initIMU() does it, with its loop() logging the samples
+the INT pin handler reads, two ways:
+
+  blocking   the handler drains the FIFO in bursts and reads the compass,
+             like the firmware's acquireSamples(), waiting for each
+             transfer
+  async      the handler only starts the drain (dmpStartFifoBurst()); the
+             reads run on the I2C transaction queue's transfer engine, and
+             the loop calls asyncPoll() between blocks of samples, like
+             the firmware with ENABLE_ASYNC_ACQUISITION
+
+The host transfer engine stands in for the SAMD21's DMA: a transaction
+takes its bus time while the CPU goes on (see mpu9250_sim.cpp). Logging a
+sample costs LOG_US of CPU time. For each run it reports:
+
+  read      packets read, as a percentage of those the DMP wrote
+  bad       packets that don't match the simulated motion
+  mag       compass reads
+  i2c cpu   share of the time the CPU spent waiting for I2C transfers
+  idle      share of the time the loop had nothing to do
+  bus       share of the time the bus was busy
+  lag ms    longest time from a packet's interrupt to its being logged
+
+Everything runs on the simulator's clock, so results are deterministic and
+independent of the host's speed.
+
+Usage: async_bench [seconds]   (simulated seconds per run, default 10)
+******************************************************************************/
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <SparkFunMPU9250-DMP.h>
+#include <Wire.h>
+#include "mpu9250_sim.h"
+
+// The firmware's default settings (config.h)
+#define IMU_GYRO_FSR 2000
+#define IMU_ACCEL_FSR 2
+#define IMU_AG_LPF 5
+#define IMU_COMPASS_SAMPLE_RATE 100
+#define DMP_FEATURES (DMP_FEATURE_GYRO_CAL | DMP_FEATURE_SEND_CAL_GYRO | \
+                      DMP_FEATURE_SEND_RAW_ACCEL | DMP_FEATURE_6X_LP_QUAT)
+#define LOG_BLOCK_SIZE 16
+#define LOG_US 300 // CPU time to format and write one sample's log line
+#define IDLE_US 100 // The loop's step when there's nothing to log
+
+enum acquisitionMode
+{
+  BLOCKING,
+  ASYNC
+};
+
+struct asyncRun
+{
+  const char * name;
+  acquisitionMode mode;
+  unsigned short rate; // DMP FIFO rate, Hz
+  unsigned long clock; // I2C clock, Hz
+};
+
+static const asyncRun runs[] = {
+  {"blocking", BLOCKING, 100, 100000},
+  {"async", ASYNC, 100, 100000},
+  {"blocking", BLOCKING, 200, 100000},
+  {"async", ASYNC, 200, 100000},
+  {"blocking", BLOCKING, 200, 400000},
+  {"async", ASYNC, 200, 400000},
+};
+
+static MPU9250_DMP imu;
+static dmp_packet_s packets[DMP_MAX_BURST_PACKETS];
+
+// What a run counts. The handler and the loop run on one simulated CPU.
+static unsigned long readCount, badCount, magCount, waiting;
+static uint64_t i2cCpuUs, idleUs, edgeUs, lagUs;
+static bool draining;
+static unsigned char burstsLeft;
+
+// Same configuration as the firmware's initIMU()
+static bool initImu(unsigned short rate)
+{
+  if (imu.begin() != INV_SUCCESS)
+    return false;
+  imu.setGyroFSR(IMU_GYRO_FSR);
+  imu.setAccelFSR(IMU_ACCEL_FSR);
+  imu.setLPF(IMU_AG_LPF);
+  imu.setSampleRate(rate);
+  imu.setCompassMode(COMPASS_MODE_CONTINUOUS);
+  imu.setCompassSampleRate(IMU_COMPASS_SAMPLE_RATE);
+  if (imu.dmpBegin(DMP_FEATURES, rate) != INV_SUCCESS)
+    return false;
+  imu.setFifoRecovery(FIFO_RECOVERY_RESYNC);
+  return true;
+}
+
+// A packet is good if its accel reading is gravity, rotated into the
+// sensor frame by its quaternion
+static bool goodPacket(const dmp_packet_s & packet)
+{
+  double q[4];
+  for (int i = 0; i < 4; i++)
+    q[i] = packet.quat[i] / 1073741824.0;
+  double w = q[0], x = q[1], y = q[2], z = q[3];
+  double expected[3] = {2 * (x * z - w * y), 2 * (y * z + w * x),
+                        1 - 2 * (x * x + y * y)};
+  for (int i = 0; i < 3; i++)
+  {
+    if (fabs(packet.accel[i] - expected[i] * 32768.0 / IMU_ACCEL_FSR) > 2.0)
+      return false;
+  }
+  return true;
+}
+
+static void storePackets(unsigned char count)
+{
+  for (unsigned char i = 0; i < count; i++)
+  {
+    if (!goodPacket(packets[i]))
+      badCount++;
+  }
+  readCount += count;
+  waiting += count;
+}
+
+// Like the firmware's acquireSamples(): every transfer waits on the bus
+static void blockingDrain(void)
+{
+  uint64_t start = mpuSim.now();
+  unsigned char count, more, left = 4;
+  unsigned long timestamp;
+  do
+  {
+    if (dmp_read_fifo_burst(packets, DMP_MAX_BURST_PACKETS, &count,
+                            &timestamp, &more) != INV_SUCCESS)
+      break;
+    short mag[3];
+    unsigned long magTime;
+    if (mpu_get_compass_reg(mag, &magTime) == INV_SUCCESS)
+      magCount++;
+    storePackets(count);
+  } while (more && --left);
+  i2cCpuUs += mpuSim.now() - start;
+}
+
+// Like the firmware's asyncBurstRead() and friends
+static void burstRead(void);
+
+static void startDrain(void)
+{
+  burstsLeft = 4;
+  draining = (imu.dmpStartFifoBurst(packets, DMP_MAX_BURST_PACKETS,
+                                    burstRead) == INV_SUCCESS);
+}
+
+static void storeBurst(void)
+{
+  unsigned char count;
+  imu.dmpFifoBurstResult(&count);
+  storePackets(count);
+  if (!imu.fifoPending() || !--burstsLeft ||
+      (imu.dmpStartFifoBurst(packets, DMP_MAX_BURST_PACKETS, burstRead) !=
+       INV_SUCCESS))
+    draining = false;
+}
+
+static void compassRead(void)
+{
+  if (imu.compassReadResult() == INV_SUCCESS)
+    magCount++;
+  storeBurst();
+}
+
+static void burstRead(void)
+{
+  unsigned char count;
+  if (imu.dmpFifoBurstResult(&count) != INV_SUCCESS)
+  {
+    draining = false;
+    return;
+  }
+  if (imu.startCompassRead(compassRead) != INV_SUCCESS)
+    storeBurst();
+}
+
+static acquisitionMode currentMode;
+static bool edgeMissed;
+
+static void imuInterrupt(void)
+{
+  if (!waiting)
+    edgeUs = mpuSim.now(); // The oldest packet not yet logged
+  if (currentMode == BLOCKING)
+    blockingDrain();
+  else if (draining)
+    edgeMissed = true; // The loop starts another drain when this one's done
+  else
+    startDrain();
+}
+
+// The CPU time asyncPoll() takes is its blocking transfers' (the FIFO
+// overflow checks), and the done functions are as quick as the
+// blocking handler's
+static void poll(void)
+{
+  uint64_t start = mpuSim.now();
+  imu.asyncPoll();
+  i2cCpuUs += mpuSim.now() - start;
+  if (!draining && edgeMissed)
+  {
+    edgeMissed = false;
+    startDrain();
+  }
+}
+
+static void simulate(const asyncRun & run, double seconds)
+{
+  mpuSim.powerOn();
+  mpuSim.setInterruptHandler(NULL);
+  mpuSim.setRotationRate(30.0f, -20.0f, 45.0f);
+  Wire.setClock(run.clock);
+  if (!initImu(run.rate))
+  {
+    printf("initialization failed\n");
+    return;
+  }
+
+  currentMode = run.mode;
+  readCount = badCount = magCount = waiting = 0;
+  i2cCpuUs = idleUs = lagUs = 0;
+  draining = edgeMissed = false;
+  mpu9250SimStats start = mpuSim.stats();
+  uint64_t startUs = mpuSim.now();
+  uint64_t endUs = startUs + (uint64_t)(seconds * 1e6);
+
+  mpuSim.setInterruptHandler(imuInterrupt);
+  // Like the firmware, drain once to clear an interrupt latched before the
+  // handler was attached
+  edgeUs = mpuSim.now();
+  if (run.mode == BLOCKING)
+    blockingDrain();
+  else
+    startDrain();
+
+  while (mpuSim.now() < endUs)
+  {
+    if (run.mode == ASYNC)
+      poll();
+    if (!waiting)
+    {
+      uint64_t idleStart = mpuSim.now();
+      uint64_t i2cStart = i2cCpuUs;
+      delayMicroseconds(IDLE_US);
+      // A blocking handler that ran meanwhile took its time from the idle
+      idleUs += mpuSim.now() - idleStart - (i2cCpuUs - i2cStart);
+      continue;
+    }
+    // Log a block, with the CPU busy for each sample
+    unsigned long count = (waiting < LOG_BLOCK_SIZE) ? waiting :
+                          LOG_BLOCK_SIZE;
+    waiting -= count;
+    uint64_t lag = mpuSim.now() - edgeUs;
+    if (lag > lagUs)
+      lagUs = lag;
+    edgeUs = mpuSim.now();
+    for (unsigned long i = 0; i < count; i++)
+      delayMicroseconds(LOG_US);
+  }
+
+  mpuSim.setInterruptHandler(NULL);
+  while (draining)
+    poll(), delayMicroseconds(IDLE_US);
+  const mpu9250SimStats & end = mpuSim.stats();
+  double elapsed = (double)(mpuSim.now() - startUs);
+  unsigned long written = end.dmpPackets - start.dmpPackets;
+
+  printf("%-9s %4u %4lu %6lu %5.1f%% %4lu %5lu %6.1f%% %5.1f%% %5.1f%% %6.1f\n",
+         run.name, run.rate, run.clock / 1000, readCount,
+         written ? 100.0 * readCount / written : 0.0, badCount, magCount,
+         100.0 * i2cCpuUs / elapsed, 100.0 * idleUs / elapsed,
+         100.0 * (end.busTimeUs - start.busTimeUs) / elapsed, lagUs / 1000.0);
+}
+
+int main(int argc, char * argv[])
+{
+  double seconds = (argc > 1) ? atof(argv[1]) : 10.0;
+  if (seconds <= 0.0)
+  {
+    printf("Usage: async_bench [seconds]\n");
+    return 1;
+  }
+
+  printf("%.0f s per run, logging %d us per sample\n", seconds, LOG_US);
+  printf("%-9s %4s %4s %6s %6s %4s %5s %7s %6s %6s %6s\n", "mode", "Hz",
+         "kHz", "read", "", "bad", "mag", "i2c cpu", "idle", "bus",
+         "lag ms");
+  for (const asyncRun & run : runs)
+    simulate(run, seconds);
+  return 0;
+}
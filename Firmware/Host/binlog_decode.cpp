@@ -0,0 +1,380 @@
+/******************************************************************************
+binlog_decode.cpp
+Convert a 9DoF Razor binary log to text
+
+Reads a binary log (an SD card .bin file, or a capture of the serial port)
+and prints its records as comma-separated text, in the same units as the
+firmware's calculated text log, or as raw counts with -r.
+
+Every header in the log starts a new column line. Records are checked
+against their CRC, and sequence numbers are checked for gaps. Capture
+records (raw capture mode) are printed a sample per line, timed from the
+start of the capture at the header's sample rate, and gaps in their sample
+numbers are counted as lost samples. Anything that
+doesn't parse (a torn record, or serial menu text) is skipped until the
+next header or record. A summary is printed to stderr.
+
+Records are converted to calculated units a block at a time, one axis per
+call of the DMP library's block conversions (util/block_convert.h), which
+the compiler can vectorize.
+
+Usage: binlog_decode [-r] [log.bin]   (reads stdin if no file is given)
+******************************************************************************/
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#include "binary_log.h"
+extern "C" {
+#include "block_convert.h"
+}
+
+#define BLOCK_RECORDS 256 // Records converted together
+
+struct decodeStats
+{
+  unsigned long headers;
+  unsigned long records;
+  unsigned long badRecords; // Failed CRC where a record was expected
+  unsigned long dropped; // Missing sequence numbers
+  unsigned long samples; // Capture samples
+  unsigned long lostSamples; // Missing capture sample numbers
+  unsigned long skippedBytes;
+};
+
+static void printColumns(const binLogConfig & config, bool raw)
+{
+  printf("# %u Hz%s, accel +/-%u g, gyro +/-%u dps, mag +/-%u uT%s\n",
+         config.sampleRate,
+         (config.channels & BINLOG_CH_CAPTURE) ? " raw capture" : "",
+         config.accelFSR, config.gyroFSR, config.magFSR,
+         raw ? ", raw counts" : "");
+  if (config.i2cClock)
+    printf("# I2C at %u kHz\n", config.i2cClock);
+  if (config.channels & BINLOG_CH_CAPTURE)
+    return; // Capture records print their own, see printCapture()
+  const char * sep = "";
+  printf("# ");
+  if (config.channels & BINLOG_CH_TIME)
+  {
+    printf("%stime", sep);
+    sep = ", ";
+  }
+  if (config.channels & BINLOG_CH_ACCEL)
+  {
+    printf("%sax, ay, az", sep);
+    sep = ", ";
+  }
+  if (config.channels & BINLOG_CH_GYRO)
+  {
+    printf("%sgx, gy, gz", sep);
+    sep = ", ";
+  }
+  if (config.channels & BINLOG_CH_MAG)
+  {
+    printf("%smx, my, mz", sep);
+    sep = ", ";
+  }
+  if (config.channels & BINLOG_CH_QUAT)
+    printf("%sqw, qx, qy, qz", sep);
+  printf("\n");
+}
+
+// Records waiting to be printed. The accel, gyro and mag axes are copied
+// out to a row each (sample i is column i) to be converted. Quaternions are
+// printed straight from Q30, as the firmware does: through a float, the
+// last digit would sometimes round the other way.
+struct recordBlock
+{
+  unsigned int count;
+  imuSample samples[BLOCK_RECORDS];
+  short counts[9][BLOCK_RECORDS]; // ax..az, gx..gz, mx..mz
+  float units[9][BLOCK_RECORDS]; // counts, in g's, dps and uT
+};
+
+// Convert the enabled accel, gyro and mag channels of every record in block
+static void convertBlock(const binLogConfig & config, recordBlock & block)
+{
+  const unsigned int n = block.count;
+  for (unsigned int i = 0; i < n; i++)
+  {
+    for (int axis = 0; axis < 3; axis++)
+    {
+      block.counts[axis][i] = block.samples[i].accel[axis];
+      block.counts[3 + axis][i] = block.samples[i].gyro[axis];
+      block.counts[6 + axis][i] = block.samples[i].mag[axis];
+    }
+  }
+  for (int axis = 0; axis < 3; axis++)
+  {
+    if (config.channels & BINLOG_CH_ACCEL)
+      block_scale(block.counts[axis], block.units[axis], n,
+                  1.0f / config.accelSens);
+    if (config.channels & BINLOG_CH_GYRO)
+      block_scale(block.counts[3 + axis], block.units[3 + axis], n,
+                  1.0f / config.gyroSens);
+    if (config.channels & BINLOG_CH_MAG)
+      block_scale(block.counts[6 + axis], block.units[6 + axis], n,
+                  config.magSens);
+  }
+}
+
+// Print record index of block, from its counts if raw, otherwise from the
+// units convertBlock() found
+static void printRecord(const binLogConfig & config,
+                        const recordBlock & block, unsigned int index,
+                        bool raw)
+{
+  const imuSample & s = block.samples[index];
+  const char * sep = "";
+  if (config.channels & BINLOG_CH_TIME)
+  {
+    printf("%lu.%03u", (unsigned long)s.time, s.timeUs);
+    sep = ", ";
+  }
+  if (config.channels & BINLOG_CH_ACCEL)
+  {
+    for (int i = 0; i < 3; i++, sep = ", ")
+    {
+      if (raw)
+        printf("%s%d", sep, s.accel[i]);
+      else
+        printf("%s%.2f", sep, block.units[i][index]);
+    }
+  }
+  if (config.channels & BINLOG_CH_GYRO)
+  {
+    for (int i = 0; i < 3; i++, sep = ", ")
+    {
+      if (raw)
+        printf("%s%d", sep, s.gyro[i]);
+      else
+        printf("%s%.2f", sep, block.units[3 + i][index]);
+    }
+  }
+  if (config.channels & BINLOG_CH_MAG)
+  {
+    for (int i = 0; i < 3; i++, sep = ", ")
+    {
+      if (raw)
+        printf("%s%d", sep, s.mag[i]);
+      else
+        printf("%s%.2f", sep, block.units[6 + i][index]);
+    }
+  }
+  if (config.channels & BINLOG_CH_QUAT)
+  {
+    for (int i = 0; i < 4; i++, sep = ", ")
+    {
+      if (raw)
+        printf("%s%ld", sep, (long)s.quat[i]);
+      else
+        printf("%s%.4f", sep, s.quat[i] / 1073741824.0);
+    }
+  }
+  printf("\n");
+}
+
+// Print and empty block
+static void flushBlock(const binLogConfig & config, recordBlock & block,
+                       bool raw)
+{
+  if (!raw)
+    convertBlock(config, block);
+  for (unsigned int i = 0; i < block.count; i++)
+    printRecord(config, block, i, raw);
+  block.count = 0;
+}
+
+// Print the samples of a capture record, a line each, with a column line
+// first if its sensors differ from the last record's
+static void printCapture(const binLogConfig & config, uint32_t first,
+                         uint8_t sensors, uint8_t count,
+                         const int16_t * values, uint8_t & lastSensors,
+                         bool raw)
+{
+  static const struct
+  {
+    uint8_t sensor;
+    const char * names;
+  } columns[] = {
+    {BINLOG_CAPTURE_ACCEL, ", ax, ay, az"},
+    {BINLOG_CAPTURE_GYRO_X, ", gx"},
+    {BINLOG_CAPTURE_GYRO_Y, ", gy"},
+    {BINLOG_CAPTURE_GYRO_Z, ", gz"},
+  };
+  if (sensors != lastSensors)
+  {
+    printf("# time");
+    for (const auto & column : columns)
+    {
+      if (sensors & column.sensor)
+        printf("%s", column.names);
+    }
+    printf("\n");
+    lastSensors = sensors;
+  }
+
+  unsigned int perSample = binLogCaptureValues(sensors);
+  unsigned int accelValues = (sensors & BINLOG_CAPTURE_ACCEL) ? 3 : 0;
+  double rate = config.sampleRate ? config.sampleRate : 1.0;
+  for (unsigned int i = 0; i < count; i++, values += perSample)
+  {
+    printf("%.6f", (first + i) / rate);
+    for (unsigned int j = 0; j < perSample; j++)
+    {
+      if (raw)
+        printf(", %d", values[j]);
+      else if (j < accelValues)
+        printf(", %.4f", values[j] / config.accelSens);
+      else
+        printf(", %.3f", values[j] / config.gyroSens);
+    }
+    printf("\n");
+  }
+}
+
+static void decode(const std::vector<uint8_t> & data, bool raw,
+                   decodeStats & stats)
+{
+  binLogConfig config;
+  memset(&config, 0, sizeof(config));
+  bool haveHeader = false;
+  bool haveSequence = false;
+  bool aligned = false; // The last bytes parsed ended a header or record
+  uint16_t expected = 0;
+  bool haveSample = false;
+  uint32_t nextSample = 0; // Capture sample number expected next
+  uint8_t lastSensors = 0;
+  size_t pos = 0;
+  static recordBlock block;
+  block.count = 0;
+
+  memset(&stats, 0, sizeof(stats));
+  while (pos < data.size())
+  {
+    size_t left = data.size() - pos;
+    const uint8_t * p = &data[pos];
+
+    binLogConfig newConfig;
+    unsigned int headerLength = binLogParseHeader(p, left, newConfig);
+    if (headerLength)
+    {
+      flushBlock(config, block, raw); // Records under the last header
+      config = newConfig;
+      haveHeader = true;
+      aligned = true;
+      stats.headers++;
+      haveSample = false;
+      lastSensors = 0;
+      printColumns(config, raw);
+      pos += headerLength;
+      continue;
+    }
+
+    if (haveHeader && (config.channels & BINLOG_CH_CAPTURE) &&
+        (p[0] == BINLOG_CAPTURE_SYNC))
+    {
+      static int16_t values[BINLOG_CAPTURE_MAX_VALUES];
+      uint16_t sequence;
+      uint32_t first;
+      uint8_t sensors, count;
+      unsigned int length = binLogParseCaptureRecord(p, left, sequence,
+                                                     first, sensors, count,
+                                                     values);
+      if (length)
+      {
+        uint16_t gap = sequence - expected;
+        if (haveSequence && (gap < 0x8000))
+          stats.dropped += gap;
+        expected = sequence + 1;
+        haveSequence = true;
+        // Sample numbers only go up within a capture
+        if (haveSample && (first > nextSample))
+          stats.lostSamples += first - nextSample;
+        nextSample = first + count;
+        haveSample = true;
+        aligned = true;
+        stats.records++;
+        stats.samples += count;
+        printCapture(config, first, sensors, count, values, lastSensors,
+                     raw);
+        pos += length;
+        continue;
+      }
+      if (aligned)
+        stats.badRecords++;
+    }
+
+    if (haveHeader && !(config.channels & BINLOG_CH_CAPTURE) &&
+        (p[0] == BINLOG_SYNC))
+    {
+      unsigned int length = binLogRecordLength(config.channels);
+      uint16_t sequence;
+      imuSample & sample = block.samples[block.count];
+      if ((left >= length) &&
+          binLogParseRecord(p, config.channels, sequence, sample))
+      {
+        // A jump backwards means the logger restarted, not lost records
+        uint16_t gap = sequence - expected;
+        if (haveSequence && (gap < 0x8000))
+          stats.dropped += gap;
+        expected = sequence + 1;
+        haveSequence = true;
+        aligned = true;
+        stats.records++;
+        if (++block.count == BLOCK_RECORDS)
+          flushBlock(config, block, raw);
+        pos += length;
+        continue;
+      }
+      if (aligned)
+        stats.badRecords++;
+    }
+
+    // Not a header or a good record: resync on the next byte
+    aligned = false;
+    stats.skippedBytes++;
+    pos++;
+  }
+  flushBlock(config, block, raw);
+}
+
+int main(int argc, char ** argv)
+{
+  bool raw = false;
+  const char * path = NULL;
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "-r") == 0)
+      raw = true;
+    else
+      path = argv[i];
+  }
+
+  FILE * in = path ? fopen(path, "rb") : stdin;
+  if (!in)
+  {
+    fprintf(stderr, "Can't open %s\n", path);
+    return 1;
+  }
+  std::vector<uint8_t> data;
+  uint8_t chunk[4096];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), in)) > 0)
+    data.insert(data.end(), chunk, chunk + n);
+  if (path)
+    fclose(in);
+
+  decodeStats stats;
+  decode(data, raw, stats);
+  fprintf(stderr, "%lu headers, %lu records, %lu bad records, "
+          "%lu dropped records, %lu bytes skipped\n", stats.headers,
+          stats.records, stats.badRecords, stats.dropped,
+          stats.skippedBytes);
+  if (stats.samples || stats.lostSamples)
+    fprintf(stderr, "%lu capture samples, %lu lost\n", stats.samples,
+            stats.lostSamples);
+  return (stats.headers || !data.size()) ? 0 : 1;
+}
@@ -0,0 +1,212 @@
+/******************************************************************************
+capture_bench.cpp
+Raw capture rates over I2C, against the simulated MPU-9250
+
+Runs MPU9250_DMP's raw capture (beginCapture() and updateCapture()) against
+the simulated MPU-9250, the way the firmware's capture mode does: each read
+takes as many samples as fit in one capture record (see binary_log.h), and
+builds the record. Each run captures a set of sensors at 1 kHz (through
+the DLPF) or 8 kHz (bypassed), at an I2C clock of 100 kHz, 400 kHz or
+1 MHz. A loop that does nothing else but read is compared with one that
+stalls now and then, like a slow SD card write. For each run it reports:
+
+  bus kB/s   FIFO data the rate needs, and the bus time it takes
+  rate       samples read per second (getCaptureStats()), and as a
+             percentage of the samples the sensor produced
+  lost       samples overwritten in the FIFO: counted by the simulator,
+             as estimated by getCaptureStats(), and as gaps in the
+             capture's sample numbers
+  ovf        FIFO overflows
+  bad        samples that don't match the simulated motion: a misaligned
+             read after an overflow would give garbage
+  log kB/s   capture records the firmware would write to SD or USB
+
+beginCapture() refuses a rate the I2C clock can't carry; those runs are
+shown as refused. Of the rest, no sample may be bad, and the loop that
+only reads must lose none. The bench exits with 1 if any does.
+
+Everything runs on the simulator's clock, so results are deterministic and
+independent of the host's speed. The SAMD21's own time to build and write
+records isn't modelled, besides the stalls.
+
+Usage: capture_bench [seconds]   (simulated seconds per run, default 5)
+******************************************************************************/
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <SparkFunMPU9250-DMP.h>
+#include "binary_log.h"
+#include "mpu9250_sim.h"
+
+#define IMU_GYRO_FSR 2000
+#define IMU_ACCEL_FSR 2
+#define STALL_MS 50 // The stalling loop stops for this long...
+#define STALL_EVERY_MS 500 // ...this often
+#define RATE_X 30.0f // Simulated rotation, deg/s
+#define RATE_Y -60.0f
+#define RATE_Z 90.0f
+
+struct captureRun
+{
+  const char * name;
+  unsigned char sensors;
+  unsigned short rate; // Hz
+};
+
+static const captureRun runs[] = {
+  {"accel+gyro", INV_XYZ_ACCEL | INV_XYZ_GYRO, 1000},
+  {"accel+gyro", INV_XYZ_ACCEL | INV_XYZ_GYRO, MPU_HIGH_RATE_HZ},
+  {"gyro xyz", INV_XYZ_GYRO, MPU_HIGH_RATE_HZ},
+  {"accel", INV_XYZ_ACCEL, MPU_HIGH_RATE_HZ},
+  {"gyro xy", INV_X_GYRO | INV_Y_GYRO, MPU_HIGH_RATE_HZ},
+  {"gyro z", INV_Z_GYRO, MPU_HIGH_RATE_HZ},
+};
+
+static const unsigned long clocks[] = {100000, 400000, 1000000};
+
+static MPU9250_DMP imu;
+
+// Gyro counts of the simulated rotation, to check samples against
+static bool gyroMatches(unsigned char sensors, const short * values)
+{
+  const float rates[3] = {RATE_X, RATE_Y, RATE_Z};
+  const unsigned char axes[3] = {INV_X_GYRO, INV_Y_GYRO, INV_Z_GYRO};
+  float sens = imu.getGyroSens();
+  unsigned int v = (sensors & INV_XYZ_ACCEL) ? 3 : 0;
+  for (int i = 0; i < 3; i++)
+  {
+    if (!(sensors & axes[i]))
+      continue;
+    if (abs(values[v++] - (int)lround(rates[i] * sens)) > 1)
+      return false;
+  }
+  return true;
+}
+
+// Gravity is 1 g, however the body is turned
+static bool accelMatches(unsigned char sensors, const short * values)
+{
+  if (!(sensors & INV_XYZ_ACCEL))
+    return true;
+  double g = sqrt((double)values[0] * values[0] +
+                  (double)values[1] * values[1] +
+                  (double)values[2] * values[2]) / imu.getAccelSens();
+  return fabs(g - 1.0) < 0.01;
+}
+
+// Returns false if the run failed its checks
+static bool simulate(const captureRun & run, unsigned long clock,
+                     bool stall, double seconds)
+{
+  char clockText[16];
+  snprintf(clockText, sizeof(clockText), "%lu%s",
+           clock >= 1000000 ? clock / 1000000 : clock / 1000,
+           clock >= 1000000 ? "M" : "k");
+  mpuSim.powerOn();
+  mpuSim.setRotationRate(RATE_X, RATE_Y, RATE_Z);
+  imu.setI2CClock(clock);
+  if (imu.begin() != INV_SUCCESS)
+  {
+    printf("initialization failed\n");
+    return false;
+  }
+  imu.setGyroFSR(IMU_GYRO_FSR);
+  imu.setAccelFSR(IMU_ACCEL_FSR);
+  imu.setFifoRecovery(FIFO_RECOVERY_RESYNC);
+  if (imu.beginCapture(run.sensors, run.rate) != INV_SUCCESS)
+  {
+    const unsigned int values = ((run.sensors & INV_XYZ_ACCEL) ? 3 : 0) +
+      ((run.sensors & INV_X_GYRO) ? 1 : 0) +
+      ((run.sensors & INV_Y_GYRO) ? 1 : 0) +
+      ((run.sensors & INV_Z_GYRO) ? 1 : 0);
+    printf("%-11s %5u %4s %-5s %6.1f refused\n", run.name, run.rate,
+           clockText, stall ? "stall" : "quick",
+           2.0 * values * run.rate / 1000.0);
+    imu.endCapture();
+    return true;
+  }
+
+  const unsigned int values = imu.captureValues();
+  const unsigned short maxSamples = BINLOG_CAPTURE_MAX_VALUES / values;
+  static short samples[BINLOG_CAPTURE_MAX_VALUES];
+  uint8_t record[BINLOG_CAPTURE_RECORD_MAX];
+  mpu9250SimStats start = mpuSim.stats();
+  unsigned long queued = mpuSim.fifoCount() / (2 * values);
+  uint64_t startUs = mpuSim.now();
+  uint64_t endUs = startUs + (uint64_t)(seconds * 1e6);
+  uint64_t nextStall = startUs + STALL_EVERY_MS * 1000;
+  unsigned long read = 0, bad = 0, gaps = 0, logBytes = 0;
+  unsigned long nextIndex = 0;
+  uint16_t sequence = 0;
+
+  while (mpuSim.now() < endUs)
+  {
+    if (stall && (mpuSim.now() >= nextStall))
+    {
+      delay(STALL_MS);
+      nextStall += STALL_EVERY_MS * 1000;
+    }
+    unsigned short count;
+    unsigned long index;
+    if ((imu.updateCapture(samples, maxSamples, &count, &index) !=
+         INV_SUCCESS) || !count)
+      continue;
+    if (index > nextIndex)
+      gaps += index - nextIndex;
+    nextIndex = index + count;
+    read += count;
+    for (unsigned int i = 0; i < count; i++)
+    {
+      const short * sample = &samples[i * values];
+      if (!gyroMatches(run.sensors, sample) ||
+          !accelMatches(run.sensors, sample))
+        bad++;
+    }
+    logBytes += binLogCaptureRecord(sequence++, index, run.sensors,
+                                    samples, count, record);
+  }
+
+  capture_stats_s stats;
+  imu.getCaptureStats(&stats);
+  const mpu9250SimStats & end = mpuSim.stats();
+  double elapsed = (mpuSim.now() - startUs) / 1e6;
+  unsigned long produced = end.samples - start.samples;
+  unsigned long left = mpuSim.fifoCount() / (2 * values);
+  unsigned long lost = produced + queued - read - left;
+  imu.endCapture();
+
+  printf("%-11s %5u %4s %-5s %6.1f %5.0f%% %6lu %5.1f%% %6lu %6lu %6lu %5lu "
+         "%4lu %6.1f\n", run.name, run.rate, clockText, stall ? "stall" : "quick",
+         2.0 * values * run.rate / 1000.0,
+         (end.busTimeUs - start.busTimeUs) / 1e4 / elapsed, stats.rate,
+         100.0 * read / produced, lost, stats.lost, gaps, stats.overflows,
+         bad, logBytes / 1000.0 / elapsed);
+  return !bad && (stall || !lost);
+}
+
+int main(int argc, char * argv[])
+{
+  double seconds = (argc > 1) ? atof(argv[1]) : 5.0;
+  if (seconds <= 0.0)
+  {
+    printf("Usage: capture_bench [seconds]\n");
+    return 1;
+  }
+
+  printf("%.0f s per run, stalls of %d ms every %d ms\n", seconds, STALL_MS,
+         STALL_EVERY_MS);
+  printf("%-11s %5s %4s %-5s %6s %6s %6s %6s %6s %6s %6s %5s %4s %6s\n",
+         "sensors", "Hz", "i2c", "loop", "kB/s", "bus", "rate", "read",
+         "lost", "est", "gaps", "ovf", "bad", "log");
+  bool ok = true;
+  for (const captureRun & run : runs)
+  {
+    for (unsigned long clock : clocks)
+    {
+      ok &= simulate(run, clock, false, seconds);
+      ok &= simulate(run, clock, true, seconds);
+    }
+  }
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,177 @@
+/******************************************************************************
+dmp_boot_bench.cpp
+MPU-9250 start-up time against the simulated MPU-9250
+
+Starts the MPU-9250 DMP library, configured the way the firmware's
+initIMU() does it, against the register-level simulator (mpu9250_sim.h),
+and times each boot up to the first DMP packet read. It boots:
+
+  cold   after the MPU-9250 is powered on, so its DMP memory is empty
+  warm   after a reset of the microcontroller alone (a watchdog or
+         bootloader reset, or a brown-out the IMU rode out): the MPU-9250
+         is still running with the DMP image loaded by the last boot
+
+each with fast boot (setFastBoot()) off and on. For every boot it reports
+the time spent in mpu_init(), loading and verifying the DMP image, and up
+to the first packet, with the I2C transactions and bytes used. Then it
+reads a second of packets and checks each against the simulated motion
+(accel must be gravity rotated by the quaternion), so a DMP left in a bad
+state by a warm boot shows up as bad packets.
+
+Everything runs on the simulator's clock, so results are deterministic and
+independent of the host's speed.
+
+Usage: dmp_boot_bench
+******************************************************************************/
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <SparkFunMPU9250-DMP.h>
+#include "mpu9250_sim.h"
+
+// The firmware's default settings (config.h)
+#define IMU_GYRO_FSR 2000
+#define IMU_ACCEL_FSR 2
+#define IMU_AG_LPF 5
+#define IMU_AG_SAMPLE_RATE 100
+#define IMU_COMPASS_SAMPLE_RATE 100
+#define DMP_FIFO_RATE 100
+#define DMP_FEATURES (DMP_FEATURE_GYRO_CAL | DMP_FEATURE_SEND_CAL_GYRO | \
+                      DMP_FEATURE_SEND_RAW_ACCEL | DMP_FEATURE_6X_LP_QUAT)
+
+struct benchRun
+{
+  const char * name;
+  bool powerCycle; // Power the MPU-9250 off and on first
+  unsigned char fastBoot;
+};
+
+// Each warm boot follows the boot before it
+static const benchRun runs[] = {
+  {"cold", true, 0},
+  {"warm", false, 0},
+  {"cold", true, 1},
+  {"warm", false, 1},
+  {"warm", false, 1},
+};
+
+static MPU9250_DMP imu;
+static dmp_packet_s packets[DMP_MAX_BURST_PACKETS];
+
+// Same configuration as the firmware's initIMU()
+static bool initImu(unsigned char fastBoot)
+{
+  imu.setFastBoot(fastBoot);
+  if (imu.begin() != INV_SUCCESS)
+    return false;
+  imu.enableInterrupt();
+  imu.setIntLevel(1);
+  imu.setIntLatched(1);
+  imu.setGyroFSR(IMU_GYRO_FSR);
+  imu.setAccelFSR(IMU_ACCEL_FSR);
+  imu.setLPF(IMU_AG_LPF);
+  imu.setSampleRate(IMU_AG_SAMPLE_RATE);
+  imu.setCompassMode(COMPASS_MODE_CONTINUOUS);
+  imu.setCompassSampleRate(IMU_COMPASS_SAMPLE_RATE);
+  return imu.dmpBegin(DMP_FEATURES, DMP_FIFO_RATE) == INV_SUCCESS;
+}
+
+// A packet is good if its accel reading is gravity, rotated into the
+// sensor frame by its quaternion
+static bool goodPacket(const dmp_packet_s & packet)
+{
+  double q[4];
+  for (int i = 0; i < 4; i++)
+    q[i] = packet.quat[i] / 1073741824.0;
+  double w = q[0], x = q[1], y = q[2], z = q[3];
+  double expected[3] = {2 * (x * z - w * y), 2 * (y * z + w * x),
+                        1 - 2 * (x * x + y * y)};
+  for (int i = 0; i < 3; i++)
+  {
+    if (fabs(packet.accel[i] - expected[i] * 32768.0 / IMU_ACCEL_FSR) > 2.0)
+      return false;
+  }
+  return true;
+}
+
+// Read bursts for a while. Returns the packets read, and counts the bad.
+static unsigned long readPackets(uint64_t us, unsigned long * bad)
+{
+  unsigned long read = 0;
+  uint64_t end = mpuSim.now() + us;
+  while (mpuSim.now() < end)
+  {
+    unsigned char count;
+    if (imu.fifoAvailable() &&
+        (imu.dmpUpdateFifoBurst(packets, DMP_MAX_BURST_PACKETS, &count) ==
+         INV_SUCCESS))
+    {
+      for (unsigned char i = 0; i < count; i++)
+      {
+        if (!goodPacket(packets[i]))
+          (*bad)++;
+      }
+      read += count;
+    }
+    delayMicroseconds(500);
+  }
+  return read;
+}
+
+static void bench(const benchRun & run)
+{
+  if (run.powerCycle)
+    mpuSim.powerOn();
+  mpu9250SimStats start = mpuSim.stats();
+  uint64_t startUs = mpuSim.now();
+
+  if (!initImu(run.fastBoot))
+  {
+    printf("%-5s %4s  initialization failed\n", run.name,
+           run.fastBoot ? "on" : "off");
+    return;
+  }
+  mpu_boot_stats_s boot;
+  imu.getBootStats(&boot);
+
+  // Time to the first packet
+  unsigned char count = 0;
+  while (count == 0)
+  {
+    if (!imu.fifoAvailable() ||
+        (imu.dmpUpdateFifoBurst(packets, DMP_MAX_BURST_PACKETS, &count) !=
+         INV_SUCCESS))
+    {
+      count = 0;
+      delayMicroseconds(500);
+    }
+  }
+  double firstMs = (mpuSim.now() - startUs) / 1000.0;
+  const mpu9250SimStats & stats = mpuSim.stats();
+  unsigned long transactions = stats.transactions - start.transactions;
+  unsigned long bytes = stats.busBytes - start.busBytes;
+  unsigned long bad = 0;
+  for (unsigned char i = 0; i < count; i++)
+  {
+    if (!goodPacket(packets[i]))
+      bad++;
+  }
+  unsigned long read = count + readPackets(1000000, &bad);
+
+  printf("%-5s %4s %8s %7lu %7lu %7lu %9.1f %7lu %7lu %6lu %4lu\n",
+         run.name, run.fastBoot ? "on" : "off",
+         boot.resident ? "yes" : "no", boot.init_ms, boot.load_ms,
+         boot.verify_ms, firstMs, transactions, bytes, read, bad);
+}
+
+int main(void)
+{
+  printf("I2C at 100 kHz, DMP at %u Hz\n", DMP_FIFO_RATE);
+  printf("%-5s %4s %8s %7s %7s %7s %9s %7s %7s %6s %4s\n", "boot", "fast",
+         "resident", "init ms", "load ms", "ver ms", "first ms", "xfers",
+         "bytes", "read", "bad");
+  for (unsigned int i = 0; i < sizeof(runs) / sizeof(runs[0]); i++)
+    bench(runs[i]);
+  return 0;
+}
@@ -0,0 +1,295 @@
+/******************************************************************************
+dmp_decode_bench.cpp
+DMP packet decoding, per feature set and burst size
+
+Sets up the MPU-9250 DMP library against the simulated MPU-9250, enables
+each set of DMP features below with dmp_enable_feature(), which works out
+the packet layout, then times dmp_decode_fifo_burst() on bursts of 1, 4
+and as many packets as a burst holds (DMP_MAX_BURST_PACKETS, or fewer
+that fit in DMP_MAX_BURST_BYTES), made up on the host, the way
+dmp_read_fifo_burst() and the I2C transfer engine's done functions
+decode the FIFO data they read:
+
+  quat       6-axis quaternion only
+  accel+gyro raw accel and gyro, no quaternion
+  firmware   quaternion, accel, calibrated gyro and the gesture data the
+             library always adds (the firmware's default)
+  +compass   as firmware, with the compass read through the FIFO: two
+             compass blocks ahead of each packet at 100 Hz, the older one
+             new, the newer one new half of the time
+
+Every decoded packet is checked against the values it was made from: its
+quaternion, accel and gyro readings, its sensors, and for +compass the
+newest new compass reading. For each feature set it reports:
+
+  bytes     length of a packet in the FIFO, with any compass data
+  full      packets in a full burst
+  ns/packet time per packet decoded, for each burst size
+  cycles    time stamp counter cycles per packet, in full bursts, where
+            there is one
+  ok        whether every packet decoded as it should
+
+Times are for the host CPU. The SAMD21 runs the same C, so they show how
+the burst size and feature set compare, not its times.
+
+Usage: dmp_decode_bench [bursts per burst size]   (default 1000000)
+******************************************************************************/
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC
+#endif
+
+#include <SparkFunMPU9250-DMP.h>
+#include "mpu9250_sim.h"
+
+#define DMP_FIFO_RATE 100
+#define BURSTS 256 // Bursts of data cycled through by the timed calls
+#define COMPASS_BLOCK 8 // ST1, the readings and ST2, as the FIFO holds them
+
+struct decodeRun
+{
+  const char * name;
+  unsigned short features;
+  bool compassFifo;
+};
+
+static const decodeRun runs[] = {
+  {"quat", DMP_FEATURE_6X_LP_QUAT, false},
+  {"accel+gyro", DMP_FEATURE_SEND_RAW_ACCEL | DMP_FEATURE_SEND_RAW_GYRO,
+   false},
+  {"firmware", DMP_FEATURE_GYRO_CAL | DMP_FEATURE_SEND_CAL_GYRO |
+   DMP_FEATURE_SEND_RAW_ACCEL | DMP_FEATURE_6X_LP_QUAT | DMP_FEATURE_TAP,
+   false},
+  {"+compass", DMP_FEATURE_GYRO_CAL | DMP_FEATURE_SEND_CAL_GYRO |
+   DMP_FEATURE_SEND_RAW_ACCEL | DMP_FEATURE_6X_LP_QUAT | DMP_FEATURE_TAP,
+   true},
+};
+
+static MPU9250_DMP imu;
+
+// What each burst's packets should decode to, and the FIFO data they were
+// made into
+static dmp_packet_s expected[BURSTS][DMP_MAX_BURST_PACKETS];
+static unsigned char fifoData[BURSTS][DMP_MAX_BURST_BYTES];
+static dmp_packet_s packets[DMP_MAX_BURST_PACKETS];
+
+static void putLong(unsigned char * data, long value)
+{
+  data[0] = (unsigned char)(value >> 24);
+  data[1] = (unsigned char)(value >> 16);
+  data[2] = (unsigned char)(value >> 8);
+  data[3] = (unsigned char)value;
+}
+
+static void putShort(unsigned char * data, short value)
+{
+  data[0] = (unsigned char)(value >> 8);
+  data[1] = (unsigned char)value;
+}
+
+static short randomShort(void)
+{
+  return (short)(rand() % 65536 - 32768);
+}
+
+// A compass block as the AK8963 writes it, new or not
+static void putCompass(unsigned char * data, bool isNew)
+{
+  data[0] = isNew ? 0x01 : 0x00; // ST1: DRDY
+  for (int i = 0; i < 3; i++)
+  {
+    short reading = (short)(rand() % 8000 - 4000);
+    data[1 + 2 * i] = (unsigned char)reading; // Little-endian
+    data[2 + 2 * i] = (unsigned char)(reading >> 8);
+  }
+  data[7] = 0x10; // ST2: 16-bit output, no overflow
+}
+
+static unsigned int length; // Of a packet in the FIFO
+static unsigned char full; // Packets in a full burst
+
+// Make up BURSTS full bursts of packets for run's features: random unit
+// quaternions (Q30), accel and gyro readings, and compass blocks
+static void makePackets(const decodeRun & run)
+{
+  bool quat = run.features & DMP_FEATURE_6X_LP_QUAT;
+  bool accel = run.features & DMP_FEATURE_SEND_RAW_ACCEL;
+  bool gyro = run.features &
+              (DMP_FEATURE_SEND_RAW_GYRO | DMP_FEATURE_SEND_CAL_GYRO);
+  bool gesture = run.features & DMP_FEATURE_TAP;
+  unsigned int blocks = run.compassFifo ? 200 / DMP_FIFO_RATE : 0;
+  length = blocks * COMPASS_BLOCK + (quat ? 16 : 0) + (accel ? 6 : 0) +
+           (gyro ? 6 : 0) + (gesture ? 4 : 0);
+  full = DMP_MAX_BURST_BYTES / length;
+  if (full > DMP_MAX_BURST_PACKETS)
+    full = DMP_MAX_BURST_PACKETS;
+
+  srand(1);
+  memset(expected, 0, sizeof(expected));
+  for (int b = 0; b < BURSTS; b++)
+  {
+    for (int p = 0; p < full; p++)
+    {
+      dmp_packet_s & packet = expected[b][p];
+      unsigned char * data = fifoData[b] + p * length;
+      for (unsigned int k = 0; k < blocks; k++, data += COMPASS_BLOCK)
+      {
+        // The oldest block is always new, the newest half of the time
+        putCompass(data, (k == 0) || (rand() & 1));
+        if (mpu_decode_compass(data, packet.compass) == INV_SUCCESS)
+          packet.sensors |= INV_XYZ_COMPASS;
+      }
+      if (quat)
+      {
+        double q[4], norm = 0.0;
+        for (int i = 0; i < 4; i++)
+        {
+          q[i] = rand() / (double)RAND_MAX - 0.5;
+          norm += q[i] * q[i];
+        }
+        for (int i = 0; i < 4; i++)
+        {
+          packet.quat[i] = lround(q[i] / sqrt(norm) * 1073741823.0);
+          putLong(data + 4 * i, packet.quat[i]);
+        }
+        data += 16;
+        packet.sensors |= INV_WXYZ_QUAT;
+      }
+      if (accel)
+      {
+        for (int i = 0; i < 3; i++)
+        {
+          packet.accel[i] = randomShort();
+          putShort(data + 2 * i, packet.accel[i]);
+        }
+        data += 6;
+        packet.sensors |= INV_XYZ_ACCEL;
+      }
+      if (gyro)
+      {
+        for (int i = 0; i < 3; i++)
+        {
+          packet.gyro[i] = randomShort();
+          putShort(data + 2 * i, packet.gyro[i]);
+        }
+        data += 6;
+        packet.sensors |= INV_XYZ_GYRO;
+      }
+      if (gesture)
+        memset(data, 0, 4); // No tap or orientation change
+    }
+  }
+}
+
+static bool samePacket(const dmp_packet_s & a, const dmp_packet_s & b)
+{
+  if (a.sensors != b.sensors)
+    return false;
+  if ((a.sensors & INV_WXYZ_QUAT) && memcmp(a.quat, b.quat, sizeof(a.quat)))
+    return false;
+  if ((a.sensors & INV_XYZ_ACCEL) &&
+      memcmp(a.accel, b.accel, sizeof(a.accel)))
+    return false;
+  if ((a.sensors & INV_XYZ_GYRO) && memcmp(a.gyro, b.gyro, sizeof(a.gyro)))
+    return false;
+  if ((a.sensors & INV_XYZ_COMPASS) &&
+      memcmp(a.compass, b.compass, sizeof(a.compass)))
+    return false;
+  return true;
+}
+
+// Decode every burst once, in full, and check each packet
+static bool checkBursts(void)
+{
+  for (int b = 0; b < BURSTS; b++)
+  {
+    unsigned char count;
+    if ((dmp_decode_fifo_burst(fifoData[b], full, packets, &count) !=
+         INV_SUCCESS) || (count != full))
+      return false;
+    for (int p = 0; p < full; p++)
+    {
+      if (!samePacket(packets[p], expected[b][p]))
+        return false;
+    }
+  }
+  return true;
+}
+
+struct decodeTime
+{
+  double ns;
+  double cycles;
+};
+
+// Time decoding bursts of size packets, per packet
+static decodeTime timeBursts(unsigned long bursts, unsigned char size)
+{
+  volatile unsigned long sink = 0;
+  unsigned char count;
+  auto start = std::chrono::steady_clock::now();
+#ifdef HAVE_TSC
+  unsigned long long startTsc = __rdtsc();
+#endif
+  for (unsigned long i = 0; i < bursts; i++)
+  {
+    dmp_decode_fifo_burst(fifoData[i % BURSTS], size, packets, &count);
+    sink += packets[size - 1].sensors;
+  }
+  decodeTime t;
+#ifdef HAVE_TSC
+  t.cycles = (double)(__rdtsc() - startTsc) / bursts / size;
+#else
+  t.cycles = 0;
+#endif
+  t.ns = std::chrono::duration<double, std::nano>(
+         std::chrono::steady_clock::now() - start).count() / bursts / size;
+  return t;
+}
+
+int main(int argc, char * argv[])
+{
+  unsigned long bursts = (argc > 1) ? strtoul(argv[1], NULL, 10) : 1000000;
+  if (bursts == 0)
+  {
+    printf("Usage: dmp_decode_bench [bursts per burst size]\n");
+    return 1;
+  }
+
+  mpuSim.powerOn();
+  if ((imu.begin() != INV_SUCCESS) ||
+      (imu.setCompassMode(COMPASS_MODE_CONTINUOUS) != INV_SUCCESS) ||
+      (imu.dmpBegin(DMP_FEATURE_6X_LP_QUAT, DMP_FIFO_RATE) != INV_SUCCESS))
+  {
+    printf("initialization failed\n");
+    return 1;
+  }
+
+  printf("%lu bursts per burst size\n", bursts);
+  printf("%-10s %5s %4s %28s %7s %3s\n", "features", "bytes", "full",
+         "ns/packet, burst of 1/4/full", "cycles", "ok");
+  for (const decodeRun & run : runs)
+  {
+    if ((dmp_enable_feature(run.features) != INV_SUCCESS) ||
+        (imu.dmpEnableCompassFifo(run.compassFifo) != INV_SUCCESS))
+    {
+      printf("%-10s setup failed\n", run.name);
+      continue;
+    }
+    makePackets(run);
+    bool ok = checkBursts();
+    const unsigned char sizes[] = {1, 4, full};
+    decodeTime t[3];
+    for (int i = 0; i < 3; i++)
+      t[i] = timeBursts(bursts, sizes[i]);
+    printf("%-10s %5u %4u %10.1f %8.1f %8.1f %7.1f %3s\n", run.name, length,
+           full, t[0].ns, t[1].ns, t[2].ns, t[2].cycles, ok ? "yes" : "no");
+  }
+  return 0;
+}
@@ -0,0 +1,484 @@
+/******************************************************************************
+dmp_sim_bench.cpp
+DMP FIFO throughput against the simulated MPU-9250
+
+Runs the MPU-9250 DMP library, configured the way the firmware's initIMU()
+does it, against the register-level simulator (mpu9250_sim.h), and drains
+the DMP FIFO several ways:
+
+  poll-single  loop() checks fifoAvailable() and reads one packet with
+               dmpUpdateFifo(), like the original firmware
+  poll-burst   loop() checks fifoAvailable() and reads up to
+               DMP_MAX_BURST_PACKETS packets with dmpUpdateFifoBurst()
+  int-burst    the INT pin handler drains the FIFO in bursts, like the
+               firmware's acquireSamples(); loop() never polls
+
+Each is run with a quick loop, and with a loop that stalls for longer than
+the FIFO can hold (like a slow SD card write). The stalled runs are
+repeated with each FIFO overflow recovery mode: resetting the FIFO, or
+realigning it to the next packet. Some runs ask the DMP for quaternions
+only, as the firmware does when nothing else is logged, to show the effect
+of the packet size. Others read the compass too, like the firmware: with
+a separate read after each burst, or through the FIFO with the packets
+(dmpEnableCompassFifo()), with the compass triggered after every read or
+measuring continuously (setCompassMode()). For every run it reports the
+packets the DMP produced, read and lost, FIFO overflows, driver FIFO
+resets, and I2C traffic per packet read, on the host bus and the MPU's
+auxiliary bus. When realigning, it also numbers packets with the
+firmware's SampleClock (sample_clock.h), which estimates how many were
+lost to each overflow (or to a FIFO reset, where one is still needed),
+and checks the estimate against the actual count. Every packet read
+is checked against the simulated motion: its accelerometer reading must be
+gravity rotated by its quaternion, and its compass reading must be as
+strong as the simulated field, so a misaligned FIFO read shows up as a bad
+packet. A compass reading from the FIFO must also match the field at its
+packet's orientation, so one that has stopped updating is bad too. The
+stalled compass FIFO runs check that an overflow is recovered from without
+misaligned reads although compass blocks sit between the packets. It exits
+with 1 on a wrong period or estimate, or on any bad packet.
+
+First, it checks SampleClock's period at rates from 1 Hz to 1 kHz.
+
+Everything runs on the simulator's clock, so results are deterministic and
+independent of the host's speed.
+
+Usage: dmp_sim_bench [seconds]   (simulated seconds per run, default 10)
+******************************************************************************/
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <SparkFunMPU9250-DMP.h>
+#include "mpu9250_sim.h"
+#include "sample_clock.h"
+
+// The firmware's default settings (config.h)
+#define IMU_GYRO_FSR 2000
+#define IMU_ACCEL_FSR 2
+#define IMU_AG_LPF 5
+#define IMU_AG_SAMPLE_RATE 100
+#define IMU_COMPASS_SAMPLE_RATE 100
+#define MAG_FIFO_TOLERANCE 8.0 // Counts: 1.2 uT, about 1.4 degrees
+#define MAG_FIFO_SETTLE_US 50000 // Readings measured during setup come first
+// SampleClock's lost packet estimate must be within this many, plus this
+// fraction of the packets lost, of the actual count
+#define ESTIMATE_SLACK 2
+#define ESTIMATE_SLACK_FRACTION 20 // 1/20 = 5%
+
+enum drainMode
+{
+  POLL_SINGLE,
+  POLL_BURST,
+  INT_BURST
+};
+
+enum compassMode
+{
+  COMPASS_NONE, // Not logged
+  COMPASS_READ, // mpu_get_compass_reg() after each burst
+  COMPASS_FIFO // With the packets, through the FIFO
+};
+
+struct benchRun
+{
+  const char * name;
+  drainMode mode;
+  unsigned short rate; // DMP FIFO rate (Hz)
+  unsigned long loopUs; // Time the rest of loop() takes
+  unsigned long stallMs; // A stall this long...
+  unsigned long stallEveryMs; // ...this often (0 for none)
+  unsigned char recovery; // FIFO_RECOVERY_RESET or FIFO_RECOVERY_RESYNC
+  unsigned short features; // DMP features
+  compassMode compass;
+  unsigned char magMode; // COMPASS_MODE_SINGLE or COMPASS_MODE_CONTINUOUS
+};
+
+// The firmware's DMP features with every log channel on, and with only
+// quaternions, Euler angles or heading logged
+#define ALL_FEATURES (DMP_FEATURE_GYRO_CAL | DMP_FEATURE_SEND_CAL_GYRO | \
+                      DMP_FEATURE_SEND_RAW_ACCEL | DMP_FEATURE_6X_LP_QUAT)
+#define QUAT_FEATURES (DMP_FEATURE_GYRO_CAL | DMP_FEATURE_6X_LP_QUAT)
+
+static const benchRun runs[] = {
+  {"poll-single", POLL_SINGLE, 100, 500, 0, 0, FIFO_RECOVERY_RESET,
+   ALL_FEATURES, COMPASS_NONE, COMPASS_MODE_CONTINUOUS},
+  {"poll-burst", POLL_BURST, 100, 500, 0, 0, FIFO_RECOVERY_RESET,
+   ALL_FEATURES, COMPASS_NONE, COMPASS_MODE_CONTINUOUS},
+  {"int-burst", INT_BURST, 100, 500, 0, 0, FIFO_RECOVERY_RESET,
+   ALL_FEATURES, COMPASS_NONE, COMPASS_MODE_CONTINUOUS},
+  {"poll-single", POLL_SINGLE, 200, 500, 0, 0, FIFO_RECOVERY_RESET,
+   ALL_FEATURES, COMPASS_NONE, COMPASS_MODE_CONTINUOUS},
+  {"poll-single", POLL_SINGLE, 200, 500, 0, 0, FIFO_RECOVERY_RESYNC,
+   ALL_FEATURES, COMPASS_NONE, COMPASS_MODE_CONTINUOUS},
+  {"poll-burst", POLL_BURST, 200, 500, 0, 0, FIFO_RECOVERY_RESET,
+   ALL_FEATURES, COMPASS_NONE, COMPASS_MODE_CONTINUOUS},
+  {"int-burst", INT_BURST, 200, 500, 0, 0, FIFO_RECOVERY_RESET,
+   ALL_FEATURES, COMPASS_NONE, COMPASS_MODE_CONTINUOUS},
+  {"poll-single", POLL_SINGLE, 100, 500, 400, 2000, FIFO_RECOVERY_RESET,
+   ALL_FEATURES, COMPASS_NONE, COMPASS_MODE_CONTINUOUS},
+  {"poll-burst", POLL_BURST, 100, 500, 400, 2000, FIFO_RECOVERY_RESET,
+   ALL_FEATURES, COMPASS_NONE, COMPASS_MODE_CONTINUOUS},
+  {"poll-single", POLL_SINGLE, 100, 500, 400, 2000, FIFO_RECOVERY_RESYNC,
+   ALL_FEATURES, COMPASS_NONE, COMPASS_MODE_CONTINUOUS},
+  {"poll-burst", POLL_BURST, 100, 500, 400, 2000, FIFO_RECOVERY_RESYNC,
+   ALL_FEATURES, COMPASS_NONE, COMPASS_MODE_CONTINUOUS},
+  {"poll-burst", POLL_BURST, 200, 500, 400, 2000, FIFO_RECOVERY_RESYNC,
+   ALL_FEATURES, COMPASS_NONE, COMPASS_MODE_CONTINUOUS},
+  {"poll-burst", POLL_BURST, 100, 500, 0, 0, FIFO_RECOVERY_RESET,
+   QUAT_FEATURES, COMPASS_NONE, COMPASS_MODE_CONTINUOUS},
+  {"int-burst", INT_BURST, 100, 500, 0, 0, FIFO_RECOVERY_RESET,
+   QUAT_FEATURES, COMPASS_NONE, COMPASS_MODE_CONTINUOUS},
+  {"int-burst", INT_BURST, 200, 500, 0, 0, FIFO_RECOVERY_RESET,
+   QUAT_FEATURES, COMPASS_NONE, COMPASS_MODE_CONTINUOUS},
+  {"int-burst", INT_BURST, 100, 500, 0, 0, FIFO_RECOVERY_RESET,
+   ALL_FEATURES, COMPASS_READ, COMPASS_MODE_SINGLE},
+  {"int-burst", INT_BURST, 100, 500, 0, 0, FIFO_RECOVERY_RESET,
+   ALL_FEATURES, COMPASS_READ, COMPASS_MODE_CONTINUOUS},
+  {"int-burst", INT_BURST, 100, 500, 0, 0, FIFO_RECOVERY_RESET,
+   ALL_FEATURES, COMPASS_FIFO, COMPASS_MODE_CONTINUOUS},
+  {"int-burst", INT_BURST, 200, 500, 0, 0, FIFO_RECOVERY_RESET,
+   QUAT_FEATURES, COMPASS_READ, COMPASS_MODE_CONTINUOUS},
+  {"int-burst", INT_BURST, 200, 500, 0, 0, FIFO_RECOVERY_RESET,
+   QUAT_FEATURES, COMPASS_FIFO, COMPASS_MODE_SINGLE},
+  {"int-burst", INT_BURST, 200, 500, 0, 0, FIFO_RECOVERY_RESET,
+   QUAT_FEATURES, COMPASS_FIFO, COMPASS_MODE_CONTINUOUS},
+  {"int-burst", INT_BURST, 50, 500, 0, 0, FIFO_RECOVERY_RESET,
+   QUAT_FEATURES, COMPASS_READ, COMPASS_MODE_CONTINUOUS},
+  {"int-burst", INT_BURST, 50, 500, 0, 0, FIFO_RECOVERY_RESET,
+   QUAT_FEATURES, COMPASS_FIFO, COMPASS_MODE_CONTINUOUS},
+  {"poll-burst", POLL_BURST, 100, 500, 400, 2000, FIFO_RECOVERY_RESET,
+   ALL_FEATURES, COMPASS_FIFO, COMPASS_MODE_CONTINUOUS},
+  {"poll-burst", POLL_BURST, 100, 500, 400, 2000, FIFO_RECOVERY_RESYNC,
+   ALL_FEATURES, COMPASS_FIFO, COMPASS_MODE_CONTINUOUS},
+  {"poll-burst", POLL_BURST, 200, 500, 400, 2000, FIFO_RECOVERY_RESYNC,
+   ALL_FEATURES, COMPASS_FIFO, COMPASS_MODE_CONTINUOUS},
+};
+
+struct benchResult
+{
+  unsigned long read; // Packets read
+  unsigned long bad; // Packets that don't match the simulated motion
+  unsigned long estimatedLost; // Packets SampleClock found missing
+  unsigned long compass; // New compass readings
+};
+
+static MPU9250_DMP imu;
+static benchResult result;
+static dmp_packet_s packets[DMP_MAX_BURST_PACKETS];
+// Packet numbering, as in the firmware's acquireSamples()
+static SampleClock sampleClock;
+static uint32_t packetCount;
+static unsigned long fifoRecoveries; // Driver resyncs + resets
+static bool packetsHaveAccel;
+static compassMode compass;
+
+// Same configuration as the firmware's initIMU()
+static bool initImu(unsigned short rate, unsigned short features,
+                    unsigned char magMode)
+{
+  if (imu.begin() != INV_SUCCESS)
+    return false;
+  imu.enableInterrupt();
+  imu.setIntLevel(1);
+  imu.setIntLatched(1);
+  imu.setGyroFSR(IMU_GYRO_FSR);
+  imu.setAccelFSR(IMU_ACCEL_FSR);
+  imu.setLPF(IMU_AG_LPF);
+  imu.setSampleRate(IMU_AG_SAMPLE_RATE);
+  imu.setCompassMode(magMode);
+  imu.setCompassSampleRate(IMU_COMPASS_SAMPLE_RATE);
+  return imu.dmpBegin(features, rate) == INV_SUCCESS;
+}
+
+// Bytes in each DMP packet. The library always adds tap detection, which
+// sends 4 bytes of gesture data. Through the FIFO, every sample's compass
+// data comes ahead of it.
+static unsigned int packetLength(const benchRun & run)
+{
+  unsigned short features = run.features;
+  unsigned int length = 4;
+  if (run.compass == COMPASS_FIFO)
+    length += 8 * (200 / run.rate);
+  if (features & (DMP_FEATURE_LP_QUAT | DMP_FEATURE_6X_LP_QUAT))
+    length += 16;
+  if (features & DMP_FEATURE_SEND_RAW_ACCEL)
+    length += 6;
+  if (features & (DMP_FEATURE_SEND_RAW_GYRO | DMP_FEATURE_SEND_CAL_GYRO))
+    length += 6;
+  return length;
+}
+
+// A packet is good if its accel reading is gravity, rotated into the
+// sensor frame by its quaternion. Packets without accel data can't be
+// checked.
+static void checkPacket(const long * quat, const short * accel)
+{
+  if (!packetsHaveAccel)
+  {
+    result.read++;
+    return;
+  }
+  double q[4];
+  for (int i = 0; i < 4; i++)
+    q[i] = quat[i] / 1073741824.0;
+  double w = q[0], x = q[1], y = q[2], z = q[3];
+  double expected[3] = {2 * (x * z - w * y), 2 * (y * z + w * x),
+                        1 - 2 * (x * x + y * y)};
+  double sens = 32768.0 / IMU_ACCEL_FSR;
+
+  result.read++;
+  for (int i = 0; i < 3; i++)
+  {
+    if (fabs(accel[i] - expected[i] * sens) > 2.0)
+    {
+      result.bad++;
+      return;
+    }
+  }
+}
+
+// A compass reading is good if it's as strong as the simulated field:
+// 49.2 uT, at 0.15 uT per count. One read through the FIFO must also point
+// where the field does at its packet's orientation (quat), give or take the
+// body's turn since the compass measured: a reading that has stopped
+// updating doesn't. The first readings of a run may have been measured
+// during setup, so they're only checked for strength.
+static uint64_t magCheckUs;
+static void checkCompass(const short * mag, const long * quat)
+{
+  double strength = sqrt((double)mag[0] * mag[0] + (double)mag[1] * mag[1] +
+                         (double)mag[2] * mag[2]);
+  result.compass++;
+  if (fabs(strength - sqrt(20.0 * 20.0 + 45.0 * 45.0) / 0.15) > 4.0)
+  {
+    result.bad++;
+    return;
+  }
+  if (!quat || (mpuSim.now() < magCheckUs))
+    return;
+  double expected[3], error = 0.0;
+  mpuSim.magExpected(quat, expected);
+  for (int i = 0; i < 3; i++)
+    error += (mag[i] - expected[i]) * (mag[i] - expected[i]);
+  if (sqrt(error) > MAG_FIFO_TOLERANCE)
+    result.bad++;
+}
+
+// Number the packets just read. If the FIFO was realigned or reset, skip
+// the numbers of the packets the clock says were lost. seenUs is when the
+// newest packet in the FIFO was seen, if observe is true.
+static void numberPackets(unsigned char count, uint32_t seenUs, bool observe)
+{
+  unsigned char more = imu.fifoPending();
+  mpu_fifo_stats_s fifoStats;
+  imu.getFifoStats(&fifoStats);
+  unsigned long recoveries = fifoStats.resyncs + fifoStats.resets;
+  if ((recoveries != fifoRecoveries) && (count + more > 0))
+  {
+    uint32_t lost = sampleClock.missed(packetCount + count + more - 1,
+                                       seenUs);
+    packetCount += lost;
+    result.estimatedLost += lost;
+  }
+  fifoRecoveries = recoveries;
+  if (observe && (count + more > 0))
+    sampleClock.observe(packetCount + count + more - 1, seenUs);
+  packetCount += count;
+}
+
+static void drainBursts(uint32_t seenUs)
+{
+  unsigned char count;
+  bool observe = true;
+  do
+  {
+    if (imu.dmpUpdateFifoBurst(packets, DMP_MAX_BURST_PACKETS, &count) !=
+        INV_SUCCESS)
+      return;
+    numberPackets(count, seenUs, observe);
+    observe = false;
+    for (unsigned char i = 0; i < count; i++)
+    {
+      checkPacket(packets[i].quat, packets[i].accel);
+      if (packets[i].sensors & INV_XYZ_COMPASS)
+        checkCompass(packets[i].compass, packets[i].quat);
+    }
+    short mag[3];
+    unsigned long magTime;
+    if ((compass == COMPASS_READ) &&
+        (mpu_get_compass_reg(mag, &magTime) == INV_SUCCESS))
+      checkCompass(mag, NULL);
+  } while (imu.fifoPending());
+}
+
+static void imuInterrupt(void)
+{
+  drainBursts(micros());
+}
+
+// Returns false if a packet was bad, or the lost packet estimate is off
+// when realigning
+static bool bench(const benchRun & run, unsigned long seconds)
+{
+  mpuSim.powerOn();
+  mpuSim.setInterruptHandler(NULL);
+  if (!initImu(run.rate, run.features, run.magMode))
+  {
+    printf("%-12s initialization failed\n", run.name);
+    return false;
+  }
+  imu.setFifoRecovery(run.recovery);
+  if ((run.compass == COMPASS_FIFO) &&
+      (imu.dmpEnableCompassFifo() != INV_SUCCESS))
+  {
+    printf("%-12s compass FIFO failed\n", run.name);
+    return false;
+  }
+
+  // Start counting once the DMP is running
+  imu.resetFifo();
+  mpu9250SimStats start = mpuSim.stats();
+  unsigned long startWaiting = mpuSim.fifoCount() / packetLength(run);
+  mpu_fifo_stats_s fifoStart;
+  imu.getFifoStats(&fifoStart);
+  result.read = 0;
+  result.bad = 0;
+  result.estimatedLost = 0;
+  result.compass = 0;
+  compass = run.compass;
+  magCheckUs = mpuSim.now() + MAG_FIFO_SETTLE_US;
+  sampleClock = SampleClock(); // The simulated clock restarts with each run
+  sampleClock.setRate(run.rate);
+  packetCount = 0;
+  fifoRecoveries = fifoStart.resyncs + fifoStart.resets;
+  packetsHaveAccel = run.features & DMP_FEATURE_SEND_RAW_ACCEL;
+  if (run.mode == INT_BURST)
+  {
+    mpuSim.setInterruptHandler(imuInterrupt);
+    // Like the firmware, drain once to clear an interrupt latched before
+    // the handler was attached. Otherwise there's never another edge.
+    drainBursts(micros());
+  }
+
+  uint64_t end = mpuSim.now() + (uint64_t)seconds * 1000000;
+  uint64_t nextStall = mpuSim.now() + (uint64_t)run.stallEveryMs * 1000;
+  while (mpuSim.now() < end)
+  {
+    uint32_t seenUs = micros();
+    if (run.mode == POLL_SINGLE)
+    {
+      if (imu.fifoAvailable() && (imu.dmpUpdateFifo() == INV_SUCCESS))
+      {
+        numberPackets(1, seenUs, true);
+        long quat[4] = {imu.qw, imu.qx, imu.qy, imu.qz};
+        short accel[3] = {(short)imu.ax, (short)imu.ay, (short)imu.az};
+        checkPacket(quat, accel);
+      }
+    }
+    else if (run.mode == POLL_BURST)
+    {
+      if (imu.fifoAvailable())
+        drainBursts(seenUs);
+    }
+
+    delayMicroseconds(run.loopUs);
+    // Stalls that would run past the end would only lose packets nobody
+    // reads, so there aren't any
+    if (run.stallEveryMs && (mpuSim.now() >= nextStall) &&
+        (mpuSim.now() + run.stallMs * 1000 < end))
+    {
+      delay(run.stallMs);
+      nextStall += (uint64_t)run.stallEveryMs * 1000;
+    }
+  }
+  mpuSim.setInterruptHandler(NULL);
+
+  const mpu9250SimStats & stats = mpuSim.stats();
+  mpu_fifo_stats_s fifoStats;
+  imu.getFifoStats(&fifoStats);
+  unsigned long produced = stats.dmpPackets - start.dmpPackets +
+                          startWaiting;
+  unsigned long waiting = mpuSim.fifoCount() / packetLength(run);
+  unsigned long lost = produced - result.read - waiting;
+  // SampleClock counts sample periods: while a FIFO reset holds the DMP,
+  // it skips packets the DMP never made, which aren't lost
+  unsigned long nominal = (unsigned long)run.rate * seconds;
+  unsigned long unmade = stats.dmpPackets - start.dmpPackets;
+  unmade = (nominal > unmade) ? nominal - unmade : 0;
+  long estimateError = (long)result.estimatedLost - (long)lost;
+  bool estimateOk = (run.recovery != FIFO_RECOVERY_RESYNC) ||
+    (labs(estimateError) <= (long)(unmade + ESTIMATE_SLACK +
+                                   lost / ESTIMATE_SLACK_FRACTION));
+  double perPacket = result.read ? 1.0 / result.read : 0.0;
+  double elapsed = (double)seconds * 1e6;
+  char stall[48] = "-";
+  if (run.stallEveryMs)
+    snprintf(stall, sizeof(stall), "%lu/%lu", run.stallMs, run.stallEveryMs);
+  char estimated[16] = "-";
+  if (run.recovery == FIFO_RECOVERY_RESYNC)
+    snprintf(estimated, sizeof(estimated), "%lu%s", result.estimatedLost,
+             estimateOk ? "" : "!");
+  static const char * const compassNames[] = {"-", "read", "fifo"};
+  char compassName[16];
+  snprintf(compassName, sizeof(compassName), "%s%s",
+           compassNames[run.compass], (run.compass == COMPASS_NONE) ? "" :
+           (run.magMode == COMPASS_MODE_CONTINUOUS) ? "-c" : "-s");
+
+  printf("%-12s %4u %3u %9s %-7s %-6s %8lu %8lu %6lu %6s %6lu %4lu %5lu "
+         "%6lu %7.2f %7.1f %5.1f%% %5.2f\n",
+         run.name, run.rate, packetLength(run), stall,
+         (run.recovery == FIFO_RECOVERY_RESYNC) ? "resync" : "reset",
+         compassName, produced, result.read, lost, estimated,
+         result.compass, result.bad,
+         stats.fifoOverflows - start.fifoOverflows,
+         fifoStats.resets - fifoStart.resets,
+         (stats.transactions - start.transactions) * perPacket,
+         (stats.busBytes - start.busBytes) * perPacket,
+         100.0 * (stats.busTimeUs - start.busTimeUs) / elapsed,
+         (stats.auxTransactions - start.auxTransactions) * perPacket);
+  return estimateOk && !result.bad;
+}
+
+// SampleClock's nominal period at rates from 1 Hz to 1 kHz, against the
+// exact one, to within its Q8 us resolution
+static bool checkPeriods(void)
+{
+  static const uint16_t rates[] = {1, 10, 50, 100, 1000};
+  bool ok = true;
+  for (unsigned int i = 0; i < sizeof(rates) / sizeof(rates[0]); i++)
+  {
+    SampleClock clock;
+    clock.setRate(rates[i]);
+    double expected = 1e9 / rates[i];
+    if (fabs(clock.periodNs() - expected) > 4.0)
+    {
+      printf("sample clock period at %u Hz: %lu ns, not %.0f\n", rates[i],
+             (unsigned long)clock.periodNs(), expected);
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+int main(int argc, char ** argv)
+{
+  unsigned long seconds = (argc > 1) ? strtoul(argv[1], NULL, 10) : 10;
+  if (!seconds)
+    seconds = 10;
+
+  bool periodsOk = checkPeriods();
+  bool runsOk = true;
+  printf("sample clock periods: %s\n", periodsOk ? "ok" : "WRONG");
+  printf("%lu simulated seconds per run, I2C at 100 kHz, 500 us loop\n",
+         seconds);
+  printf("%-12s %4s %3s %9s %-7s %-6s %8s %8s %6s %6s %6s %4s %5s %6s %7s "
+         "%7s %6s %5s\n",
+         "mode", "Hz", "pkt", "stall ms", "ovf rec", "mag", "produced", "read",
+         "lost", "est", "mag rd", "bad", "ovf", "resets", "xfers/p", "bytes/p",
+         "bus", "aux/p");
+  for (unsigned int i = 0; i < sizeof(runs) / sizeof(runs[0]); i++)
+    runsOk &= bench(runs[i], seconds);
+  printf("bad packets and lost packet estimates: %s\n",
+         runsOk ? "ok" : "FAILED (estimates off are marked !)");
+  return (periodsOk && runsOk) ? 0 : 1;
+}
@@ -0,0 +1,398 @@
+/******************************************************************************
+fixed_math_bench.cpp
+Compare MPU9250_DMP's float and fixed-point calc and compute methods
+
+Times each calc*() and compute*() method against its *Fixed version
+(util/fixed_math.h), on the same inputs, and checks both against a double
+precision reference:
+
+  calcAccel, calcGyro  every 16-bit count, at every full-scale range
+  calcMag              every 16-bit count
+  calcQuat             random Q30 values
+  computeEulerAngles   random unit quaternions, in degrees
+  computeCompassHeading random magnetometer readings
+  fix_sincos           every Q16 angle in [-pi, pi], against sinf() and
+                       cosf()
+
+and the calc*Block() and calc*BlockFixed() versions of the conversions
+(util/block_convert.h), a block of BLOCK samples per call, with their
+times given per sample to compare with the calc*() rows.
+
+Times are for the host CPU, which has an FPU: they understate what the
+float versions cost on the SAMD21, which does every float operation, and
+asin() and atan2(), in software. Cycles are the host's time stamp counter,
+where there is one.
+
+Usage: fixed_math_bench [calls per method]
+******************************************************************************/
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC
+#endif
+
+#include <SparkFunMPU9250-DMP.h>
+#include <util/fixed_math.h>
+#include "mpu9250_sim.h"
+
+#define INPUTS 4096 // Inputs cycled through by the timed calls
+#define BLOCK 64 // Samples per calc*Block() call
+
+static MPU9250_DMP imu;
+
+static int counts[INPUTS];
+static short shortCounts[INPUTS];
+static long quatElements[INPUTS];
+static short allCounts[65536]; // Every 16-bit count
+static float floatOut[65536];
+static long fixedOut[65536];
+static long quats[INPUTS][4];
+static int mags[INPUTS][2];
+static volatile long sink;
+
+struct callTime
+{
+  double ns;
+  double cycles;
+};
+
+// Time calls of f(i) for i = 0..calls-1
+template <typename F>
+static callTime timeCalls(unsigned long calls, F f)
+{
+  auto start = std::chrono::steady_clock::now();
+#ifdef HAVE_TSC
+  unsigned long long startTsc = __rdtsc();
+#endif
+  for (unsigned long i = 0; i < calls; i++)
+    f(i % INPUTS);
+  callTime t;
+#ifdef HAVE_TSC
+  t.cycles = (double)(__rdtsc() - startTsc) / calls;
+#else
+  t.cycles = 0;
+#endif
+  t.ns = std::chrono::duration<double, std::nano>(
+         std::chrono::steady_clock::now() - start).count() / calls;
+  return t;
+}
+
+// Time calls of f(first) on blocks of BLOCK inputs, per sample
+template <typename F>
+static callTime timeBlocks(unsigned long calls, F f)
+{
+  callTime t = timeCalls(calls / BLOCK, [&](int i) {
+    f((i * BLOCK) % INPUTS); });
+  t.ns /= BLOCK;
+  t.cycles /= BLOCK;
+  return t;
+}
+
+// Largest error of calcBlock() and calcBlockFixed() over every count,
+// against count / sens
+template <typename F, typename G>
+static void blockErrors(F calcBlock, G calcBlockFixed, double sens,
+                        double * floatErr, double * fixedErr)
+{
+  calcBlock(allCounts, floatOut, 65536);
+  calcBlockFixed(allCounts, fixedOut, 65536);
+  for (long i = 0; i < 65536; i++)
+  {
+    double exact = allCounts[i] / sens;
+    *floatErr = fmax(*floatErr, fabs(floatOut[i] - exact));
+    *fixedErr = fmax(*fixedErr, fabs(fixedOut[i] / 65536.0 - exact));
+  }
+}
+
+// Difference of two angles in degrees, wrapped to [-180, 180]
+static double angleError(double a, double b)
+{
+  double d = fmod(a - b, 360.0);
+  if (d > 180.0) d -= 360.0;
+  if (d < -180.0) d += 360.0;
+  return fabs(d);
+}
+
+static void report(const char * name, callTime floatTime, callTime fixedTime,
+                   double floatErr, double fixedErr, const char * unit)
+{
+  char floatCycles[16] = "-", fixedCycles[16] = "-";
+#ifdef HAVE_TSC
+  snprintf(floatCycles, sizeof(floatCycles), "%.1f", floatTime.cycles);
+  snprintf(fixedCycles, sizeof(fixedCycles), "%.1f", fixedTime.cycles);
+#endif
+  printf("%-22s %8.2f %7s %8.2f %7s %7.2fx %10.2e %10.2e %s\n", name,
+         floatTime.ns, floatCycles, fixedTime.ns, fixedCycles,
+         floatTime.ns / fixedTime.ns, floatErr, fixedErr, unit);
+}
+
+// Largest error of calc() and calcFixed() over every count, against
+// count / sens
+template <typename F, typename G>
+static void countErrors(F calc, G calcFixed, double sens, double * floatErr,
+                        double * fixedErr)
+{
+  for (long count = -32768; count <= 32767; count++)
+  {
+    double exact = count / sens;
+    *floatErr = fmax(*floatErr, fabs(calc((int)count) - exact));
+    *fixedErr = fmax(*fixedErr, fabs(calcFixed((int)count) / 65536.0 - exact));
+  }
+}
+
+// computeEulerAngles() in double precision
+static void eulerReference(const long * q, double * angles)
+{
+  double w = q[0] / 1073741824.0, x = q[1] / 1073741824.0;
+  double y = q[2] / 1073741824.0, z = q[3] / 1073741824.0;
+  double t2 = -2.0 * (x * z + w * y);
+  t2 = t2 > 1.0 ? 1.0 : (t2 < -1.0 ? -1.0 : t2);
+  angles[0] = asin(t2) * 2 * 180.0 / M_PI;
+  angles[1] = atan2(2.0 * (y * z - w * x), 1.0 - 2.0 * (x * x + y * y)) *
+              180.0 / M_PI;
+  angles[2] = atan2(2.0 * (x * y - w * z), 1.0 - 2.0 * (y * y + z * z)) *
+              180.0 / M_PI;
+}
+
+int main(int argc, char * argv[])
+{
+  unsigned long calls = (argc > 1) ? strtoul(argv[1], NULL, 0) : 2000000;
+
+  mpuSim.powerOn();
+  if (imu.begin() != INV_SUCCESS)
+  {
+    printf("MPU-9250 initialization failed\n");
+    return 1;
+  }
+
+  srand(1);
+  for (int i = 0; i < INPUTS; i++)
+  {
+    counts[i] = (rand() % 65536) - 32768;
+    shortCounts[i] = counts[i];
+    double q[4], norm = 0;
+    for (int j = 0; j < 4; j++)
+    {
+      q[j] = (double)rand() / RAND_MAX * 2.0 - 1.0;
+      norm += q[j] * q[j];
+    }
+    for (int j = 0; j < 4; j++)
+      quats[i][j] = lround(q[j] / sqrt(norm) * 1073741823.0);
+    mags[i][0] = (rand() % 8001) - 4000;
+    mags[i][1] = (rand() % 8001) - 4000;
+    quatElements[i] = quats[i][i & 3];
+  }
+  for (long count = -32768; count <= 32767; count++)
+    allCounts[count + 32768] = count;
+
+  printf("%lu calls per method, host times\n", calls);
+  printf("%-22s %8s %7s %8s %7s %8s %10s %10s\n", "method", "float ns",
+         "cycles", "fixed ns", "cycles", "speedup", "float err", "fixed err");
+
+  // Conversions, timed at the firmware's default FSRs
+  imu.setAccelFSR(2);
+  imu.setGyroFSR(2000);
+  callTime floatTime = timeCalls(calls, [](int i) {
+    sink = (long)(imu.calcAccel(counts[i]) * 65536.0f); });
+  callTime fixedTime = timeCalls(calls, [](int i) {
+    sink = imu.calcAccelFixed(counts[i]); });
+  double floatErr = 0, fixedErr = 0;
+  const unsigned char accelFSRs[] = {2, 4, 8, 16};
+  for (unsigned char fsr : accelFSRs)
+  {
+    imu.setAccelFSR(fsr);
+    countErrors([](int c) { return imu.calcAccel(c); },
+                [](int c) { return imu.calcAccelFixed(c); },
+                imu.getAccelSens(), &floatErr, &fixedErr);
+  }
+  report("calcAccel", floatTime, fixedTime, floatErr, fixedErr, "g");
+
+  floatTime = timeCalls(calls, [](int i) {
+    sink = (long)(imu.calcGyro(counts[i]) * 65536.0f); });
+  fixedTime = timeCalls(calls, [](int i) {
+    sink = imu.calcGyroFixed(counts[i]); });
+  floatErr = fixedErr = 0;
+  const unsigned short gyroFSRs[] = {250, 500, 1000, 2000};
+  for (unsigned short fsr : gyroFSRs)
+  {
+    imu.setGyroFSR(fsr);
+    countErrors([](int c) { return imu.calcGyro(c); },
+                [](int c) { return imu.calcGyroFixed(c); },
+                imu.getGyroSens(), &floatErr, &fixedErr);
+  }
+  report("calcGyro", floatTime, fixedTime, floatErr, fixedErr, "dps");
+
+  floatTime = timeCalls(calls, [](int i) {
+    sink = (long)(imu.calcMag(counts[i]) * 65536.0f); });
+  fixedTime = timeCalls(calls, [](int i) {
+    sink = imu.calcMagFixed(counts[i]); });
+  floatErr = fixedErr = 0;
+  countErrors([](int c) { return imu.calcMag(c); },
+              [](int c) { return imu.calcMagFixed(c); },
+              6.665, &floatErr, &fixedErr);
+  report("calcMag", floatTime, fixedTime, floatErr, fixedErr, "uT");
+
+  floatTime = timeCalls(calls, [](int i) {
+    sink = (long)(imu.calcQuat(quats[i][i & 3]) * 65536.0f); });
+  fixedTime = timeCalls(calls, [](int i) {
+    sink = imu.calcQuatFixed(quats[i][i & 3]); });
+  floatErr = fixedErr = 0;
+  for (int i = 0; i < INPUTS; i++)
+  {
+    for (int j = 0; j < 4; j++)
+    {
+      double exact = quats[i][j] / 1073741824.0;
+      floatErr = fmax(floatErr, fabs(imu.calcQuat(quats[i][j]) - exact));
+      fixedErr = fmax(fixedErr,
+                      fabs(imu.calcQuatFixed(quats[i][j]) / 65536.0 - exact));
+    }
+  }
+  report("calcQuat", floatTime, fixedTime, floatErr, fixedErr, "");
+
+  // Block conversions
+  imu.setAccelFSR(2);
+  imu.setGyroFSR(2000);
+  floatTime = timeBlocks(calls, [](int i) {
+    imu.calcAccelBlock(&shortCounts[i], &floatOut[i], BLOCK); });
+  fixedTime = timeBlocks(calls, [](int i) {
+    imu.calcAccelBlockFixed(&shortCounts[i], &fixedOut[i], BLOCK); });
+  floatErr = fixedErr = 0;
+  for (unsigned char fsr : accelFSRs)
+  {
+    imu.setAccelFSR(fsr);
+    blockErrors([](const short * c, float * out, int n) {
+                  imu.calcAccelBlock(c, out, n); },
+                [](const short * c, long * out, int n) {
+                  imu.calcAccelBlockFixed(c, out, n); },
+                imu.getAccelSens(), &floatErr, &fixedErr);
+  }
+  report("calcAccelBlock", floatTime, fixedTime, floatErr, fixedErr, "g");
+
+  floatTime = timeBlocks(calls, [](int i) {
+    imu.calcGyroBlock(&shortCounts[i], &floatOut[i], BLOCK); });
+  fixedTime = timeBlocks(calls, [](int i) {
+    imu.calcGyroBlockFixed(&shortCounts[i], &fixedOut[i], BLOCK); });
+  floatErr = fixedErr = 0;
+  for (unsigned short fsr : gyroFSRs)
+  {
+    imu.setGyroFSR(fsr);
+    blockErrors([](const short * c, float * out, int n) {
+                  imu.calcGyroBlock(c, out, n); },
+                [](const short * c, long * out, int n) {
+                  imu.calcGyroBlockFixed(c, out, n); },
+                imu.getGyroSens(), &floatErr, &fixedErr);
+  }
+  report("calcGyroBlock", floatTime, fixedTime, floatErr, fixedErr, "dps");
+
+  floatTime = timeBlocks(calls, [](int i) {
+    imu.calcMagBlock(&shortCounts[i], &floatOut[i], BLOCK); });
+  fixedTime = timeBlocks(calls, [](int i) {
+    imu.calcMagBlockFixed(&shortCounts[i], &fixedOut[i], BLOCK); });
+  floatErr = fixedErr = 0;
+  blockErrors([](const short * c, float * out, int n) {
+                imu.calcMagBlock(c, out, n); },
+              [](const short * c, long * out, int n) {
+                imu.calcMagBlockFixed(c, out, n); },
+              6.665, &floatErr, &fixedErr);
+  report("calcMagBlock", floatTime, fixedTime, floatErr, fixedErr, "uT");
+
+  floatTime = timeBlocks(calls, [](int i) {
+    imu.calcQuatBlock(&quatElements[i], &floatOut[i], BLOCK); });
+  fixedTime = timeBlocks(calls, [](int i) {
+    imu.calcQuatBlockFixed(&quatElements[i], &fixedOut[i], BLOCK); });
+  imu.calcQuatBlock(quatElements, floatOut, INPUTS);
+  imu.calcQuatBlockFixed(quatElements, fixedOut, INPUTS);
+  floatErr = fixedErr = 0;
+  for (int i = 0; i < INPUTS; i++)
+  {
+    double exact = quatElements[i] / 1073741824.0;
+    floatErr = fmax(floatErr, fabs(floatOut[i] - exact));
+    fixedErr = fmax(fixedErr, fabs(fixedOut[i] / 65536.0 - exact));
+  }
+  report("calcQuatBlock", floatTime, fixedTime, floatErr, fixedErr, "");
+
+  // Angles
+  auto loadQuat = [](int i) {
+    imu.qw = quats[i][0];
+    imu.qx = quats[i][1];
+    imu.qy = quats[i][2];
+    imu.qz = quats[i][3];
+  };
+  floatTime = timeCalls(calls, [&](int i) {
+    loadQuat(i);
+    imu.computeEulerAngles();
+    sink = (long)imu.yaw; });
+  fixedTime = timeCalls(calls, [&](int i) {
+    loadQuat(i);
+    imu.computeEulerAnglesFixed();
+    sink = imu.yawFixed; });
+  floatErr = fixedErr = 0;
+  for (int i = 0; i < INPUTS; i++)
+  {
+    double exact[3];
+    eulerReference(quats[i], exact);
+    loadQuat(i);
+    imu.computeEulerAngles();
+    imu.computeEulerAnglesFixed();
+    const float floats[3] = {imu.pitch, imu.roll, imu.yaw};
+    const long fixeds[3] = {imu.pitchFixed, imu.rollFixed, imu.yawFixed};
+    for (int j = 0; j < 3; j++)
+    {
+      floatErr = fmax(floatErr, angleError(floats[j], exact[j]));
+      fixedErr = fmax(fixedErr, angleError(fixeds[j] / 65536.0, exact[j]));
+    }
+  }
+  report("computeEulerAngles", floatTime, fixedTime, floatErr, fixedErr,
+         "deg");
+
+  auto loadMag = [](int i) {
+    imu.mx = mags[i][0];
+    imu.my = mags[i][1];
+  };
+  floatTime = timeCalls(calls, [&](int i) {
+    loadMag(i);
+    sink = (long)imu.computeCompassHeading(); });
+  fixedTime = timeCalls(calls, [&](int i) {
+    loadMag(i);
+    sink = imu.computeCompassHeadingFixed(); });
+  floatErr = fixedErr = 0;
+  for (int i = 0; i < INPUTS; i++)
+  {
+    double exact = atan2((double)mags[i][0], (double)mags[i][1]) *
+                   180.0 / M_PI;
+    loadMag(i);
+    floatErr = fmax(floatErr, angleError(imu.computeCompassHeading(), exact));
+    fixedErr = fmax(fixedErr,
+                    angleError(imu.computeCompassHeadingFixed() / 65536.0,
+                               exact));
+  }
+  report("computeCompassHeading", floatTime, fixedTime, floatErr, fixedErr,
+         "deg");
+
+  // The sine and cosine mag_fusion turns its yaw correction with
+  floatTime = timeCalls(calls, [](int i) {
+    float angle = counts[i] * (float)(M_PI / 32768.0);
+    sink = (long)((sinf(angle) + cosf(angle)) * 1073741824.0f); });
+  fixedTime = timeCalls(calls, [](int i) {
+    long sine, cosine;
+    fix_sincos((counts[i] * FIX_PI_Q16) >> 15, &sine, &cosine);
+    sink = sine + cosine; });
+  floatErr = fixedErr = 0;
+  for (long angle = -FIX_PI_Q16; angle <= FIX_PI_Q16; angle++)
+  {
+    double exact = angle / 65536.0;
+    long sine, cosine;
+    fix_sincos(angle, &sine, &cosine);
+    floatErr = fmax(floatErr, fmax(fabs(sinf((float)exact) - sin(exact)),
+                                   fabs(cosf((float)exact) - cos(exact))));
+    fixedErr = fmax(fixedErr,
+                    fmax(fabs(sine / 1073741824.0 - sin(exact)),
+                         fabs(cosine / 1073741824.0 - cos(exact))));
+  }
+  report("fix_sincos", floatTime, fixedTime, floatErr, fixedErr, "");
+  return 0;
+}
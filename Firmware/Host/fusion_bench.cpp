@@ -0,0 +1,400 @@
+/******************************************************************************
+fusion_bench.cpp
+Accuracy and cost of MPU9250_DMP's 9-axis fusion (updateFusion())
+
+Runs the MPU-9250 DMP library against the simulated MPU-9250 at 200 Hz,
+with the compass read through the FIFO at 100 Hz, and fuses every packet
+the way the firmware does. The simulated DMP's quaternion is exact, so each
+run turns it by a yaw error that starts at some angle and drifts at some
+rate, like the real DMP's 6-axis quaternion, before it's fused. Each run
+reports, against the simulated orientation:
+
+  fused    the fused heading (fusedHeading)
+  dmp      the heading of the DMP's quaternion alone
+  compass  computeCompassHeading(), which isn't tilt compensated
+
+as the RMS and largest error after the first SETTLE_S seconds, and the
+time the fused heading took to settle for good within the run's band: 1
+degree, or 2 with the noisy compass, whose noise keeps the fused heading
+near 1.6 degrees off at worst. Each run has limits on the fused RMS error
+and the settling time; the bench exits with 1 if a run exceeds them, or
+fails to start. They fail if the compass
+readings stop updating, leaving the fused heading to the DMP's.
+
+Given binary logs (see _9DoF_Razor_M0_Firmware/binary_log.h) recorded with
+the quaternion and compass channels, it replays each through updateFusion()
+instead. With no truth to compare with, it reports how far each compass
+reading (tilt compensated) was from the fused heading, and how far the
+DMP's yaw drifted from it over the log.
+
+Last, it times updateFusion() with and without a new compass reading, on
+the host.
+
+Usage: fusion_bench [-t seconds] [log.bin ...]
+******************************************************************************/
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+
+#include <SparkFunMPU9250-DMP.h>
+#include "mpu9250_sim.h"
+#include "binary_log.h"
+
+#define DMP_FIFO_RATE 200
+#define IMU_COMPASS_SAMPLE_RATE 100
+#define DMP_FEATURES (DMP_FEATURE_GYRO_CAL | DMP_FEATURE_SEND_CAL_GYRO | \
+                      DMP_FEATURE_SEND_RAW_ACCEL | DMP_FEATURE_6X_LP_QUAT)
+#define SETTLE_S 30.0 // Errors are counted after this
+#define TIMED_CALLS 1000000
+
+struct fusionRun
+{
+  const char * name;
+  float rate[3]; // Body rotation, deg/s
+  double yawError; // DMP yaw error at the start, degrees
+  double drift; // DMP yaw drift, degrees/s
+  float magNoise; // uT RMS per axis
+  double maxRms; // Limit on the fused RMS error, degrees
+  double settleBand; // Settled within this error, degrees
+  double maxSettle; // Limit on the settling time, s
+};
+
+// The noisy compass keeps the fused heading wandering past 1 degree now
+// and then, so that run settles within a wider band
+static const fusionRun runs[] = {
+  {"still", {0, 0, 0}, 40.0, 0.1, 0.6, 0.15, 1.0, 5.0},
+  {"turning", {0, 0, 30}, 40.0, 0.1, 0.6, 0.15, 1.0, 5.0},
+  {"tumbling", {10, -20, 30}, 40.0, 0.1, 0.6, 0.25, 1.0, 5.0},
+  {"tumbling, 1 deg/s drift", {10, -20, 30}, -120.0, 1.0, 0.6, 0.25, 1.0,
+   20.0},
+  {"tumbling, noisy compass", {10, -20, 30}, 40.0, 0.1, 3.0, 0.6, 2.0, 10.0},
+};
+
+static MPU9250_DMP imu;
+static dmp_packet_s packets[DMP_MAX_BURST_PACKETS];
+
+struct errorStats
+{
+  double sumSquares;
+  double max;
+  unsigned long count;
+
+  void add(double error)
+  {
+    sumSquares += error * error;
+    max = fmax(max, error);
+    count++;
+  }
+  double rms(void) const { return count ? sqrt(sumSquares / count) : 0.0; }
+};
+
+// Difference of two angles in degrees, wrapped to [-180, 180]
+static double angleDiff(double a, double b)
+{
+  double d = fmod(a - b, 360.0);
+  if (d > 180.0) d -= 360.0;
+  if (d < -180.0) d += 360.0;
+  return d;
+}
+
+// Heading of the MPU-9250's x axis for a quaternion, like
+// mag_fusion_heading(): degrees clockwise from the world's x axis
+static double headingOf(const double * q)
+{
+  double w = q[0], x = q[1], y = q[2], z = q[3];
+  double heading = atan2(-2.0 * (x * y + w * z), 1.0 - 2.0 * (y * y + z * z));
+  return fmod(heading * 180.0 / M_PI + 360.0, 360.0);
+}
+
+// Turn q by angle (degrees) about the world's z axis
+static void turnYaw(const double * q, double angle, double * out)
+{
+  double c = cos(angle * M_PI / 360.0), s = sin(angle * M_PI / 360.0);
+  out[0] = c * q[0] - s * q[3];
+  out[1] = c * q[1] - s * q[2];
+  out[2] = c * q[2] + s * q[1];
+  out[3] = c * q[3] + s * q[0];
+}
+
+// Same configuration as the firmware's initIMU(), at 200 Hz with the
+// compass through the FIFO
+static bool initImu(void)
+{
+  if (imu.begin() != INV_SUCCESS)
+    return false;
+  imu.setGyroFSR(2000);
+  imu.setAccelFSR(2);
+  imu.setLPF(5);
+  imu.setSampleRate(DMP_FIFO_RATE);
+  imu.setCompassMode(COMPASS_MODE_CONTINUOUS);
+  imu.setCompassSampleRate(IMU_COMPASS_SAMPLE_RATE);
+  if (imu.dmpBegin(DMP_FEATURES, DMP_FIFO_RATE) != INV_SUCCESS)
+    return false;
+  if (imu.dmpEnableCompassFifo() != INV_SUCCESS)
+    return false;
+  imu.setFusionGains(MAG_FUSION_KP, MAG_FUSION_KI, IMU_COMPASS_SAMPLE_RATE);
+  imu.resetFusion();
+  return true;
+}
+
+// Returns false if the run exceeded its limits, or failed to start
+static bool simulate(const fusionRun & run, double seconds)
+{
+  mpuSim.powerOn();
+  mpuSim.setRotationRate(run.rate[0], run.rate[1], run.rate[2]);
+  mpuSim.setMagNoise(run.magNoise);
+  if (!initImu())
+  {
+    printf("%-26s initialization failed\n", run.name);
+    return false;
+  }
+
+  errorStats fused = {0, 0, 0}, dmp = {0, 0, 0}, compass = {0, 0, 0};
+  unsigned long index = 0;
+  double settled = 0.0;
+  short lastMag[3] = {0, 0, 0};
+  while (index < seconds * DMP_FIFO_RATE)
+  {
+    unsigned char count;
+    if (!imu.fifoAvailable() ||
+        (imu.dmpUpdateFifoBurst(packets, DMP_MAX_BURST_PACKETS, &count) !=
+         INV_SUCCESS))
+    {
+      delay(5);
+      continue;
+    }
+    for (unsigned char i = 0; i < count; i++, index++)
+    {
+      const dmp_packet_s & packet = packets[i];
+      double t = (double)index / DMP_FIFO_RATE;
+      double truth[4], drifted[4];
+      for (int j = 0; j < 4; j++)
+        truth[j] = packet.quat[j] / 1073741824.0;
+      turnYaw(truth, run.yawError + run.drift * t, drifted);
+
+      imu.qw = lround(drifted[0] * 1073741823.0);
+      imu.qx = lround(drifted[1] * 1073741823.0);
+      imu.qy = lround(drifted[2] * 1073741823.0);
+      imu.qz = lround(drifted[3] * 1073741823.0);
+      imu.mx = packet.compass[0];
+      imu.my = packet.compass[1];
+      imu.mz = packet.compass[2];
+      // As in the firmware, a reading is new if it changed
+      bool newMag = memcmp(lastMag, packet.compass, sizeof(lastMag)) != 0;
+      memcpy(lastMag, packet.compass, sizeof(lastMag));
+      imu.updateFusion(newMag);
+
+      double heading = headingOf(truth);
+      double fusedError = fabs(angleDiff(imu.fusedHeading / 65536.0,
+                                         heading));
+      if (fusedError > run.settleBand)
+        settled = t + 1.0 / DMP_FIFO_RATE;
+      if (t >= SETTLE_S)
+      {
+        fused.add(fusedError);
+        dmp.add(fabs(angleDiff(headingOf(drifted), heading)));
+        compass.add(fabs(angleDiff(imu.computeCompassHeading(), heading)));
+      }
+    }
+  }
+  bool ok = (fused.rms() <= run.maxRms) && (settled <= run.maxSettle);
+  printf("%-26s %7.2f %7.3f %7.3f %7.2f %7.2f %7.2f %7.2f %3s\n", run.name,
+         settled, fused.rms(), fused.max, dmp.rms(), dmp.max, compass.rms(),
+         compass.max, ok ? "yes" : "no");
+  return ok;
+}
+
+// Replay a recorded binary log through updateFusion()
+static void replay(const char * path)
+{
+  FILE * in = fopen(path, "rb");
+  if (!in)
+  {
+    printf("%s: can't open\n", path);
+    return;
+  }
+  std::vector<uint8_t> data;
+  uint8_t chunk[4096];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), in)) > 0)
+    data.insert(data.end(), chunk, chunk + n);
+  fclose(in);
+
+  const uint16_t needed = BINLOG_CH_TIME | BINLOG_CH_QUAT | BINLOG_CH_MAG;
+  binLogConfig config;
+  bool haveHeader = false;
+  unsigned long records = 0, readings = 0;
+  uint32_t startMs = 0, lastMs = 0;
+  short lastMag[3] = {0, 0, 0};
+  errorStats compass = {0, 0, 0};
+  double startOffset = 0.0, offset = 0.0;
+  bool haveStart = false;
+  size_t pos = 0;
+
+  imu.setFusionGains(MAG_FUSION_KP, MAG_FUSION_KI, IMU_COMPASS_SAMPLE_RATE);
+  imu.resetFusion();
+  while (pos < data.size())
+  {
+    size_t left = data.size() - pos;
+    const uint8_t * p = &data[pos];
+    binLogConfig newConfig;
+    unsigned int headerLength = binLogParseHeader(p, left, newConfig);
+    if (headerLength)
+    {
+      config = newConfig;
+      haveHeader = (config.channels & needed) == needed;
+      // New compass readings come at the compass rate, or the log rate
+      // if that's lower
+      if (haveHeader)
+        imu.setFusionGains(MAG_FUSION_KP, MAG_FUSION_KI,
+                           (config.sampleRate < IMU_COMPASS_SAMPLE_RATE) ?
+                           config.sampleRate : IMU_COMPASS_SAMPLE_RATE);
+      pos += headerLength;
+      continue;
+    }
+    uint16_t sequence;
+    imuSample sample;
+    if (haveHeader && (p[0] == BINLOG_SYNC) &&
+        (left >= binLogRecordLength(config.channels)) &&
+        binLogParseRecord(p, config.channels, sequence, sample))
+    {
+      pos += binLogRecordLength(config.channels);
+      if (!records)
+        startMs = sample.time;
+      lastMs = sample.time;
+      records++;
+
+      imu.qw = sample.quat[0];
+      imu.qx = sample.quat[1];
+      imu.qy = sample.quat[2];
+      imu.qz = sample.quat[3];
+      imu.mx = sample.mag[0];
+      imu.my = sample.mag[1];
+      imu.mz = sample.mag[2];
+      bool newMag = memcmp(lastMag, sample.mag, sizeof(lastMag)) != 0;
+      memcpy(lastMag, sample.mag, sizeof(lastMag));
+      imu.updateFusion(newMag);
+      readings += newMag;
+
+      double q[4] = {imu.qw / 1073741824.0, imu.qx / 1073741824.0,
+                     imu.qy / 1073741824.0, imu.qz / 1073741824.0};
+      double fusedHeading = imu.fusedHeading / 65536.0;
+      offset = angleDiff(fusedHeading, headingOf(q));
+      if ((sample.time - startMs) < SETTLE_S * 1000)
+        continue;
+      if (!haveStart)
+      {
+        startOffset = offset;
+        haveStart = true;
+      }
+      if (newMag)
+      {
+        // The compass reading's heading, tilt compensated with the fused
+        // quaternion, in double precision
+        double fq[4] = {imu.fusedQw / 1073741824.0, imu.fusedQx / 1073741824.0,
+                        imu.fusedQy / 1073741824.0, imu.fusedQz / 1073741824.0};
+        double w = fq[0], x = fq[1], y = fq[2], z = fq[3];
+        double m[3] = {(double)imu.my, (double)imu.mx, -(double)imu.mz};
+        double hx = (1 - 2 * (y * y + z * z)) * m[0] +
+                    2 * (x * y - w * z) * m[1] + 2 * (x * z + w * y) * m[2];
+        double hy = 2 * (x * y + w * z) * m[0] +
+                    (1 - 2 * (x * x + z * z)) * m[1] +
+                    2 * (y * z - w * x) * m[2];
+        compass.add(fabs(atan2(hy, hx) * 180.0 / M_PI));
+      }
+      continue;
+    }
+    pos++; // Not a header or a good record: resync on the next byte
+  }
+
+  if (!records)
+  {
+    printf("%s: no records with time, quaternion and compass channels\n",
+           path);
+    return;
+  }
+  double minutes = (lastMs - startMs) / 60000.0;
+  double driftMinutes = minutes - SETTLE_S / 60.0;
+  double drift = haveStart ? angleDiff(offset, startOffset) : 0.0;
+  printf("%s: %lu records, %lu compass readings, %.1f min\n", path, records,
+         readings, minutes);
+  printf("  compass - fused heading after %.0f s: %.3f RMS, %.3f max deg\n",
+         SETTLE_S, compass.rms(), compass.max);
+  printf("  DMP yaw drift from fused: %.2f deg (%.3f deg/min)\n", drift,
+         driftMinutes > 0 ? drift / driftMinutes : 0.0);
+}
+
+// Time updateFusion() on the host, on the inputs of a simulated run
+static void timeUpdates(void)
+{
+  struct input { long q[4]; int m[3]; };
+  static input inputs[1024];
+  mpuSim.powerOn();
+  mpuSim.setRotationRate(10, -20, 30);
+  for (int i = 0; i < 1024; i++)
+  {
+    long q[4];
+    mpuSim.truth(i * 5000, q);
+    memcpy(inputs[i].q, q, sizeof(q));
+    inputs[i].m[0] = 130 + (i % 7);
+    inputs[i].m[1] = -40 + (i % 5);
+    inputs[i].m[2] = -300 + (i % 3);
+  }
+
+  for (int withMag = 0; withMag < 2; withMag++)
+  {
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned long i = 0; i < TIMED_CALLS; i++)
+    {
+      const input & in = inputs[i & 1023];
+      imu.qw = in.q[0];
+      imu.qx = in.q[1];
+      imu.qy = in.q[2];
+      imu.qz = in.q[3];
+      imu.mx = in.m[0];
+      imu.my = in.m[1];
+      imu.mz = in.m[2];
+      imu.updateFusion(withMag);
+    }
+    double ns = std::chrono::duration<double, std::nano>(
+                std::chrono::steady_clock::now() - start).count() /
+                TIMED_CALLS;
+    printf("updateFusion(%s): %.1f ns per call, host\n",
+           withMag ? "true" : "false", ns);
+  }
+}
+
+int main(int argc, char * argv[])
+{
+  double seconds = 120.0;
+  bool ok = true;
+  std::vector<const char *> logs;
+  for (int i = 1; i < argc; i++)
+  {
+    if ((strcmp(argv[i], "-t") == 0) && (i + 1 < argc))
+      seconds = atof(argv[++i]);
+    else
+      logs.push_back(argv[i]);
+  }
+
+  if (logs.empty())
+  {
+    printf("%.0f s per run, DMP at %u Hz, compass at %u Hz, errors in "
+           "degrees after %.0f s\n", seconds, DMP_FIFO_RATE,
+           IMU_COMPASS_SAMPLE_RATE, SETTLE_S);
+    printf("%-26s %7s %7s %7s %7s %7s %7s %7s %3s\n", "run", "settle",
+           "fused", "max", "dmp", "max", "compass", "max", "ok");
+    for (unsigned int i = 0; i < sizeof(runs) / sizeof(runs[0]); i++)
+    {
+      if (!simulate(runs[i], seconds))
+        ok = false;
+    }
+  }
+  for (const char * path : logs)
+    replay(path);
+  timeUpdates();
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,176 @@
+/******************************************************************************
+i2c_clock_bench.cpp
+I2C clock autotune, against the simulated MPU-9250
+
+Sets up the MPU-9250 DMP library the way the firmware's initIMU() does it,
+against the simulated MPU-9250, then picks the I2C clock with
+tuneI2CClock() (trying up to fast mode plus), on buses of different
+quality: a clean one, and ones whose edges are too slow for the clocks
+above 400 kHz or 100 kHz (mpuSim.setBusLimit()), where transactions fail
+or misread a bit now and then. A first run stays at the standard clock
+without tuning, for comparison. After tuning, it reads DMP packets in
+bursts, and the compass, the way the firmware's loop does, at 200 Hz.
+For each run it reports:
+
+  kHz       the clock picked
+  tune ms   time tuneI2CClock() took
+  read      packets read afterwards, as a percentage of those the DMP wrote
+  bad       packets that don't match the simulated motion: misread data
+            that got past the driver's checks
+  reset     FIFO resets, after packets that failed the driver's checks
+  retries   I2C attempts after the first (getI2CStats())
+  failed    I2C transfers that failed, after any retries
+  bus       share of the time the bus was busy
+
+Everything runs on the simulator's clock, so results are deterministic and
+independent of the host's speed.
+
+Usage: i2c_clock_bench [seconds]   (simulated seconds per run, default 10)
+******************************************************************************/
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <SparkFunMPU9250-DMP.h>
+#include "mpu9250_sim.h"
+
+// The firmware's default settings (config.h), at its highest log rate
+#define IMU_GYRO_FSR 2000
+#define IMU_ACCEL_FSR 2
+#define IMU_AG_LPF 5
+#define IMU_COMPASS_SAMPLE_RATE 100
+#define DMP_FIFO_RATE 200
+#define DMP_FEATURES (DMP_FEATURE_GYRO_CAL | DMP_FEATURE_SEND_CAL_GYRO | \
+                      DMP_FEATURE_SEND_RAW_ACCEL | DMP_FEATURE_6X_LP_QUAT)
+#define LOOP_US 2000 // The firmware's loop polls the FIFO this often
+
+struct clockRun
+{
+  const char * name;
+  bool tune; // Pick the clock with tuneI2CClock(), or stay at 100 kHz
+  uint32_t limit; // Bus limit (Hz), 0 for none
+  double rate; // Fraction of transactions failed above it
+};
+
+static const clockRun runs[] = {
+  {"untuned", false, 0, 0.0},
+  {"clean", true, 0, 0.0},
+  {"slow>400k", true, 400000, 0.02},
+  {"slow>100k", true, 100000, 0.02},
+  {"marginal", true, 400000, 0.0002},
+};
+
+static MPU9250_DMP imu;
+static dmp_packet_s packets[DMP_MAX_BURST_PACKETS];
+
+// Same configuration as the firmware's initIMU()
+static bool initImu(void)
+{
+  if (imu.begin() != INV_SUCCESS)
+    return false;
+  imu.setGyroFSR(IMU_GYRO_FSR);
+  imu.setAccelFSR(IMU_ACCEL_FSR);
+  imu.setLPF(IMU_AG_LPF);
+  imu.setSampleRate(DMP_FIFO_RATE);
+  imu.setCompassMode(COMPASS_MODE_CONTINUOUS);
+  imu.setCompassSampleRate(IMU_COMPASS_SAMPLE_RATE);
+  if (imu.dmpBegin(DMP_FEATURES, DMP_FIFO_RATE) != INV_SUCCESS)
+    return false;
+  imu.setFifoRecovery(FIFO_RECOVERY_RESYNC);
+  return true;
+}
+
+// A packet is good if its accel reading is gravity, rotated into the
+// sensor frame by its quaternion
+static bool goodPacket(const dmp_packet_s & packet)
+{
+  double q[4];
+  for (int i = 0; i < 4; i++)
+    q[i] = packet.quat[i] / 1073741824.0;
+  double w = q[0], x = q[1], y = q[2], z = q[3];
+  double expected[3] = {2 * (x * z - w * y), 2 * (y * z + w * x),
+                        1 - 2 * (x * x + y * y)};
+  for (int i = 0; i < 3; i++)
+  {
+    if (fabs(packet.accel[i] - expected[i] * 32768.0 / IMU_ACCEL_FSR) > 2.0)
+      return false;
+  }
+  return true;
+}
+
+static void simulate(const clockRun & run, double seconds)
+{
+  mpuSim.powerOn();
+  mpuSim.setBusLimit(0, 0.0);
+  imu.setI2CClock(I2C_CLOCK_STANDARD);
+  if (!initImu())
+  {
+    printf("initialization failed\n");
+    return;
+  }
+
+  mpuSim.setFaultRate(0.0); // Restarts the fault sequence
+  mpuSim.setBusLimit(run.limit, run.rate);
+  uint64_t tuneStart = mpuSim.now();
+  if (run.tune && (imu.tuneI2CClock(I2C_CLOCK_FAST_PLUS) != INV_SUCCESS))
+    printf("%-10s tuning failed\n", run.name);
+  double tuneMs = (mpuSim.now() - tuneStart) / 1000.0;
+
+  mpu9250SimStats start = mpuSim.stats();
+  mpu_fifo_stats_s fifoStart, fifoEnd;
+  imu.getFifoStats(&fifoStart);
+  i2c_stats_s i2cStart, i2cEnd;
+  imu.getI2CStats(&i2cStart);
+  uint64_t startUs = mpuSim.now();
+  uint64_t endUs = startUs + (uint64_t)(seconds * 1e6);
+  unsigned long read = 0, bad = 0;
+
+  while (mpuSim.now() < endUs)
+  {
+    unsigned char count;
+    if (imu.fifoAvailable() &&
+        (imu.dmpUpdateFifoBurst(packets, DMP_MAX_BURST_PACKETS, &count) ==
+         INV_SUCCESS))
+    {
+      for (unsigned char i = 0; i < count; i++)
+      {
+        if (!goodPacket(packets[i]))
+          bad++;
+      }
+      read += count;
+      imu.updateCompass();
+    }
+    delayMicroseconds(LOOP_US);
+  }
+
+  const mpu9250SimStats & end = mpuSim.stats();
+  imu.getFifoStats(&fifoEnd);
+  imu.getI2CStats(&i2cEnd);
+  double elapsed = (mpuSim.now() - startUs) / 1e6;
+  unsigned long written = end.dmpPackets - start.dmpPackets;
+
+  printf("%-10s %5lu %7.1f %6lu %5.1f%% %5lu %5lu %7lu %6lu %5.1f%%\n",
+         run.name, imu.getI2CClock() / 1000, tuneMs, read,
+         written ? 100.0 * read / written : 0.0, bad,
+         fifoEnd.resets - fifoStart.resets, i2cEnd.retries - i2cStart.retries,
+         i2cEnd.failures - i2cStart.failures,
+         (end.busTimeUs - start.busTimeUs) / 1e4 / elapsed);
+}
+
+int main(int argc, char * argv[])
+{
+  double seconds = (argc > 1) ? atof(argv[1]) : 10.0;
+  if (seconds <= 0.0)
+  {
+    printf("Usage: i2c_clock_bench [seconds]\n");
+    return 1;
+  }
+
+  printf("%.0f s per run, DMP at %d Hz, %d probe rounds per clock\n",
+         seconds, DMP_FIFO_RATE, I2C_PROBE_ROUNDS);
+  printf("%-10s %5s %7s %6s %6s %5s %5s %7s %6s %6s\n", "bus", "kHz",
+         "tune ms", "read", "", "bad", "reset", "retries", "failed", "bus");
+  for (const clockRun & run : runs)
+    simulate(run, seconds);
+  return 0;
+}
@@ -0,0 +1,190 @@
+/******************************************************************************
+i2c_fault_bench.cpp
+DMP acquisition through a faulty I2C bus, against the simulated MPU-9250
+
+Runs the MPU-9250 DMP library against the simulated MPU-9250, set up the
+way the firmware's initIMU() does it, reading DMP packets in bursts the
+way its loop does, while the simulated bus fails a fraction of its
+transactions (mpuSim.setFaultRate()): half of them NACK their address,
+and half NACK a data byte or end a read half-way. Each fault rate is run
+with the I2C transport's retries off (setI2CRetryBudget(0)), where every
+fault fails its transfer, and with the default retry budget. A last pair
+of runs gets the bus stuck (a slave holding SDA low) twice a second. For
+each run it reports:
+
+  read      packets read, as a percentage of those the DMP wrote
+  bad       packets that don't match the simulated motion: corrupt data
+            that got through to the packet parser
+  sync      FIFO realignments and resets, after failed FIFO reads
+  reset
+  faults    transactions the simulator failed
+  retries   I2C attempts after the first (getI2CStats())
+  failed    I2C transfers that failed, after any retries
+  recov     bus recoveries
+  bus       share of the time the bus was busy
+
+Everything runs on the simulator's clock, so results are deterministic and
+independent of the host's speed.
+
+Usage: i2c_fault_bench [seconds]   (simulated seconds per run, default 10)
+******************************************************************************/
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <SparkFunMPU9250-DMP.h>
+#include "mpu9250_sim.h"
+
+// The firmware's default settings (config.h)
+#define IMU_GYRO_FSR 2000
+#define IMU_ACCEL_FSR 2
+#define IMU_AG_LPF 5
+#define IMU_AG_SAMPLE_RATE 100
+#define IMU_COMPASS_SAMPLE_RATE 100
+#define DMP_FIFO_RATE 100
+#define DMP_FEATURES (DMP_FEATURE_GYRO_CAL | DMP_FEATURE_SEND_CAL_GYRO | \
+                      DMP_FEATURE_SEND_RAW_ACCEL | DMP_FEATURE_6X_LP_QUAT)
+#define LOOP_US 2000 // The firmware's loop polls the FIFO this often
+#define STUCK_EVERY_US 500000 // The stuck runs get the bus stuck this often
+
+struct faultRun
+{
+  double rate; // Fraction of transactions failed
+  bool stuck; // Get the bus stuck now and then instead
+};
+
+static const faultRun runs[] = {
+  {0.0, false},
+  {0.001, false},
+  {0.01, false},
+  {0.05, false},
+  {0.0, true},
+};
+
+static MPU9250_DMP imu;
+static dmp_packet_s packets[DMP_MAX_BURST_PACKETS];
+
+// Same configuration as the firmware's initIMU()
+static bool initImu(void)
+{
+  if (imu.begin() != INV_SUCCESS)
+    return false;
+  imu.setGyroFSR(IMU_GYRO_FSR);
+  imu.setAccelFSR(IMU_ACCEL_FSR);
+  imu.setLPF(IMU_AG_LPF);
+  imu.setSampleRate(IMU_AG_SAMPLE_RATE);
+  imu.setCompassMode(COMPASS_MODE_CONTINUOUS);
+  imu.setCompassSampleRate(IMU_COMPASS_SAMPLE_RATE);
+  if (imu.dmpBegin(DMP_FEATURES, DMP_FIFO_RATE) != INV_SUCCESS)
+    return false;
+  imu.setFifoRecovery(FIFO_RECOVERY_RESYNC);
+  return true;
+}
+
+// A packet is good if its accel reading is gravity, rotated into the
+// sensor frame by its quaternion
+static bool goodPacket(const dmp_packet_s & packet)
+{
+  double q[4];
+  for (int i = 0; i < 4; i++)
+    q[i] = packet.quat[i] / 1073741824.0;
+  double w = q[0], x = q[1], y = q[2], z = q[3];
+  double expected[3] = {2 * (x * z - w * y), 2 * (y * z + w * x),
+                        1 - 2 * (x * x + y * y)};
+  for (int i = 0; i < 3; i++)
+  {
+    if (fabs(packet.accel[i] - expected[i] * 32768.0 / IMU_ACCEL_FSR) > 2.0)
+      return false;
+  }
+  return true;
+}
+
+static void simulate(const faultRun & run, unsigned long retryBudget,
+                     double seconds)
+{
+  mpuSim.powerOn();
+  mpuSim.setFaultRate(0.0);
+  imu.setI2CRetryBudget(I2C_RETRY_BUDGET_US);
+  if (!initImu())
+  {
+    printf("initialization failed\n");
+    return;
+  }
+
+  imu.setI2CRetryBudget(retryBudget);
+  mpuSim.setFaultRate(run.rate);
+  mpu9250SimStats start = mpuSim.stats();
+  mpu_fifo_stats_s fifoStart, fifoEnd;
+  imu.getFifoStats(&fifoStart);
+  i2c_stats_s i2cStart, i2cEnd;
+  imu.getI2CStats(&i2cStart);
+  uint64_t startUs = mpuSim.now();
+  uint64_t endUs = startUs + (uint64_t)(seconds * 1e6);
+  uint64_t nextStuck = startUs + STUCK_EVERY_US;
+  unsigned long read = 0, bad = 0;
+
+  while (mpuSim.now() < endUs)
+  {
+    if (run.stuck && (mpuSim.now() >= nextStuck))
+    {
+      mpuSim.injectFault(Mpu9250Sim::FAULT_BUS_STUCK);
+      nextStuck += STUCK_EVERY_US;
+    }
+    unsigned char count;
+    if (imu.fifoAvailable() &&
+        (imu.dmpUpdateFifoBurst(packets, DMP_MAX_BURST_PACKETS, &count) ==
+         INV_SUCCESS))
+    {
+      for (unsigned char i = 0; i < count; i++)
+      {
+        if (!goodPacket(packets[i]))
+          bad++;
+      }
+      read += count;
+    }
+    delayMicroseconds(LOOP_US);
+  }
+
+  mpuSim.setFaultRate(0.0);
+  const mpu9250SimStats & end = mpuSim.stats();
+  imu.getFifoStats(&fifoEnd);
+  imu.getI2CStats(&i2cEnd);
+  double elapsed = (mpuSim.now() - startUs) / 1e6;
+  unsigned long written = end.dmpPackets - start.dmpPackets;
+
+  char faultText[16];
+  if (run.stuck)
+    snprintf(faultText, sizeof(faultText), "stuck");
+  else
+    snprintf(faultText, sizeof(faultText), "%.1f%%", run.rate * 100.0);
+  printf("%-6s %5s %6lu %5.1f%% %5lu %5lu %5lu %6lu %7lu %6lu %5lu %5.1f%%\n",
+         faultText, retryBudget ? "on" : "off", read,
+         written ? 100.0 * read / written : 0.0, bad,
+         fifoEnd.resyncs - fifoStart.resyncs, fifoEnd.resets - fifoStart.resets,
+         end.busFaults - start.busFaults, i2cEnd.retries - i2cStart.retries,
+         i2cEnd.failures - i2cStart.failures,
+         i2cEnd.recoveries - i2cStart.recoveries,
+         (end.busTimeUs - start.busTimeUs) / 1e4 / elapsed);
+}
+
+int main(int argc, char * argv[])
+{
+  double seconds = (argc > 1) ? atof(argv[1]) : 10.0;
+  if (seconds <= 0.0)
+  {
+    printf("Usage: i2c_fault_bench [seconds]\n");
+    return 1;
+  }
+
+  printf("%.0f s per run, DMP at %d Hz, I2C at 100 kHz, retry budget %d us\n",
+         seconds, DMP_FIFO_RATE, I2C_RETRY_BUDGET_US);
+  printf("%-6s %5s %6s %6s %5s %5s %5s %6s %7s %6s %5s %6s\n", "faults",
+         "retry", "read", "", "bad", "sync", "reset", "faults", "retries",
+         "failed", "recov", "bus");
+  for (const faultRun & run : runs)
+  {
+    simulate(run, 0, seconds);
+    simulate(run, I2C_RETRY_BUDGET_US, seconds);
+  }
+  return 0;
+}
@@ -0,0 +1,287 @@
+/******************************************************************************
+log_format_bench.cpp
+Compare the String-based and fixed-buffer IMU log formatters
+
+Formats the same stream of synthetic samples with every log channel enabled,
+once with the original String-based logIMUData() code and once with
+LogLine, and reports time, heap traffic and output size per line. Lines
+from both paths are compared, so this also checks that LogLine's output
+matches the old format.
+
+Times are for the host CPU. They show the relative cost of the two paths,
+not the absolute cost on the SAMD21, which also has no FPU or divider.
+******************************************************************************/
+#include <math.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+
+#include "WString.h"
+#include "log_format.h"
+
+#define SD_LOG_WRITE_BUFFER_SIZE 1024 // The old SD buffer size from config.h
+
+// The parts of MPU9250_DMP that logIMUData() uses, with the default FSRs
+struct imuState
+{
+  int ax, ay, az, gx, gy, gz, mx, my, mz;
+  long qw, qx, qy, qz;
+  unsigned long time;
+  float pitch, roll, yaw, heading;
+
+  float calcAccel(int axis) { return (float) axis / 16384.0f; } // +/-2g
+  float calcGyro(int axis) { return (float) axis / 16.4f; } // +/-2000dps
+  float calcMag(int axis) { return (float) axis / 6.665f; }
+  float calcQuat(long axis) { return qToFloat(axis, 30); }
+  float qToFloat(long number, unsigned char q)
+  {
+    unsigned long mask = 0;
+    for (int i=0; i<q; i++)
+      mask |= (1<<i);
+    return (number >> q) + ((number & mask) / (float) (2<<(q-1)));
+  }
+};
+
+static uint32_t rngState = 12345;
+static int32_t rng(int32_t range)
+{
+  rngState = rngState * 1664525u + 1013904223u;
+  return (int32_t)((rngState >> 8) % (2 * range + 1)) - range;
+}
+
+// Fill samples with plausible raw values and a unit quaternion
+static void makeSamples(std::vector<imuState> & samples)
+{
+  for (size_t i = 0; i < samples.size(); i++)
+  {
+    imuState & s = samples[i];
+    s.time = 1000 + i * 5;
+    s.ax = rng(20000); s.ay = rng(20000); s.az = 16384 + rng(2000);
+    s.gx = rng(3000); s.gy = rng(3000); s.gz = rng(3000);
+    s.mx = rng(600); s.my = rng(600); s.mz = rng(600);
+    double q[4], n = 0;
+    for (int j = 0; j < 4; j++)
+    {
+      q[j] = rng(10000) / 10000.0;
+      n += q[j] * q[j];
+    }
+    n = sqrt(n);
+    s.qw = (long)(q[0] / n * 1073741823.0);
+    s.qx = (long)(q[1] / n * 1073741823.0);
+    s.qy = (long)(q[2] / n * 1073741823.0);
+    s.qz = (long)(q[3] / n * 1073741823.0);
+    s.pitch = rng(9000) / 100.0f;
+    s.roll = rng(18000) / 100.0f;
+    s.yaw = rng(18000) / 100.0f + 180.0f;
+    s.heading = (rng(18000) + 18000) / 100.0f;
+  }
+}
+
+// The original logIMUData() line building, all channels enabled
+static void formatString(imuState & imu, bool calculated, String & imuLog)
+{
+  imuLog = "";
+  imuLog += String(imu.time) + ", ";
+  if (calculated)
+  {
+    imuLog += String(imu.calcAccel(imu.ax)) + ", ";
+    imuLog += String(imu.calcAccel(imu.ay)) + ", ";
+    imuLog += String(imu.calcAccel(imu.az)) + ", ";
+    imuLog += String(imu.calcGyro(imu.gx)) + ", ";
+    imuLog += String(imu.calcGyro(imu.gy)) + ", ";
+    imuLog += String(imu.calcGyro(imu.gz)) + ", ";
+    imuLog += String(imu.calcMag(imu.mx)) + ", ";
+    imuLog += String(imu.calcMag(imu.my)) + ", ";
+    imuLog += String(imu.calcMag(imu.mz)) + ", ";
+    imuLog += String(imu.calcQuat(imu.qw), 4) + ", ";
+    imuLog += String(imu.calcQuat(imu.qx), 4) + ", ";
+    imuLog += String(imu.calcQuat(imu.qy), 4) + ", ";
+    imuLog += String(imu.calcQuat(imu.qz), 4) + ", ";
+  }
+  else
+  {
+    imuLog += String(imu.ax) + ", ";
+    imuLog += String(imu.ay) + ", ";
+    imuLog += String(imu.az) + ", ";
+    imuLog += String(imu.gx) + ", ";
+    imuLog += String(imu.gy) + ", ";
+    imuLog += String(imu.gz) + ", ";
+    imuLog += String(imu.mx) + ", ";
+    imuLog += String(imu.my) + ", ";
+    imuLog += String(imu.mz) + ", ";
+    imuLog += String(imu.qw) + ", ";
+    imuLog += String(imu.qx) + ", ";
+    imuLog += String(imu.qy) + ", ";
+    imuLog += String(imu.qz) + ", ";
+  }
+  imuLog += String(imu.pitch, 2) + ", ";
+  imuLog += String(imu.roll, 2) + ", ";
+  imuLog += String(imu.yaw, 2) + ", ";
+  imuLog += String(imu.heading, 2) + ", ";
+  imuLog.remove(imuLog.length() - 2, 2);
+  imuLog += "\r\n";
+}
+
+// The new logIMUData() line building, all channels enabled
+static void formatLogLine(imuState & imu, bool calculated, LogLine & imuLog)
+{
+  imuLog.clear();
+  imuLog.addUInt(imu.time);
+  if (calculated)
+  {
+    imuLog.addFloat(imu.calcAccel(imu.ax));
+    imuLog.addFloat(imu.calcAccel(imu.ay));
+    imuLog.addFloat(imu.calcAccel(imu.az));
+    imuLog.addFloat(imu.calcGyro(imu.gx));
+    imuLog.addFloat(imu.calcGyro(imu.gy));
+    imuLog.addFloat(imu.calcGyro(imu.gz));
+    imuLog.addFloat(imu.calcMag(imu.mx));
+    imuLog.addFloat(imu.calcMag(imu.my));
+    imuLog.addFloat(imu.calcMag(imu.mz));
+    imuLog.addQ30(imu.qw, 4);
+    imuLog.addQ30(imu.qx, 4);
+    imuLog.addQ30(imu.qy, 4);
+    imuLog.addQ30(imu.qz, 4);
+  }
+  else
+  {
+    imuLog.addInt(imu.ax);
+    imuLog.addInt(imu.ay);
+    imuLog.addInt(imu.az);
+    imuLog.addInt(imu.gx);
+    imuLog.addInt(imu.gy);
+    imuLog.addInt(imu.gz);
+    imuLog.addInt(imu.mx);
+    imuLog.addInt(imu.my);
+    imuLog.addInt(imu.mz);
+    imuLog.addInt(imu.qw);
+    imuLog.addInt(imu.qx);
+    imuLog.addInt(imu.qy);
+    imuLog.addInt(imu.qz);
+  }
+  imuLog.addFloat(imu.pitch, 2);
+  imuLog.addFloat(imu.roll, 2);
+  imuLog.addFloat(imu.yaw, 2);
+  imuLog.addFloat(imu.heading, 2);
+  imuLog.end();
+}
+
+// Compare two log lines field by field. Returns 0 if they're identical, 1 if
+// some fields differ by at most one in the last printed digit (the String
+// path rounds Q30 quaternions through float, LogLine doesn't), or 2 if
+// they really differ.
+static int compareLines(const char * a, const char * b)
+{
+  if (strcmp(a, b) == 0)
+    return 0;
+  while (*a && *b)
+  {
+    char * endA;
+    char * endB;
+    double va = strtod(a, &endA);
+    double vb = strtod(b, &endB);
+    if ((endA == a) || (endB == b))
+      return 2;
+    const char * dot = strchr(a, '.');
+    int decimals = (dot && (dot < endA)) ? (int)(endA - dot - 1) : 0;
+    if (fabs(va - vb) > 1.01 * pow(10.0, -decimals))
+      return 2;
+    a = endA;
+    b = endB;
+    if (strncmp(a, ", ", 2) == 0)
+      a += 2;
+    if (strncmp(b, ", ", 2) == 0)
+      b += 2;
+    if ((*a == '\r') && (*b == '\r'))
+      return 1;
+  }
+  return 2;
+}
+
+static double nowNs(void)
+{
+  return std::chrono::duration<double, std::nano>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void run(std::vector<imuState> & samples, bool calculated)
+{
+  const size_t n = samples.size();
+  unsigned long bytes = 0;
+
+  // String path, including the String SD buffer
+  String imuLog;
+  String logFileBuffer;
+  stringAllocCount = stringAllocBytes = 0;
+  double start = nowNs();
+  for (size_t i = 0; i < n; i++)
+  {
+    formatString(samples[i], calculated, imuLog);
+    if (imuLog.length() + logFileBuffer.length() >= SD_LOG_WRITE_BUFFER_SIZE)
+      logFileBuffer = "";
+    logFileBuffer += imuLog;
+    bytes += imuLog.length();
+  }
+  double stringNs = (nowNs() - start) / n;
+  double stringAllocs = (double)stringAllocCount / n;
+  double stringHeap = (double)stringAllocBytes / n;
+  double stringLine = (double)bytes / n;
+
+  // LogLine path, with a fixed SD buffer
+  LogLine line;
+  static char sdBuffer[SD_LOG_WRITE_BUFFER_SIZE];
+  unsigned int sdLength = 0;
+  bytes = 0;
+  start = nowNs();
+  for (size_t i = 0; i < n; i++)
+  {
+    formatLogLine(samples[i], calculated, line);
+    if (line.length() + sdLength >= SD_LOG_WRITE_BUFFER_SIZE)
+      sdLength = 0;
+    memcpy(sdBuffer + sdLength, line.c_str(), line.length());
+    sdLength += line.length();
+    bytes += line.length();
+  }
+  double lineNs = (nowNs() - start) / n;
+  double lineLine = (double)bytes / n;
+
+  // Compare the two outputs line by line
+  size_t rounding = 0, mismatches = 0;
+  for (size_t i = 0; i < n; i++)
+  {
+    formatString(samples[i], calculated, imuLog);
+    formatLogLine(samples[i], calculated, line);
+    int result = compareLines(imuLog.c_str(), line.c_str());
+    if (result == 1)
+      rounding++;
+    else if (result == 2)
+    {
+      if (mismatches == 0)
+        printf("  first mismatch:\n    String:  %s    LogLine: %s",
+               imuLog.c_str(), line.c_str());
+      mismatches++;
+    }
+  }
+
+  printf("%s values, %zu lines:\n", calculated ? "Calculated" : "Raw", n);
+  printf("  %-8s %8.1f ns/line  %5.1f allocs/line  %6.1f heap bytes/line  %5.1f bytes/line\n",
+         "String", stringNs, stringAllocs, stringHeap, stringLine);
+  printf("  %-8s %8.1f ns/line  %5.1f allocs/line  %6.1f heap bytes/line  %5.1f bytes/line\n",
+         "LogLine", lineNs, 0.0, 0.0, lineLine);
+  printf("  speedup %.1fx, %zu lines off by one in the last digit, "
+         "%zu mismatched lines\n", stringNs / lineNs, rounding, mismatches);
+}
+
+int main(int argc, char ** argv)
+{
+  size_t lines = (argc > 1) ? strtoul(argv[1], NULL, 10) : 200000;
+  std::vector<imuState> samples(lines);
+  makeSamples(samples);
+
+  run(samples, false);
+  run(samples, true);
+  return 0;
+}
@@ -0,0 +1,322 @@
+/******************************************************************************
+mag_cal_bench.cpp
+Accuracy and cost of MPU9250_DMP's online magnetometer calibration
+
+Runs the MPU-9250 DMP library against the simulated MPU-9250, with hard
+and soft iron added to the simulated AK8963, reading the compass with
+updateCompass() at 100 Hz and learning from every reading with
+updateMagCalibration(). The body tumbles, turning about a different axis
+every few seconds so the readings cover the sphere, and stopping for a
+moment between turns. Errors are only counted while it's stopped, since a
+reading lags the orientation it's checked against. Each run reports:
+
+  applied  when the calibration was first changed, and how many times
+  before   heading and field strength errors with no calibration, over
+           the first 10 s
+  after    the same, calibrated, over the last LAST_S seconds
+
+The heading is tilt compensated with the simulated orientation, so its
+error is the compass's alone. The field strength error is the RMS
+deviation of the readings' magnitude from their mean, in percent.
+
+The "turning about z" run only sees a circle of the sphere, and should
+never be calibrated. The "restored" run starts from the calibration the
+first run learned, as the firmware does from flash.
+
+Last, it times the parts on the host: adding a reading, a fit, and a
+compass decode with and without the correction.
+
+Usage: mag_cal_bench [-t seconds]
+******************************************************************************/
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+
+#include <SparkFunMPU9250-DMP.h>
+#include "mpu9250_sim.h"
+
+#define IMU_COMPASS_SAMPLE_RATE 100
+#define TURN_S 2.0 // Each turn of the tumble lasts this long
+#define STOP_S 1.0 // then the body stops for this long
+#define SETTLE_S 0.2 // Readings this soon after stopping aren't checked
+#define BEFORE_S 10.0 // Uncalibrated errors are counted until this
+#define LAST_S 30.0 // Calibrated errors are counted for the last this long
+#define TIMED_CALLS 1000000
+
+struct calRun
+{
+  const char * name;
+  float ironOffset[3]; // uT, AK8963 axes
+  float ironMatrix[9];
+  float magNoise; // uT RMS per axis
+  bool tumble; // Or turn about z only
+  bool restore; // Start from the calibration the first run learned
+};
+
+#define MILD_IRON {1.05f, 0.03f, -0.02f, 0.03f, 0.97f, 0.01f, \
+                   -0.02f, 0.01f, 1.02f}
+#define STRONG_IRON {1.15f, 0.08f, -0.05f, 0.08f, 0.88f, 0.04f, \
+                     -0.05f, 0.04f, 1.06f}
+
+static const calRun runs[] = {
+  {"mild iron", {12, -20, 8}, MILD_IRON, 0.6f, true, false},
+  {"strong iron", {60, -45, 30}, STRONG_IRON, 0.6f, true, false},
+  {"strong iron, noisy", {60, -45, 30}, STRONG_IRON, 2.0f, true, false},
+  {"turning about z", {12, -20, 8}, MILD_IRON, 0.6f, false, false},
+  {"restored", {12, -20, 8}, MILD_IRON, 0.6f, true, true},
+};
+
+// Axes the tumble turns about, in turn, deg/s
+static const float tumbleRates[][3] = {
+  {60, 0, 0}, {0, 60, 0}, {0, 0, 60}, {40, 40, 0}, {0, 40, -40},
+  {40, -30, 30}, {-50, 20, 10},
+};
+
+static MPU9250_DMP imu;
+static short learnedOffset[3], learnedMatrix[9];
+static bool learned = false;
+
+struct errorStats
+{
+  double sumSquares;
+  double max;
+  unsigned long count;
+
+  void add(double error)
+  {
+    sumSquares += error * error;
+    max = fmax(max, fabs(error));
+    count++;
+  }
+  double rms(void) const { return count ? sqrt(sumSquares / count) : 0.0; }
+};
+
+// Field strength spread: RMS deviation from the mean, in percent
+struct strengthStats
+{
+  double sum;
+  double sumSquares;
+  unsigned long count;
+
+  void add(double value)
+  {
+    sum += value;
+    sumSquares += value * value;
+    count++;
+  }
+  double spread(void) const
+  {
+    if (!count)
+      return 0.0;
+    double mean = sum / count;
+    return sqrt(fmax(sumSquares / count - mean * mean, 0.0)) / mean * 100.0;
+  }
+};
+
+// Heading error of a compass reading (AK8963 axes), tilt compensated with
+// the simulated orientation: the angle of its horizontal part in the world
+// frame from the field's, which points along world x
+static double headingError(const short * mag)
+{
+  long quat[4];
+  mpuSim.truth(mpuSim.now(), quat);
+  double w = quat[0] / 1073741824.0, x = quat[1] / 1073741824.0;
+  double y = quat[2] / 1073741824.0, z = quat[3] / 1073741824.0;
+  // The AK8963's axes are the MPU-9250's with x and y swapped and z
+  // reversed
+  double v[3] = {(double)mag[1], (double)mag[0], -(double)mag[2]};
+  // Sensor to world: q v q*
+  double hx = (1 - 2 * (y * y + z * z)) * v[0] + 2 * (x * y - w * z) * v[1] +
+              2 * (x * z + w * y) * v[2];
+  double hy = 2 * (x * y + w * z) * v[0] + (1 - 2 * (x * x + z * z)) * v[1] +
+              2 * (y * z - w * x) * v[2];
+  return atan2(hy, hx) * 180.0 / M_PI;
+}
+
+static bool initImu(void)
+{
+  if (imu.begin() != INV_SUCCESS)
+    return false;
+  imu.setCompassMode(COMPASS_MODE_CONTINUOUS);
+  imu.setCompassSampleRate(IMU_COMPASS_SAMPLE_RATE);
+  imu.resetMagCalibration();
+  return true;
+}
+
+static void simulate(const calRun & run, double seconds)
+{
+  mpuSim.powerOn();
+  mpuSim.setMagIron(run.ironOffset, run.ironMatrix);
+  mpuSim.setMagNoise(run.magNoise);
+  mpuSim.setRotationRate(0, 0, 60);
+  if (!initImu())
+  {
+    printf("%-20s initialization failed\n", run.name);
+    return;
+  }
+  if (run.restore)
+  {
+    if (!learned)
+    {
+      printf("%-20s nothing learned to restore\n", run.name);
+      return;
+    }
+    imu.setMagCalibration(learnedOffset, learnedMatrix);
+  }
+
+  errorStats before = {0, 0, 0}, after = {0, 0, 0};
+  strengthStats beforeStrength = {0, 0, 0}, afterStrength = {0, 0, 0};
+  double firstApplied = -1.0;
+  unsigned int applied = 0, turn = 0;
+  bool stopped = false;
+  uint64_t start = mpuSim.now();
+  for (double t = 0.0; t < seconds; t = (mpuSim.now() - start) / 1e6)
+  {
+    // Turn, stop, and turn about the next axis
+    double phase = fmod(t, TURN_S + STOP_S);
+    if (!stopped && (phase >= TURN_S))
+    {
+      mpuSim.setRotationRate(0, 0, 0);
+      stopped = true;
+    }
+    else if (stopped && (phase < TURN_S))
+    {
+      const float * rate = tumbleRates[++turn % (sizeof(tumbleRates) /
+                                                 sizeof(tumbleRates[0]))];
+      if (run.tumble)
+        mpuSim.setRotationRate(rate[0], rate[1], rate[2]);
+      else
+        mpuSim.setRotationRate(0, 0, 60);
+      stopped = false;
+    }
+    delay(1000 / IMU_COMPASS_SAMPLE_RATE);
+    if (imu.updateCompass() != INV_SUCCESS)
+      continue;
+    if (imu.updateMagCalibration())
+    {
+      if (firstApplied < 0.0)
+        firstApplied = t;
+      applied++;
+    }
+
+    if (!stopped || (phase < TURN_S + SETTLE_S))
+      continue;
+    const short mag[3] = {(short)imu.mx, (short)imu.my, (short)imu.mz};
+    double strength = sqrt((double)mag[0] * mag[0] +
+                           (double)mag[1] * mag[1] +
+                           (double)mag[2] * mag[2]);
+    if (t < BEFORE_S && !run.restore)
+    {
+      before.add(headingError(mag));
+      beforeStrength.add(strength);
+    }
+    if (t >= seconds - LAST_S)
+    {
+      after.add(headingError(mag));
+      afterStrength.add(strength);
+    }
+  }
+
+  // The first run's calibration is the one restored
+  if (!learned && (applied > 0))
+  {
+    imu.getMagCalibration(learnedOffset, learnedMatrix);
+    learned = true;
+  }
+
+  mag_cal_fit_s fit;
+  int status = imu.getMagCalFit(&fit);
+  char firstText[16] = "never";
+  if (firstApplied >= 0.0)
+    snprintf(firstText, sizeof(firstText), "%.1f", firstApplied);
+  printf("%-20s %7s %4u %7.2f %7.2f %6.2f %7.2f %7.2f %6.2f %6d\n",
+         run.name, firstText, applied, before.rms(), before.max,
+         beforeStrength.spread(), after.rms(), after.max,
+         afterStrength.spread(), status);
+}
+
+template <typename F>
+static double timeCalls(unsigned long calls, F f)
+{
+  auto start = std::chrono::steady_clock::now();
+  for (unsigned long i = 0; i < calls; i++)
+    f(i);
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(end - start).count() /
+         calls;
+}
+
+static void timeParts(void)
+{
+  static volatile int sink __attribute__((unused));
+  static short readings[4096][3];
+  srand(1);
+  for (int i = 0; i < 4096; i++)
+  {
+    double v[3], norm = 0.0;
+    for (int j = 0; j < 3; j++)
+    {
+      v[j] = (double)rand() / RAND_MAX * 2.0 - 1.0;
+      norm += v[j] * v[j];
+    }
+    for (int j = 0; j < 3; j++)
+      readings[i][j] = (short)lround(v[j] / sqrt(norm) * 330.0 + 100.0 * j);
+  }
+
+  mag_cal_s cal;
+  mag_cal_reset(&cal, 0);
+  double addNs = timeCalls(TIMED_CALLS, [&](unsigned long i) {
+    sink = mag_cal_add(&cal, readings[i & 4095]); });
+  mag_cal_fit_s fit;
+  double solveNs = timeCalls(TIMED_CALLS / 100, [&](unsigned long i) {
+    sink = mag_cal_solve(&cal, &fit); });
+
+  // ST1, three little-endian axes, ST2 (16-bit output)
+  unsigned char raw[8] = {0x01, 0x10, 0x01, 0x20, 0xFF, 0x30, 0x00, 0x10};
+  short data[3];
+  imu.setMagCalibration(NULL, NULL);
+  double plainNs = timeCalls(TIMED_CALLS, [&](unsigned long i) {
+    raw[1] = (unsigned char)i;
+    sink = mpu_decode_compass(raw, data); });
+  const short offset[3] = {80, -133, 53};
+  const short matrix[9] = {15604, -492, 328, -492, 16892, -164, 328, -164,
+                           16064};
+  imu.setMagCalibration(offset, matrix);
+  double correctedNs = timeCalls(TIMED_CALLS, [&](unsigned long i) {
+    raw[1] = (unsigned char)i;
+    sink = mpu_decode_compass(raw, data); });
+  imu.setMagCalibration(NULL, NULL);
+
+  printf("mag_cal_add: %.1f ns per reading, host\n", addNs);
+  printf("mag_cal_solve: %.2f us per fit, host\n", solveNs / 1000.0);
+  printf("mpu_decode_compass: %.1f ns, %.1f ns corrected, host\n", plainNs,
+         correctedNs);
+}
+
+int main(int argc, char * argv[])
+{
+  double seconds = 120.0;
+  for (int i = 1; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "-t") && (i + 1 < argc))
+      seconds = atof(argv[++i]);
+    else
+    {
+      printf("Usage: mag_cal_bench [-t seconds]\n");
+      return 1;
+    }
+  }
+  if (seconds < LAST_S + BEFORE_S)
+    seconds = LAST_S + BEFORE_S;
+
+  printf("%.0f s per run, compass at %d Hz, heading errors in degrees, "
+         "strength spread in %%\n", seconds, IMU_COMPASS_SAMPLE_RATE);
+  printf("%-20s %7s %4s %7s %7s %6s %7s %7s %6s %6s\n", "run", "applied",
+         "x", "before", "max", "str", "after", "max", "str", "fit");
+  for (const calRun & run : runs)
+    simulate(run, seconds);
+  timeParts();
+  return 0;
+}
@@ -0,0 +1,1183 @@
+/******************************************************************************
+mpu9250_sim.cpp
+Simulated MPU-9250 and AK8963, at the register level
+
+See mpu9250_sim.h for an overview. The Arduino.h and Wire.h stand-ins are
+implemented at the end of this file.
+******************************************************************************/
+#include <math.h>
+#include <string.h>
+
+#include "mpu9250_sim.h"
+#include "Arduino.h"
+#include "Wire.h"
+#include "MPU9250_RegisterMap.h"
+#include "dmpKey.h"
+#include "arduino_mpu9250_i2c.h"
+
+Mpu9250Sim mpuSim;
+
+// Registers MPU9250_RegisterMap.h doesn't name
+#define MPU9250_DMP_INT_STATUS 0x39
+#define MPU9250_BANK_SEL 0x6D
+#define MPU9250_MEM_START_ADDR 0x6E
+#define MPU9250_MEM_R_W 0x6F
+#define MPU9250_PRGM_START_H 0x70
+
+// Register bits
+#define USER_CTRL_DMP_EN 0x80
+#define USER_CTRL_FIFO_EN 0x40
+#define USER_CTRL_I2C_MST_EN 0x20
+#define USER_CTRL_DMP_RST 0x08
+#define USER_CTRL_FIFO_RST 0x04
+#define USER_CTRL_RESETS 0x0F // Self-clearing reset bits
+#define INT_DATA_READY 0x01
+#define INT_DMP 0x02
+#define INT_FIFO_OVERFLOW 0x10
+#define FIFO_EN_TEMP 0x80
+#define FIFO_EN_GYRO_X 0x40
+#define FIFO_EN_GYRO_Y 0x20
+#define FIFO_EN_GYRO_Z 0x10
+#define FIFO_EN_ACCEL 0x08
+#define I2C_MST_CTRL_SLV_3_FIFO_EN 0x20
+#define I2C_SLV_EN 0x80
+#define I2C_SLV_READ 0x80
+
+// AK8963 modes and status bits
+#define AK8963_MODE_POWER_DOWN 0x00
+#define AK8963_MODE_SINGLE 0x01
+#define AK8963_MODE_CONTINUOUS_8HZ 0x02
+#define AK8963_MODE_CONTINUOUS_100HZ 0x06
+#define AK8963_MODE_FUSE_ROM 0x0F
+#define AK8963_CNTL2 0x0B
+#define AK8963_ST1_DRDY 0x01
+#define AK8963_ST1_DOR 0x02
+#define AK8963_ST2_HOFL 0x08
+#define AK8963_ST2_BITM 0x10
+#define AK8963_MEASURE_US 7200 // Time for one measurement
+
+// DMP memory the driver writes to select the packet contents. Same
+// addresses as inv_mpu_dmp_motion_driver.c.
+#define CFG_LP_QUAT 2712
+#define CFG_8 2718
+#define CFG_15 2727
+#define CFG_27 2742
+#define D_0_22 (22 + 512)
+
+#define SENSOR_TEMP_C 25.0
+
+const uint8_t Mpu9250Sim::_magAsa[3] = {0xB0, 0xB3, 0xA8};
+
+static int16_t saturate(double value)
+{
+  if (value > 32767.0)
+    return 32767;
+  if (value < -32768.0)
+    return -32768;
+  return (int16_t)lround(value);
+}
+
+static void putBig16(uint8_t * p, int16_t value)
+{
+  p[0] = (uint8_t)((uint16_t)value >> 8);
+  p[1] = (uint8_t)value;
+}
+
+static void putLittle16(uint8_t * p, int16_t value)
+{
+  p[0] = (uint8_t)value;
+  p[1] = (uint8_t)((uint16_t)value >> 8);
+}
+
+Mpu9250Sim::Mpu9250Sim()
+{
+  _address = MPU9250_SIM_ADDRESS;
+  _next = NULL;
+  _handler = NULL;
+  _rate.x = 10.0;
+  _rate.y = -20.0;
+  _rate.z = 30.0;
+  _field.x = 20.0;
+  _field.y = 0.0;
+  _field.z = -45.0;
+  _magNoise = 0.0;
+  _noiseState = 1;
+  _faultRate = 0.0;
+  _faultState = 1;
+  _busLimit = 0;
+  _limitRate = 0.0;
+  setMagIron(NULL, NULL);
+  powerOn();
+}
+
+void Mpu9250Sim::powerOn(void)
+{
+  _now = 0;
+  _start[0] = 1.0;
+  _start[1] = _start[2] = _start[3] = 0.0;
+  _startUs = 0;
+  _busClock = 100000;
+  memset(&_stats, 0, sizeof(_stats));
+  _inHandler = false;
+  _edgePending = false;
+  _injected = FAULT_NONE;
+  _busStuck = false;
+  resetMpu();
+  resetMag();
+  if (_next)
+    _next->powerOn();
+}
+
+void Mpu9250Sim::attach(Mpu9250Sim * device)
+{
+  Mpu9250Sim * last = this;
+  while (last->_next)
+    last = last->_next;
+  last->_next = device;
+  device->powerOn();
+}
+
+void Mpu9250Sim::resetMpu(void)
+{
+  memset(_regs, 0, sizeof(_regs));
+  _regs[MPU9250_PWR_MGMT_1] = 0x01;
+  _regs[MPU9250_WHO_AM_I] = MPU9250_WHO_AM_I_RESULT;
+  _pointer = 0;
+  _fifoHead = 0;
+  _fifoCount = 0;
+  memset(_mem, 0, sizeof(_mem));
+  _sampleIndex = 0;
+  _dmpPhase = 0;
+  _intActive = false;
+  _nextSample = _now + samplePeriod();
+}
+
+void Mpu9250Sim::resetMag(void)
+{
+  _magPointer = 0;
+  _magMode = AK8963_MODE_POWER_DOWN;
+  _mag16Bit = false;
+  memset(_magData, 0, sizeof(_magData));
+  _magNext = 0;
+}
+
+void Mpu9250Sim::setRotationRate(float x, float y, float z)
+{
+  if (_now > _startUs)
+  {
+    orientation(_now, _start);
+    _startUs = _now;
+  }
+  _rate.x = x;
+  _rate.y = y;
+  _rate.z = z;
+}
+
+void Mpu9250Sim::setMagIron(const float * offset, const float * matrix)
+{
+  for (int i = 0; i < 3; i++)
+    _ironOffset[i] = offset ? offset[i] : 0.0;
+  for (int i = 0; i < 9; i++)
+    _ironMatrix[i] = matrix ? matrix[i] : ((i % 4) ? 0.0 : 1.0);
+}
+
+void Mpu9250Sim::setMagneticField(float x, float y, float z)
+{
+  _field.x = x;
+  _field.y = y;
+  _field.z = z;
+}
+
+///////////
+// Clock //
+///////////
+
+// Samples are taken at 1 kHz / (1 + SMPLRT_DIV), or at 8 kHz with the DLPF
+// bypassed (DLPF_CFG 0 or 7), where the divider has no effect. The gyro's
+// own 32 kHz bypass (FCHOICE_B) isn't modelled.
+bool Mpu9250Sim::dlpfBypassed(void) const
+{
+  uint8_t dlpf = _regs[MPU9250_CONFIG] & 0x07;
+  return (dlpf == 0) || (dlpf == 7);
+}
+
+uint64_t Mpu9250Sim::samplePeriod(void) const
+{
+  if (dlpfBypassed())
+    return 125;
+  return 1000 * (1 + _regs[MPU9250_SMPLRT_DIV]);
+}
+
+void Mpu9250Sim::advance(uint64_t us)
+{
+  uint64_t end = _now + us;
+
+  // Events run in time order. An interrupt handler started by one of
+  // them may use the bus, which advances the clock (and runs later events)
+  // from inside this loop.
+  for (;;)
+  {
+    uint64_t next = _nextSample;
+    if (_magNext && (_magNext < next))
+      next = _magNext;
+    if (next > end)
+      break;
+    if (next > _now)
+      _now = next;
+    if (_magNext && (_magNext <= _nextSample))
+      magMeasure();
+    else
+      sample();
+  }
+  if (end > _now)
+    _now = end;
+
+  // Attached devices catch up. Each does the same for the next.
+  if (_next && (_next->_now < _now))
+    _next->advance(_now - _next->_now);
+}
+
+void Mpu9250Sim::busTransfer(unsigned int bits)
+{
+  advance(busBackground(bits));
+}
+
+uint64_t Mpu9250Sim::busBackground(unsigned int bits)
+{
+  uint64_t us = ((uint64_t)bits * 1000000 + _busClock - 1) / _busClock;
+  _stats.busTimeUs += us;
+  return us;
+}
+
+////////////
+// Motion //
+////////////
+
+// The body starts level, and turns at a constant rate in its own frame,
+// from where it was when the rate was set
+void Mpu9250Sim::orientation(uint64_t timeUs, double * q) const
+{
+  const double degToRad = M_PI / 180.0;
+  double t = ((double)timeUs - (double)_startUs) / 1e6;
+  double wx = _rate.x * degToRad, wy = _rate.y * degToRad;
+  double wz = _rate.z * degToRad;
+  double w = sqrt(wx * wx + wy * wy + wz * wz);
+  double r[4] = {1.0, 0.0, 0.0, 0.0};
+  if (w != 0.0)
+  {
+    double half = w * t / 2.0;
+    double s = sin(half) / w;
+    r[0] = cos(half);
+    r[1] = wx * s;
+    r[2] = wy * s;
+    r[3] = wz * s;
+  }
+  // q = start * r: the turn is in the body's frame
+  const double * p = _start;
+  double out[4];
+  out[0] = p[0] * r[0] - p[1] * r[1] - p[2] * r[2] - p[3] * r[3];
+  out[1] = p[0] * r[1] + p[1] * r[0] + p[2] * r[3] - p[3] * r[2];
+  out[2] = p[0] * r[2] - p[1] * r[3] + p[2] * r[0] + p[3] * r[1];
+  out[3] = p[0] * r[3] + p[1] * r[2] - p[2] * r[1] + p[3] * r[0];
+  for (int i = 0; i < 4; i++)
+    q[i] = out[i];
+}
+
+void Mpu9250Sim::truth(uint64_t timeUs, long * quat) const
+{
+  double q[4];
+  orientation(timeUs, q);
+  for (int i = 0; i < 4; i++)
+    quat[i] = (long)lround(q[i] * 1073741824.0);
+}
+
+void Mpu9250Sim::magExpected(const long * quat, double * counts) const
+{
+  double q[4];
+  for (int i = 0; i < 4; i++)
+    q[i] = quat[i] / 1073741824.0;
+  vector3 field = toSensor(q, _field);
+  double axis[3] = {field.y, field.x, -field.z};
+  for (int i = 0; i < 3; i++)
+  {
+    const double * iron = &_ironMatrix[i * 3];
+    counts[i] = (iron[0] * axis[0] + iron[1] * axis[1] + iron[2] * axis[2] +
+                 _ironOffset[i]) / 0.15;
+  }
+}
+
+// Rotate a world-frame vector into the sensor frame (q* v q)
+Mpu9250Sim::vector3 Mpu9250Sim::toSensor(const double * q,
+                                         const vector3 & v) const
+{
+  double w = q[0], x = -q[1], y = -q[2], z = -q[3];
+  vector3 r;
+  r.x = (1 - 2 * (y * y + z * z)) * v.x + 2 * (x * y - w * z) * v.y +
+        2 * (x * z + w * y) * v.z;
+  r.y = 2 * (x * y + w * z) * v.x + (1 - 2 * (x * x + z * z)) * v.y +
+        2 * (y * z - w * x) * v.z;
+  r.z = 2 * (x * z - w * y) * v.x + 2 * (y * z + w * x) * v.y +
+        (1 - 2 * (x * x + y * y)) * v.z;
+  return r;
+}
+
+//////////////
+// Sampling //
+//////////////
+
+void Mpu9250Sim::sample(void)
+{
+  _nextSample = _now + samplePeriod();
+  if (_regs[MPU9250_PWR_MGMT_1] & 0x40)
+    return; // Asleep
+  _sampleIndex++;
+  _stats.samples++;
+
+  double q[4];
+  orientation(_now, q);
+  vector3 gravity = {0.0, 0.0, 1.0};
+  vector3 accel = toSensor(q, gravity);
+  double accelSens = 16384.0 / (1 << ((_regs[MPU9250_ACCEL_CONFIG] >> 3) & 3));
+  double gyroSens = 131.072 / (1 << ((_regs[MPU9250_GYRO_CONFIG] >> 3) & 3));
+
+  uint8_t * out = &_regs[MPU9250_ACCEL_XOUT_H];
+  // With its filter bypassed too (ACCEL_FCHOICE_B), the accel samples at
+  // 4 kHz, so at 8 kHz every other sample repeats the last reading
+  bool accelDue = !dlpfBypassed() ||
+                  !(_regs[MPU9250_ACCEL_CONFIG_2] & 0x08) ||
+                  !(_sampleIndex & 1);
+  if (accelDue)
+  {
+    putBig16(out + 0, saturate(accel.x * accelSens));
+    putBig16(out + 2, saturate(accel.y * accelSens));
+    putBig16(out + 4, saturate(accel.z * accelSens));
+  }
+  putBig16(out + 6, saturate((SENSOR_TEMP_C - 21.0) * 333.87));
+  putBig16(out + 8, saturate(_rate.x * gyroSens));
+  putBig16(out + 10, saturate(_rate.y * gyroSens));
+  putBig16(out + 12, saturate(_rate.z * gyroSens));
+
+  if (_regs[MPU9250_USER_CTRL] & USER_CTRL_I2C_MST_EN)
+    runAuxBus();
+
+  uint8_t status = INT_DATA_READY;
+  uint8_t userCtrl = _regs[MPU9250_USER_CTRL];
+  if (userCtrl & USER_CTRL_FIFO_EN)
+  {
+    // Sensor data selected by FIFO_EN, in register order
+    uint8_t data[14 + 24];
+    unsigned int length = 0;
+    uint8_t fifoEn = _regs[MPU9250_FIFO_EN];
+    if (fifoEn & FIFO_EN_ACCEL)
+    {
+      memcpy(&data[length], &_regs[MPU9250_ACCEL_XOUT_H], 6);
+      length += 6;
+    }
+    if (fifoEn & FIFO_EN_TEMP)
+    {
+      memcpy(&data[length], &_regs[MPU9250_TEMP_OUT_H], 2);
+      length += 2;
+    }
+    for (int i = 0; i < 3; i++)
+    {
+      if (fifoEn & (FIFO_EN_GYRO_X >> i))
+      {
+        memcpy(&data[length], &_regs[MPU9250_GYRO_XOUT_H + 2 * i], 2);
+        length += 2;
+      }
+    }
+    // Each enabled read slave has its own run of EXT_SENS_DATA
+    unsigned int ext = 0;
+    for (int n = 0; n < 4; n++)
+    {
+      uint8_t ctrl = _regs[MPU9250_I2C_SLV0_CTRL + 3 * n];
+      bool read = _regs[MPU9250_I2C_SLV0_ADDR + 3 * n] & I2C_SLV_READ;
+      if (!(ctrl & I2C_SLV_EN) || !read)
+        continue;
+      unsigned int slaveLength = ctrl & 0x0F;
+      bool toFifo = (n < 3) ? (fifoEn & (0x01 << n)) :
+                    (_regs[MPU9250_I2C_MST_CTRL] & I2C_MST_CTRL_SLV_3_FIFO_EN);
+      if (toFifo && (ext + slaveLength <= 24))
+      {
+        memcpy(&data[length], &_regs[MPU9250_EXT_SENS_DATA_00 + ext],
+               slaveLength);
+        length += slaveLength;
+      }
+      ext += slaveLength;
+    }
+    if (length)
+      fifoPush(data, length);
+
+    // The DMP writes a packet every (D_0_22 + 1) samples
+    if (userCtrl & USER_CTRL_DMP_EN)
+    {
+      unsigned int divider = ((_mem[D_0_22] << 8) | _mem[D_0_22 + 1]) + 1;
+      if (_dmpPhase == 0)
+      {
+        pushDmpPacket();
+        _regs[MPU9250_DMP_INT_STATUS] |= 0x01;
+        status |= INT_DMP;
+      }
+      _dmpPhase = (_dmpPhase + 1) % divider;
+    }
+  }
+
+  raise(status);
+}
+
+// Run the I2C master's slave 0-3 transactions for this sample
+void Mpu9250Sim::runAuxBus(void)
+{
+  uint8_t delay = _regs[MPU9250_I2C_SLV4_CTRL] & 0x1F;
+  uint8_t delayed = _regs[MPU9250_I2C_MST_DELAY_CTRL];
+  unsigned int ext = 0;
+
+  for (int n = 0; n < 4; n++)
+  {
+    uint8_t address = _regs[MPU9250_I2C_SLV0_ADDR + 3 * n];
+    uint8_t reg = _regs[MPU9250_I2C_SLV0_REG + 3 * n];
+    uint8_t ctrl = _regs[MPU9250_I2C_SLV0_CTRL + 3 * n];
+    unsigned int length = ctrl & 0x0F;
+    bool read = address & I2C_SLV_READ;
+    if (!(ctrl & I2C_SLV_EN))
+      continue;
+
+    // Delayed slaves only run every (I2C_MST_DLY + 1) samples, but keep
+    // their place in EXT_SENS_DATA
+    bool run = !(delayed & (1 << n)) || ((_sampleIndex % (delay + 1)) == 0);
+    if (run)
+    {
+      _stats.auxTransactions++;
+      if ((address & 0x7F) != AK8963_SIM_ADDRESS)
+        _regs[MPU9250_I2C_MST_STATUS] |= 1 << n; // NACK
+      else if (read)
+      {
+        for (unsigned int i = 0; (i < length) && (ext + i < 24); i++)
+          _regs[MPU9250_EXT_SENS_DATA_00 + ext + i] = magRead(reg + i);
+        if ((reg <= AK8963_ST2) && (reg + length > AK8963_ST2))
+          _magData[0] &= ~(AK8963_ST1_DRDY | AK8963_ST1_DOR);
+      }
+      else
+        magWrite(reg, _regs[MPU9250_I2C_SLV0_DO + n]);
+    }
+    if (read)
+      ext += length;
+  }
+}
+
+void Mpu9250Sim::pushDmpPacket(void)
+{
+  uint8_t packet[32];
+  unsigned int length = 0;
+
+  if ((_mem[CFG_LP_QUAT] == DINBC0) || (_mem[CFG_8] == DINA20))
+  {
+    long quat[4];
+    truth(_now, quat);
+    for (int i = 0; i < 4; i++)
+    {
+      packet[length++] = (uint8_t)(quat[i] >> 24);
+      packet[length++] = (uint8_t)(quat[i] >> 16);
+      packet[length++] = (uint8_t)(quat[i] >> 8);
+      packet[length++] = (uint8_t)quat[i];
+    }
+  }
+  if (_mem[CFG_15 + 1] == 0xC0)
+  {
+    memcpy(&packet[length], &_regs[MPU9250_ACCEL_XOUT_H], 6);
+    length += 6;
+  }
+  if (_mem[CFG_15 + 4] == 0xC4)
+  {
+    memcpy(&packet[length], &_regs[MPU9250_GYRO_XOUT_H], 6);
+    length += 6;
+  }
+  if (_mem[CFG_27] == DINA20)
+  {
+    memset(&packet[length], 0, 4); // No gestures
+    length += 4;
+  }
+
+  _stats.dmpPackets++;
+  if (length)
+    fifoPush(packet, length);
+}
+
+// When the FIFO is full, new data replaces the oldest
+void Mpu9250Sim::fifoPush(const uint8_t * data, unsigned int length)
+{
+  unsigned int room = MPU9250_SIM_FIFO_SIZE - _fifoCount;
+  if (length > room)
+  {
+    unsigned int lost = length - room;
+    _fifoHead = (_fifoHead + lost) % MPU9250_SIM_FIFO_SIZE;
+    _fifoCount -= lost;
+    _stats.fifoOverflows++;
+    _stats.fifoBytesLost += lost;
+    raise(INT_FIFO_OVERFLOW);
+  }
+  for (unsigned int i = 0; i < length; i++)
+  {
+    _fifo[(_fifoHead + _fifoCount) % MPU9250_SIM_FIFO_SIZE] = data[i];
+    _fifoCount++;
+  }
+}
+
+////////////////
+// Interrupts //
+////////////////
+
+void Mpu9250Sim::raise(uint8_t status)
+{
+  _regs[MPU9250_INT_STATUS] |= status;
+  if (_regs[MPU9250_INT_ENABLE] & status)
+    setPin(true);
+}
+
+void Mpu9250Sim::setPin(bool active)
+{
+  bool latched = _regs[MPU9250_INT_PIN_CFG] & (1 << INT_PIN_CFG_LATCH_INT_EN);
+  if (!active)
+  {
+    _intActive = false;
+    return;
+  }
+  if (_intActive)
+    return; // Still latched from an earlier event: no new edge
+  // Unlatched interrupts are a 50 us pulse. It's an edge either way.
+  _intActive = latched;
+  _stats.interrupts++;
+
+  if (!_handler)
+    return;
+  if (_inHandler)
+  {
+    _edgePending = true; // Runs once the current handler returns
+    return;
+  }
+  _inHandler = true;
+  do
+  {
+    _edgePending = false;
+    _handler();
+  } while (_edgePending);
+  _inHandler = false;
+}
+
+void Mpu9250Sim::clearOnRead(void)
+{
+  if (_regs[MPU9250_INT_PIN_CFG] & (1 << INT_PIN_CFG_INT_ANYRD_2CLEAR))
+  {
+    _regs[MPU9250_INT_STATUS] = 0;
+    setPin(false);
+  }
+}
+
+///////////////
+// Registers //
+///////////////
+
+bool Mpu9250Sim::write(uint8_t address, const uint8_t * data,
+                       unsigned int length)
+{
+  _stats.transactions++;
+  _stats.busBytes += 1 + length;
+
+  for (Mpu9250Sim * device = this; device; device = device->_next)
+  {
+    if (device->writeDevice(address, data, length))
+      return true;
+  }
+  return false;
+}
+
+bool Mpu9250Sim::read(uint8_t address, uint8_t * data, unsigned int length)
+{
+  _stats.transactions++;
+  _stats.busBytes += 1 + length;
+
+  for (Mpu9250Sim * device = this; device; device = device->_next)
+  {
+    if (device->readDevice(address, data, length))
+      return true;
+  }
+  return false;
+}
+
+bool Mpu9250Sim::writeDevice(uint8_t address, const uint8_t * data,
+                             unsigned int length)
+{
+  if (address == _address)
+  {
+    if (length == 0)
+      return true;
+    _pointer = data[0] & 0x7F;
+    for (unsigned int i = 1; i < length; i++)
+    {
+      writeRegister(_pointer, data[i]);
+      if ((_pointer != MPU9250_FIFO_R_W) && (_pointer != MPU9250_MEM_R_W))
+        _pointer = (_pointer + 1) & 0x7F;
+    }
+    return true;
+  }
+
+  // The AK8963 is only on the host bus in bypass mode
+  bool bypass = (_regs[MPU9250_INT_PIN_CFG] & (1 << INT_PIN_CFG_BYPASS_EN)) &&
+                !(_regs[MPU9250_USER_CTRL] & USER_CTRL_I2C_MST_EN);
+  if ((address == AK8963_SIM_ADDRESS) && bypass)
+  {
+    if (length == 0)
+      return true;
+    _magPointer = data[0];
+    for (unsigned int i = 1; i < length; i++)
+      magWrite(_magPointer++, data[i]);
+    return true;
+  }
+  return false;
+}
+
+bool Mpu9250Sim::readDevice(uint8_t address, uint8_t * data,
+                            unsigned int length)
+{
+  if (address == _address)
+  {
+    for (unsigned int i = 0; i < length; i++)
+    {
+      data[i] = readRegister(_pointer);
+      if ((_pointer != MPU9250_FIFO_R_W) && (_pointer != MPU9250_MEM_R_W))
+        _pointer = (_pointer + 1) & 0x7F;
+    }
+    clearOnRead();
+    return true;
+  }
+
+  bool bypass = (_regs[MPU9250_INT_PIN_CFG] & (1 << INT_PIN_CFG_BYPASS_EN)) &&
+                !(_regs[MPU9250_USER_CTRL] & USER_CTRL_I2C_MST_EN);
+  if ((address == AK8963_SIM_ADDRESS) && bypass)
+  {
+    uint8_t start = _magPointer;
+    for (unsigned int i = 0; i < length; i++)
+      data[i] = magRead(_magPointer++);
+    if ((start <= AK8963_ST2) && (start + length > AK8963_ST2))
+      _magData[0] &= ~(AK8963_ST1_DRDY | AK8963_ST1_DOR);
+    return true;
+  }
+  return false;
+}
+
+uint8_t Mpu9250Sim::readRegister(uint8_t reg)
+{
+  uint8_t value;
+
+  switch (reg)
+  {
+  case MPU9250_FIFO_COUNTH:
+    return (_fifoCount >> 8) & 0x1F;
+  case MPU9250_FIFO_COUNTL:
+    return _fifoCount & 0xFF;
+  case MPU9250_FIFO_R_W:
+    if (!_fifoCount)
+      return 0xFF;
+    value = _fifo[_fifoHead];
+    _fifoHead = (_fifoHead + 1) % MPU9250_SIM_FIFO_SIZE;
+    _fifoCount--;
+    return value;
+  case MPU9250_MEM_R_W:
+    value = _mem[(_regs[MPU9250_BANK_SEL] & 0x0F) * 256 +
+                 _regs[MPU9250_MEM_START_ADDR]];
+    _regs[MPU9250_MEM_START_ADDR]++; // Wraps within the bank
+    return value;
+  case MPU9250_INT_STATUS:
+    value = _regs[MPU9250_INT_STATUS];
+    _regs[MPU9250_INT_STATUS] = 0;
+    setPin(false);
+    return value;
+  case MPU9250_DMP_INT_STATUS:
+    value = _regs[MPU9250_DMP_INT_STATUS];
+    _regs[MPU9250_DMP_INT_STATUS] = 0;
+    return value;
+  default:
+    return _regs[reg];
+  }
+}
+
+void Mpu9250Sim::writeRegister(uint8_t reg, uint8_t value)
+{
+  switch (reg)
+  {
+  case MPU9250_PWR_MGMT_1:
+    if (value & (1 << PWR_MGMT_1_H_RESET))
+      resetMpu();
+    else
+      _regs[reg] = value;
+    break;
+  case MPU9250_USER_CTRL:
+    if (value & USER_CTRL_FIFO_RST)
+    {
+      _fifoHead = 0;
+      _fifoCount = 0;
+      _stats.fifoResets++;
+    }
+    if (value & USER_CTRL_DMP_RST)
+      _dmpPhase = 0;
+    _regs[reg] = value & ~USER_CTRL_RESETS;
+    break;
+  case MPU9250_FIFO_R_W:
+    fifoPush(&value, 1);
+    break;
+  case MPU9250_MEM_R_W:
+    _mem[(_regs[MPU9250_BANK_SEL] & 0x0F) * 256 +
+         _regs[MPU9250_MEM_START_ADDR]] = value;
+    _regs[MPU9250_MEM_START_ADDR]++;
+    break;
+  case MPU9250_INT_STATUS:
+  case MPU9250_FIFO_COUNTH:
+  case MPU9250_FIFO_COUNTL:
+  case MPU9250_WHO_AM_I:
+    break; // Read-only
+  default:
+    if ((reg >= MPU9250_ACCEL_XOUT_H) && (reg <= MPU9250_EXT_SENS_DATA_23))
+      break; // Read-only
+    _regs[reg] = value;
+    break;
+  }
+}
+
+////////////
+// AK8963 //
+////////////
+
+uint8_t Mpu9250Sim::magRead(uint8_t reg)
+{
+  if ((reg >= AK8963_ST1) && (reg <= AK8963_ST2))
+    return _magData[reg - AK8963_ST1];
+  switch (reg)
+  {
+  case AK8963_WIA:
+    return AK8963_WHO_AM_I_RESULT;
+  case AK8963_INFO:
+    return 0x9A;
+  case AK8963_CNTL:
+    return _magMode | (_mag16Bit ? 0x10 : 0x00);
+  case AK8963_ASAX:
+  case AK8963_ASAY:
+  case AK8963_ASAZ:
+    // Fuse ROM is only readable in fuse ROM access mode
+    if (_magMode == AK8963_MODE_FUSE_ROM)
+      return _magAsa[reg - AK8963_ASAX];
+    return 0;
+  default:
+    return 0;
+  }
+}
+
+void Mpu9250Sim::magWrite(uint8_t reg, uint8_t value)
+{
+  if (reg == AK8963_CNTL2)
+  {
+    if (value & 0x01)
+      resetMag(); // Soft reset
+    return;
+  }
+  if (reg != AK8963_CNTL)
+    return;
+
+  _magMode = value & MAG_CTRL_OP_MODE_MASK;
+  _mag16Bit = value & 0x10;
+  switch (_magMode)
+  {
+  case AK8963_MODE_SINGLE:
+  case AK8963_MODE_CONTINUOUS_8HZ:
+  case AK8963_MODE_CONTINUOUS_100HZ:
+    _magNext = _now + AK8963_MEASURE_US;
+    break;
+  default:
+    _magNext = 0;
+    break;
+  }
+}
+
+// Finish a measurement. The AK8963's axes are the MPU-9250's with x and y
+// swapped and z reversed.
+void Mpu9250Sim::magMeasure(void)
+{
+  double q[4];
+  orientation(_now, q);
+  vector3 field = toSensor(q, _field);
+  double resolution = _mag16Bit ? 0.15 : 0.6; // uT/LSB
+  double axis[3] = {field.y, field.x, -field.z};
+  bool overflow = false;
+
+  for (int i = 0; i < 3; i++)
+  {
+    // Undo the fuse ROM adjustment the driver applies
+    double adjust = (_magAsa[i] + 128) / 256.0;
+    const double * iron = &_ironMatrix[i * 3];
+    double value = iron[0] * axis[0] + iron[1] * axis[1] +
+                   iron[2] * axis[2] + _ironOffset[i];
+    if (_magNoise > 0.0)
+      value += _magNoise * noise();
+    double counts = value / resolution / adjust;
+    if (fabs(value) > 4912.0)
+      overflow = true;
+    putLittle16(&_magData[1 + 2 * i], saturate(counts));
+  }
+  if (_magData[0] & AK8963_ST1_DRDY)
+    _magData[0] |= AK8963_ST1_DOR; // The last result was never read
+  _magData[0] |= AK8963_ST1_DRDY;
+  _magData[7] = (_mag16Bit ? AK8963_ST2_BITM : 0) |
+                (overflow ? AK8963_ST2_HOFL : 0);
+  _stats.magSamples++;
+
+  switch (_magMode)
+  {
+  case AK8963_MODE_CONTINUOUS_8HZ:
+    _magNext += 125000;
+    break;
+  case AK8963_MODE_CONTINUOUS_100HZ:
+    _magNext += 10000;
+    break;
+  default:
+    _magMode = AK8963_MODE_POWER_DOWN; // Single measurement is done
+    _magNext = 0;
+    break;
+  }
+}
+
+// Roughly Gaussian, mean 0 and standard deviation 1: the sum of twelve
+// uniform numbers (xorshift64*), less 6
+double Mpu9250Sim::noise(void)
+{
+  double sum = 0.0;
+  for (int i = 0; i < 12; i++)
+  {
+    _noiseState ^= _noiseState >> 12;
+    _noiseState ^= _noiseState << 25;
+    _noiseState ^= _noiseState >> 27;
+    sum += (_noiseState * 2685821657736338717ULL >> 11) / 9007199254740992.0;
+  }
+  return sum - 6.0;
+}
+
+///////////////
+// Bus faults //
+///////////////
+
+void Mpu9250Sim::injectFault(busFault fault)
+{
+  if (fault == FAULT_BUS_STUCK)
+    _busStuck = true;
+  else
+    _injected = fault;
+}
+
+void Mpu9250Sim::setFaultRate(double rate)
+{
+  _faultRate = rate;
+  _faultState = 1;
+}
+
+void Mpu9250Sim::setBusLimit(uint32_t hz, double rate)
+{
+  _busLimit = hz;
+  _limitRate = rate;
+}
+
+// Uniform in [0, 1), xorshift64*, the same sequence after setFaultRate()
+double Mpu9250Sim::faultDraw(void)
+{
+  _faultState ^= _faultState >> 12;
+  _faultState ^= _faultState << 25;
+  _faultState ^= _faultState >> 27;
+  return (_faultState * 2685821657736338717ULL >> 11) / 9007199254740992.0;
+}
+
+Mpu9250Sim::busFault Mpu9250Sim::nextFault(bool read)
+{
+  busFault fault = _injected;
+  _injected = FAULT_NONE;
+  if (_busStuck)
+    fault = FAULT_BUS_STUCK;
+  else if ((fault == FAULT_NONE) && (_faultRate > 0.0))
+  {
+    double r = faultDraw();
+    if (r < _faultRate / 2)
+      fault = FAULT_ADDR_NACK;
+    else if (r < _faultRate)
+      fault = read ? FAULT_SHORT_READ : FAULT_DATA_NACK;
+  }
+  if ((fault == FAULT_NONE) && _busLimit && (_busClock > _busLimit))
+  {
+    double r = faultDraw();
+    if (r < _limitRate / 2)
+      fault = FAULT_ADDR_NACK;
+    else if (r < _limitRate)
+      fault = read ? FAULT_BIT_ERROR : FAULT_DATA_NACK;
+  }
+  if (fault != FAULT_NONE)
+    _stats.busFaults++;
+  return fault;
+}
+
+///////////////////////////////
+// Arduino.h and Wire.h glue //
+///////////////////////////////
+
+extern "C" unsigned long millis(void)
+{
+  return (unsigned long)(mpuSim.now() / 1000);
+}
+
+extern "C" unsigned long micros(void)
+{
+  return (unsigned long)mpuSim.now();
+}
+
+// A bit error: one bit of a read, picked from its length, read wrong
+static void flipBit(uint8_t * data, unsigned int length)
+{
+  data[length / 2] ^= 1 << (length % 8);
+}
+
+// Host transfer engine for the I2C transaction queue (see
+// arduino_mpu9250_i2c.h). A transaction is made on the simulated bus when
+// it starts, with Wire's faults, but the clock doesn't move: it's done,
+// and its interrupt runs, once a delay passes the time it would take. As
+// on the SAMD21, a read's data only starts once the engine is polled after
+// its register address has gone out.
+static bool dmaRunning = false;
+static uint64_t dmaDoneUs = 0;
+static uint64_t dmaPointerUs = 0; // A read's register address is out then
+static uint64_t dmaDataUs = 0; // and its data take this long
+static int dmaStatus = 0;
+static unsigned char dmaMoved = 0;
+
+extern "C" int arduino_i2c_dma_start(const struct i2c_txn_s * txn)
+{
+  unsigned int bits;
+  dmaStatus = 0;
+  dmaMoved = 0;
+  dmaPointerUs = 0;
+
+  // A read writes its register address first, then restarts
+  Mpu9250Sim::busFault fault = mpuSim.nextFault(false);
+  if ((fault == Mpu9250Sim::FAULT_ADDR_NACK) ||
+      (fault == Mpu9250Sim::FAULT_BUS_STUCK))
+  {
+    mpuSim.failedTransaction();
+    bits = 1 + 9 + 1;
+    dmaStatus = (fault == Mpu9250Sim::FAULT_BUS_STUCK) ? I2C_ERR_BUS :
+                I2C_ERR_ADDR_NACK;
+  }
+  else if (txn->read)
+  {
+    if (!mpuSim.write(txn->slave_addr, &txn->reg_addr, 1))
+    {
+      bits = 1 + 9 + 1;
+      dmaStatus = I2C_ERR_ADDR_NACK;
+    }
+    else
+    {
+      bits = 1 + 9 * 2;
+      unsigned int quantity = txn->length;
+      fault = mpuSim.nextFault(true);
+      if (fault == Mpu9250Sim::FAULT_SHORT_READ)
+        quantity /= 2;
+      else if ((fault != Mpu9250Sim::FAULT_NONE) &&
+               (fault != Mpu9250Sim::FAULT_BIT_ERROR))
+        quantity = 0;
+      if (!quantity)
+      {
+        mpuSim.failedTransaction();
+        dmaStatus = I2C_ERR_ADDR_NACK;
+      }
+      else if (!mpuSim.read(txn->slave_addr, txn->data, quantity))
+      {
+        quantity = 0;
+        dmaStatus = I2C_ERR_ADDR_NACK;
+      }
+      else if (quantity < txn->length)
+      {
+        dmaStatus = I2C_ERR_SHORT_READ;
+        dmaMoved = 1;
+      }
+      else if (fault == Mpu9250Sim::FAULT_BIT_ERROR)
+        flipBit(txn->data, quantity);
+      if (quantity)
+      {
+        dmaPointerUs = mpuSim.now() + mpuSim.busBackground(bits);
+        dmaDataUs = mpuSim.busBackground(1 + 9 * (1 + quantity) + 1);
+        dmaDoneUs = UINT64_MAX;
+        dmaRunning = true;
+        return 0;
+      }
+      bits += 1 + 9 + 1;
+    }
+  }
+  else
+  {
+    uint8_t buffer[1 + I2C_MAX_WRITE_LENGTH];
+    unsigned int length = 1 + txn->length;
+    buffer[0] = txn->reg_addr;
+    memcpy(buffer + 1, txn->data, txn->length);
+    if (fault == Mpu9250Sim::FAULT_DATA_NACK)
+      length = (length + 1) / 2;
+    bool ack = mpuSim.write(txn->slave_addr, buffer, length);
+    bits = 1 + 9 * (1 + (ack ? length : 0)) + 1;
+    if (!ack)
+      dmaStatus = I2C_ERR_ADDR_NACK;
+    else if (fault == Mpu9250Sim::FAULT_DATA_NACK)
+    {
+      dmaStatus = I2C_ERR_DATA_NACK;
+      dmaMoved = 1;
+    }
+  }
+
+  dmaDoneUs = mpuSim.now() + mpuSim.busBackground(bits);
+  dmaRunning = true;
+  return 0;
+}
+
+extern "C" int arduino_i2c_dma_status(unsigned char * moved)
+{
+  if (dmaRunning && dmaPointerUs && (mpuSim.now() >= dmaPointerUs))
+  {
+    dmaDoneUs = mpuSim.now() + dmaDataUs;
+    dmaPointerUs = 0;
+  }
+  *moved = dmaMoved;
+  if (dmaRunning && (mpuSim.now() < dmaDoneUs))
+    return I2C_PENDING;
+  return dmaStatus;
+}
+
+extern "C" void arduino_i2c_dma_release(void)
+{
+  dmaRunning = false;
+}
+
+// Run the clock to end, stopping for the engine's interrupt whenever a
+// transaction finishes on the way (which may start the next)
+static void advanceTo(uint64_t end)
+{
+  while (dmaRunning && (dmaDoneUs <= end))
+  {
+    if (dmaDoneUs > mpuSim.now())
+      mpuSim.advance(dmaDoneUs - mpuSim.now());
+    dmaRunning = false;
+    arduino_i2c_dma_done();
+  }
+  if (end > mpuSim.now())
+    mpuSim.advance(end - mpuSim.now());
+}
+
+extern "C" void delay(unsigned long ms)
+{
+  advanceTo(mpuSim.now() + (uint64_t)ms * 1000);
+}
+
+extern "C" void delayMicroseconds(unsigned int us)
+{
+  advanceTo(mpuSim.now() + us);
+}
+
+TwoWire Wire;
+
+TwoWire::TwoWire()
+{
+  _txAddress = 0;
+  _txLength = 0;
+  _rxLength = 0;
+  _rxIndex = 0;
+}
+
+// Restarting the bus stands in for the recovery that comes before it
+void TwoWire::begin(void)
+{
+  mpuSim.busRecover();
+}
+
+void TwoWire::end(void)
+{
+}
+
+void TwoWire::setClock(uint32_t clock)
+{
+  mpuSim.setBusClock(clock);
+}
+
+void TwoWire::beginTransmission(uint8_t address)
+{
+  _txAddress = address;
+  _txLength = 0;
+}
+
+size_t TwoWire::write(uint8_t data)
+{
+  if (_txLength >= WIRE_BUFFER_LENGTH)
+    return 0;
+  _txBuffer[_txLength++] = data;
+  return 1;
+}
+
+// Each byte is 9 bits (8 and an ACK). Add a start bit, and a stop bit if
+// the transaction ends the bus cycle.
+// A fault still takes a transaction: a NACKed or stuck one ends after the
+// address, a data NACK after the byte NACKed, a short read half-way.
+uint8_t TwoWire::endTransmission(bool stopBit)
+{
+  Mpu9250Sim::busFault fault = mpuSim.nextFault(false);
+  size_t length = _txLength;
+  _txLength = 0;
+  if ((fault == Mpu9250Sim::FAULT_ADDR_NACK) ||
+      (fault == Mpu9250Sim::FAULT_BUS_STUCK))
+  {
+    mpuSim.failedTransaction();
+    mpuSim.busTransfer(1 + 9 + (stopBit ? 1 : 0));
+    return (fault == Mpu9250Sim::FAULT_BUS_STUCK) ? 4 : 2;
+  }
+  if (fault == Mpu9250Sim::FAULT_DATA_NACK)
+    length = (length + 1) / 2;
+  bool ack = mpuSim.write(_txAddress, _txBuffer, length);
+  unsigned int bytes = 1 + (ack ? length : 0);
+  mpuSim.busTransfer(1 + 9 * bytes + (stopBit ? 1 : 0));
+  if (!ack)
+    return 2;
+  return (fault == Mpu9250Sim::FAULT_DATA_NACK) ? 3 : 0;
+}
+
+uint8_t TwoWire::requestFrom(uint8_t address, size_t quantity, bool stopBit)
+{
+  if (quantity > WIRE_BUFFER_LENGTH)
+    quantity = WIRE_BUFFER_LENGTH;
+  Mpu9250Sim::busFault fault = mpuSim.nextFault(true);
+  if (fault == Mpu9250Sim::FAULT_SHORT_READ)
+    quantity /= 2;
+  else if ((fault != Mpu9250Sim::FAULT_NONE) &&
+           (fault != Mpu9250Sim::FAULT_BIT_ERROR))
+    quantity = 0;
+  _rxLength = 0;
+  _rxIndex = 0;
+  if (!quantity)
+    mpuSim.failedTransaction();
+  else if (mpuSim.read(address, _rxBuffer, quantity))
+  {
+    _rxLength = quantity;
+    if (fault == Mpu9250Sim::FAULT_BIT_ERROR)
+      flipBit(_rxBuffer, quantity);
+  }
+  mpuSim.busTransfer(1 + 9 * (1 + _rxLength) + (stopBit ? 1 : 0));
+  return _rxLength;
+}
+
+int TwoWire::available(void)
+{
+  return _rxLength - _rxIndex;
+}
+
+int TwoWire::read(void)
+{
+  if (_rxIndex >= _rxLength)
+    return -1;
+  return _rxBuffer[_rxIndex++];
+}
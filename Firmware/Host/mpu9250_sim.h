@@ -0,0 +1,240 @@
+/******************************************************************************
+mpu9250_sim.h
+Simulated MPU-9250 and AK8963, at the register level
+
+Lets the MPU-9250 DMP library (inv_mpu.c, inv_mpu_dmp_motion_driver.c and
+MPU9250_DMP) run on a PC, unmodified, through the Arduino.h and Wire.h
+stand-ins in this directory. The simulation is driven by a virtual clock:
+I2C transactions and delay() advance it, and samples are produced as it
+passes each sample time. It models:
+
+  - The register file, with auto-incrementing burst reads and writes,
+    device reset, and the FIFO and DMP memory access registers.
+  - Sampling at the SMPLRT_DIV rate, or 8 kHz (accel 4 kHz) with the DLPF
+    bypassed, from a rigid body turning at a constant rate: accel
+    (gravity), gyro, temperature and compass values follow the configured
+    full-scale ranges.
+  - The 1 kB FIFO: sensor data selected by FIFO_EN, and DMP packets at the
+    DMP's output rate, laid out according to the features the driver has
+    written into DMP memory (quaternion, accel, gyro, gesture). When full,
+    the oldest bytes are overwritten and FIFO_OFLOW_INT is raised.
+  - Interrupts: data ready, DMP and FIFO overflow status bits, and the
+    INT pin with latched, any-read-clear and pulse modes.
+  - The AK8963 on the auxiliary bus: directly addressable in bypass mode,
+    or read/written by the I2C master's slave 0-3 channels (with the
+    I2C_MST_DLY rate divider) into EXT_SENS_DATA and the FIFO. Single,
+    8 Hz and 100 Hz measurement modes, DRDY/DOR status and fuse ROM.
+  - Faults on the host bus, when asked for: NACKs, short reads and a
+    stuck bus, and bit errors above a clock the bus is too slow for.
+
+More devices can share the bus (attach()), at the other AD0 address, each
+turning at its own rate.
+
+The DMP itself isn't emulated: its quaternion is the simulated body's
+exact orientation, and its gyro calibration, orientation matrix and
+gestures have no effect.
+******************************************************************************/
+#ifndef _MPU9250_SIM_H_
+#define _MPU9250_SIM_H_
+
+#include <stdint.h>
+
+#define MPU9250_SIM_ADDRESS 0x68
+#define AK8963_SIM_ADDRESS 0x0C
+#define MPU9250_SIM_FIFO_SIZE 1024
+#define MPU9250_SIM_MEM_SIZE 4096 // DMP memory: 16 banks of 256 bytes
+
+struct mpu9250SimStats
+{
+  unsigned long transactions; // I2C transactions on the host bus
+  unsigned long busBytes; // Address, register and data bytes transferred
+  uint64_t busTimeUs; // Time the host bus was busy
+  unsigned long samples; // Sensor samples taken
+  unsigned long dmpPackets; // DMP packets written to the FIFO
+  unsigned long fifoOverflows; // Samples/packets that overflowed the FIFO
+  unsigned long fifoBytesLost; // Bytes overwritten by those overflows
+  unsigned long fifoResets;
+  unsigned long interrupts; // Active edges on the INT pin
+  unsigned long magSamples; // AK8963 measurements completed
+  unsigned long auxTransactions; // Slave 0-3 transactions on the aux bus
+  unsigned long busFaults; // Host bus transactions made to fail
+};
+
+class Mpu9250Sim
+{
+public:
+  Mpu9250Sim();
+
+  // powerOn -- Reset both chips and all statistics, and restart the clock.
+  // Attached devices are powered on too.
+  void powerOn(void);
+
+  // setAddress -- The I2C address: 0x68 (the default) or 0x69, for AD0 high
+  void setAddress(uint8_t address) { _address = address; }
+  // attach -- Put another device on this one's bus. It answers at its own
+  // address and runs on this one's clock; bus statistics are counted here.
+  void attach(Mpu9250Sim * device);
+
+  // Host I2C bus. data[0] of a write sets the device's register address;
+  // a read continues from it. Both return false if nothing answers at
+  // address. They don't advance the clock: the caller accounts for the
+  // bus time with busTransfer().
+  bool write(uint8_t address, const uint8_t * data, unsigned int length);
+  bool read(uint8_t address, uint8_t * data, unsigned int length);
+  // busTransfer -- Advance the clock by the time to clock bits bits
+  void busTransfer(unsigned int bits);
+  // busBackground -- Count the time to clock bits bits as bus time, without
+  // advancing the clock, for a transfer made in the background (the host
+  // transfer engine, see arduino_i2c_dma_start())
+  // Output: The time, in microseconds
+  uint64_t busBackground(unsigned int bits);
+  void setBusClock(uint32_t hz) { _busClock = hz ? hz : 100000; }
+  uint32_t busClock(void) const { return _busClock; }
+
+  // Host bus faults. A transaction may NACK its address (nothing is
+  // transferred), NACK a data byte half-way through a write (the bytes
+  // before it are written), or end a read half-way (the bytes before it
+  // are read, and the FIFO and memory ports move on by them). A stuck bus,
+  // a slave holding SDA low, fails every transaction until busRecover().
+  enum busFault
+  {
+    FAULT_NONE,
+    FAULT_ADDR_NACK,
+    FAULT_DATA_NACK, // Writes
+    FAULT_SHORT_READ, // Reads
+    FAULT_BUS_STUCK,
+    FAULT_BIT_ERROR // Reads: a data bit is misread, and nothing says so
+  };
+  // injectFault -- Fail the next transaction, or get the bus stuck
+  void injectFault(busFault fault);
+  // setFaultRate -- Fail this fraction of transactions at random, half of
+  // them with address NACKs and half with data NACKs or short reads. The
+  // faults are the same sequence on every run.
+  void setFaultRate(double rate);
+  // setBusLimit -- Model a bus whose edges are too slow for clocks above
+  // hz: transactions there also fail at rate, half with address NACKs and
+  // half with data NACKs (writes) or a flipped bit (reads). 0 for no
+  // limit, the default.
+  void setBusLimit(uint32_t hz, double rate);
+  // nextFault -- The fault for the next transaction, if any. Wire.h calls
+  // it for each one.
+  busFault nextFault(bool read);
+  // failedTransaction -- Count a transaction that ended before any data
+  void failedTransaction(void) { _stats.transactions++; _stats.busBytes++; }
+  // busRecover -- Free a stuck bus, as clocking SCL until the slave lets go
+  // of SDA does. Wire.h's begin() calls it.
+  void busRecover(void) { _busStuck = false; }
+
+  // Virtual clock (microseconds since powerOn())
+  uint64_t now(void) const { return _now; }
+  // advance -- Run the simulation forward
+  void advance(uint64_t us);
+
+  // Motion: the body turns at a constant rate (deg/s, sensor frame), in
+  // a constant field (uT, world frame, z up). Changing the rate starts
+  // the new turn from wherever the body is, so a run can be pieced
+  // together from turns about different axes.
+  void setRotationRate(float x, float y, float z);
+  void setMagneticField(float x, float y, float z);
+  // Gaussian noise added to each compass axis (uT RMS, 0 for none). The
+  // noise is the same sequence on every run.
+  void setMagNoise(float uT) { _magNoise = uT; }
+  // Hard and soft iron on the board: the AK8963 measures
+  // matrix * field + offset (uT, row major, its own axes). NULL for none.
+  void setMagIron(const float * offset, const float * matrix);
+
+  // INT pin. The handler is called on each active edge, like an Arduino
+  // interrupt: it may use the bus, but isn't re-entered.
+  void setInterruptHandler(void (*handler)(void)) { _handler = handler; }
+  bool interruptActive(void) const { return _intActive; }
+
+  unsigned int fifoCount(void) const { return _fifoCount; }
+  const mpu9250SimStats & stats(void) const { return _stats; }
+
+  // truth -- Exact orientation (Q30 w, x, y, z) at a time
+  void truth(uint64_t timeUs, long * quat) const;
+  // magExpected -- The compass reading, as the driver returns it (16-bit
+  // counts on the AK8963's axes, fuse ROM adjustment applied), for the body
+  // at an orientation (Q30), with the board's iron but without noise
+  void magExpected(const long * quat, double * counts) const;
+
+private:
+  struct vector3 { double x, y, z; };
+
+  bool writeDevice(uint8_t address, const uint8_t * data,
+                   unsigned int length);
+  bool readDevice(uint8_t address, uint8_t * data, unsigned int length);
+  void resetMpu(void);
+  void resetMag(void);
+  bool dlpfBypassed(void) const;
+  uint64_t samplePeriod(void) const;
+  void sample(void);
+  void runAuxBus(void);
+  void pushDmpPacket(void);
+  void fifoPush(const uint8_t * data, unsigned int length);
+  void raise(uint8_t status);
+  void setPin(bool active);
+  void clearOnRead(void);
+  uint8_t readRegister(uint8_t reg);
+  void writeRegister(uint8_t reg, uint8_t value);
+  uint8_t magRead(uint8_t reg);
+  void magWrite(uint8_t reg, uint8_t value);
+  void magMeasure(void);
+  void orientation(uint64_t timeUs, double * q) const;
+  vector3 toSensor(const double * q, const vector3 & world) const;
+
+  uint64_t _now;
+  uint32_t _busClock;
+  uint8_t _address;
+  Mpu9250Sim * _next; // Next device on the bus
+  mpu9250SimStats _stats;
+
+  // MPU-9250
+  uint8_t _regs[128];
+  uint8_t _pointer; // Register address for the next read or write
+  uint8_t _fifo[MPU9250_SIM_FIFO_SIZE];
+  unsigned int _fifoHead; // Oldest byte
+  unsigned int _fifoCount;
+  uint8_t _mem[MPU9250_SIM_MEM_SIZE];
+  uint64_t _nextSample;
+  unsigned long _sampleIndex; // Samples since reset, for rate dividers
+  unsigned int _dmpPhase; // Samples since the last DMP packet
+  bool _intActive;
+  void (*_handler)(void);
+  bool _inHandler;
+  bool _edgePending;
+
+  // AK8963
+  uint8_t _magPointer;
+  uint8_t _magMode; // CNTL1 mode bits
+  bool _mag16Bit; // CNTL1 BIT
+  uint8_t _magData[8]; // ST1, HXL-HZH, ST2
+  uint64_t _magNext; // Time of the next measurement, 0 if none
+  static const uint8_t _magAsa[3]; // Fuse ROM sensitivity adjustments
+  double _magNoise; // uT RMS
+  double _ironOffset[3]; // uT
+  double _ironMatrix[9];
+  uint64_t _noiseState;
+  double noise(void);
+  double faultDraw(void);
+
+  // Host bus faults
+  busFault _injected;
+  bool _busStuck;
+  double _faultRate;
+  uint64_t _faultState;
+  uint32_t _busLimit;
+  double _limitRate;
+
+  // Motion
+  vector3 _rate; // deg/s
+  double _start[4]; // Orientation when the rate was set
+  uint64_t _startUs; // and when
+  vector3 _field; // uT
+};
+
+// The simulated device the Arduino stand-ins talk to, and whose clock they
+// use
+extern Mpu9250Sim mpuSim;
+
+#endif // _MPU9250_SIM_H_
@@ -0,0 +1,402 @@
+/******************************************************************************
+multi_imu_bench.cpp
+Two MPU-9250s on one bus, against the simulated MPU-9250
+
+Runs two MPU9250_DMP objects, at AD0 addresses 0x68 and 0x69, against two
+simulated MPU-9250s on the same bus (mpu9250_sim.h). Each turns at its own
+rate in its own magnetic field, and is set up differently: the first
+sends quaternions, accel and gyro, the second quaternions and accel, with
+its compass through the FIFO. Their INT pin handlers only flag the device;
+loop() reads the FIFOs two ways:
+
+  sequential   each flagged device's FIFO is drained completely, in order
+  round-robin  MPU9250_DMP_RoundRobin reads one burst at a time, from each
+               device in turn
+
+Each runs with a quick loop, and with a loop that stalls (like a slow SD
+card write), so both FIFOs come back nearly full. For each device it
+reports the packets the DMP produced, read and lost, FIFO overflows, and
+the largest delay between a packet's sample and its read. Every packet is
+checked against its own device's simulated motion: accel must be gravity
+rotated by the quaternion, the quaternion must be close to the device's
+true orientation, and the compass must be as strong as the device's field.
+Packets decoded with the other device's driver state would fail these.
+
+Last, it checks that reading one device leaves the driver working on the
+device that was selected before: a background burst's done functions,
+which asyncPoll() may run in the middle of a call on the other device,
+and MPU9250_DMP_RoundRobin::poll().
+
+Everything runs on the simulator's clock, so results are deterministic and
+independent of the host's speed.
+
+Usage: multi_imu_bench [seconds]   (simulated seconds per run, default 10)
+******************************************************************************/
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <SparkFunMPU9250-DMP.h>
+#include "mpu9250_sim.h"
+
+#define IMU_GYRO_FSR 2000
+#define IMU_ACCEL_FSR 2
+#define IMU_AG_LPF 5
+#define IMU_AG_SAMPLE_RATE 100
+#define IMU_COMPASS_SAMPLE_RATE 100
+#define IMUS 2
+#define I2C_CLOCK 400000 // Two devices' packets don't fit in 100 kHz
+
+enum drainMode
+{
+  SEQUENTIAL,
+  ROUND_ROBIN
+};
+
+struct benchRun
+{
+  const char * name;
+  drainMode mode;
+  unsigned short rate; // DMP FIFO rate (Hz), both devices
+  unsigned long loopUs; // Time the rest of loop() takes
+  unsigned long stallMs; // A stall this long...
+  unsigned long stallEveryMs; // ...this often (0 for none)
+};
+
+static const benchRun runs[] = {
+  {"sequential", SEQUENTIAL, 100, 500, 0, 0},
+  {"round-robin", ROUND_ROBIN, 100, 500, 0, 0},
+  {"sequential", SEQUENTIAL, 100, 500, 160, 2000},
+  {"round-robin", ROUND_ROBIN, 100, 500, 160, 2000},
+  {"sequential", SEQUENTIAL, 200, 500, 0, 0},
+  {"round-robin", ROUND_ROBIN, 200, 500, 0, 0},
+  {"sequential", SEQUENTIAL, 200, 500, 80, 2000},
+  {"round-robin", ROUND_ROBIN, 200, 500, 80, 2000},
+};
+
+struct imuSetup
+{
+  uint8_t address;
+  float rate[3]; // deg/s
+  float field[3]; // uT
+  unsigned short features;
+  bool compassFifo;
+};
+
+static const imuSetup setups[IMUS] = {
+  {MPU9250_ADDRESS_AD0_LOW, {10.0f, -20.0f, 30.0f}, {20.0f, 0.0f, -45.0f},
+   DMP_FEATURE_GYRO_CAL | DMP_FEATURE_SEND_CAL_GYRO |
+   DMP_FEATURE_SEND_RAW_ACCEL | DMP_FEATURE_6X_LP_QUAT, false},
+  {MPU9250_ADDRESS_AD0_HIGH, {-35.0f, 5.0f, -15.0f}, {0.0f, 30.0f, -30.0f},
+   DMP_FEATURE_GYRO_CAL | DMP_FEATURE_SEND_RAW_ACCEL |
+   DMP_FEATURE_6X_LP_QUAT, true},
+};
+
+struct imuResult
+{
+  unsigned long read; // Packets read
+  unsigned long bad; // Packets that don't match the simulated motion
+  unsigned long compass; // Compass readings in packets
+  uint64_t maxDelayUs; // Longest a packet waited to be read
+};
+
+static MPU9250_DMP imu0(MPU9250_ADDRESS_AD0_LOW);
+static MPU9250_DMP imu1(MPU9250_ADDRESS_AD0_HIGH);
+static MPU9250_DMP * const imus[IMUS] = {&imu0, &imu1};
+static Mpu9250Sim secondSim;
+static Mpu9250Sim * const sims[IMUS] = {&mpuSim, &secondSim};
+static MPU9250_DMP_RoundRobin scheduler(imus, IMUS);
+
+static imuResult results[IMUS];
+static dmp_packet_s packets[DMP_MAX_BURST_PACKETS];
+static volatile bool flagged[IMUS];
+
+// Same configuration as the firmware's initIMU()
+static bool initImu(unsigned int index, unsigned short rate)
+{
+  MPU9250_DMP & imu = *imus[index];
+  if (imu.begin() != INV_SUCCESS)
+    return false;
+  imu.enableInterrupt();
+  imu.setIntLevel(1);
+  imu.setIntLatched(1);
+  imu.setGyroFSR(IMU_GYRO_FSR);
+  imu.setAccelFSR(IMU_ACCEL_FSR);
+  imu.setLPF(IMU_AG_LPF);
+  imu.setSampleRate(IMU_AG_SAMPLE_RATE);
+  imu.setCompassMode(COMPASS_MODE_CONTINUOUS);
+  imu.setCompassSampleRate(IMU_COMPASS_SAMPLE_RATE);
+  if (imu.dmpBegin(setups[index].features, rate) != INV_SUCCESS)
+    return false;
+  return !setups[index].compassFifo ||
+         (imu.dmpEnableCompassFifo() == INV_SUCCESS);
+}
+
+// Bytes in each DMP packet: see dmp_sim_bench.cpp
+static unsigned int packetLength(unsigned int index, unsigned short rate)
+{
+  unsigned short features = setups[index].features;
+  unsigned int length = 4;
+  if (setups[index].compassFifo)
+    length += 8 * (200 / rate);
+  if (features & (DMP_FEATURE_LP_QUAT | DMP_FEATURE_6X_LP_QUAT))
+    length += 16;
+  if (features & DMP_FEATURE_SEND_RAW_ACCEL)
+    length += 6;
+  if (features & (DMP_FEATURE_SEND_RAW_GYRO | DMP_FEATURE_SEND_CAL_GYRO))
+    length += 6;
+  return length;
+}
+
+// The angle (degrees) between two Q30 quaternions
+static double angleBetween(const long * a, const long * b)
+{
+  double dot = 0.0;
+  for (int i = 0; i < 4; i++)
+    dot += (a[i] / 1073741824.0) * (b[i] / 1073741824.0);
+  dot = fabs(dot);
+  if (dot > 1.0)
+    dot = 1.0;
+  return 2.0 * acos(dot) * 180.0 / M_PI;
+}
+
+// The newest of count packets was sampled no later than now. Find when
+// the oldest was, from its quaternion: the device turns at a known,
+// constant rate, so the angle back to its true orientation now is the
+// time the packet has waited.
+static void checkPackets(unsigned int index, unsigned char count)
+{
+  const imuSetup & setup = setups[index];
+  imuResult & result = results[index];
+  double rate = sqrt(setup.rate[0] * setup.rate[0] +
+                     setup.rate[1] * setup.rate[1] +
+                     setup.rate[2] * setup.rate[2]);
+  long truth[4];
+  sims[index]->truth(mpuSim.now(), truth);
+
+  for (unsigned char i = 0; i < count; i++)
+  {
+    const dmp_packet_s & packet = packets[i];
+    result.read++;
+    bool bad = false;
+
+    // Gravity, rotated into the sensor frame by the quaternion
+    double q[4];
+    for (int j = 0; j < 4; j++)
+      q[j] = packet.quat[j] / 1073741824.0;
+    double w = q[0], x = q[1], y = q[2], z = q[3];
+    double expected[3] = {2 * (x * z - w * y), 2 * (y * z + w * x),
+                          1 - 2 * (x * x + y * y)};
+    for (int j = 0; j < 3; j++)
+    {
+      if (fabs(packet.accel[j] - expected[j] * 32768.0 / IMU_ACCEL_FSR) > 2.0)
+        bad = true;
+    }
+
+    // No packet waits a second, which the angle can't wrap around in
+    double delayUs = angleBetween(packet.quat, truth) / rate * 1e6;
+    if (delayUs > 1e6)
+      bad = true;
+    else if (i == 0 && delayUs > result.maxDelayUs)
+      result.maxDelayUs = (uint64_t)delayUs;
+
+    if (packet.sensors & INV_XYZ_COMPASS)
+    {
+      double strength = sqrt((double)packet.compass[0] * packet.compass[0] +
+                             (double)packet.compass[1] * packet.compass[1] +
+                             (double)packet.compass[2] * packet.compass[2]);
+      double field = sqrt(setup.field[0] * setup.field[0] +
+                          setup.field[1] * setup.field[1] +
+                          setup.field[2] * setup.field[2]);
+      result.compass++;
+      if (fabs(strength - field / 0.15) > 4.0)
+        bad = true;
+    }
+    if (bad)
+      result.bad++;
+  }
+}
+
+static void imu0Interrupt(void)
+{
+  flagged[0] = true;
+  scheduler.signal(0);
+}
+
+static void imu1Interrupt(void)
+{
+  flagged[1] = true;
+  scheduler.signal(1);
+}
+
+static void drainSequential(void)
+{
+  for (unsigned int i = 0; i < IMUS; i++)
+  {
+    if (!flagged[i])
+      continue;
+    flagged[i] = false;
+    unsigned char count;
+    do
+    {
+      if (imus[i]->dmpUpdateFifoBurst(packets, DMP_MAX_BURST_PACKETS,
+                                      &count) != INV_SUCCESS)
+        break;
+      checkPackets(i, count);
+    } while (imus[i]->fifoPending());
+  }
+}
+
+static void drainRoundRobin(void)
+{
+  unsigned char count;
+  int index;
+  while ((index = scheduler.poll(packets, DMP_MAX_BURST_PACKETS, &count)) >= 0)
+    checkPackets(index, count);
+}
+
+static void bench(const benchRun & run, unsigned long seconds)
+{
+  mpuSim.powerOn();
+  Wire.setClock(I2C_CLOCK);
+  for (unsigned int i = 0; i < IMUS; i++)
+  {
+    sims[i]->setInterruptHandler(NULL);
+    sims[i]->setRotationRate(setups[i].rate[0], setups[i].rate[1],
+                             setups[i].rate[2]);
+    sims[i]->setMagneticField(setups[i].field[0], setups[i].field[1],
+                              setups[i].field[2]);
+  }
+  for (unsigned int i = 0; i < IMUS; i++)
+  {
+    if (!initImu(i, run.rate))
+    {
+      printf("%-12s imu%u initialization failed\n", run.name, i);
+      return;
+    }
+  }
+
+  // Start counting once both DMPs are running. Resetting the second FIFO
+  // takes long enough for packets to build up in the first, so drain both
+  // once before starting. That also clears interrupts latched before the
+  // handlers were attached.
+  for (unsigned int i = 0; i < IMUS; i++)
+    imus[i]->resetFifo();
+  sims[0]->setInterruptHandler(imu0Interrupt);
+  sims[1]->setInterruptHandler(imu1Interrupt);
+  for (unsigned int i = 0; i < IMUS; i++)
+    flagged[i] = true;
+  drainSequential();
+  scheduler.signalAll();
+  mpu9250SimStats start[IMUS];
+  unsigned long startWaiting[IMUS];
+  for (unsigned int i = 0; i < IMUS; i++)
+  {
+    start[i] = sims[i]->stats();
+    startWaiting[i] = sims[i]->fifoCount() / packetLength(i, run.rate);
+    results[i].read = 0;
+    results[i].bad = 0;
+    results[i].compass = 0;
+    results[i].maxDelayUs = 0;
+  }
+
+  uint64_t end = mpuSim.now() + (uint64_t)seconds * 1000000;
+  uint64_t nextStall = mpuSim.now() + (uint64_t)run.stallEveryMs * 1000;
+  while (mpuSim.now() < end)
+  {
+    if (run.mode == SEQUENTIAL)
+      drainSequential();
+    else
+      drainRoundRobin();
+
+    delayMicroseconds(run.loopUs);
+    if (run.stallEveryMs && (mpuSim.now() >= nextStall) &&
+        (mpuSim.now() + run.stallMs * 1000 < end))
+    {
+      delay(run.stallMs);
+      nextStall += (uint64_t)run.stallEveryMs * 1000;
+    }
+  }
+  for (unsigned int i = 0; i < IMUS; i++)
+    sims[i]->setInterruptHandler(NULL);
+
+  char stall[48] = "-";
+  if (run.stallEveryMs)
+    snprintf(stall, sizeof(stall), "%lu/%lu", run.stallMs, run.stallEveryMs);
+  double elapsed = (double)seconds * 1e6;
+  for (unsigned int i = 0; i < IMUS; i++)
+  {
+    const mpu9250SimStats & stats = sims[i]->stats();
+    unsigned long produced = stats.dmpPackets - start[i].dmpPackets +
+                             startWaiting[i];
+    unsigned long waiting = sims[i]->fifoCount() / packetLength(i, run.rate);
+    unsigned long lost = produced - results[i].read - waiting;
+    char bus[16] = "";
+    if (i == 0) // Bus statistics are counted on the first device
+      snprintf(bus, sizeof(bus), "%5.1f%%",
+               100.0 * (stats.busTimeUs - start[i].busTimeUs) / elapsed);
+    printf("%-12s %4u %9s %4u %3u %8lu %8lu %6lu %6lu %4lu %5lu %8.1f %6s\n",
+           run.name, run.rate, stall, i, packetLength(i, run.rate), produced,
+           results[i].read, lost, results[i].compass, results[i].bad,
+           stats.fifoOverflows - start[i].fifoOverflows,
+           results[i].maxDelayUs / 1000.0, bus);
+  }
+}
+
+static bool burstDone;
+
+static void finishBurst(void)
+{
+  burstDone = true;
+}
+
+// Read each device with the other one selected, in the background and
+// round-robin, and check the other is still selected after
+static bool checkSelection(void)
+{
+  bool kept = true;
+  for (unsigned int i = 0; i < IMUS; i++)
+  {
+    unsigned char other = (i + 1) % IMUS;
+    unsigned char count;
+    delay(20); // Let packets build up
+    burstDone = false;
+    mpu_select_device(other);
+    if (imus[i]->dmpStartFifoBurst(packets, DMP_MAX_BURST_PACKETS,
+                                   finishBurst) != INV_SUCCESS)
+      return false;
+    while (!burstDone)
+      MPU9250_DMP::asyncPoll(), delayMicroseconds(100);
+    if ((imus[i]->dmpFifoBurstResult(&count) != INV_SUCCESS) || !count ||
+        (mpu_get_device() != other))
+      kept = false;
+
+    delay(20);
+    scheduler.signalAll();
+    if ((scheduler.poll(packets, DMP_MAX_BURST_PACKETS, &count) < 0) ||
+        (mpu_get_device() != other))
+      kept = false;
+  }
+  return kept;
+}
+
+int main(int argc, char ** argv)
+{
+  unsigned long seconds = (argc > 1) ? strtoul(argv[1], NULL, 10) : 10;
+  if (!seconds)
+    seconds = 10;
+
+  secondSim.setAddress(MPU9250_ADDRESS_AD0_HIGH);
+  mpuSim.attach(&secondSim);
+
+  printf("%lu simulated seconds per run, I2C at %lu kHz, 500 us loop\n",
+         seconds, (unsigned long)I2C_CLOCK / 1000);
+  printf("%-12s %4s %9s %4s %3s %8s %8s %6s %6s %4s %5s %8s %6s\n",
+         "mode", "Hz", "stall ms", "imu", "pkt", "produced", "read", "lost",
+         "mag rd", "bad", "ovf", "delay ms", "bus");
+  for (unsigned int i = 0; i < sizeof(runs) / sizeof(runs[0]); i++)
+    bench(runs[i], seconds);
+  bool kept = checkSelection();
+  printf("device selection: %s\n", kept ? "kept" : "NOT KEPT");
+  return kept ? 0 : 1;
+}
@@ -0,0 +1,418 @@
+/******************************************************************************
+reconfig_bench.cpp
+I2C cost of the firmware's runtime reconfiguration commands
+
+Starts the MPU-9250 DMP library against the simulated MPU-9250, set up the
+way the firmware's initIMU() does it, then makes the register changes the
+firmware's serial commands make (parseSerialInput() and updateDmpFeatures()):
+toggling accel, gyro and quaternion logging, which reprograms the DMP's
+features, stepping the accel and gyro FSRs, and stepping the log rate.
+Each command is run twice over:
+
+  off   with the register shadow off (setRegShadow(0)): every register
+        access goes on the bus
+  on    with the register shadow on, and the command's writes deferred
+        (deferWrites() and flushWrites()), as the firmware does
+
+For each command it reports the I2C transactions, bytes and bus time per
+command, at 100 kHz, and the bus time saved. After each command it reads
+packets for a while, and counts packets that don't match the simulated
+motion, and FIFO overflows and realignments.
+
+Then, with the DMP stopped, it puts back the sensor settings initIMU()
+makes (FSRs, LPF and sample rate), and changes them to other values, the
+same two ways. Their
+registers, 0x19 to 0x1C, are adjacent, so with the shadow on the four
+deferred writes must go in one burst, and the chip must end up with the
+new values. Last, the chip's configuration registers are read back and
+compared between the two runs: they must end up the same.
+
+Everything runs on the simulator's clock, so results are deterministic and
+independent of the host's speed.
+
+Usage: reconfig_bench [repeats]   (times each command is run, rounded up to
+                                  an even number, default 8)
+******************************************************************************/
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <SparkFunMPU9250-DMP.h>
+#include "mpu9250_sim.h"
+
+// The firmware's default settings (config.h)
+#define IMU_GYRO_FSR 2000
+#define IMU_ACCEL_FSR 2
+#define IMU_AG_LPF 5
+#define IMU_AG_SAMPLE_RATE 100
+#define IMU_COMPASS_SAMPLE_RATE 100
+#define DMP_FIFO_RATE 100
+#define COMPASS_FIFO_MIN_RATE 200
+#define SETTLE_US 30000 // Packets aren't checked for this long after a command
+#define CHECK_US 200000 // then they're checked for this long
+
+// The sensor settings changed with the DMP stopped
+#define SETUP_GYRO_FSR 500
+#define SETUP_ACCEL_FSR 8
+#define SETUP_LPF 20
+#define SETUP_SAMPLE_RATE 50
+#define SETUP_FIRST_REG 0x19 // SMPLRT_DIV, CONFIG, GYRO_CONFIG, ACCEL_CONFIG
+#define SETUP_REGS 4
+
+static MPU9250_DMP imu;
+static dmp_packet_s packets[DMP_MAX_BURST_PACKETS];
+
+// The firmware's log channels, which pick the DMP's features
+static bool enableAccel, enableGyro, enableQuat;
+static unsigned short dmpFeatureMask;
+
+static unsigned short dmpFeatures(void)
+{
+  unsigned short mask = DMP_FEATURE_GYRO_CAL;
+  if (enableAccel)
+    mask |= DMP_FEATURE_SEND_RAW_ACCEL;
+  if (enableGyro)
+    mask |= DMP_FEATURE_SEND_CAL_GYRO;
+  if (enableQuat || !(enableAccel || enableGyro))
+    mask |= DMP_FEATURE_6X_LP_QUAT;
+  return mask;
+}
+
+// As the firmware's updateDmpFeatures(), which every command ends with
+static void updateDmpFeatures(void)
+{
+  unsigned short mask = dmpFeatures();
+  if ((mask != dmpFeatureMask) &&
+      (imu.dmpEnableFeatures(mask) == INV_SUCCESS))
+    dmpFeatureMask = mask;
+  bool compassFifo = imu.dmpGetFifoRate() >= COMPASS_FIFO_MIN_RATE;
+  if (compassFifo != imu.dmpCompassFifoEnabled())
+    imu.dmpEnableCompassFifo(compassFifo);
+}
+
+static void toggleAccel(void) { enableAccel = !enableAccel; }
+static void toggleGyro(void) { enableGyro = !enableGyro; }
+static void toggleQuat(void) { enableQuat = !enableQuat; }
+
+static void stepAccelFSR(void)
+{
+  unsigned short fsr = imu.getAccelFSR();
+  imu.setAccelFSR(fsr >= 16 ? 2 : fsr * 2);
+  // The DMP's accel biases are scaled to the FSR
+  long bias[3] = {0, 0, 0};
+  imu.dmpSetAccelBias(bias);
+}
+
+static void stepGyroFSR(void)
+{
+  unsigned short fsr = imu.getGyroFSR();
+  imu.setGyroFSR(fsr >= 2000 ? 250 : fsr * 2);
+}
+
+static void stepLogRate(void)
+{
+  unsigned short rate = imu.dmpGetFifoRate();
+  rate = (rate == 1) ? 10 : rate + 10;
+  imu.dmpSetFifoRate(rate > 100 ? 1 : rate);
+}
+
+struct command
+{
+  const char * name;
+  void (*run)(void);
+};
+
+static const command commands[] = {
+  {"accel on/off", toggleAccel},
+  {"gyro on/off", toggleGyro},
+  {"quat on/off", toggleQuat},
+  {"accel FSR", stepAccelFSR},
+  {"gyro FSR", stepGyroFSR},
+  {"log rate", stepLogRate},
+};
+#define COMMANDS (sizeof(commands) / sizeof(commands[0]))
+
+struct commandCost
+{
+  unsigned long transactions;
+  unsigned long bytes;
+  uint64_t busUs;
+};
+
+// Same configuration as the firmware's initIMU()
+static bool initImu(unsigned char shadow)
+{
+  imu.setRegShadow(shadow);
+  if (imu.begin() != INV_SUCCESS)
+    return false;
+  imu.enableInterrupt();
+  imu.setIntLevel(1);
+  imu.setIntLatched(1);
+  imu.setGyroFSR(IMU_GYRO_FSR);
+  imu.setAccelFSR(IMU_ACCEL_FSR);
+  imu.setLPF(IMU_AG_LPF);
+  imu.setSampleRate(IMU_AG_SAMPLE_RATE);
+  imu.setCompassMode(COMPASS_MODE_CONTINUOUS);
+  imu.setCompassSampleRate(IMU_COMPASS_SAMPLE_RATE);
+  enableAccel = enableGyro = enableQuat = true;
+  dmpFeatureMask = dmpFeatures();
+  return imu.dmpBegin(dmpFeatureMask, DMP_FIFO_RATE) == INV_SUCCESS;
+}
+
+// A packet is good if its accel reading is gravity, rotated into the
+// sensor frame by its quaternion. Packets without both can't be checked.
+static bool goodPacket(const dmp_packet_s & packet)
+{
+  if ((dmpFeatureMask & (DMP_FEATURE_SEND_RAW_ACCEL | DMP_FEATURE_6X_LP_QUAT))
+      != (DMP_FEATURE_SEND_RAW_ACCEL | DMP_FEATURE_6X_LP_QUAT))
+    return true;
+  double q[4];
+  for (int i = 0; i < 4; i++)
+    q[i] = packet.quat[i] / 1073741824.0;
+  double w = q[0], x = q[1], y = q[2], z = q[3];
+  double expected[3] = {2 * (x * z - w * y), 2 * (y * z + w * x),
+                        1 - 2 * (x * x + y * y)};
+  float sens = imu.getAccelSens();
+  for (int i = 0; i < 3; i++)
+  {
+    if (fabs(packet.accel[i] - expected[i] * sens) > 2.0)
+      return false;
+  }
+  return true;
+}
+
+// Read bursts for a while. Returns the packets read, and counts the bad
+// (unless bad is NULL).
+static unsigned long readPackets(uint64_t us, unsigned long * bad)
+{
+  unsigned long read = 0;
+  uint64_t end = mpuSim.now() + us;
+  while (mpuSim.now() < end)
+  {
+    unsigned char count;
+    if (imu.fifoAvailable() &&
+        (imu.dmpUpdateFifoBurst(packets, DMP_MAX_BURST_PACKETS, &count) ==
+         INV_SUCCESS))
+    {
+      for (unsigned char i = 0; i < count; i++)
+      {
+        if (bad && !goodPacket(packets[i]))
+          (*bad)++;
+      }
+      read += count;
+    }
+    delayMicroseconds(500);
+  }
+  return read;
+}
+
+// The configuration registers, read back from the chip
+static void readConfig(unsigned char * regs)
+{
+  for (unsigned char reg = 0; reg < 0x80; reg++)
+  {
+    // FIFO and DMP memory ports, and registers that change on their own
+    if ((reg == 0x3A) || ((reg >= 0x3B) && (reg <= 0x60)) || (reg == 0x6F) ||
+        (reg == 0x72) || (reg == 0x73) || (reg == 0x74))
+      regs[reg] = 0;
+    else if (mpu_read_reg(reg, &regs[reg]))
+      regs[reg] = 0xFF;
+  }
+}
+
+// The sensor settings' registers as the chip should have them: the rate
+// divider, DLPF_CFG (20 Hz), GYRO_FS_SEL and ACCEL_FS_SEL
+static bool setupApplied(const unsigned char * regs)
+{
+  return (regs[0] == 1000 / SETUP_SAMPLE_RATE - 1) &&
+         ((regs[1] & 0x07) == 4) &&
+         ((regs[2] & 0x18) == (1 << 3)) && // 500 dps
+         ((regs[3] & 0x18) == (2 << 3)); // 8 g
+}
+
+struct setupResult
+{
+  commandCost cost; // Of the whole setup
+  commandCost flush; // Of flushWrites(), with the shadow on
+  unsigned long merged; // Deferred writes merged into bursts
+  bool applied; // The chip has the new settings
+};
+
+// Change the sensor settings as initIMU() makes them, with the DMP
+// stopped, since it sets the sample rate itself, then start it again.
+// They're first put back to initIMU()'s, unmeasured, since the FSR
+// commands leave them wherever the repeats end. Returns false if the DMP
+// couldn't be stopped or started.
+static bool changeSetup(unsigned char shadow, setupResult * result)
+{
+  if (mpu_set_dmp_state(0) != INV_SUCCESS)
+    return false;
+  imu.setGyroFSR(IMU_GYRO_FSR);
+  imu.setAccelFSR(IMU_ACCEL_FSR);
+  imu.setLPF(IMU_AG_LPF);
+  imu.setSampleRate(IMU_AG_SAMPLE_RATE);
+  mpu_shadow_stats_s shadowStart, shadowEnd;
+  imu.getShadowStats(&shadowStart);
+  mpu9250SimStats start = mpuSim.stats();
+  if (shadow)
+    imu.deferWrites();
+  imu.setGyroFSR(SETUP_GYRO_FSR);
+  imu.setAccelFSR(SETUP_ACCEL_FSR);
+  imu.setLPF(SETUP_LPF);
+  imu.setSampleRate(SETUP_SAMPLE_RATE);
+  mpu9250SimStats flushStart = mpuSim.stats();
+  if (shadow)
+    imu.flushWrites();
+  const mpu9250SimStats & end = mpuSim.stats();
+  imu.getShadowStats(&shadowEnd);
+  result->cost.transactions = end.transactions - start.transactions;
+  result->cost.bytes = end.busBytes - start.busBytes;
+  result->cost.busUs = end.busTimeUs - start.busTimeUs;
+  result->flush.transactions = end.transactions - flushStart.transactions;
+  result->flush.bytes = end.busBytes - flushStart.busBytes;
+  result->flush.busUs = end.busTimeUs - flushStart.busTimeUs;
+  result->merged = shadowEnd.writes_merged - shadowStart.writes_merged;
+
+  // mpu_read_reg() reads the chip, not the shadow
+  unsigned char regs[SETUP_REGS];
+  result->applied = true;
+  for (unsigned char i = 0; i < SETUP_REGS; i++)
+  {
+    if (mpu_read_reg(SETUP_FIRST_REG + i, &regs[i]))
+      result->applied = false;
+  }
+  result->applied = result->applied && setupApplied(regs);
+  return mpu_set_dmp_state(1) == INV_SUCCESS;
+}
+
+// Runs every command repeats times, then changes the sensor settings.
+// Returns false if initialization failed.
+static bool simulate(unsigned char shadow, unsigned int repeats,
+                     commandCost * costs, unsigned long * bad,
+                     unsigned long * lost, setupResult * setup,
+                     unsigned char * regs)
+{
+  mpuSim.powerOn();
+  mpuSim.setRotationRate(30, -60, 90);
+  if (!initImu(shadow))
+    return false;
+  mpu_fifo_stats_s fifoStart;
+  imu.getFifoStats(&fifoStart);
+
+  // Each command in turn, an even number of times, so the toggles end
+  // where they started
+  for (unsigned int c = 0; c < COMMANDS; c++)
+  {
+    for (unsigned int r = 0; r < repeats; r++)
+    {
+      mpu9250SimStats start = mpuSim.stats();
+      if (shadow)
+        imu.deferWrites();
+      commands[c].run();
+      updateDmpFeatures();
+      if (shadow)
+        imu.flushWrites();
+      const mpu9250SimStats & end = mpuSim.stats();
+      costs[c].transactions += end.transactions - start.transactions;
+      costs[c].bytes += end.busBytes - start.busBytes;
+      costs[c].busUs += end.busTimeUs - start.busTimeUs;
+      // Packets sampled before an FSR change are scaled to the old one
+      readPackets(SETTLE_US, NULL);
+      readPackets(CHECK_US, bad);
+    }
+  }
+
+  mpu_fifo_stats_s fifoEnd;
+  imu.getFifoStats(&fifoEnd);
+  *lost = fifoEnd.overflows - fifoStart.overflows +
+          fifoEnd.resyncs - fifoStart.resyncs;
+  if (!changeSetup(shadow, setup))
+    return false;
+  readConfig(regs);
+  return true;
+}
+
+int main(int argc, char * argv[])
+{
+  int repeats = (argc > 1) ? atoi(argv[1]) : 8;
+  if (repeats <= 0)
+  {
+    printf("Usage: reconfig_bench [repeats]\n");
+    return 1;
+  }
+  repeats = (repeats + 1) & ~1;
+
+  commandCost costs[2][COMMANDS] = {};
+  unsigned long bad[2] = {0, 0}, lost[2] = {0, 0};
+  setupResult setup[2];
+  static unsigned char regs[2][0x80];
+  for (unsigned char shadow = 0; shadow < 2; shadow++)
+  {
+    if (!simulate(shadow, repeats, costs[shadow], &bad[shadow], &lost[shadow],
+                  &setup[shadow], regs[shadow]))
+    {
+      printf("initialization failed\n");
+      return 1;
+    }
+  }
+
+  printf("%d runs of each command, I2C at 100 kHz, per command\n", repeats);
+  printf("%-13s %6s %6s %8s   %6s %6s %8s   %5s\n", "command", "off tr",
+         "B", "us", "on tr", "B", "us", "saved");
+  for (unsigned int c = 0; c < COMMANDS; c++)
+  {
+    const commandCost & off = costs[0][c];
+    const commandCost & on = costs[1][c];
+    printf("%-13s %6.1f %6.1f %8.0f   %6.1f %6.1f %8.0f   %4.0f%%\n",
+           commands[c].name, (double)off.transactions / repeats,
+           (double)off.bytes / repeats, (double)off.busUs / repeats,
+           (double)on.transactions / repeats, (double)on.bytes / repeats,
+           (double)on.busUs / repeats,
+           off.busUs ? 100.0 - 100.0 * on.busUs / off.busUs : 0.0);
+  }
+
+  printf("%-13s %6lu %6lu %8lu   %6lu %6lu %8lu   %4.0f%%\n",
+         "sensor setup", setup[0].cost.transactions, setup[0].cost.bytes,
+         (unsigned long)setup[0].cost.busUs, setup[1].cost.transactions,
+         setup[1].cost.bytes, (unsigned long)setup[1].cost.busUs,
+         setup[0].cost.busUs ?
+         100.0 - 100.0 * setup[1].cost.busUs / setup[0].cost.busUs : 0.0);
+  // The four deferred writes must be one burst of four registers:
+  // address, register and four data bytes
+  bool setupMerged = (setup[1].flush.transactions == 1) &&
+                     (setup[1].flush.bytes == 2 + SETUP_REGS) &&
+                     (setup[1].merged == SETUP_REGS - 1);
+  printf("sensor setup: flush %lu tr, %lu B, %lu writes merged: %s; "
+         "registers 0x%02X-0x%02X: %s off, %s on\n",
+         setup[1].flush.transactions, setup[1].flush.bytes, setup[1].merged,
+         setupMerged ? "one burst" : "NOT MERGED", SETUP_FIRST_REG,
+         SETUP_FIRST_REG + SETUP_REGS - 1,
+         setup[0].applied ? "ok" : "WRONG", setup[1].applied ? "ok" : "WRONG");
+
+  // The FSR commands are a single write of a register that changes (plus
+  // the DMP's accel biases, which scale with the FSR), so the shadow can't
+  // save anything on them
+  printf("accel FSR and gyro FSR: nothing to save, every write changes "
+         "the chip\n");
+
+  mpu_shadow_stats_s shadowStats;
+  imu.getShadowStats(&shadowStats);
+  printf("shadow: %lu reads saved, %lu writes saved, %lu writes merged\n",
+         shadowStats.reads_saved, shadowStats.writes_saved,
+         shadowStats.writes_merged);
+  printf("bad packets: %lu off, %lu on; overflows and resyncs: %lu off, "
+         "%lu on\n", bad[0], bad[1], lost[0], lost[1]);
+  unsigned int differ = 0;
+  for (unsigned int reg = 0; reg < 0x80; reg++)
+  {
+    if (regs[0][reg] != regs[1][reg])
+    {
+      printf("register 0x%02X: 0x%02X off, 0x%02X on\n", reg, regs[0][reg],
+             regs[1][reg]);
+      differ++;
+    }
+  }
+  printf("configuration registers: %s\n", differ ? "DIFFER" : "same");
+  return (differ || !setupMerged || !setup[0].applied || !setup[1].applied) ?
+         1 : 0;
+}
@@ -33,6 +33,16 @@ Hardware:
 // config.h manages default logging parameters and can be used
 // to adjust specific parameters of the IMU
 #include "config.h"
+// Sample ring between acquisition and logging
+#include "sample_ring.h"
+// Fixed-buffer log line formatter
+#include "log_format.h"
+// Persistent, double-buffered SD log file
+#include "sd_log_writer.h"
+// Compact binary log records
+#include "binary_log.h"
+// Per-packet sample times
+#include "sample_clock.h"
 // Flash storage (for nv storage on ATSAMD21)
 #ifdef ENABLE_NVRAM_STORAGE
 #include <FlashStorage.h>
@@ -54,6 +64,7 @@ bool enableCompass = ENABLE_MAG_LOG;
 bool enableQuat = ENABLE_QUAT_LOG;
 bool enableEuler = ENABLE_EULER_LOG;
 bool enableHeading = ENABLE_HEADING_LOG;
+bool enableBinaryLog = ENABLE_BINARY_LOG;
 unsigned short accelFSR = IMU_ACCEL_FSR;
 unsigned short gyroFSR = IMU_GYRO_FSR;
 unsigned short fifoRate = DMP_SAMPLE_RATE;
@@ -62,8 +73,105 @@ unsigned short fifoRate = DMP_SAMPLE_RATE;
 // SD Card Globals //
 /////////////////////
 bool sdCardPresent = false; // Keeps track of if SD card is plugged in
-String logFileName; // Active logging file
-String logFileBuffer; // Buffer for logged data. Max is set in config
+SdLogWriter sdLog; // Active log file and its write buffers
+
+////////////////////////
+// Binary Log Globals //
+////////////////////////
+uint8_t logHeader[BINLOG_HEADER_SIZE]; // Describes the records being logged
+uint16_t logChannels = 0; // BINLOG_CH_* mask of the logged channels
+uint16_t logSequence = 0; // Sequence number of the next record
+uint32_t lastSerialHeader = 0; // millis() the header was last sent to serial
+LogLine imuLog; // The line being formatted by logIMUData()
+// Samples being logged, popped from the ring a block at a time. For text
+// logging in calculated mode, their accel, gyro and mag counts are copied
+// out one axis per row, and converted a row at a time by the calc*Block()
+// methods instead of a reading at a time.
+imuSample logSamples[LOG_BLOCK_SIZE];
+short logCounts[9][LOG_BLOCK_SIZE]; // ax..az, gx..gz, mx..mz
+float logUnits[9][LOG_BLOCK_SIZE]; // logCounts, in g's, dps and uT
+
+/////////////////////////
+// Raw Capture Globals //
+/////////////////////////
+// While capturing (see TOGGLE_CAPTURE), the DMP is stopped, and loop()
+// reads raw samples straight from the FIFO into capture records instead
+// of going through the sample ring.
+bool captureMode = false;
+short captureSamples[BINLOG_CAPTURE_MAX_VALUES]; // One record's worth
+
+/////////////////////////
+// Acquisition Globals //
+/////////////////////////
+// Samples are drained from the FIFO into this ring, and popped by loop()
+// for logging, a block at a time. loop() drains the FIFO again between
+// blocks, so a long run of logging doesn't leave it to overflow. A single
+// SD card write still has to fit in the FIFO: nothing drains it while the
+// write blocks loop() (see SAMPLE_RING_SIZE).
+SampleRing<imuSample, SAMPLE_RING_SIZE> sampleRing;
+// Packets read from the FIFO in one burst, oldest first
+dmp_packet_s imuPackets[DMP_MAX_BURST_PACKETS];
+short lastMag[3] = {0, 0, 0}; // Most recent compass reading
+short seenMag[3] = {0, 0, 0}; // Compass reading of the last sample logged
+uint32_t lastImuData = 0; // millis() of the last FIFO read
+uint32_t firstSampleMs = 0; // millis() of the first packet read
+// Every packet read from the FIFO is numbered, and given a sample time by
+// sampleClock from the times it was seen in the FIFO.
+SampleClock sampleClock;
+uint32_t packetCount = 0; // Number of the next packet to be read
+// Packets overwritten in the FIFO by an overflow, and skipped in the
+// numbering, as counted by sampleClock
+uint32_t packetsLost = 0;
+unsigned long fifoRecoveries = 0; // Last resyncs + resets from the driver
+// DMP features programmed for the current log channels (see dmpFeatures())
+unsigned short dmpFeatureMask = 0;
+// I2C clock initIMU() tuned the bus to (Hz), put back after a capture
+unsigned long i2cClock = I2C_CLOCK_STANDARD;
+// Set while loop() is using the I2C bus, so the interrupt doesn't start
+// a FIFO read in the middle of another transfer.
+volatile bool imuBusBusy = false;
+
+#ifdef ENABLE_INTERRUPT_ACQUISITION
+// Set by the interrupt when the FIFO has new data for loop() to drain
+// (with ENABLE_ASYNC_ACQUISITION, only when the interrupt couldn't start
+// the reads itself). Starts true so the first read clears any interrupt
+// latched at boot.
+volatile bool imuDataReady = true;
+volatile uint32_t imuEdgeUs = 0; // micros() of the interrupt's last edge
+// Each loop that finds nothing flagged by the interrupt skips a
+// fifoAvailable() call, which is two register reads over I2C.
+uint32_t pollsAvoided = 0; // Counter for the current second
+uint32_t pollsAvoidedPerSec = 0; // Result from the last full second
+uint32_t lastStatsUpdate = 0;
+
+#ifdef ENABLE_ASYNC_ACQUISITION
+// A background drain of the FIFO, started by the interrupt. Its reads
+// finish in imu.asyncPoll(), from loop(), which stores the packets.
+volatile bool asyncDrain = false;
+uint32_t asyncSeenUs; // As acquireSamples()'s seenUs and observe
+bool asyncObserve;
+unsigned char asyncBurstsLeft;
+#endif
+
+// The FIFO reads block on I2C, retry and may recover the bus, which is no
+// work for an interrupt: the handler only times the edge and leaves the
+// reads to loop(). Background reads only take starting, so with
+// ENABLE_ASYNC_ACQUISITION it starts them, unless loop() has the bus.
+void imuInterrupt(void)
+{
+  // The newest packet arrived at this edge. Time it before anything else.
+  uint32_t edge = micros();
+#ifdef ENABLE_ASYNC_ACQUISITION
+  if ( !imuBusBusy && !asyncDrain )
+  {
+    startAsyncDrain(edge, true);
+    return;
+  }
+#endif
+  imuEdgeUs = edge;
+  imuDataReady = true;
+}
+#endif
 
 ///////////////////////
 // LED Blink Control //
@@ -98,7 +206,37 @@ void blinkLED()
   FlashStorage(flashAccelFSR, unsigned short);
   FlashStorage(flashGyroFSR, unsigned short);
   FlashStorage(flashLogRate, unsigned short);
+
+  // Biases the DMP is using, as last saved (see updateBiasStorage())
+  #define IMU_BIAS_MAGIC 0x42696173 // "Bias"
+  struct imuBiases
+  {
+    uint32_t magic; // IMU_BIAS_MAGIC once saved
+    uint32_t saves; // Number of times saved, for IMU_BIAS_SAVE_LIMIT
+    long gyro[3];   // dps, q16
+    long accel[3];  // g, q16
+  };
+  FlashStorage(flashImuBiases, imuBiases);
+  imuBiases savedBiases; // Copy of what's in flash
+  uint32_t lastBiasCheck = 0; // millis() the DMP's biases were last read
+  uint32_t lastBiasSave = 0; // millis() they were last saved
+  bool biasesRestored = false; // Pushed to the DMP at boot
+
+  // Magnetometer calibration, as last saved (see updateMagCalStorage())
+  #define MAG_CAL_MAGIC 0x4D43616C // "MCal"
+  struct magCalibration
+  {
+    uint32_t magic; // MAG_CAL_MAGIC once saved
+    uint32_t saves; // Number of times saved, for MAG_CAL_SAVE_LIMIT
+    short offset[3]; // counts
+    short matrix[9]; // row major, q14
+  };
+  FlashStorage(flashMagCal, magCalibration);
+  magCalibration savedMagCal; // Copy of what's in flash
+  uint32_t lastMagCalSave = 0; // millis() it was last saved
+  bool magCalRestored = false; // Applied at boot
 #endif
+bool magCalChanged = false; // Learned since it was last saved
 
 void setup()
 {
@@ -108,6 +246,14 @@ void setup()
 #ifdef ENABLE_NVRAM_STORAGE
   // Load previously-set logging parameters from nvram:
   initLoggingParams();
+  // And the biases the DMP learned before this reset
+  savedBiases = flashImuBiases.read();
+  if ( savedBiases.magic != IMU_BIAS_MAGIC )
+    memset(&savedBiases, 0, sizeof(savedBiases));
+  // And the magnetometer calibration
+  savedMagCal = flashMagCal.read();
+  if ( savedMagCal.magic != MAG_CAL_MAGIC )
+    memset(&savedMagCal, 0, sizeof(savedMagCal));
 #endif
 
   // Initialize the MPU-9250. Should return true on success:
@@ -117,13 +263,30 @@ void setup()
     while (1) ; // Loop forever if we fail to connect
     // LED will remain off in this state.
   }
+  // Time packets at the configured FIFO rate
+  sampleClock.setRate(imu.dmpGetFifoRate());
+  // Describe the current settings for binary logs
+  updateLogHeader(false);
+
+#ifdef ENABLE_INTERRUPT_ACQUISITION
+  // The MPU-9250 interrupt is active-low and latched. It's cleared by
+  // any register read, so each new DMP packet produces a falling edge.
+  attachInterrupt(digitalPinToInterrupt(MPU9250_INT_PIN), imuInterrupt,
+                  FALLING);
+#endif
 
   // Check for the presence of an SD card, and initialize it:
   if ( initSD() )
   {
-    sdCardPresent = true;
-    // Get the next, available log file name
-    logFileName = nextLogFile(); 
+    // Binary log files start with the header describing their records
+    if (enableBinaryLog)
+      sdLog.setFileHeader(logHeader, sizeof(logHeader));
+    // Open the next available log file, and keep it open
+    sdCardPresent = sdLog.begin(LOG_FILE_PREFIX,
+                                enableBinaryLog ? LOG_FILE_SUFFIX_BINARY :
+                                                  LOG_FILE_SUFFIX,
+                                LOG_FILE_INDEX_MAX, SD_MAX_FILE_SIZE,
+                                SD_SYNC_INTERVAL_MS);
   }
 
   // For production testing only
@@ -137,135 +300,501 @@ void loop()
   if ( LOG_PORT.available() )
   {
     // If new input is available on serial port
+    imuBusBusy = true; // Commands may reconfigure the MPU-9250
+    waitForAsyncDrain();
+    // Write a command's register changes in bursts, and reset the FIFO once
+    imu.deferWrites();
     parseSerialInput(LOG_PORT.read()); // parse it
+    imu.flushWrites();
+    imuBusBusy = captureMode; // The DMP's FIFO reads wait for the capture
   }
 
-  // Then check IMU for new data, and log it
-  if ( !imu.fifoAvailable() ) // If no new data is available
-    return;                   // return to the top of the loop
+  // Raw capture has the bus to itself: read the FIFO as fast as the loop
+  // goes, and skip everything that needs the DMP
+  if ( captureMode )
+  {
+    logCapture();
+    if ( sdCardPresent && sdLog.service() )
+      blinkLED();
+    return;
+  }
 
-  // Read from the digital motion processor's FIFO
-  if ( imu.dmpUpdateFifo() != INV_SUCCESS )
-    return; // If that fails (uh, oh), return to top
+#ifdef ENABLE_INTERRUPT_ACQUISITION
+  updateAcquisitionStats();
+  // Drain the FIFO if the interrupt saw new data (and didn't start reading
+  // it in the background), or if an edge may have been missed
+#ifdef ENABLE_ASYNC_ACQUISITION
+  // Finish the reads of a background drain, if one is running
+  imu.asyncPoll();
+  bool draining = asyncDrain;
+#else
+  bool draining = false;
+#endif
+  if ( draining )
+    ; // It'll see anything new before it's done
+  else if ( imuDataReady || (millis() - lastImuData >= INTERRUPT_TIMEOUT_MS) )
+    acquireFromLoop();
+  else
+    pollsAvoided++; // Skipped a fifoAvailable() check
+#else
+  // Check IMU for new data, and drain it into the sample ring. Without
+  // the interrupt edge, the time of the check is the best we have.
+  uint32_t now = micros();
+  if ( imu.fifoAvailable() )
+    acquireSamples(now, true);
+#endif
 
-  // If enabled, read from the compass.
-  if ( (enableCompass || enableHeading) && (imu.updateCompass() != INV_SUCCESS) )
-    return; // If compass read fails (uh, oh) return to top
+  // Log the samples that were waiting when we got here, oldest first.
+  // Anything drained meanwhile is left for the next loop, so serial input
+  // is still serviced under a steady stream of data.
+  for (uint16_t n = sampleRing.available(); n > 0; )
+  {
+#ifdef ENABLE_ASYNC_ACQUISITION
+    imu.asyncPoll(); // Keep a background drain going between blocks
+    if ( imuDataReady && !asyncDrain )
+      acquireFromLoop(); // One the interrupt couldn't start
+#elif defined(ENABLE_INTERRUPT_ACQUISITION)
+    if ( imuDataReady )
+      acquireFromLoop(); // Keep the FIFO drained between blocks
+#endif
+    uint16_t count = (n < LOG_BLOCK_SIZE) ? n : LOG_BLOCK_SIZE;
+    for (uint16_t i = 0; i < count; i++)
+      sampleRing.pop(logSamples[i]);
+    n -= count;
 
-  // If logging (to either UART and SD card) is enabled
-  if ( enableSerialLogging || enableSDLogging)
-    logIMUData(); // Log new data
+    bool logging = enableSerialLogging || enableSDLogging;
+    if ( logging && !enableBinaryLog && enableCalculatedValues )
+      calcLogBlock(count);
+    for (uint16_t i = 0; i < count; i++)
+    {
+      loadSample(logSamples[i]);
+      bool newMag = newCompassReading(logSamples[i].mag);
+      if ( ENABLE_MAG_CALIBRATION && newMag )
+        learnMagCalibration();
+      if ( fuseHeading() )
+        imu.updateFusion(newMag);
+      // If logging (to either UART and SD card) is enabled
+      if ( logging )
+      {
+        if ( enableBinaryLog )
+          logBinaryData(logSamples[i]); // Log new data as a binary record
+        else
+          logIMUData(i); // Log new data
+      }
+    }
+  }
+
+  // Write a full SD buffer, if one is waiting, now that logging is done
+  if ( sdCardPresent && sdLog.service() )
+    blinkLED(); // Blink LED every time a block is logged to SD
+
+#ifdef ENABLE_NVRAM_STORAGE
+  // Save the DMP's biases if its calibration has moved them
+  if ( ENABLE_BIAS_STORAGE )
+    updateBiasStorage();
+  // And the magnetometer calibration, if it's been learned
+  if ( ENABLE_MAG_CALIBRATION )
+    updateMagCalStorage();
+#endif
 
   // Check for production mode testing message, "$"
   // This will be sent to board from testbed, and should be heard on hadware serial port Serial1
   if ( Serial1.available() )
   {
-    if ( Serial1.read() == '$' ) production_testing();
+    if ( Serial1.read() == '$' )
+    {
+      imuBusBusy = true;
+      waitForAsyncDrain();
+      production_testing();
+      imuBusBusy = false;
+    }
   }
   
 }
 
-void logIMUData(void)
+// Drain the DMP FIFO into the sample ring. Called from loop(), once the
+// MPU-9250's interrupt has seen new data if that's enabled.
+// seenUs is a micros() time when every packet now in the FIFO had already
+// arrived. If observe is true, it's also close to when the newest one
+// did, and is used to keep sampleClock in step with the sensor.
+void acquireSamples(uint32_t seenUs, bool observe)
+{
+  unsigned char count, more;
+  unsigned long timestamp;
+  // The 1kB FIFO holds at most four full bursts of packets
+  unsigned char burstsLeft = 4;
+
+  do
+  {
+    if ( dmp_read_fifo_burst(imuPackets, DMP_MAX_BURST_PACKETS, &count,
+                             &timestamp, &more) != INV_SUCCESS )
+      return;
+
+    // If enabled, read from the compass, unless its data comes with the
+    // packets. If that fails, the previous reading is logged again.
+    if ( (enableCompass || enableHeading) && !imu.dmpCompassFifoEnabled() )
+    {
+      short mag[3];
+      unsigned long magTime;
+      if ( mpu_get_compass_reg(mag, &magTime) == INV_SUCCESS )
+        memcpy(lastMag, mag, sizeof(lastMag));
+    }
+
+    storePackets(count, more, seenUs, observe);
+    observe = false;
+  } while ( more && --burstsLeft );
+}
+
+// Number and time the count packets just read into imuPackets, and push
+// them into the sample ring. more is the number still in the FIFO;
+// seenUs and observe are as for acquireSamples().
+void storePackets(unsigned char count, unsigned char more, uint32_t seenUs,
+                  bool observe)
+{
+  lastImuData = millis();
+  if ( !firstSampleMs && count )
+    firstSampleMs = lastImuData;
+
+  // If the FIFO overflowed and was realigned, the oldest packets were
+  // overwritten; if it was reset, all it held was lost. The sensor kept
+  // sampling steadily either way, so the clock can tell how many: skip
+  // their numbers, and the rest keep their times.
+  mpu_fifo_stats_s fifoStats;
+  mpu_get_fifo_stats(&fifoStats);
+  unsigned long recoveries = fifoStats.resyncs + fifoStats.resets;
+  if ( (recoveries != fifoRecoveries) && (count + more > 0) )
+  {
+    uint32_t lost = sampleClock.missed(packetCount + count + more - 1,
+                                       seenUs);
+    packetCount += lost;
+    packetsLost += lost;
+  }
+  fifoRecoveries = recoveries;
+
+  // The first burst sees the whole FIFO: the newest packet is the last
+  // of the ones just read and the ones still waiting.
+  if ( (observe || !sampleClock.locked()) && (count + more > 0) )
+    sampleClock.observe(packetCount + count + more - 1, seenUs);
+
+  for (unsigned char i = 0; i < count; i++)
+  {
+    imuSample sample;
+    uint64_t time = sampleClock.timeOf(packetCount++);
+    sample.time = time / 1000;
+    sample.timeUs = time % 1000;
+    // Packets only hold what dmpFeatures() asked for
+    const dmp_packet_s & packet = imuPackets[i];
+    if (packet.sensors & INV_WXYZ_QUAT)
+      memcpy(sample.quat, packet.quat, sizeof(sample.quat));
+    else
+      memset(sample.quat, 0, sizeof(sample.quat));
+    if (packet.sensors & INV_XYZ_ACCEL)
+      memcpy(sample.accel, packet.accel, sizeof(sample.accel));
+    else
+      memset(sample.accel, 0, sizeof(sample.accel));
+    if (packet.sensors & INV_XYZ_GYRO)
+      memcpy(sample.gyro, packet.gyro, sizeof(sample.gyro));
+    else
+      memset(sample.gyro, 0, sizeof(sample.gyro));
+    if (packet.sensors & INV_XYZ_COMPASS)
+      memcpy(lastMag, packet.compass, sizeof(lastMag));
+    memcpy(sample.mag, lastMag, sizeof(sample.mag));
+    sampleRing.push(sample); // Counted as dropped if the ring is full
+  }
+}
+
+#ifdef ENABLE_INTERRUPT_ACQUISITION
+// Drain the FIFO from loop(), after the interrupt saw new data, or when
+// an edge may have been missed
+void acquireFromLoop(void)
+{
+  noInterrupts();
+  bool edgeSeen = imuDataReady;
+  uint32_t edge = imuEdgeUs;
+  imuDataReady = false;
+  interrupts();
+  // The edge timed the newest packet, unless the next one may have come
+  // in since: then it's stale, and isn't observed
+  uint32_t now = micros();
+  bool fresh = edgeSeen &&
+               (now - edge < sampleClock.periodNs() / 2000); // Half a period
+#ifdef ENABLE_ASYNC_ACQUISITION
+  startAsyncDrain(fresh ? edge : now, fresh);
+#else
+  acquireSamples(fresh ? edge : now, fresh);
+#endif
+}
+#endif
+
+#ifdef ENABLE_ASYNC_ACQUISITION
+// Start draining the FIFO in the background, as acquireSamples() does in
+// the foreground. The reads go on while loop() logs, and end up in
+// asyncBurstRead().
+void startAsyncDrain(uint32_t seenUs, bool observe)
+{
+  asyncSeenUs = seenUs;
+  asyncObserve = observe;
+  // The 1kB FIFO holds at most four full bursts of packets
+  asyncBurstsLeft = 4;
+  asyncDrain = true;
+  if ( imu.dmpStartFifoBurst(imuPackets, DMP_MAX_BURST_PACKETS,
+                             asyncBurstRead) != INV_SUCCESS )
+    asyncDrain = false;
+}
+
+// A background burst is read: read the compass too, if it's needed, or
+// store the packets
+void asyncBurstRead(void)
+{
+  unsigned char count;
+  if ( imu.dmpFifoBurstResult(&count) != INV_SUCCESS )
+  {
+    asyncDrain = false;
+    return;
+  }
+  if ( (enableCompass || enableHeading) && !imu.dmpCompassFifoEnabled() &&
+       (imu.startCompassRead(asyncCompassRead) == INV_SUCCESS) )
+    return;
+  storeAsyncBurst();
+}
+
+void asyncCompassRead(void)
+{
+  // If that fails, the previous reading is logged again
+  if ( imu.compassReadResult() == INV_SUCCESS )
+  {
+    lastMag[0] = imu.mx;
+    lastMag[1] = imu.my;
+    lastMag[2] = imu.mz;
+  }
+  storeAsyncBurst();
+}
+
+// Store a background burst's packets, and start the next if the FIFO
+// holds more
+void storeAsyncBurst(void)
 {
-  String imuLog = ""; // Create a fresh line to log
+  unsigned char count;
+  imu.dmpFifoBurstResult(&count);
+  unsigned char more = imu.fifoPending();
+  storePackets(count, more, asyncSeenUs, asyncObserve);
+  asyncObserve = false;
+  if ( !more || !--asyncBurstsLeft ||
+       (imu.dmpStartFifoBurst(imuPackets, DMP_MAX_BURST_PACKETS,
+                              asyncBurstRead) != INV_SUCCESS) )
+    asyncDrain = false;
+}
+#endif
+
+// Wait for a background drain of the FIFO to finish, before using the
+// MPU-9250 in a way that could upset it
+void waitForAsyncDrain(void)
+{
+#ifdef ENABLE_ASYNC_ACQUISITION
+  while ( asyncDrain )
+    imu.asyncPoll();
+#endif
+}
+
+// Copy one sample into the imu object so it can be logged
+void loadSample(const imuSample & sample)
+{
+  imu.time = sample.time;
+  imu.ax = sample.accel[0];
+  imu.ay = sample.accel[1];
+  imu.az = sample.accel[2];
+  imu.gx = sample.gyro[0];
+  imu.gy = sample.gyro[1];
+  imu.gz = sample.gyro[2];
+  imu.mx = sample.mag[0];
+  imu.my = sample.mag[1];
+  imu.mz = sample.mag[2];
+  imu.qw = sample.quat[0];
+  imu.qx = sample.quat[1];
+  imu.qy = sample.quat[2];
+  imu.qz = sample.quat[3];
+}
+
+// True if mag is a new compass reading. Samples between compass readings
+// repeat the last one, so a reading that hasn't changed isn't counted
+// again.
+bool newCompassReading(const short * mag)
+{
+  if ( !memcmp(mag, seenMag, sizeof(seenMag)) )
+    return false;
+  memcpy(seenMag, mag, sizeof(seenMag));
+  return true;
+}
+
+// Learn the magnetometer calibration from the reading loadSample() copied
+// into the imu object. A changed calibration is written to the driver's
+// state, which the interrupt's FIFO reads use, so they're held off.
+void learnMagCalibration(void)
+{
+  imuBusBusy = true;
+  if ( imu.updateMagCalibration() )
+    magCalChanged = true;
+  imuBusBusy = false;
+}
+
+// Convert the enabled channels of logSamples[0..count-1] to calculated
+// units, into logUnits
+void calcLogBlock(uint16_t count)
+{
+  for (uint16_t i = 0; i < count; i++)
+  {
+    for (uint8_t axis = 0; axis < 3; axis++)
+    {
+      logCounts[axis][i] = logSamples[i].accel[axis];
+      logCounts[3 + axis][i] = logSamples[i].gyro[axis];
+      logCounts[6 + axis][i] = logSamples[i].mag[axis];
+    }
+  }
+  for (uint8_t axis = 0; axis < 3; axis++)
+  {
+    if (enableAccel)
+      imu.calcAccelBlock(logCounts[axis], logUnits[axis], count);
+    if (enableGyro)
+      imu.calcGyroBlock(logCounts[3 + axis], logUnits[3 + axis], count);
+    if (enableCompass)
+      imu.calcMagBlock(logCounts[6 + axis], logUnits[6 + axis], count);
+  }
+}
+
+// Log sample index of the block being logged, which loadSample() has
+// copied into the imu object. In calculated mode, its accel, gyro and mag
+// readings come from calcLogBlock().
+void logIMUData(uint16_t index)
+{
+  imuLog.clear(); // Start a fresh line to log
   if (enableTimeLog) // If time logging is enabled
   {
-    imuLog += String(imu.time) + ", "; // Add time to log string
+    imuLog.addUInt(imu.time); // Add time to log line
   }
   if (enableAccel) // If accelerometer logging is enabled
   {
     if ( enableCalculatedValues ) // If in calculated mode
     {
-      imuLog += String(imu.calcAccel(imu.ax)) + ", ";
-      imuLog += String(imu.calcAccel(imu.ay)) + ", ";
-      imuLog += String(imu.calcAccel(imu.az)) + ", ";
+      imuLog.addFloat(logUnits[0][index]);
+      imuLog.addFloat(logUnits[1][index]);
+      imuLog.addFloat(logUnits[2][index]);
     }
     else
     {
-      imuLog += String(imu.ax) + ", ";
-      imuLog += String(imu.ay) + ", ";
-      imuLog += String(imu.az) + ", ";
+      imuLog.addInt(imu.ax);
+      imuLog.addInt(imu.ay);
+      imuLog.addInt(imu.az);
     }
   }
   if (enableGyro) // If gyroscope logging is enabled
   {
     if ( enableCalculatedValues ) // If in calculated mode
     {
-      imuLog += String(imu.calcGyro(imu.gx)) + ", ";
-      imuLog += String(imu.calcGyro(imu.gy)) + ", ";
-      imuLog += String(imu.calcGyro(imu.gz)) + ", ";
+      imuLog.addFloat(logUnits[3][index]);
+      imuLog.addFloat(logUnits[4][index]);
+      imuLog.addFloat(logUnits[5][index]);
     }
     else
     {
-      imuLog += String(imu.gx) + ", ";
-      imuLog += String(imu.gy) + ", ";
-      imuLog += String(imu.gz) + ", ";
+      imuLog.addInt(imu.gx);
+      imuLog.addInt(imu.gy);
+      imuLog.addInt(imu.gz);
     }
   }
   if (enableCompass) // If magnetometer logging is enabled
   {
     if ( enableCalculatedValues ) // If in calculated mode
     {
-      imuLog += String(imu.calcMag(imu.mx)) + ", ";
-      imuLog += String(imu.calcMag(imu.my)) + ", ";
-      imuLog += String(imu.calcMag(imu.mz)) + ", ";    
+      imuLog.addFloat(logUnits[6][index]);
+      imuLog.addFloat(logUnits[7][index]);
+      imuLog.addFloat(logUnits[8][index]);
     }
     else
     {
-      imuLog += String(imu.mx) + ", ";
-      imuLog += String(imu.my) + ", ";
-      imuLog += String(imu.mz) + ", ";
+      imuLog.addInt(imu.mx);
+      imuLog.addInt(imu.my);
+      imuLog.addInt(imu.mz);
     }
   }
   if (enableQuat) // If quaternion logging is enabled
   {
     if ( enableCalculatedValues )
     {
-      imuLog += String(imu.calcQuat(imu.qw), 4) + ", ";
-      imuLog += String(imu.calcQuat(imu.qx), 4) + ", ";
-      imuLog += String(imu.calcQuat(imu.qy), 4) + ", ";
-      imuLog += String(imu.calcQuat(imu.qz), 4) + ", ";
+      // Quaternions are Q30, so they can be printed without float math
+      imuLog.addQ30(imu.qw, 4);
+      imuLog.addQ30(imu.qx, 4);
+      imuLog.addQ30(imu.qy, 4);
+      imuLog.addQ30(imu.qz, 4);
     }
     else
     {
-      imuLog += String(imu.qw) + ", ";
-      imuLog += String(imu.qx) + ", ";
-      imuLog += String(imu.qy) + ", ";
-      imuLog += String(imu.qz) + ", ";      
+      imuLog.addInt(imu.qw);
+      imuLog.addInt(imu.qx);
+      imuLog.addInt(imu.qy);
+      imuLog.addInt(imu.qz);
     }
   }
   if (enableEuler) // If Euler-angle logging is enabled
   {
     imu.computeEulerAngles();
-    imuLog += String(imu.pitch, 2) + ", ";
-    imuLog += String(imu.roll, 2) + ", ";
-    imuLog += String(imu.yaw, 2) + ", ";
+    imuLog.addFloat(imu.pitch, 2);
+    imuLog.addFloat(imu.roll, 2);
+    imuLog.addFloat(imu.yaw, 2);
   }
   if (enableHeading) // If heading logging is enabled
   {
-    imuLog += String(imu.computeCompassHeading(), 2) + ", ";
+    if ( fuseHeading() )
+      imuLog.addFloat(imu.fusedHeading / 65536.0f, 2);
+    else
+      imuLog.addFloat(imu.computeCompassHeading(), 2);
   }
   
-  // Remove last comma/space:
-  imuLog.remove(imuLog.length() - 2, 2);
-  imuLog += "\r\n"; // Add a new line
+  // Replace last comma/space with a new line:
+  imuLog.end();
 
   if (enableSerialLogging)  // If serial port logging is enabled
-    LOG_PORT.print(imuLog); // Print log line to serial port
+    LOG_PORT.write((const uint8_t *)imuLog.c_str(), imuLog.length());
 
   // If SD card logging is enabled & a card is plugged in
   if ( sdCardPresent && enableSDLogging)
   {
-    // If adding this log line will put us over the buffer length:
-    if (imuLog.length() + logFileBuffer.length() >=
-        SD_LOG_WRITE_BUFFER_SIZE)
+    // Add new line to SD log buffer. loop() writes it out once a
+    // block is full.
+    sdLog.write(imuLog.c_str(), imuLog.length());
+  }
+  else
+  {
+    // Blink LED once every second (if only logging to serial port)
+    if ( millis() > lastBlink + UART_BLINK_RATE )
+    {
+      blinkLED(); 
+      lastBlink = millis();
+    }
+  }
+}
+
+// Log one sample as a binary record
+void logBinaryData(const imuSample & sample)
+{
+  uint8_t record[BINLOG_RECORD_MAX];
+  unsigned int length = binLogRecord(logChannels, logSequence++, sample,
+                                     record);
+
+  if (enableSerialLogging)  // If serial port logging is enabled
+  {
+    // Repeat the header now and then, for readers that join late
+    if ( millis() - lastSerialHeader >= SERIAL_HEADER_INTERVAL )
     {
-      sdLogString(logFileBuffer); // Log SD buffer
-      logFileBuffer = ""; // Clear SD log buffer 
-      blinkLED(); // Blink LED every time a new buffer is logged to SD
+      LOG_PORT.write(logHeader, sizeof(logHeader));
+      lastSerialHeader = millis();
     }
-    // Add new line to SD log buffer
-    logFileBuffer += imuLog;
+    LOG_PORT.write(record, length);
+  }
+
+  // If SD card logging is enabled & a card is plugged in
+  if ( sdCardPresent && enableSDLogging)
+  {
+    sdLog.write((const char *)record, length);
   }
   else
   {
@@ -278,6 +807,229 @@ void logIMUData(void)
   }
 }
 
+// Read the samples waiting in the FIFO, a record's worth at a time, and
+// log them as capture records
+void logCapture(void)
+{
+  unsigned short maxSamples = BINLOG_CAPTURE_MAX_VALUES / imu.captureValues();
+  unsigned short count;
+  unsigned long first;
+  // The FIFO fills in a few ms at the high rates, so it's drained now
+  // rather than a record per loop
+  for (uint8_t records = 0; records < 4; records++)
+  {
+    if ( (imu.updateCapture(captureSamples, maxSamples, &count, &first)
+          != INV_SUCCESS) || !count )
+      return;
+    uint8_t record[BINLOG_CAPTURE_RECORD_MAX];
+    unsigned int length = binLogCaptureRecord(logSequence++, first,
+                                              CAPTURE_SENSORS,
+                                              captureSamples, count, record);
+
+    if (enableSerialLogging)  // If serial port logging is enabled
+    {
+      if ( millis() - lastSerialHeader >= SERIAL_HEADER_INTERVAL )
+      {
+        LOG_PORT.write(logHeader, sizeof(logHeader));
+        lastSerialHeader = millis();
+      }
+      LOG_PORT.write(record, length);
+    }
+    if ( sdCardPresent && enableSDLogging )
+      sdLog.write((const char *)record, length);
+    if ( count < maxSamples )
+      return; // The FIFO is drained
+  }
+}
+
+// Start or stop the raw capture. Capture records always go to a new
+// binary file, and the text or binary log carries on in another one after.
+void setCaptureMode(bool capture)
+{
+  if ( capture )
+  {
+    // Kept across bus recoveries. Set first: beginCapture() refuses a rate
+    // the clock can't carry.
+    imu.setI2CClock(CAPTURE_I2C_CLOCK);
+    if ( imu.beginCapture(CAPTURE_SENSORS, CAPTURE_RATE) != INV_SUCCESS )
+    {
+      imu.setI2CClock(i2cClock);
+      imu.endCapture(); // Put the DMP back
+      LOG_PORT.println("Raw capture failed to start");
+      return;
+    }
+  }
+  else
+  {
+    capture_stats_s stats;
+    imu.getCaptureStats(&stats);
+    imu.setI2CClock(i2cClock); // As tuned
+    imu.endCapture();
+    sampleClock.setRate(imu.dmpGetFifoRate()); // The DMP starts over
+    LOG_PORT.println("Raw capture: " + String(stats.samples) + " samples at " +
+                     String(stats.rate) + " Hz, " + String(stats.lost) +
+                     " lost");
+  }
+  captureMode = capture;
+  updateLogHeader(false);
+  bool binary = captureMode || enableBinaryLog;
+  if ( sdCardPresent )
+  {
+    sdLog.setFileHeader(binary ? logHeader : NULL, sizeof(logHeader));
+    sdLog.nextFile(binary ? LOG_FILE_SUFFIX_BINARY : LOG_FILE_SUFFIX);
+  }
+  lastSerialHeader = millis() - SERIAL_HEADER_INTERVAL; // Send it next
+#ifdef ENABLE_INTERRUPT_ACQUISITION
+  // Clear whatever the interrupt latched meanwhile
+  if ( !captureMode )
+    imuDataReady = true;
+#endif
+}
+
+// Rebuild the binary log header from the current settings. If it changed
+// (and sendIfChanged is set), send it ahead of the next records.
+void updateLogHeader(bool sendIfChanged)
+{
+  binLogConfig config;
+  config.channels = 0;
+  if ( captureMode )
+  {
+    capture_stats_s stats;
+    imu.getCaptureStats(&stats);
+    config.channels = BINLOG_CH_CAPTURE;
+    config.sampleRate = stats.nominal;
+  }
+  else
+  {
+    if (enableTimeLog) config.channels |= BINLOG_CH_TIME;
+    if (enableAccel) config.channels |= BINLOG_CH_ACCEL;
+    if (enableGyro) config.channels |= BINLOG_CH_GYRO;
+    if (enableCompass) config.channels |= BINLOG_CH_MAG;
+    if (enableQuat) config.channels |= BINLOG_CH_QUAT;
+    config.sampleRate = imu.dmpGetFifoRate();
+  }
+  config.accelFSR = imu.getAccelFSR();
+  config.gyroFSR = imu.getGyroFSR();
+  config.magFSR = imu.getMagFSR();
+  config.accelSens = imu.getAccelSens();
+  config.gyroSens = imu.getGyroSens();
+  config.magSens = imu.getMagSens();
+  config.i2cClock = imu.getI2CClock() / 1000;
+
+  uint8_t header[BINLOG_HEADER_SIZE];
+  binLogHeader(config, header);
+  if ( memcmp(header, logHeader, sizeof(header)) == 0 )
+    return;
+  memcpy(logHeader, header, sizeof(header));
+  logChannels = config.channels;
+
+  if ( sendIfChanged && (enableBinaryLog || captureMode) )
+  {
+    lastSerialHeader = millis() - SERIAL_HEADER_INTERVAL; // Send it next
+    if ( sdCardPresent )
+      sdLog.write((const char *)logHeader, sizeof(logHeader));
+  }
+}
+
+#ifdef ENABLE_INTERRUPT_ACQUISITION
+// Roll the avoided-poll counter over once per second
+void updateAcquisitionStats(void)
+{
+  if ( millis() - lastStatsUpdate >= 1000 )
+  {
+    pollsAvoidedPerSec = pollsAvoided;
+    pollsAvoided = 0;
+    lastStatsUpdate = millis();
+  }
+}
+#endif
+
+// Print acquisition statistics to the log port
+void printStats(void)
+{
+#ifdef ENABLE_INTERRUPT_ACQUISITION
+  LOG_PORT.println("FIFO polls avoided: " + String(pollsAvoidedPerSec) + 
+                   "/s (" + String(pollsAvoidedPerSec * 2) +
+                   " register reads/s)");
+#endif
+  LOG_PORT.println("Sample ring: " + String(sampleRing.highWater()) + "/" +
+                   String(sampleRing.capacity()) + " max used, " +
+                   String(sampleRing.dropped()) + " dropped");
+  LOG_PORT.println("Sample period: " + String(sampleClock.periodNs()) +
+                   " ns (" + String(sampleClock.driftPpm()) + " ppm), " +
+                   String(sampleClock.jitterUs()) + " us jitter, " +
+                   String(sampleClock.resyncs()) + " resyncs");
+  mpu_fifo_stats_s fifoStats;
+  mpu_get_fifo_stats(&fifoStats);
+  LOG_PORT.println("FIFO: " + String(fifoStats.overflows) + " overflows, " +
+                   String(fifoStats.resyncs) + " resyncs (" +
+                   String(packetsLost) + " packets lost), " +
+                   String(fifoStats.resets) + " resets");
+  i2c_stats_s i2cStats;
+  imu.getI2CStats(&i2cStats);
+  LOG_PORT.println("I2C: " + String(imu.getI2CClock() / 1000) + " kHz, " +
+                   String(i2cStats.transfers) + " transfers, " +
+                   String(i2cStats.retries) + " retries, " +
+                   String(i2cStats.failures) + " failed, " +
+                   String(i2cStats.recoveries) + " bus recoveries (" +
+                   String(i2cStats.addr_nacks) + " address NACKs, " +
+                   String(i2cStats.data_nacks) + " data NACKs, " +
+                   String(i2cStats.short_reads) + " short reads, " +
+                   String(i2cStats.bus_errors) + " bus errors)");
+  mpu_shadow_stats_s shadowStats;
+  imu.getShadowStats(&shadowStats);
+  LOG_PORT.println("Register shadow: " + String(shadowStats.reads_saved) +
+                   " reads and " + String(shadowStats.writes_saved) +
+                   " writes saved, " + String(shadowStats.writes_merged) +
+                   " writes merged");
+  mpu_boot_stats_s bootStats;
+  imu.getBootStats(&bootStats);
+  LOG_PORT.println("Boot: MPU init " + String(bootStats.init_ms) + " ms, DMP " +
+                   (bootStats.resident ? String("resident") :
+                    "load " + String(bootStats.load_ms) + " ms + verify " +
+                    String(bootStats.verify_ms) + " ms") +
+                   ", first sample at " + String(firstSampleMs) + " ms");
+#ifdef ENABLE_NVRAM_STORAGE
+  LOG_PORT.println("Gyro bias: " + String(savedBiases.gyro[0] / 65536.0, 3) +
+                   ", " + String(savedBiases.gyro[1] / 65536.0, 3) + ", " +
+                   String(savedBiases.gyro[2] / 65536.0, 3) + " dps, " +
+                   (biasesRestored ? "restored at boot, " : "") +
+                   String(savedBiases.saves) + " saves");
+#endif
+  if ( ENABLE_MAG_CALIBRATION )
+    printMagCalibration();
+  if ( captureMode )
+  {
+    capture_stats_s stats;
+    imu.getCaptureStats(&stats);
+    LOG_PORT.println("Raw capture: " + String(stats.samples) + " samples, " +
+                     String(stats.rate) + " of " + String(stats.nominal) +
+                     " Hz, " + String(stats.lost) + " lost in " +
+                     String(stats.overflows) + " overflows");
+  }
+}
+
+// The magnetometer correction in use, and how the last fit went
+void printMagCalibration(void)
+{
+  short offset[3], matrix[9];
+  mag_cal_fit_s fit;
+  imu.getMagCalibration(offset, matrix);
+  int status = imu.getMagCalFit(&fit);
+  LOG_PORT.println("Mag offset: " + String(offset[0]) + ", " +
+                   String(offset[1]) + ", " + String(offset[2]) +
+                   " counts, scale " + String(matrix[0] / 16384.0, 3) +
+                   ", " + String(matrix[4] / 16384.0, 3) + ", " +
+                   String(matrix[8] / 16384.0, 3) +
+#ifdef ENABLE_NVRAM_STORAGE
+                   (magCalRestored ? ", restored at boot, " : ", ") +
+                   String(savedMagCal.saves) + " saves" +
+#endif
+                   ", last fit " + String(status) + " (" +
+                   String(fit.error * 100.0, 1) + "% error, " +
+                   String(fit.spread, 2) + " spread)");
+}
+
 void initHardware(void)
 {
   // Set up LED pin (active-high, default to off)
@@ -293,6 +1045,8 @@ void initHardware(void)
 
 bool initIMU(void)
 {
+  // Keep the DMP image if it's still loaded from before an MCU reset
+  imu.setFastBoot(IMU_FAST_BOOT);
   // imu.begin() should return 0 on success. Will initialize
   // I2C bus, and reset MPU-9250 to defaults.
   if (imu.begin() != INV_SUCCESS)
@@ -313,95 +1067,210 @@ bool initIMU(void)
   // Set gyro/accel sample rate: must be between 4-1000Hz
   // (note: this value will be overridden by the DMP sample rate)
   imu.setSampleRate(IMU_AG_SAMPLE_RATE); 
+  // Let the compass measure continuously, or trigger each measurement
+  imu.setCompassMode(IMU_COMPASS_MODE);
   // Set compass sample rate: between 4-100Hz
   imu.setCompassSampleRate(IMU_COMPASS_SAMPLE_RATE); 
 
   // Configure digital motion processor. Use the FIFO to get
-  // data from the DMP.
-  unsigned short dmpFeatureMask = 0;
-  if (ENABLE_GYRO_CALIBRATION)
-  {
-    // Gyro calibration re-calibrates the gyro after a set amount
-    // of no motion detected
-    dmpFeatureMask |= DMP_FEATURE_GYRO_CAL;
-    dmpFeatureMask |= DMP_FEATURE_SEND_CAL_GYRO;
-  }
-  else
-  {
-    // Otherwise add raw gyro readings to the DMP
-    dmpFeatureMask |= DMP_FEATURE_SEND_RAW_GYRO;
-  }
-  // Add accel and quaternion's to the DMP
-  dmpFeatureMask |= DMP_FEATURE_SEND_RAW_ACCEL;
-  dmpFeatureMask |= DMP_FEATURE_6X_LP_QUAT;
+  // data from the DMP, with only what the log channels need.
+  dmpFeatureMask = dmpFeatures();
 
   // Initialize the DMP, and set the FIFO's update rate:
   imu.dmpBegin(dmpFeatureMask, fifoRate);
+  // Recover from FIFO overflows without a reset, if configured
+  imu.setFifoRecovery(IMU_FIFO_RECOVERY);
+  // Read the compass through the FIFO, if it's logged and that's cheaper
+  if ( useCompassFifo() )
+    imu.dmpEnableCompassFifo();
+  setFusionRate();
+  // Run the bus as fast as it reliably goes (at the standard clock if
+  // nothing faster passes)
+  imu.tuneI2CClock(IMU_I2C_CLOCK_MAX);
+  i2cClock = imu.getI2CClock();
+
+#ifdef ENABLE_NVRAM_STORAGE
+  // Correct the quaternion from the first sample, instead of waiting for
+  // gyro calibration to see the IMU still
+  if ( ENABLE_BIAS_STORAGE )
+    restoreBiases();
+  // And the compass, instead of waiting to learn its calibration again
+  if ( ENABLE_MAG_CALIBRATION && (savedMagCal.magic == MAG_CAL_MAGIC) )
+  {
+    imu.setMagCalibration(savedMagCal.offset, savedMagCal.matrix);
+    magCalRestored = true;
+  }
+#endif
 
   return true; // Return success
 }
 
-bool initSD(void)
+#ifdef ENABLE_NVRAM_STORAGE
+// Push the saved biases to the DMP. A DMP image that stayed loaded through
+// the reset (IMU_FAST_BOOT) kept its own gyro biases, which are newer.
+void restoreBiases(void)
 {
-  // SD.begin should return true if a valid SD card is present
-  if ( !SD.begin(SD_CHIP_SELECT_PIN) )
+  if ( savedBiases.magic != IMU_BIAS_MAGIC )
+    return;
+  mpu_boot_stats_s bootStats;
+  imu.getBootStats(&bootStats);
+  if ( !bootStats.resident )
+    imu.dmpSetGyroBias(savedBiases.gyro);
+  // The DMP keeps these scaled to the accel FSR, which may have changed
+  imu.dmpSetAccelBias(savedBiases.accel);
+  biasesRestored = true;
+}
+
+// Every IMU_BIAS_CHECK_INTERVAL, read the biases back from the DMP, and
+// save them if they've moved enough. Saves are spaced and capped to spare
+// the flash, and each one stalls the CPU for a row erase and write (a few
+// ms, which the FIFO rides out).
+void updateBiasStorage(void)
+{
+  if ( millis() - lastBiasCheck < IMU_BIAS_CHECK_INTERVAL )
+    return;
+  lastBiasCheck = millis();
+  if ( savedBiases.saves >= IMU_BIAS_SAVE_LIMIT )
+    return;
+  if ( lastBiasSave && (millis() - lastBiasSave < IMU_BIAS_SAVE_INTERVAL) )
+    return;
+
+  long gyro[3], accel[3];
+  imuBusBusy = true;
+  bool read = (imu.dmpGetGyroBias(gyro) == INV_SUCCESS) &&
+              (imu.dmpGetAccelBias(accel) == INV_SUCCESS);
+  imuBusBusy = false;
+  if ( !read )
+    return;
+
+  bool moved = false;
+  for (int i = 0; i < 3; i++)
   {
-    return false;
+    if ( (abs(gyro[i] - savedBiases.gyro[i]) >
+          (long)(IMU_GYRO_BIAS_SAVE_DELTA * 65536)) ||
+         (abs(accel[i] - savedBiases.accel[i]) >
+          (long)(IMU_ACCEL_BIAS_SAVE_DELTA * 65536)) )
+      moved = true;
   }
+  if ( !moved )
+    return;
 
-  return true;
+  memcpy(savedBiases.gyro, gyro, sizeof(gyro));
+  memcpy(savedBiases.accel, accel, sizeof(accel));
+  savedBiases.magic = IMU_BIAS_MAGIC;
+  savedBiases.saves++;
+  flashImuBiases.write(savedBiases);
+  lastBiasSave = millis();
 }
 
-// Log a string to the SD card
-bool sdLogString(String toLog)
+// Save the magnetometer calibration once it's changed, spaced and capped
+// like the biases. It only changes while updateMagCalibration() is still
+// refining it, so once it's learned, it's rarely saved again.
+void updateMagCalStorage(void)
 {
-  // Open the current file name:
-  File logFile = SD.open(logFileName, FILE_WRITE);
-  
-  // If the file will get too big with this new string, create
-  // a new one, and open it.
-  if (logFile.size() > (SD_MAX_FILE_SIZE - toLog.length()))
+  if ( !magCalChanged || (savedMagCal.saves >= MAG_CAL_SAVE_LIMIT) )
+    return;
+  if ( lastMagCalSave && (millis() - lastMagCalSave < MAG_CAL_SAVE_INTERVAL) )
+    return;
+  if ( imu.getMagCalibration(savedMagCal.offset, savedMagCal.matrix) !=
+       INV_SUCCESS )
+    return;
+  savedMagCal.magic = MAG_CAL_MAGIC;
+  savedMagCal.saves++;
+  flashMagCal.write(savedMagCal);
+  lastMagCalSave = millis();
+  magCalChanged = false;
+}
+#endif
+
+// The smallest set of DMP features that covers the enabled log channels.
+// Each one sent to the FIFO makes every packet bigger (accel and gyro by 6
+// bytes, the quaternion by 16), and every packet is read over I2C.
+unsigned short dmpFeatures(void)
+{
+  unsigned short mask = 0;
+  if (ENABLE_GYRO_CALIBRATION)
   {
-    logFileName = nextLogFile();
-    logFile = SD.open(logFileName, FILE_WRITE);
+    // Gyro calibration re-calibrates the gyro after a set amount
+    // of no motion detected. It costs nothing in the FIFO, and also
+    // corrects the quaternion.
+    mask |= DMP_FEATURE_GYRO_CAL;
   }
-
-  // If the log file opened properly, add the string to it.
-  if (logFile)
+  if (enableAccel)
+    mask |= DMP_FEATURE_SEND_RAW_ACCEL;
+  if (enableGyro)
   {
-    logFile.print(toLog);
-    logFile.close();
-
-    return true; // Return success
+    // Calibrated gyro readings if calibration is on, raw otherwise
+    mask |= ENABLE_GYRO_CALIBRATION ? DMP_FEATURE_SEND_CAL_GYRO :
+                                      DMP_FEATURE_SEND_RAW_GYRO;
   }
+  // Euler angles are computed from the quaternion. Something has to be
+  // sent to pace acquisition even if only the compass is logged, and the
+  // quaternion is also how the driver spots a misaligned FIFO, so it's
+  // only left out when accel or gyro data is there without it.
+  if (enableQuat || enableEuler || fuseHeading() ||
+      !(enableAccel || enableGyro))
+    mask |= DMP_FEATURE_6X_LP_QUAT;
+  return mask;
+}
 
-  return false; // Return fail
+// The heading is logged from the fused quaternion (see ENABLE_MAG_FUSION)
+bool fuseHeading(void)
+{
+  return ENABLE_MAG_FUSION && enableHeading;
+}
+
+// The fusion's gains are per compass reading. There's a new one every
+// compass sample, or every packet if those come slower.
+void setFusionRate(void)
+{
+  unsigned short rate = imu.dmpGetFifoRate();
+  if (rate > IMU_COMPASS_SAMPLE_RATE)
+    rate = IMU_COMPASS_SAMPLE_RATE;
+  imu.setFusionGains(MAG_FUSION_KP, MAG_FUSION_KI, rate);
 }
 
-// Find the next available log file. Or return a null string
-// if we've reached the maximum file limit.
-String nextLogFile(void)
+// Read the compass with the DMP's packets if it's logged, at high enough
+// log rates (see COMPASS_FIFO_MIN_RATE)
+bool useCompassFifo(void)
 {
-  String filename;
-  int logIndex = 0;
+  return (enableCompass || enableHeading) &&
+         (imu.dmpGetFifoRate() >= COMPASS_FIFO_MIN_RATE);
+}
 
-  for (int i = 0; i < LOG_FILE_INDEX_MAX; i++)
+// Reprogram the DMP if the log channels now need different features, and
+// read the compass through the FIFO only while it's worth it. Either resets
+// the FIFO, so the packet clock starts over too.
+void updateDmpFeatures(void)
+{
+  bool reset = false;
+  unsigned short mask = dmpFeatures();
+  if ( (mask != dmpFeatureMask) &&
+       (imu.dmpEnableFeatures(mask) == INV_SUCCESS) )
   {
-    // Construct a file with PREFIX[Index].SUFFIX
-    filename = String(LOG_FILE_PREFIX);
-    filename += String(logIndex);
-    filename += ".";
-    filename += String(LOG_FILE_SUFFIX);
-    // If the file name doesn't exist, return it
-    if (!SD.exists(filename))
-    {
-      return filename;
-    }
-    // Otherwise increment the index, and try again
-    logIndex++;
+    dmpFeatureMask = mask;
+    reset = true;
+  }
+  // A log rate change may have turned it off, or made it worth it again
+  bool compassFifo = useCompassFifo();
+  if ( (compassFifo != imu.dmpCompassFifoEnabled()) &&
+       (imu.dmpEnableCompassFifo(compassFifo) == INV_SUCCESS) )
+    reset = true;
+  if (reset)
+    sampleClock.setRate(imu.dmpGetFifoRate());
+  // The log rate may have changed
+  setFusionRate();
+}
+
+bool initSD(void)
+{
+  // SD.begin should return true if a valid SD card is present
+  if ( !SD.begin(SD_CHIP_SELECT_PIN) )
+  {
+    return false;
   }
 
-  return "";
+  return true;
 }
 
 // Parse serial input, take action if it's a valid character
@@ -460,11 +1329,15 @@ void parseSerialInput(char c)
     break;
   case ENABLE_HEADING: // Enable/disable heading output
     enableHeading = !enableHeading;
+    // The fusion was left behind while the heading wasn't logged
+    imu.resetFusion();
 #ifdef ENABLE_NVRAM_STORAGE
     flashEnableHeading.write(enableHeading);
 #endif
     break;
   case SET_LOG_RATE: // Increment the log rate from 1-100Hz (10Hz increments)
+    if ( captureMode )
+      break; // The capture runs at CAPTURE_RATE
     temp = imu.dmpGetFifoRate(); // Get current FIFO rate
     if (temp == 1) // If it's 1Hz, set it to 10Hz
       temp = 10;
@@ -474,6 +1347,7 @@ void parseSerialInput(char c)
       temp = 1;
     imu.dmpSetFifoRate(temp); // Send the new rate
     temp = imu.dmpGetFifoRate(); // Read the updated rate
+    sampleClock.setRate(temp); // Packets are now spaced differently
 #ifdef ENABLE_NVRAM_STORAGE
     flashLogRate.write(temp); // Store it in NVM and print new rate
 #endif
@@ -489,6 +1363,9 @@ void parseSerialInput(char c)
     temp = imu.getAccelFSR(); // Read it to make sure
 #ifdef ENABLE_NVRAM_STORAGE
     flashAccelFSR.write(temp); // Update the NVM value, and print
+    // The DMP's accel biases are scaled to the FSR
+    if ( ENABLE_BIAS_STORAGE && (savedBiases.magic == IMU_BIAS_MAGIC) )
+      imu.dmpSetAccelBias(savedBiases.accel);
 #endif
     LOG_PORT.println("Accel FSR set to +/-" + String(temp) + " g");
     break;
@@ -507,13 +1384,57 @@ void parseSerialInput(char c)
     break;
   case ENABLE_SD_LOGGING: // Enable/disable SD card logging
     enableSDLogging = !enableSDLogging;
+    // Get everything logged so far onto the card
+    if ( sdCardPresent && !enableSDLogging )
+      sdLog.flush();
 #ifdef ENABLE_NVRAM_STORAGE
     flashEnableSDLogging.write(enableSDLogging);
 #endif
     break;
+  case PRINT_STATS: // Print acquisition statistics
+    printStats();
+    break;
+  case RESET_MAG_CAL: // Forget the magnetometer calibration
+    imuBusBusy = true;
+    imu.resetMagCalibration();
+    imuBusBusy = false;
+    magCalChanged = false;
+#ifdef ENABLE_NVRAM_STORAGE
+    if ( savedMagCal.magic == MAG_CAL_MAGIC )
+    {
+      savedMagCal.magic = 0;
+      flashMagCal.write(savedMagCal);
+    }
+    magCalRestored = false;
+#endif
+    LOG_PORT.println("Magnetometer calibration reset");
+    break;
+  case ENABLE_BINARY: // Switch between text and binary logging
+    enableBinaryLog = !enableBinaryLog;
+    // Don't mix formats in one file. Binary files start with a header.
+    // A capture keeps its file, and the next one is opened after it.
+    if ( sdCardPresent && !captureMode )
+    {
+      sdLog.setFileHeader(enableBinaryLog ? logHeader : NULL,
+                          sizeof(logHeader));
+      sdLog.nextFile(enableBinaryLog ? LOG_FILE_SUFFIX_BINARY :
+                                       LOG_FILE_SUFFIX);
+    }
+    lastSerialHeader = millis() - SERIAL_HEADER_INTERVAL; // Send it next
+    break;
+  case TOGGLE_CAPTURE: // Start/stop the raw capture
+    setCaptureMode(!captureMode);
+    break;
   default: // If an invalid character, do nothing
     break;
   }
+
+  // Only read what the (possibly changed) log channels need. The DMP is
+  // stopped while capturing: it's set up when the capture ends.
+  if ( !captureMode )
+    updateDmpFeatures();
+  // If a setting changed, tell binary log readers about it
+  updateLogHeader(true);
 }
 
 #ifdef ENABLE_NVRAM_STORAGE
@@ -613,13 +1534,11 @@ void production_testing(void)
 // Note, this requires that the 9dof wake up and start logging to a new file (even just for a microsecond)
 bool uSD_ping(void)
 {
-//  Serial1.print("nextLogFile: ");
-//  Serial1.print( nextLogFile() );
-
 //  Serial1.print("logFileName: ");
-//  Serial1.print( String(logFileName) );
+//  Serial1.print( sdLog.fileName() );
 
-  bool remove_log_file_result = SD.remove(logFileName);
+  sdLog.close(); // The log file can't be removed while it's open
+  bool remove_log_file_result = SD.remove(sdLog.fileName());
 //  Serial1.print("r: ");
 //  Serial1.print( remove_log_file_result , BIN);
 
@@ -0,0 +1,274 @@
+/******************************************************************************
+binary_log.cpp
+Compact binary log format
+
+See binary_log.h for the format.
+******************************************************************************/
+#include <string.h>
+#include "binary_log.h"
+
+static const uint8_t binLogMagic[4] = {'R', 'Z', 'B', 'L'};
+
+// CRC-16/CCITT-FALSE, four bits at a time. A 16-entry table keeps this
+// fast without the 512 bytes of flash a byte-wide table would need.
+static const uint16_t crcNibble[16] = {
+  0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+  0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF
+};
+
+uint16_t binLogCrc(const uint8_t * data, unsigned int length)
+{
+  uint16_t crc = 0xFFFF;
+  while (length--)
+  {
+    crc = (crc << 4) ^ crcNibble[(crc >> 12) ^ (*data >> 4)];
+    crc = (crc << 4) ^ crcNibble[(crc >> 12) ^ (*data & 0x0F)];
+    data++;
+  }
+  return crc;
+}
+
+static uint8_t * put16(uint8_t * p, uint16_t v)
+{
+  p[0] = v & 0xFF;
+  p[1] = v >> 8;
+  return p + 2;
+}
+
+static uint8_t * put32(uint8_t * p, uint32_t v)
+{
+  p[0] = v & 0xFF;
+  p[1] = (v >> 8) & 0xFF;
+  p[2] = (v >> 16) & 0xFF;
+  p[3] = v >> 24;
+  return p + 4;
+}
+
+static uint8_t * putFloat(uint8_t * p, float v)
+{
+  uint32_t bits;
+  memcpy(&bits, &v, sizeof(bits));
+  return put32(p, bits);
+}
+
+static uint16_t get16(const uint8_t * p)
+{
+  return p[0] | ((uint16_t)p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t * p)
+{
+  return p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) |
+         ((uint32_t)p[3] << 24);
+}
+
+static float getFloat(const uint8_t * p)
+{
+  uint32_t bits = get32(p);
+  float v;
+  memcpy(&v, &bits, sizeof(v));
+  return v;
+}
+
+unsigned int binLogHeader(const binLogConfig & config, uint8_t * out)
+{
+  uint8_t * p = out;
+  memcpy(p, binLogMagic, sizeof(binLogMagic));
+  p += sizeof(binLogMagic);
+  *p++ = BINLOG_VERSION;
+  *p++ = BINLOG_HEADER_SIZE;
+  p = put16(p, config.channels);
+  p = put16(p, config.sampleRate);
+  p = put16(p, config.accelFSR);
+  p = put16(p, config.gyroFSR);
+  p = put16(p, config.magFSR);
+  p = putFloat(p, config.accelSens);
+  p = putFloat(p, config.gyroSens);
+  p = putFloat(p, config.magSens);
+  p = put16(p, binLogRecordLength(config.channels));
+  p = put16(p, config.i2cClock);
+  p = put16(p, binLogCrc(out, p - out));
+  return p - out;
+}
+
+unsigned int binLogParseHeader(const uint8_t * data, unsigned int available,
+                               binLogConfig & config)
+{
+  if ((available < 6) ||
+      (memcmp(data, binLogMagic, sizeof(binLogMagic)) != 0))
+    return 0;
+  unsigned int length = (data[4] < 4) ? BINLOG_HEADER_SIZE_V3 :
+                                        BINLOG_HEADER_SIZE;
+  if ((data[4] < BINLOG_MIN_VERSION) || (data[4] > BINLOG_VERSION) ||
+      (data[5] != length) || (available < length))
+    return 0;
+  if (get16(data + length - 2) != binLogCrc(data, length - 2))
+    return 0;
+
+  config.channels = get16(data + 6);
+  config.sampleRate = get16(data + 8);
+  config.accelFSR = get16(data + 10);
+  config.gyroFSR = get16(data + 12);
+  config.magFSR = get16(data + 14);
+  config.accelSens = getFloat(data + 16);
+  config.gyroSens = getFloat(data + 20);
+  config.magSens = getFloat(data + 24);
+  config.i2cClock = (length > BINLOG_HEADER_SIZE_V3) ? get16(data + 30) : 0;
+  if (get16(data + 28) != binLogRecordLength(config.channels))
+    return 0;
+  return length;
+}
+
+unsigned int binLogRecordLength(uint16_t channels)
+{
+  unsigned int length = 1 + 2 + 2; // Sync, sequence, and CRC
+  if (channels & BINLOG_CH_CAPTURE)
+    return length + 4 + 1 + 1; // Sample number, sensors and count
+  if (channels & BINLOG_CH_TIME)
+    length += 6;
+  if (channels & BINLOG_CH_ACCEL)
+    length += 6;
+  if (channels & BINLOG_CH_GYRO)
+    length += 6;
+  if (channels & BINLOG_CH_MAG)
+    length += 6;
+  if (channels & BINLOG_CH_QUAT)
+    length += 16;
+  return length;
+}
+
+unsigned int binLogRecord(uint16_t channels, uint16_t sequence,
+                          const imuSample & sample, uint8_t * out)
+{
+  uint8_t * p = out;
+  *p++ = BINLOG_SYNC;
+  p = put16(p, sequence);
+  if (channels & BINLOG_CH_TIME)
+  {
+    p = put32(p, sample.time);
+    p = put16(p, sample.timeUs);
+  }
+  if (channels & BINLOG_CH_ACCEL)
+  {
+    for (int i = 0; i < 3; i++)
+      p = put16(p, sample.accel[i]);
+  }
+  if (channels & BINLOG_CH_GYRO)
+  {
+    for (int i = 0; i < 3; i++)
+      p = put16(p, sample.gyro[i]);
+  }
+  if (channels & BINLOG_CH_MAG)
+  {
+    for (int i = 0; i < 3; i++)
+      p = put16(p, sample.mag[i]);
+  }
+  if (channels & BINLOG_CH_QUAT)
+  {
+    for (int i = 0; i < 4; i++)
+      p = put32(p, sample.quat[i]);
+  }
+  p = put16(p, binLogCrc(out, p - out));
+  return p - out;
+}
+
+bool binLogParseRecord(const uint8_t * data, uint16_t channels,
+                       uint16_t & sequence, imuSample & sample)
+{
+  unsigned int length = binLogRecordLength(channels);
+  if (data[0] != BINLOG_SYNC)
+    return false;
+  if (get16(data + length - 2) != binLogCrc(data, length - 2))
+    return false;
+
+  memset(&sample, 0, sizeof(sample));
+  sequence = get16(data + 1);
+  const uint8_t * p = data + 3;
+  if (channels & BINLOG_CH_TIME)
+  {
+    sample.time = get32(p);
+    sample.timeUs = get16(p + 4);
+    p += 6;
+  }
+  if (channels & BINLOG_CH_ACCEL)
+  {
+    for (int i = 0; i < 3; i++, p += 2)
+      sample.accel[i] = (int16_t)get16(p);
+  }
+  if (channels & BINLOG_CH_GYRO)
+  {
+    for (int i = 0; i < 3; i++, p += 2)
+      sample.gyro[i] = (int16_t)get16(p);
+  }
+  if (channels & BINLOG_CH_MAG)
+  {
+    for (int i = 0; i < 3; i++, p += 2)
+      sample.mag[i] = (int16_t)get16(p);
+  }
+  if (channels & BINLOG_CH_QUAT)
+  {
+    for (int i = 0; i < 4; i++, p += 4)
+      sample.quat[i] = (int32_t)get32(p);
+  }
+  return true;
+}
+
+unsigned int binLogCaptureValues(uint8_t sensors)
+{
+  unsigned int values = 0;
+  if (sensors & BINLOG_CAPTURE_ACCEL)
+    values += 3;
+  if (sensors & BINLOG_CAPTURE_GYRO_X)
+    values++;
+  if (sensors & BINLOG_CAPTURE_GYRO_Y)
+    values++;
+  if (sensors & BINLOG_CAPTURE_GYRO_Z)
+    values++;
+  return values;
+}
+
+unsigned int binLogCaptureRecord(uint16_t sequence, uint32_t first,
+                                 uint8_t sensors, const int16_t * values,
+                                 uint8_t count, uint8_t * out)
+{
+  unsigned int n = count * binLogCaptureValues(sensors);
+  if (n > BINLOG_CAPTURE_MAX_VALUES)
+    return 0;
+  uint8_t * p = out;
+  *p++ = BINLOG_CAPTURE_SYNC;
+  p = put16(p, sequence);
+  p = put32(p, first);
+  *p++ = sensors & BINLOG_CAPTURE_SENSORS;
+  *p++ = count;
+  for (unsigned int i = 0; i < n; i++)
+    p = put16(p, values[i]);
+  p = put16(p, binLogCrc(out, p - out));
+  return p - out;
+}
+
+unsigned int binLogParseCaptureRecord(const uint8_t * data,
+                                      unsigned int available,
+                                      uint16_t & sequence, uint32_t & first,
+                                      uint8_t & sensors, uint8_t & count,
+                                      int16_t * values)
+{
+  const unsigned int fixed = binLogRecordLength(BINLOG_CH_CAPTURE);
+  if ((available < fixed) || (data[0] != BINLOG_CAPTURE_SYNC))
+    return 0;
+  unsigned int n = data[8] * binLogCaptureValues(data[7]);
+  unsigned int length = fixed + 2 * n;
+  if ((data[7] & ~BINLOG_CAPTURE_SENSORS) || !n ||
+      (n > BINLOG_CAPTURE_MAX_VALUES) || (available < length))
+    return 0;
+  if (get16(data + length - 2) != binLogCrc(data, length - 2))
+    return 0;
+
+  sequence = get16(data + 1);
+  first = get32(data + 3);
+  sensors = data[7];
+  count = data[8];
+  const uint8_t * p = data + 9;
+  for (unsigned int i = 0; i < n; i++, p += 2)
+    values[i] = (int16_t)get16(p);
+  return length;
+}
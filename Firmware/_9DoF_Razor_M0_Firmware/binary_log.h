@@ -0,0 +1,167 @@
+/******************************************************************************
+binary_log.h
+Compact binary log format
+
+A binary log (SD file or serial stream) is a header followed by records.
+A new header is sent whenever the logged channels or sensor settings
+change, and at the start of every file. All values are little-endian.
+
+Header (BINLOG_HEADER_SIZE bytes):
+  0   'R' 'Z' 'B' 'L'   Magic
+  4   uint8   Format version (BINLOG_VERSION)
+  5   uint8   Header length in bytes
+  6   uint16  Channel mask (BINLOG_CH_*)
+  8   uint16  Sample rate (Hz)
+  10  uint16  Accel full-scale range (g)
+  12  uint16  Gyro full-scale range (dps)
+  14  uint16  Mag full-scale range (uT)
+  16  float   Accel sensitivity (LSB/g), from getAccelSens()
+  20  float   Gyro sensitivity (LSB/dps), from getGyroSens()
+  24  float   Mag sensitivity (uT/LSB), from getMagSens()
+  28  uint16  Record length in bytes, including sync and CRC (for
+              capture records, without their samples)
+  30  uint16  I2C clock (kHz), 0 if unknown
+  32  uint16  CRC-16 of bytes 0-31
+
+Version 2 and 3 headers are 30 bytes and their CRC: they have no I2C
+clock.
+
+Record (binLogRecordLength() bytes):
+  uint8   BINLOG_SYNC
+  uint16  Sequence number, incremented for every record (wraps)
+  Then, for each enabled channel, in this order:
+    uint32     Sample time (ms)              BINLOG_CH_TIME
+    uint16       and microseconds past it (0-999)
+    int16[3]   Accel x, y, z (raw)           BINLOG_CH_ACCEL
+    int16[3]   Gyro x, y, z (raw)            BINLOG_CH_GYRO
+    int16[3]   Mag x, y, z (raw)             BINLOG_CH_MAG
+    int32[4]   Quaternion w, x, y, z (Q30)   BINLOG_CH_QUAT
+  uint16  CRC-16 of everything before it in the record
+
+Capture records (raw capture mode, BINLOG_CH_CAPTURE in the channel mask,
+no other channels) carry a block of raw FIFO samples each, at the header's
+sample rate:
+  uint8   BINLOG_CAPTURE_SYNC
+  uint16  Sequence number, as above
+  uint32  Number of the first sample since the capture started. A gap
+          from the last record's means samples were lost to an overflow.
+  uint8   Sensors in each sample (BINLOG_CAPTURE_*)
+  uint8   Number of samples, n
+  int16   n samples of: accel x, y, z, then gyro x, y, z (raw), of the
+          sensors present (binLogCaptureValues() values per sample)
+  uint16  CRC-16 of everything before it in the record
+
+CRC-16 is CRC-16/CCITT-FALSE (polynomial 0x1021, initial value 0xFFFF).
+A gap in sequence numbers means records were dropped; a bad CRC means a
+record was torn or corrupted, and a reader should resync on the next
+BINLOG_SYNC byte or header magic.
+
+This file and binary_log.cpp don't depend on Arduino, so host tools can
+use them to read logs.
+******************************************************************************/
+#ifndef _BINARY_LOG_H_
+#define _BINARY_LOG_H_
+
+#include <stdint.h>
+#include "sample_ring.h"
+
+#define BINLOG_VERSION 4
+#define BINLOG_MIN_VERSION 2 // Oldest version read: 3 added capture records,
+                             // 4 the I2C clock
+#define BINLOG_SYNC 0xA5
+#define BINLOG_CAPTURE_SYNC 0x5A
+#define BINLOG_HEADER_SIZE 34
+#define BINLOG_HEADER_SIZE_V3 32 // Versions 2 and 3
+
+// Channel mask bits
+#define BINLOG_CH_TIME  0x01
+#define BINLOG_CH_ACCEL 0x02
+#define BINLOG_CH_GYRO  0x04
+#define BINLOG_CH_MAG   0x08
+#define BINLOG_CH_QUAT  0x10
+#define BINLOG_CH_CAPTURE 0x20
+
+// Capture record sensor bits (the MPU-9250 driver's FIFO sensor bits)
+#define BINLOG_CAPTURE_ACCEL  0x08
+#define BINLOG_CAPTURE_GYRO_X 0x40
+#define BINLOG_CAPTURE_GYRO_Y 0x20
+#define BINLOG_CAPTURE_GYRO_Z 0x10
+#define BINLOG_CAPTURE_SENSORS 0x78
+// Most values (samples * values per sample) in one capture record, and
+// its length: sync, sequence, sample number, sensors, count, values, CRC
+#define BINLOG_CAPTURE_MAX_VALUES 240
+#define BINLOG_CAPTURE_RECORD_MAX (1 + 2 + 4 + 1 + 1 + \
+                                   2 * BINLOG_CAPTURE_MAX_VALUES + 2)
+
+// Longest record: sync, sequence, all channels, and CRC
+#define BINLOG_RECORD_MAX (1 + 2 + 6 + 6 + 6 + 6 + 16 + 2)
+
+// Everything a reader needs to interpret the records that follow
+struct binLogConfig
+{
+  uint16_t channels; // BINLOG_CH_* mask
+  uint16_t sampleRate; // Hz
+  uint16_t accelFSR; // g
+  uint16_t gyroFSR; // dps
+  uint16_t magFSR; // uT
+  float accelSens; // LSB/g
+  float gyroSens; // LSB/dps
+  float magSens; // uT/LSB
+  uint16_t i2cClock; // kHz, 0 if unknown
+};
+
+// binLogCrc -- CRC-16/CCITT-FALSE of length bytes
+uint16_t binLogCrc(const uint8_t * data, unsigned int length);
+
+// binLogHeader -- Build a header for config
+// Output: Number of bytes written to out (BINLOG_HEADER_SIZE)
+unsigned int binLogHeader(const binLogConfig & config, uint8_t * out);
+
+// binLogParseHeader -- Check and decode a header, of this version or an
+// older one
+// Input: available bytes of data
+// Output: Length of the header, which is copied to config, or 0 if data
+//         doesn't start with a valid one
+unsigned int binLogParseHeader(const uint8_t * data, unsigned int available,
+                               binLogConfig & config);
+
+// binLogRecordLength -- Size of a record with the given channels
+unsigned int binLogRecordLength(uint16_t channels);
+
+// binLogRecord -- Build a record holding the enabled channels of sample
+// Output: Number of bytes written to out (at most BINLOG_RECORD_MAX)
+unsigned int binLogRecord(uint16_t channels, uint16_t sequence,
+                          const imuSample & sample, uint8_t * out);
+
+// binLogParseRecord -- Check and decode a record
+// Input: At least binLogRecordLength(channels) bytes
+// Output: true if data holds a valid record, which is copied to sequence
+//         and sample (disabled channels are zeroed)
+bool binLogParseRecord(const uint8_t * data, uint16_t channels,
+                       uint16_t & sequence, imuSample & sample);
+
+// binLogCaptureValues -- Values per sample for BINLOG_CAPTURE_* sensors
+unsigned int binLogCaptureValues(uint8_t sensors);
+
+// binLogCaptureRecord -- Build a capture record of count samples (at most
+// BINLOG_CAPTURE_MAX_VALUES values in all) of the given sensors
+// Input: Sequence number, number of the first sample, sensors, and the
+//        samples' values
+// Output: Number of bytes written to out (at most
+//         BINLOG_CAPTURE_RECORD_MAX), 0 if there are too many values
+unsigned int binLogCaptureRecord(uint16_t sequence, uint32_t first,
+                                 uint8_t sensors, const int16_t * values,
+                                 uint8_t count, uint8_t * out);
+
+// binLogParseCaptureRecord -- Check and decode a capture record
+// Input: available bytes of data
+// Output: Length of the record, with its fields copied to sequence, first,
+//         sensors, count and values (at least BINLOG_CAPTURE_MAX_VALUES),
+//         or 0 if data doesn't start with a valid one
+unsigned int binLogParseCaptureRecord(const uint8_t * data,
+                                      unsigned int available,
+                                      uint16_t & sequence, uint32_t & first,
+                                      uint8_t & sensors, uint8_t & count,
+                                      int16_t * values);
+
+#endif // _BINARY_LOG_H_
@@ -9,6 +9,13 @@
 #define ENABLE_QUAT_LOG       false
 #define ENABLE_EULER_LOG      false
 #define ENABLE_HEADING_LOG    false
+// Log the heading of the DMP's quaternion with its yaw corrected by the
+// compass (see util/mag_fusion.h), instead of the heading of the compass
+// alone, which is only right while the board is level.
+#define ENABLE_MAG_FUSION     true
+// Log compact binary records (see binary_log.h) instead of text. Binary logs
+// carry time, accel, gyro, mag and quaternion values only, as raw counts.
+#define ENABLE_BINARY_LOG     false
 
 ////////////////////////////////////////
 // Enable Non-Volatile Memory Storage //
@@ -24,6 +31,9 @@
 // or LOG_PORT SERIAL_PORT_HARDWARE (SerialUSB or Serial1)
 #define LOG_PORT SERIAL_PORT_USBVIRTUAL
 #define SERIAL_BAUD_RATE 115200 // Serial port baud
+// Resend the binary log header this often (ms), so a reader can pick up
+// the serial stream at any point
+#define SERIAL_HEADER_INTERVAL 1000
 
 ////////////////
 // LED Config //
@@ -38,11 +48,103 @@
 //  commands. These are just defaults on initial programming
 #define DMP_SAMPLE_RATE    100 // Logging/DMP sample rate(4-200 Hz)
 #define IMU_COMPASS_SAMPLE_RATE 100 // Compass sample rate (4-100 Hz)
+// COMPASS_MODE_CONTINUOUS has the magnetometer measure on its own at 100Hz
+// (8Hz for compass sample rates up to 8Hz), with one read per sample on the
+// MPU-9250's auxiliary bus. COMPASS_MODE_SINGLE triggers each measurement
+// with a write after every read, like the original firmware.
+#define IMU_COMPASS_MODE COMPASS_MODE_CONTINUOUS
 #define IMU_AG_SAMPLE_RATE 100 // Accel/gyro sample rate Must be between 4Hz and 1kHz
 #define IMU_GYRO_FSR       2000 // Gyro full-scale range (250, 500, 1000, or 2000)
 #define IMU_ACCEL_FSR      2 // Accel full-scale range (2, 4, 8, or 16)
 #define IMU_AG_LPF         5 // Accel/Gyro LPF corner frequency (5, 10, 20, 42, 98, or 188 Hz)
 #define ENABLE_GYRO_CALIBRATION true
+// Save the gyro biases the DMP's calibration learns to flash, and give
+// them back to the DMP at boot, so the quaternion doesn't drift until the
+// DMP has seen its next ~8s without motion. The accel biases pushed to the
+// DMP are kept too. Needs ENABLE_NVRAM_STORAGE.
+#define ENABLE_BIAS_STORAGE true
+#define IMU_BIAS_CHECK_INTERVAL 10000 // Read the biases from the DMP this often (ms)
+// Save them when one has moved by more than this (dps, or g for accel),
+// at most once per IMU_BIAS_SAVE_INTERVAL (ms), and at most IMU_BIAS_SAVE_LIMIT
+// times ever. Each save erases a flash row, good for at least 25,000.
+#define IMU_GYRO_BIAS_SAVE_DELTA 0.05
+#define IMU_ACCEL_BIAS_SAVE_DELTA 0.005
+#define IMU_BIAS_SAVE_INTERVAL 600000
+#define IMU_BIAS_SAVE_LIMIT 10000
+// Learn the magnetometer's hard- and soft-iron calibration from its
+// readings (turn the board every which way for a minute or so), and
+// correct every reading with it. With ENABLE_NVRAM_STORAGE, it's saved
+// when it changes, at most once per MAG_CAL_SAVE_INTERVAL (ms) and at most
+// MAG_CAL_SAVE_LIMIT times ever, and applied from boot.
+#define ENABLE_MAG_CALIBRATION true
+#define MAG_CAL_SAVE_INTERVAL 60000
+#define MAG_CAL_SAVE_LIMIT 10000
+// What to do when the FIFO overflows (e.g. during a long SD card stall).
+// FIFO_RECOVERY_RESYNC realigns to the next whole packet and keeps reading,
+// losing only the packets that were overwritten. FIFO_RECOVERY_RESET resets
+// the FIFO and DMP like the original firmware, losing everything in the
+// FIFO and ~50ms more.
+#define IMU_FIFO_RECOVERY FIFO_RECOVERY_RESYNC
+// Keep the DMP image loaded in the MPU-9250 across resets of the SAMD21
+// alone (watchdog, bootloader, or a brown-out the IMU rides out). Boot then
+// skips the chip reset and the image load, ~700ms to the first sample.
+// Bias registers and DMP settings initIMU() doesn't make are kept too.
+#define IMU_FAST_BOOT true
+// Fastest I2C clock to try at boot: initIMU() runs the bus at the fastest
+// of I2C_CLOCK_FAST_PLUS (1MHz), I2C_CLOCK_FAST (400kHz) and
+// I2C_CLOCK_STANDARD (100kHz), up to this, that passes a probe of
+// WHO_AM_I and FIFO reads (tuneI2CClock()), and logs it in the binary log
+// header. The MPU-9250 is rated to 400kHz; 1MHz is beyond its rating.
+#define IMU_I2C_CLOCK_MAX I2C_CLOCK_FAST
+// Have the MPU-9250 write the magnetometer data into the FIFO along with
+// the DMP's packets, at log rates of at least this much, so they're read
+// together instead of with a separate compass read. The compass data is
+// written with every 200Hz sample, so at lower rates each packet carries
+// more of it than the separate read costs (see Firmware/Host). Realigning
+// the FIFO after an overflow waits for the DMP's next packet while it's
+// used. Set it above 200 to always read the compass separately.
+#define COMPASS_FIFO_MIN_RATE 200
+
+/////////////////////////////////
+// Interrupt-Driven Acquisition //
+/////////////////////////////////
+// If defined, the MPU-9250's interrupt output is used to signal new
+// DMP data, and loop() only reads the FIFO once that interrupt has fired.
+// Comment out to poll the FIFO count over I2C on every loop.
+#define ENABLE_INTERRUPT_ACQUISITION
+// If defined (with ENABLE_INTERRUPT_ACQUISITION), the interrupt only
+// starts the FIFO reads, which run in the background (by DMA on the
+// SAMD21), while loop() gets on with logging the samples already read.
+// Left undefined until the DMA transfers have been validated on hardware.
+//#define ENABLE_ASYNC_ACQUISITION
+// If no interrupt has been seen for this long, read the FIFO anyway
+// (recovers from a missed edge, e.g. after a FIFO reset).
+#define INTERRUPT_TIMEOUT_MS 250
+// Number of slots in the ring of samples waiting to be logged. Must be a
+// power of two. Each slot is 40 bytes. The FIFO is drained from loop(),
+// between blocks of samples logged, so the ring only smooths out stalls
+// shorter than the FIFO holds: a single SD card write that blocks for
+// longer (with the default 32-byte packets, ~320ms at 100Hz, ~160ms at
+// 200Hz) still overflows the FIFO, whatever the ring's size, as does one
+// with ENABLE_ASYNC_ACQUISITION, whose reads also finish in loop().
+#define SAMPLE_RING_SIZE 64
+// Samples popped from the ring and converted to calculated units together,
+// one axis at a time. Each takes 94 bytes of RAM.
+#define LOG_BLOCK_SIZE 16
+
+////////////////////////
+// Raw Capture Config //
+////////////////////////
+// The capture mode (toggled with TOGGLE_CAPTURE) stops the DMP and logs
+// the raw accel and gyro samples from the FIFO, in binary capture records
+// (see binary_log.h), for vibration analysis and the like. Each value is
+// 2 bytes, and a 400kHz bus carries about 40kB/s: all six axes fit at
+// 1kHz, but at 8kHz (the DLPF bypassed) only gyro x and y, or gyro z alone
+// (see capture_bench in Firmware/Host). All six at 8kHz need a faster bus.
+// Capture doesn't start if CAPTURE_I2C_CLOCK can't carry the samples.
+#define CAPTURE_SENSORS (INV_XYZ_ACCEL | INV_XYZ_GYRO) // Any of INV_XYZ_ACCEL, INV_X_GYRO, INV_Y_GYRO, INV_Z_GYRO
+#define CAPTURE_RATE 1000 // 4-1000 Hz through the DLPF, or 8000 to bypass it
+#define CAPTURE_I2C_CLOCK 400000 // I2C clock while capturing (Hz)
 
 ///////////////////////
 // SD Logging Config //
@@ -51,8 +153,9 @@
 #define LOG_FILE_INDEX_MAX 999 // Max number of "logXXX.txt" files
 #define LOG_FILE_PREFIX "log"  // Prefix name for log files
 #define LOG_FILE_SUFFIX "txt"  // Suffix name for log files
+#define LOG_FILE_SUFFIX_BINARY "bin" // Suffix name for binary log files
 #define SD_MAX_FILE_SIZE 5000000 // 5MB max file size, increment to next file before surpassing
-#define SD_LOG_WRITE_BUFFER_SIZE 1024 // Experimentally tested to produce 100Hz logs
+#define SD_SYNC_INTERVAL_MS 1000 // Update the log file's size on the card this often (ms)
 
 /////////////////////
 // Serial Commands //
@@ -70,6 +173,10 @@
 #define SET_ACCEL_FSR     'A' // Set accelerometer FSR (2, 4, 8, 16g)
 #define SET_GYRO_FSR      'G' // Set gyroscope FSR (250, 500, 1000, 2000 dps)
 #define ENABLE_SD_LOGGING 's' // Enable/disable SD-card logging
+#define PRINT_STATS       'i' // Print acquisition statistics
+#define ENABLE_BINARY     'b' // Switch between text and binary logging
+#define RESET_MAG_CAL     'M' // Forget the magnetometer calibration, and start learning again
+#define TOGGLE_CAPTURE    'R' // Start/stop logging raw accel/gyro samples (see Raw Capture Config)
 
 //////////////////////////
 // Hardware Definitions //
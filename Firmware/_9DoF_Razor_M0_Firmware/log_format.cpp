@@ -0,0 +1,151 @@
+/******************************************************************************
+log_format.cpp
+Fixed-buffer formatter for IMU log lines
+
+See log_format.h for an overview.
+******************************************************************************/
+#include "log_format.h"
+
+static const uint32_t powersOf10[] = {
+  1, 10, 100, 1000, 10000, 100000, 1000000
+};
+#define MAX_DECIMALS 6
+
+// Write the decimal digits of v to tmp, least-significant first. Returns the
+// number of digits written (at most 10).
+static unsigned char toDigits(uint32_t v, char * tmp)
+{
+  unsigned char n = 0;
+  // Large values need a real (software, on the M0+) divide...
+  while (v >= 0x10000)
+  {
+    uint32_t q = v / 10;
+    tmp[n++] = '0' + (v - q * 10);
+    v = q;
+  }
+  // ...but below 2^16, x/10 == (x * 0xCCCD) >> 19 exactly, which is a
+  // single-cycle multiply. Raw sensor counts always take this path.
+  while (v >= 10)
+  {
+    uint32_t q = (v * 0xCCCDu) >> 19;
+    tmp[n++] = '0' + (v - q * 10);
+    v = q;
+  }
+  tmp[n++] = '0' + v;
+  return n;
+}
+
+LogLine::LogLine()
+{
+  clear();
+}
+
+void LogLine::clear(void)
+{
+  _len = 0;
+  _buf[0] = '\0';
+  _truncated = false;
+}
+
+void LogLine::addDecimal(bool negative, uint32_t magnitude,
+                         unsigned char decimals)
+{
+  char digits[10 + MAX_DECIMALS];
+  unsigned char n = toDigits(magnitude, digits);
+  // Pad so there's at least one digit before the decimal point
+  while (n <= decimals)
+    digits[n++] = '0';
+
+  // Sign, digits, decimal point, ", ", and the terminator
+  unsigned int need = (negative ? 1 : 0) + n + (decimals ? 1 : 0) + 3;
+  if (_len + need > LOG_LINE_MAX)
+  {
+    _truncated = true;
+    return;
+  }
+
+  char * p = _buf + _len;
+  if (negative)
+    *p++ = '-';
+  while (n)
+  {
+    *p++ = digits[--n];
+    if (decimals && (n == decimals))
+      *p++ = '.';
+  }
+  *p++ = ',';
+  *p++ = ' ';
+  *p = '\0';
+  _len = p - _buf;
+}
+
+void LogLine::addInt(int32_t value)
+{
+  bool negative = value < 0;
+  addDecimal(negative, negative ? 0u - (uint32_t)value : (uint32_t)value, 0);
+}
+
+void LogLine::addUInt(uint32_t value)
+{
+  addDecimal(false, value, 0);
+}
+
+void LogLine::addFloat(float value, unsigned char decimals)
+{
+  if (decimals > MAX_DECIMALS)
+    decimals = MAX_DECIMALS;
+
+  float scaled = value * (float)powersOf10[decimals];
+  bool negative = scaled < 0.0f;
+  if (negative)
+    scaled = -scaled;
+  // Same placeholders String(float) uses for values it can't print
+  if ((value != value) || (scaled >= 4294967040.0f))
+  {
+    const char * text = (value != value) ? "nan, " : "ovf, ";
+    if (_len + 6 > LOG_LINE_MAX)
+    {
+      _truncated = true;
+      return;
+    }
+    for (const char * t = text; *t; t++)
+      _buf[_len++] = *t;
+    _buf[_len] = '\0';
+    return;
+  }
+  // Round to nearest, ties to even, like printf()
+  float rounded = scaled + 0.5f;
+  uint32_t magnitude = (uint32_t)rounded;
+  if (((float)magnitude == rounded) && (magnitude & 1))
+    magnitude--;
+  addDecimal(negative, magnitude, decimals);
+}
+
+void LogLine::addQ30(int32_t value, unsigned char decimals)
+{
+  if (decimals > MAX_DECIMALS)
+    decimals = MAX_DECIMALS;
+
+  bool negative = value < 0;
+  uint32_t magnitude = negative ? 0u - (uint32_t)value : (uint32_t)value;
+  // Round to nearest: |value| * 10^decimals / 2^30
+  uint32_t scaled = (uint32_t)(((uint64_t)magnitude * powersOf10[decimals] +
+                                (1UL << 29)) >> 30);
+  addDecimal(negative, scaled, decimals);
+}
+
+void LogLine::end(void)
+{
+  if (_len >= 2)
+  {
+    // Every field ends with ", ", so swap the last one for a new line
+    _buf[_len - 2] = '\r';
+    _buf[_len - 1] = '\n';
+  }
+  else
+  {
+    _buf[_len++] = '\r';
+    _buf[_len++] = '\n';
+    _buf[_len] = '\0';
+  }
+}
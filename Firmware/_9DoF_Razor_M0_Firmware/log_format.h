@@ -0,0 +1,67 @@
+/******************************************************************************
+log_format.h
+Fixed-buffer formatter for IMU log lines
+
+Builds a comma-separated log line in place, in a buffer owned by the
+LogLine object. Nothing is ever allocated on the heap, so logging at full
+rate doesn't churn or fragment the SAMD21's 32kB of RAM the way String
+concatenation does.
+
+Integers are converted with a divide-free fast path for 16-bit values (the
+M0+ has no hardware divider). Calculated values are printed as fixed-point
+decimals: a float is scaled and rounded once, and Q30 quaternions are
+scaled with integer math, instead of going through dtostrf().
+
+Output matches the old String-based log: fields separated by ", " and
+lines ended with "\r\n".
+******************************************************************************/
+#ifndef _LOG_FORMAT_H_
+#define _LOG_FORMAT_H_
+
+#include <stdint.h>
+
+// Longest line the formatter will build, including the terminator. Fields
+// that don't fit are dropped (and flagged by truncated()).
+#define LOG_LINE_MAX 192
+
+class LogLine
+{
+public:
+  LogLine();
+
+  // clear -- Start a new, empty line
+  void clear(void);
+
+  // addInt -- Append a signed integer field (e.g. raw sensor counts)
+  void addInt(int32_t value);
+  // addUInt -- Append an unsigned integer field (e.g. a timestamp)
+  void addUInt(uint32_t value);
+  // addFloat -- Append a float field with a fixed number of decimals
+  // Input: value, and number of digits after the decimal point (0-6)
+  void addFloat(float value, unsigned char decimals = 2);
+  // addQ30 -- Append a Q30 fixed-point field (e.g. a DMP quaternion)
+  // converted to decimal, without going through float.
+  // Input: value, and number of digits after the decimal point (0-6)
+  void addQ30(int32_t value, unsigned char decimals = 4);
+
+  // end -- Terminate the line. Replaces the last ", " with "\r\n".
+  void end(void);
+
+  // c_str -- Null-terminated line contents
+  const char * c_str(void) const { return _buf; }
+  // length -- Line length in characters (not including the terminator)
+  unsigned int length(void) const { return _len; }
+  // truncated -- True if any field was dropped for lack of room
+  bool truncated(void) const { return _truncated; }
+
+private:
+  // Append a field: optional '-', digits of magnitude with a decimal point
+  // inserted decimals places from the right, then ", ".
+  void addDecimal(bool negative, uint32_t magnitude, unsigned char decimals);
+
+  char _buf[LOG_LINE_MAX];
+  unsigned int _len;
+  bool _truncated;
+};
+
+#endif // _LOG_FORMAT_H_
@@ -0,0 +1,129 @@
+/******************************************************************************
+sample_clock.cpp
+Per-packet sample times for the DMP FIFO
+
+See sample_clock.h for an overview.
+******************************************************************************/
+#include "sample_clock.h"
+
+// Filter gains, as shifts: phase 1/16, period 1/256. Together they settle
+// in about a hundred packets without overshooting, and average out
+// several hundred us of interrupt latency jitter to under 100 us. The
+// period gain can't go below 1/256, the resolution of the period.
+#define PHASE_GAIN_SHIFT 4
+#define PERIOD_GAIN_SHIFT 8
+// The sensor clock is within a few percent of nominal. Clamp the period
+// estimate to +/-5% so a burst of bad observations can't run away with it.
+#define PERIOD_LIMIT_SHIFT 4 // 1/16 > 5%
+
+SampleClock::SampleClock()
+{
+  _locked = false;
+  _lastObserved = 0;
+  _wraps = 0;
+  _anchorPacket = 0;
+  _anchorTime = 0;
+  _nominal = 0;
+  _period = 0;
+  _jitter = 0;
+  _resyncs = 0;
+  setRate(100);
+}
+
+void SampleClock::setRate(uint16_t rate)
+{
+  if (rate == 0)
+    rate = 1;
+  _nominal = (int32_t)((1000000UL << 8) / rate);
+  _period = _nominal;
+  _locked = false;
+}
+
+void SampleClock::restart(uint32_t packet, uint64_t time)
+{
+  _anchorPacket = packet;
+  _anchorTime = time;
+  _period = _nominal;
+  _jitter = 0;
+  _locked = true;
+}
+
+void SampleClock::observe(uint32_t packet, uint32_t timeUs)
+{
+  // Extend micros() to 64 bits
+  if (timeUs < _lastObserved)
+    _wraps++;
+  _lastObserved = timeUs;
+  uint64_t time = ((uint64_t)_wraps << 32) | timeUs;
+
+  if (!_locked)
+  {
+    restart(packet, time);
+    return;
+  }
+
+  int32_t packets = (int32_t)(packet - _anchorPacket);
+  if (packets <= 0)
+    return; // Nothing new since the last observation
+
+  int64_t predicted = (int64_t)_anchorTime +
+                      (((int64_t)packets * _period) >> 8);
+  int64_t error = (int64_t)time - predicted;
+
+  // More than half a period off means packets were lost or miscounted
+  if ((error > (_period >> 9)) || (error < -(_period >> 9)))
+  {
+    _resyncs++;
+    restart(packet, time);
+    return;
+  }
+
+  // Move the line part of the way toward the observation...
+  _anchorTime = predicted + (error >> PHASE_GAIN_SHIFT);
+  _anchorPacket = packet;
+  // ...and adjust its slope by the error per packet (error is in us, the
+  // period in Q8 us)
+  _period += (int32_t)((error << (8 - PERIOD_GAIN_SHIFT)) / packets);
+  if (_period > _nominal + (_nominal >> PERIOD_LIMIT_SHIFT))
+    _period = _nominal + (_nominal >> PERIOD_LIMIT_SHIFT);
+  else if (_period < _nominal - (_nominal >> PERIOD_LIMIT_SHIFT))
+    _period = _nominal - (_nominal >> PERIOD_LIMIT_SHIFT);
+
+  uint32_t magnitude = (error < 0) ? -error : error;
+  _jitter += (int32_t)((magnitude << 4) - _jitter) >> 4;
+}
+
+uint32_t SampleClock::missed(uint32_t packet, uint32_t timeUs) const
+{
+  if (!_locked)
+    return 0;
+  // Extend micros() to 64 bits, like observe() will
+  uint32_t wraps = _wraps + ((timeUs < _lastObserved) ? 1 : 0);
+  uint64_t time = ((uint64_t)wraps << 32) | timeUs;
+
+  // The packet was seen some time after it arrived: up to a period later
+  // if it was waiting in a full FIFO. So round down, allowing a quarter of
+  // a period for jitter the other way (the period is in Q8 us).
+  int64_t error = (int64_t)time - (int64_t)timeOf(packet) + (_period >> 10);
+  if (error <= 0)
+    return 0;
+  return (uint32_t)((error << 8) / _period);
+}
+
+uint64_t SampleClock::timeOf(uint32_t packet) const
+{
+  int32_t packets = (int32_t)(packet - _anchorPacket);
+  return _anchorTime + (((int64_t)packets * _period) >> 8);
+}
+
+uint32_t SampleClock::periodNs(void) const
+{
+  // Up to 256e6 Q8 us at 1 Hz: the product needs 64 bits
+  return (uint32_t)(((uint64_t)_period * 1000) >> 8);
+}
+
+int32_t SampleClock::driftPpm(void) const
+{
+  // Positive when the sensor runs slow (longer period than nominal)
+  return (int32_t)(((int64_t)(_period - _nominal) * 1000000) / _nominal);
+}
@@ -0,0 +1,85 @@
+/******************************************************************************
+sample_clock.h
+Per-packet sample times for the DMP FIFO
+
+Reading the FIFO only tells us when packets were read, not when they were
+sampled: a burst of backlogged packets would all get the same time. The
+MPU-9250 samples on its own clock, so packets are evenly spaced at the FIFO
+rate. SampleClock numbers every packet in the order it's read, and tracks
+a straight line through (packet number, time) observations:
+
+  - Each observation is the time of an interrupt edge (captured with
+    micros()) paired with the number of the newest packet in the FIFO at
+    that edge: the packets already read, plus the ones read now, plus the
+    "more" still waiting.
+  - A phase-locked loop (an alpha-beta filter) pulls the line toward each
+    observation, smoothing out interrupt latency, and adjusts the sample
+    period to follow the sensor's clock, which can drift by up to a
+    couple of percent from the nominal rate.
+  - A packet's time is then read off the line, so jitter is set by the
+    filter rather than by when the packet happened to be read.
+
+An observation far off the line (e.g. after a FIFO reset, when packets
+were lost) restarts tracking from scratch. When packets are known to have
+been lost without disturbing the sensor's clock (a FIFO overflow that was
+recovered without a reset), missed() tells how many, so the numbering can
+skip them and tracking carries on.
+
+Times are in microseconds, extended to 64 bits so they don't wrap when
+micros() does. This file doesn't depend on Arduino.
+******************************************************************************/
+#ifndef _SAMPLE_CLOCK_H_
+#define _SAMPLE_CLOCK_H_
+
+#include <stdint.h>
+
+class SampleClock
+{
+public:
+  SampleClock();
+
+  // setRate -- Set the nominal FIFO rate, and restart tracking
+  // Input: Rate in Hz
+  void setRate(uint16_t rate);
+
+  // observe -- Add an observation
+  // Input: Number of the newest packet in the FIFO, and the micros() time
+  //        it was known to be there
+  void observe(uint32_t packet, uint32_t timeUs);
+
+  // timeOf -- Estimated sample time of a packet (microseconds)
+  uint64_t timeOf(uint32_t packet) const;
+
+  // missed -- Number of packets missing before a packet, going by the time
+  // it was seen: the whole periods it's late by
+  // Input: Same as observe()
+  // Output: Packets to add to packet (and its predecessors' numbers) to
+  //         bring it back onto the line, 0 if not locked
+  uint32_t missed(uint32_t packet, uint32_t timeUs) const;
+
+  // locked -- True once there's been an observation to time packets from
+  bool locked(void) const { return _locked; }
+  // periodNs -- Current estimate of the sample period (nanoseconds)
+  uint32_t periodNs(void) const;
+  // driftPpm -- Sensor clock error vs. the nominal rate (parts per million)
+  int32_t driftPpm(void) const;
+  // jitterUs -- Average distance of observations from the line (us)
+  uint32_t jitterUs(void) const { return _jitter >> 4; }
+  // resyncs -- Number of times tracking had to restart
+  uint32_t resyncs(void) const { return _resyncs; }
+
+private:
+  void restart(uint32_t packet, uint64_t time);
+
+  bool _locked;
+  uint32_t _lastObserved; // Last micros() value, to count its wraps
+  uint32_t _wraps; // Number of times micros() has wrapped
+  uint32_t _anchorPacket; // A packet on the line...
+  uint64_t _anchorTime; // ...and its time (us)
+  int32_t _period; // Sample period (Q8 us)
+  int32_t _nominal; // Nominal sample period (Q8 us)
+  uint32_t _jitter; // Smoothed |observation error| (Q4 us)
+  uint32_t _resyncs;
+};
+
+#endif // _SAMPLE_CLOCK_H_
@@ -0,0 +1,126 @@
+/******************************************************************************
+sample_ring.h
+Single-producer/single-consumer ring of IMU samples
+
+Samples are pushed by the acquisition side, which drains the DMP FIFO,
+and popped by the logging side, which formats and stores them. Both run
+from loop(): the FIFO is drained when the MPU-9250's interrupt has flagged
+new data (or, with ENABLE_ASYNC_ACQUISITION, by the done functions of
+background reads, which asyncPoll() runs), including between blocks of
+samples logged. The two sides never share an index: only push() writes
+the head and only pop() writes the tail, so a producer in an interrupt
+would need no locking either.
+
+Nothing drains the FIFO while an SD card write blocks loop(), so the ring
+doesn't cover such a stall: the MPU-9250's 1kB FIFO has to. The ring
+smooths out the logging instead, letting loop() drain the FIFO between
+blocks rather than only after a whole run of them.
+
+The ring also keeps a high-water mark and a count of samples dropped
+because it was full, so its size can be tuned for the card in use.
+******************************************************************************/
+#ifndef _SAMPLE_RING_H_
+#define _SAMPLE_RING_H_
+
+#include <stdint.h>
+
+// Keeps the compiler from moving buffer accesses across index updates.
+// The M0+ is a single in-order core, so no hardware barrier is needed.
+#define SAMPLE_RING_BARRIER() __asm__ __volatile__ ("" ::: "memory")
+
+// One IMU sample, in the MPU-9250's raw units
+struct imuSample
+{
+  uint32_t time; // Sample time (ms, millis() timebase)
+  int32_t quat[4]; // w, x, y, z in Q30
+  int16_t accel[3];
+  int16_t gyro[3];
+  int16_t mag[3];
+  uint16_t timeUs; // Microseconds past time (0-999)
+};
+
+// size must be a power of two. One slot is left empty to tell a full ring
+// from an empty one, so the ring holds up to size - 1 samples.
+template <typename T, uint16_t size>
+class SampleRing
+{
+public:
+  SampleRing() : _head(0), _tail(0), _highWater(0), _dropped(0) {}
+
+  // push -- Add a sample. Producer side only.
+  // Output: true on success, false (and sample dropped) if full
+  bool push(const T & sample)
+  {
+    uint16_t head = _head;
+    uint16_t next = (head + 1) & (size - 1);
+    if (next == _tail)
+    {
+      _dropped++;
+      return false;
+    }
+    _buffer[head] = sample;
+    SAMPLE_RING_BARRIER();
+    _head = next;
+
+    uint16_t used = (next - _tail) & (size - 1);
+    if (used > _highWater)
+      _highWater = used;
+    return true;
+  }
+
+  // pop -- Remove the oldest sample. Consumer side only.
+  // Output: true if a sample was copied to sample, false if empty
+  bool pop(T & sample)
+  {
+    uint16_t tail = _tail;
+    if (tail == _head)
+      return false;
+    sample = _buffer[tail];
+    SAMPLE_RING_BARRIER();
+    _tail = (tail + 1) & (size - 1);
+    return true;
+  }
+
+  // available -- Number of samples waiting to be popped
+  uint16_t available(void) const
+  {
+    return (_head - _tail) & (size - 1);
+  }
+
+  // capacity -- Maximum number of samples the ring can hold
+  uint16_t capacity(void) const
+  {
+    return size - 1;
+  }
+
+  // highWater -- Most samples held at once since the last resetStats()
+  uint16_t highWater(void) const
+  {
+    return _highWater;
+  }
+
+  // dropped -- Samples discarded because the ring was full
+  uint32_t dropped(void) const
+  {
+    return _dropped;
+  }
+
+  // resetStats -- Clear the high-water mark and drop counter. Call with
+  // the producer stopped, or accept that a concurrent update may be lost.
+  void resetStats(void)
+  {
+    _highWater = 0;
+    _dropped = 0;
+  }
+
+private:
+  static_assert((size & (size - 1)) == 0, "SampleRing size must be a power of two");
+
+  T _buffer[size];
+  volatile uint16_t _head; // Next slot to write (producer)
+  volatile uint16_t _tail; // Next slot to read (consumer)
+  volatile uint16_t _highWater;
+  volatile uint32_t _dropped;
+};
+
+#endif // _SAMPLE_RING_H_
@@ -0,0 +1,208 @@
+/******************************************************************************
+sd_log_writer.cpp
+Persistent, double-buffered SD card log file
+
+See sd_log_writer.h for an overview.
+******************************************************************************/
+#include "sd_log_writer.h"
+
+SdLogWriter::SdLogWriter()
+{
+  _open = false;
+  _name[0] = '\0';
+  _prefix = "";
+  _suffix = "";
+  _nextIndex = 0;
+  _maxIndex = 0;
+  _maxFileSize = 0;
+  _fileSize = 0;
+  _syncInterval = 0;
+  _lastSync = 0;
+  _header = NULL;
+  _headerLength = 0;
+  _active = 0;
+  _fill = 0;
+  _limit = SD_BLOCK_SIZE;
+  _waiting = 0;
+}
+
+bool SdLogWriter::begin(const char * prefix, const char * suffix,
+                        unsigned int maxIndex, uint32_t maxFileSize,
+                        uint32_t syncInterval)
+{
+  _prefix = prefix;
+  _suffix = suffix;
+  _nextIndex = 0;
+  _maxIndex = maxIndex;
+  _maxFileSize = maxFileSize;
+  _syncInterval = syncInterval;
+  _fill = 0;
+  _limit = SD_BLOCK_SIZE;
+  _waiting = 0;
+  if (!openNextFile())
+    return false;
+  bool success = true;
+  queue((const char *)_header, _headerLength, success);
+  return success;
+}
+
+// Find and open the next available log file name
+bool SdLogWriter::openNextFile(void)
+{
+  while (_nextIndex <= _maxIndex)
+  {
+    // Construct a file with PREFIX[Index].SUFFIX
+    snprintf(_name, sizeof(_name), "%s%u.%s", _prefix, _nextIndex++,
+             _suffix);
+    // If the file name doesn't exist, use it
+    if (!SD.exists(_name))
+    {
+      _file = SD.open(_name, FILE_WRITE);
+      _open = _file;
+      _fileSize = 0;
+      _lastSync = millis();
+      return _open;
+    }
+  }
+
+  _name[0] = '\0';
+  _open = false;
+  return false;
+}
+
+// Write length bytes of a buffer to the card
+bool SdLogWriter::writeBuffer(unsigned char index, unsigned int length)
+{
+  if (!_open || !length)
+    return false;
+
+  if (_file.write(_buffer[index], length) != length)
+    return false;
+  _fileSize += length;
+  return true;
+}
+
+// Write out everything queued for the current file, then start the next one
+// (and its header)
+bool SdLogWriter::rollOver(void)
+{
+  bool success = flush();
+  _file.close();
+  if (!openNextFile())
+    return false;
+  _limit = SD_BLOCK_SIZE;
+  queue((const char *)_header, _headerLength, success);
+  return success;
+}
+
+bool SdLogWriter::nextFile(const char * suffix)
+{
+  _suffix = suffix;
+  if (!_open)
+    return false;
+  return rollOver();
+}
+
+void SdLogWriter::setFileHeader(const uint8_t * header, unsigned int length)
+{
+  _header = header;
+  _headerLength = header ? length : 0;
+}
+
+bool SdLogWriter::write(const char * data, unsigned int length)
+{
+  bool success = true;
+
+  // Keep whole lines/records in one file: move on to the next file before
+  // this one would get too big.
+  if (_open && (_fileSize + _waiting + _fill + length > _maxFileSize))
+    success = rollOver();
+
+  queue(data, length, success);
+  return success;
+}
+
+// Copy data into the block buffers, handing each full one to service()
+void SdLogWriter::queue(const char * data, unsigned int length,
+                        bool & success)
+{
+  while (length)
+  {
+    unsigned int room = _limit - _fill;
+    unsigned int n = (length < room) ? length : room;
+    memcpy(&_buffer[_active][_fill], data, n);
+    _fill += n;
+    data += n;
+    length -= n;
+
+    if (_fill == _limit)
+    {
+      // Both buffers are full: loop() hasn't had a chance to call
+      // service(), so write the older one now.
+      if (_waiting)
+      {
+        success &= writeBuffer(!_active, _waiting);
+        _waiting = 0;
+      }
+      // Hand the full buffer to service() and start filling the other
+      _waiting = _fill;
+      _active = !_active;
+      _fill = 0;
+      _limit = SD_BLOCK_SIZE;
+    }
+  }
+}
+
+bool SdLogWriter::service(void)
+{
+  bool wrote = false;
+
+  if (_waiting)
+  {
+    writeBuffer(!_active, _waiting);
+    _waiting = 0;
+    wrote = true;
+  }
+
+  if (_open && (millis() - _lastSync >= _syncInterval))
+  {
+    _file.flush(); // Update the directory entry and FAT
+    _lastSync = millis();
+  }
+
+  return wrote;
+}
+
+bool SdLogWriter::flush(void)
+{
+  bool success = true;
+
+  if (_waiting)
+  {
+    success &= writeBuffer(!_active, _waiting);
+    _waiting = 0;
+  }
+  if (_fill)
+  {
+    success &= writeBuffer(_active, _fill);
+    _fill = 0;
+    // Stop the next buffer short, so later writes are block-aligned again
+    _limit = SD_BLOCK_SIZE - (_fileSize % SD_BLOCK_SIZE);
+  }
+  if (_open)
+  {
+    _file.flush();
+    _lastSync = millis();
+  }
+
+  return success && _open;
+}
+
+void SdLogWriter::close(void)
+{
+  if (!_open)
+    return;
+  flush();
+  _file.close();
+  _open = false;
+}
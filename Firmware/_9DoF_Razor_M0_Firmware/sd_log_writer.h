@@ -0,0 +1,98 @@
+/******************************************************************************
+sd_log_writer.h
+Persistent, double-buffered SD card log file
+
+Keeps the active log file open, instead of opening, appending to and
+closing it on every flush (which rewrites its directory entry and FAT
+chain each time). Log data is collected in two 512-byte block buffers:
+while one fills, the other waits to be written by service(), which loop()
+calls once it's done logging. Writes are always whole, block-aligned
+sectors of the file, so the SD library can send them straight to the card
+without a read-modify-write of a cached block.
+
+The file is only synced (directory entry and FAT updated) every
+syncInterval milliseconds, or on flush(). When the file reaches its
+maximum size, the writer moves on to the next free file name without
+reopening the current one. If a file header is set (e.g. for binary logs),
+it's written at the start of every new file.
+******************************************************************************/
+#ifndef _SD_LOG_WRITER_H_
+#define _SD_LOG_WRITER_H_
+
+#include <Arduino.h>
+#include <SD.h>
+
+#define SD_BLOCK_SIZE 512 // SD card sector size
+#define SD_LOG_NAME_MAX 13 // 8.3 file name and terminator
+
+class SdLogWriter
+{
+public:
+  SdLogWriter();
+
+  // begin -- Open the first unused log file named prefix[index].suffix
+  // Input: File name prefix and suffix, highest file index to try,
+  //        maximum file size in bytes, and sync interval in ms
+  // Output: true if a file was opened
+  bool begin(const char * prefix, const char * suffix, unsigned int maxIndex,
+             uint32_t maxFileSize, uint32_t syncInterval);
+
+  // write -- Queue data to be logged. Only blocks on the card if both
+  // buffers are full (service() isn't being called often enough).
+  // Output: true on success, false if a block write failed
+  bool write(const char * data, unsigned int length);
+
+  // service -- Write a full buffer if one is waiting, and sync the file if
+  // the sync interval has passed. Call regularly from loop().
+  // Output: true if a block was written to the card
+  bool service(void);
+
+  // flush -- Write all buffered data, including a partial block, and sync
+  // Output: true on success
+  bool flush(void);
+
+  // close -- Flush and close the current file
+  void close(void);
+
+  // nextFile -- Close the current file and start the next free one
+  // Input: Suffix for the new file (and any after it)
+  // Output: true if a file was opened
+  bool nextFile(const char * suffix);
+
+  // setFileHeader -- Set data to be written at the start of each new file.
+  // The data isn't copied, so it must stay valid. NULL for no header.
+  void setFileHeader(const uint8_t * header, unsigned int length);
+
+  // fileName -- Name of the current log file ("" if none)
+  const char * fileName(void) const { return _name; }
+  // isOpen -- True if a log file is open
+  bool isOpen(void) const { return _open; }
+
+private:
+  bool openNextFile(void);
+  bool rollOver(void);
+  void queue(const char * data, unsigned int length, bool & success);
+  bool writeBuffer(unsigned char index, unsigned int length);
+
+  File _file;
+  bool _open;
+  char _name[SD_LOG_NAME_MAX];
+  const char * _prefix;
+  const char * _suffix;
+  unsigned int _nextIndex; // Next file index to try
+  unsigned int _maxIndex;
+  uint32_t _maxFileSize;
+  uint32_t _fileSize; // Bytes written to the current file
+  uint32_t _syncInterval;
+  uint32_t _lastSync; // millis() of the last sync
+  const uint8_t * _header;
+  unsigned int _headerLength;
+
+  uint8_t _buffer[2][SD_BLOCK_SIZE] __attribute__((aligned(4)));
+  unsigned char _active; // Buffer being filled
+  unsigned int _fill; // Bytes in the active buffer
+  unsigned int _limit; // Fill level that ends on a block boundary
+  unsigned int _waiting; // Bytes in the other buffer waiting to be written
+};
+
+#endif // _SD_LOG_WRITER_H_
@@ -22,18 +22,59 @@ extern "C" {
 #include "util/inv_mpu.h"
 }
 
-static unsigned char mpu9250_orientation;
-static unsigned char tap_count;
-static unsigned char tap_direction;
-static bool _tap_available;
-static void orient_cb(unsigned char orient);
-static void tap_cb(unsigned char direction, unsigned char count);
+MPU9250_DMP * MPU9250_DMP::_instances[MPU_MAX_DEVICES];
 
-MPU9250_DMP::MPU9250_DMP()
+MPU9250_DMP::MPU9250_DMP(unsigned char address)
 {
 	_mSense = 6.665f; // Constant - 4915 / 32760
 	_aSense = 0.0f;   // Updated after accel FSR is set
 	_gSense = 0.0f;   // Updated after gyro FSR is set
+	fix_scale_init(&_mScale, _mSense);
+	fix_scale_init(&_aScale, 0);
+	fix_scale_init(&_gScale, 0);
+	pitchFixed = rollFixed = yawFixed = headingFixed = 0;
+	mag_fusion_init(&_fusion, MAG_FUSION_KP, MAG_FUSION_KI, 100);
+	fusedQw = 1L << 30;
+	fusedQx = fusedQy = fusedQz = fusedHeading = 0;
+	mag_cal_reset(&_magCal, MAG_CAL_MIN_STEP);
+	mag_cal_solve(&_magCal, &_magCalFit);
+	_magCalStatus = MAG_CAL_TOO_FEW;
+	_magCalAdded = 0;
+	_fifoMore = 0;
+	_burstResult = _compassResult = INV_ERROR; // Nothing started yet
+	_burstCount = 0;
+	_captureValues = 0;
+	_captureDmp = false;
+	_captureRate = _captureMore = 0;
+	_captureStartUs = _captureLastUs = 0;
+	_captureSamples = _captureLost = _captureOverflows = _fifoOverflows = 0;
+	_address = address;
+	_orientation = 0;
+	_tapCount = 0;
+	_tapDirection = 0;
+	_tapAvailable = false;
+	
+	// Each object gets the first of the driver's device states no other
+	// object has. Objects past MPU_MAX_DEVICES get none, and fail begin().
+	for (_device = 0; _device < MPU_MAX_DEVICES; _device++)
+	{
+		if (!_instances[_device])
+		{
+			_instances[_device] = this;
+			break;
+		}
+	}
+}
+
+MPU9250_DMP::~MPU9250_DMP()
+{
+	if (_device >= MPU_MAX_DEVICES)
+		return;
+	// The transaction queue holds the background reads' transactions,
+	// which are part of this object
+	while ((_burstResult == INV_PENDING) || (_compassResult == INV_PENDING))
+		asyncPoll();
+	_instances[_device] = NULL;
 }
 
 inv_error_t MPU9250_DMP::begin(void)
@@ -41,7 +82,11 @@ inv_error_t MPU9250_DMP::begin(void)
 	inv_error_t result;
     struct int_param_s int_param;
 	
-	Wire.begin();
+	if (select() != INV_SUCCESS)
+		return INV_ERROR;
+	mpu_set_address(_address);
+	
+	arduino_i2c_begin();
 	
 	result = mpu_init(&int_param);
 	
@@ -54,27 +99,163 @@ inv_error_t MPU9250_DMP::begin(void)
 	
 	_gSense = getGyroSens();
 	_aSense = getAccelSens();
+	fix_scale_init(&_gScale, _gSense);
+	fix_scale_init(&_aScale, _aSense);
 	
 	return result;
 }
 
+inv_error_t MPU9250_DMP::setFastBoot(unsigned char enable)
+{
+	select();
+	return mpu_set_fast_boot(enable);
+}
+
+inv_error_t MPU9250_DMP::getBootStats(mpu_boot_stats_s * stats)
+{
+	select();
+	return mpu_get_boot_stats(stats);
+}
+
+inv_error_t MPU9250_DMP::setRegShadow(unsigned char enable)
+{
+	select();
+	return mpu_set_reg_shadow(enable);
+}
+
+inv_error_t MPU9250_DMP::deferWrites(void)
+{
+	select();
+	return mpu_defer_writes();
+}
+
+inv_error_t MPU9250_DMP::flushWrites(void)
+{
+	select();
+	return mpu_flush_writes();
+}
+
+inv_error_t MPU9250_DMP::getShadowStats(mpu_shadow_stats_s * stats)
+{
+	select();
+	return mpu_get_shadow_stats(stats);
+}
+
+void MPU9250_DMP::setI2CRetryBudget(unsigned long us)
+{
+	arduino_i2c_set_retry_budget(us);
+}
+
+inv_error_t MPU9250_DMP::getI2CStats(i2c_stats_s * stats)
+{
+	arduino_i2c_get_stats(stats);
+	return INV_SUCCESS;
+}
+
+void MPU9250_DMP::setI2CClock(unsigned long hz)
+{
+	arduino_i2c_set_clock(hz);
+}
+
+unsigned long MPU9250_DMP::getI2CClock(void)
+{
+	return arduino_i2c_get_clock();
+}
+
+inv_error_t MPU9250_DMP::tuneI2CClock(unsigned long maxHz)
+{
+	const unsigned long clocks[] = {
+		I2C_CLOCK_FAST_PLUS, I2C_CLOCK_FAST, I2C_CLOCK_STANDARD
+	};
+	unsigned char dmpOn, whoAmI;
+	
+	select();
+	if (mpu_get_dmp_state(&dmpOn) || !dmpOn)
+		return INV_ERROR;
+	
+	// WHO_AM_I as it reads at the standard clock, to check the others by
+	arduino_i2c_set_clock(I2C_CLOCK_STANDARD);
+	if (mpu_read_reg(MPU9250_WHO_AM_I, &whoAmI))
+		return INV_ERROR;
+	
+	for (unsigned char i = 0; i < sizeof(clocks) / sizeof(clocks[0]); i++)
+	{
+		if ((clocks[i] > maxHz) && (clocks[i] != I2C_CLOCK_STANDARD))
+			continue;
+		arduino_i2c_set_clock(clocks[i]);
+		if (probeI2CClock(whoAmI))
+			return INV_SUCCESS;
+	}
+	arduino_i2c_set_clock(I2C_CLOCK_STANDARD);
+	return INV_ERROR;
+}
+
+// Run tuneI2CClock()'s rounds at the current clock, until one fails
+bool MPU9250_DMP::probeI2CClock(unsigned char whoAmI)
+{
+	dmp_packet_s packets[DMP_MAX_BURST_PACKETS];
+	i2c_stats_s i2cBefore, i2cAfter;
+	mpu_fifo_stats_s fifoBefore, fifoAfter;
+	unsigned short rate;
+	unsigned char value, count, more;
+	unsigned long timestamp;
+	
+	if (dmp_get_fifo_rate(&rate) || !rate)
+		return false;
+	arduino_i2c_get_stats(&i2cBefore);
+	mpu_get_fifo_stats(&fifoBefore);
+	
+	for (unsigned char round = 0; round < I2C_PROBE_ROUNDS; round++)
+	{
+		if (mpu_read_reg(MPU9250_WHO_AM_I, &value) || (value != whoAmI))
+			return false;
+		// Wait for a packet or two, then drain the FIFO in bursts
+		delay(1000 / rate + 1);
+		unsigned short read = 0;
+		do
+		{
+			if (dmp_read_fifo_burst(packets, DMP_MAX_BURST_PACKETS, &count,
+			                        &timestamp, &more))
+				return false;
+			read += count;
+		} while (more);
+		if (!read)
+			return false;
+		
+		// Anything retried, or a packet the driver dropped, fails it
+		arduino_i2c_get_stats(&i2cAfter);
+		mpu_get_fifo_stats(&fifoAfter);
+		if ((i2cAfter.retries != i2cBefore.retries) ||
+		    (i2cAfter.failures != i2cBefore.failures) ||
+		    (i2cAfter.recoveries != i2cBefore.recoveries) ||
+		    (fifoAfter.resets != fifoBefore.resets) ||
+		    (fifoAfter.resyncs != fifoBefore.resyncs))
+			return false;
+	}
+	return true;
+}
+
 inv_error_t MPU9250_DMP::enableInterrupt(unsigned char enable)
 {
+	select();
 	return set_int_enable(enable);
 }
 
 inv_error_t MPU9250_DMP::setIntLevel(unsigned char active_low)
 {
+	select();
 	return mpu_set_int_level(active_low);
 }
 
 inv_error_t MPU9250_DMP::setIntLatched(unsigned char enable)
 {
+	select();
 	return mpu_set_int_latched(enable);
 }
 
 short MPU9250_DMP::getIntStatus(void)
 {
+	select();
 	short status;
 	if (mpu_get_int_status(&status) == INV_SUCCESS)
 	{
@@ -89,33 +270,39 @@ short MPU9250_DMP::getIntStatus(void)
 // Disables compass and gyro
 inv_error_t MPU9250_DMP::lowPowerAccel(unsigned short rate)
 {
+	select();
 	return mpu_lp_accel_mode(rate);
 }
 
 inv_error_t MPU9250_DMP::setGyroFSR(unsigned short fsr)
 {
+	select();
 	inv_error_t err;
 	err = mpu_set_gyro_fsr(fsr);
 	if (err == INV_SUCCESS)
 	{
 		_gSense = getGyroSens();
+		fix_scale_init(&_gScale, _gSense);
 	}
 	return err;
 }
 
 inv_error_t MPU9250_DMP::setAccelFSR(unsigned char fsr)
 {
+	select();
 	inv_error_t err;
 	err = mpu_set_accel_fsr(fsr);
 	if (err == INV_SUCCESS)
 	{
 		_aSense = getAccelSens();
+		fix_scale_init(&_aScale, _aSense);
 	}
 	return err;
 }
 
 unsigned short MPU9250_DMP::getGyroFSR(void)
 {
+	select();
 	unsigned short tmp;
 	if (mpu_get_gyro_fsr(&tmp) == INV_SUCCESS)
 	{
@@ -126,6 +313,7 @@ unsigned short MPU9250_DMP::getGyroFSR(void)
 
 unsigned char MPU9250_DMP::getAccelFSR(void)
 {
+	select();
 	unsigned char tmp;
 	if (mpu_get_accel_fsr(&tmp) == INV_SUCCESS)
 	{
@@ -136,6 +324,7 @@ unsigned char MPU9250_DMP::getAccelFSR(void)
 
 unsigned short MPU9250_DMP::getMagFSR(void)
 {
+	select();
 	unsigned short tmp;
 	if (mpu_get_compass_fsr(&tmp) == INV_SUCCESS)
 	{
@@ -146,11 +335,13 @@ unsigned short MPU9250_DMP::getMagFSR(void)
 
 inv_error_t MPU9250_DMP::setLPF(unsigned short lpf)
 {
+	select();
 	return mpu_set_lpf(lpf);
 }
 
 unsigned short MPU9250_DMP::getLPF(void)
 {
+	select();
 	unsigned short tmp;
 	if (mpu_get_lpf(&tmp) == INV_SUCCESS)
 	{
@@ -161,11 +352,13 @@ unsigned short MPU9250_DMP::getLPF(void)
 
 inv_error_t MPU9250_DMP::setSampleRate(unsigned short rate)
 {
+	select();
     return mpu_set_sample_rate(rate);
 }
 
 unsigned short MPU9250_DMP::getSampleRate(void)
 {
+	select();
 	unsigned short tmp;
 	if (mpu_get_sample_rate(&tmp) == INV_SUCCESS)
 	{
@@ -176,11 +369,123 @@ unsigned short MPU9250_DMP::getSampleRate(void)
 
 inv_error_t MPU9250_DMP::setCompassSampleRate(unsigned short rate)
 {
+	select();
 	return mpu_set_compass_sample_rate(rate);
 }
 
+inv_error_t MPU9250_DMP::setCompassMode(unsigned char mode)
+{
+	select();
+	return mpu_set_compass_mode(mode);
+}
+
+inv_error_t MPU9250_DMP::setMagCalibration(const short * offset,
+                                           const short * matrix)
+{
+	select();
+	return mpu_set_compass_cal(offset, matrix);
+}
+
+inv_error_t MPU9250_DMP::getMagCalibration(short * offset, short * matrix)
+{
+	select();
+	return mpu_get_compass_cal(offset, matrix, NULL);
+}
+
+bool MPU9250_DMP::updateMagCalibration(void)
+{
+	const short mag[3] = {(short)mx, (short)my, (short)mz};
+	if (!mag_cal_add(&_magCal, mag))
+		return false;
+	if (++_magCalAdded < MAG_CAL_SOLVE_INTERVAL)
+		return false;
+	_magCalAdded = 0;
+	_magCalStatus = mag_cal_solve(&_magCal, &_magCalFit);
+	if (_magCalStatus)
+		return false;
+	
+	// Leave a correction that's already close alone, and keep learning
+	const float * fitMatrix = _magCalFit.matrix;
+	float change = 0.0f;
+	for (int i = 0; i < 9; i++)
+	{
+		float d = fabs(fitMatrix[i] - ((i % 4) ? 0.0f : 1.0f));
+		if (d > change) change = d;
+	}
+	for (int i = 0; i < 3; i++)
+	{
+		float d = fabs(_magCalFit.offset[i]) / _magCalFit.radius;
+		if (d > change) change = d;
+	}
+	if (change < MAG_CAL_MIN_CHANGE)
+		return false;
+	
+	// The fit was of corrected readings, so it goes on top of the
+	// correction in use: fit * (old * (m - offset) - fitOffset) =
+	// (fit * old) * (m - (offset + old^-1 * fitOffset))
+	short offset[3], matrix[9];
+	if (getMagCalibration(offset, matrix) != INV_SUCCESS)
+		return false;
+	float old[9], inv[9];
+	for (int i = 0; i < 9; i++)
+		old[i] = matrix[i] / 16384.0f;
+	inv[0] = old[4] * old[8] - old[5] * old[7];
+	inv[1] = old[2] * old[7] - old[1] * old[8];
+	inv[2] = old[1] * old[5] - old[2] * old[4];
+	inv[3] = old[5] * old[6] - old[3] * old[8];
+	inv[4] = old[0] * old[8] - old[2] * old[6];
+	inv[5] = old[2] * old[3] - old[0] * old[5];
+	inv[6] = old[3] * old[7] - old[4] * old[6];
+	inv[7] = old[1] * old[6] - old[0] * old[7];
+	inv[8] = old[0] * old[4] - old[1] * old[3];
+	float det = old[0] * inv[0] + old[1] * inv[3] + old[2] * inv[6];
+	if (det <= 0.0f)
+		return false;
+	
+	short newOffset[3], newMatrix[9];
+	for (int i = 0; i < 3; i++)
+	{
+		float o = offset[i];
+		for (int j = 0; j < 3; j++)
+			o += inv[i * 3 + j] / det * _magCalFit.offset[j];
+		if (fabs(o) > 2047.0f) // Past anything mag_cal learns from
+			return false;
+		newOffset[i] = (short)(o + (o < 0.0f ? -0.5f : 0.5f));
+		for (int j = 0; j < 3; j++)
+		{
+			float m = 0.0f;
+			for (int k = 0; k < 3; k++)
+				m += fitMatrix[i * 3 + k] * old[k * 3 + j];
+			if (fabs(m) >= 1.999f) // Past Q14
+				return false;
+			newMatrix[i * 3 + j] = (short)(m * 16384.0f +
+			                               (m < 0.0f ? -0.5f : 0.5f));
+		}
+	}
+	if (setMagCalibration(newOffset, newMatrix) != INV_SUCCESS)
+		return false;
+	// What was learned is in the old correction's terms
+	mag_cal_reset(&_magCal, _magCal.min_step);
+	return true;
+}
+
+void MPU9250_DMP::resetMagCalibration(void)
+{
+	setMagCalibration(NULL, NULL);
+	mag_cal_reset(&_magCal, _magCal.min_step);
+	_magCalAdded = 0;
+	_magCalStatus = mag_cal_solve(&_magCal, &_magCalFit);
+}
+
+int MPU9250_DMP::getMagCalFit(struct mag_cal_fit_s * fit)
+{
+	*fit = _magCalFit;
+	return _magCalStatus;
+}
+
 unsigned short MPU9250_DMP::getCompassSampleRate(void)
 {
+	select();
 	unsigned short tmp;
 	if (mpu_get_compass_sample_rate(&tmp) == INV_SUCCESS)
 	{
@@ -192,6 +497,7 @@ unsigned short MPU9250_DMP::getCompassSampleRate(void)
 
 float MPU9250_DMP::getGyroSens(void)
 {
+	select();
 	float sens;
 	if (mpu_get_gyro_sens(&sens) == INV_SUCCESS)
 	{
@@ -202,6 +508,7 @@ float MPU9250_DMP::getGyroSens(void)
 	
 unsigned short MPU9250_DMP::getAccelSens(void)
 {
+	select();
 	unsigned short sens;
 	if (mpu_get_accel_sens(&sens) == INV_SUCCESS)
 	{
@@ -212,11 +519,13 @@ unsigned short MPU9250_DMP::getAccelSens(void)
 
 float MPU9250_DMP::getMagSens(void)
 {
+	select();
 	return 0.15; // Static, 4915/32760
 }
 
 unsigned char MPU9250_DMP::getFifoConfig(void)
 {
+	select();
 	unsigned char sensors;
 	if (mpu_get_fifo_config(&sensors) == INV_SUCCESS)
 	{
@@ -227,16 +536,182 @@ unsigned char MPU9250_DMP::getFifoConfig(void)
 
 inv_error_t MPU9250_DMP::configureFifo(unsigned char sensors)
 {
+	select();
 	return mpu_configure_fifo(sensors);
 }
 
 inv_error_t MPU9250_DMP::resetFifo(void)
 {
+	select();
 	return mpu_reset_fifo();
 }
 
+inv_error_t MPU9250_DMP::setFifoRecovery(unsigned char mode)
+{
+	select();
+	return mpu_set_fifo_recovery(mode);
+}
+
+inv_error_t MPU9250_DMP::getFifoStats(mpu_fifo_stats_s * stats)
+{
+	select();
+	return mpu_get_fifo_stats(stats);
+}
+
+inv_error_t MPU9250_DMP::beginCapture(unsigned char sensors,
+                                      unsigned short rate)
+{
+	select();
+	unsigned char dmpOn, values = 0;
+	mpu_fifo_stats_s fifoStats;
+	
+	if (sensors & INV_XYZ_ACCEL)
+		values += 3;
+	if (sensors & INV_X_GYRO)
+		values++;
+	if (sensors & INV_Y_GYRO)
+		values++;
+	if (sensors & INV_Z_GYRO)
+		values++;
+	if (!values)
+		return INV_ERROR;
+	// The bus carries about a byte per ten clocks. A capture it can't keep
+	// up with would only overflow the FIFO over and over.
+	unsigned long hz = (rate >= MPU_HIGH_RATE_HZ) ? MPU_HIGH_RATE_HZ : rate;
+	if (2UL * values * hz > getI2CClock() / 10)
+		return INV_ERROR;
+	
+	mpu_get_dmp_state(&dmpOn);
+	if (dmpOn)
+	{
+		if (mpu_set_dmp_state(0) != INV_SUCCESS)
+			return INV_ERROR;
+		_captureDmp = true;
+	}
+	if (rate >= MPU_HIGH_RATE_HZ)
+	{
+		if (mpu_set_high_rate(1) != INV_SUCCESS)
+			return INV_ERROR;
+		_captureRate = MPU_HIGH_RATE_HZ;
+	}
+	else
+	{
+		if ((mpu_set_high_rate(0) != INV_SUCCESS) ||
+		    (mpu_set_sample_rate(rate) != INV_SUCCESS) ||
+		    (mpu_get_sample_rate(&_captureRate) != INV_SUCCESS))
+			return INV_ERROR;
+	}
+	// The FIFO setup turns the data ready interrupt on. Turned off after
+	// it, it stays off through later FIFO resets.
+	if ((mpu_configure_fifo(sensors & (INV_XYZ_ACCEL | INV_XYZ_GYRO))
+	     != INV_SUCCESS) || (set_int_enable(0) != INV_SUCCESS))
+		return INV_ERROR;
+	
+	mpu_get_fifo_stats(&fifoStats);
+	_fifoOverflows = fifoStats.overflows;
+	_captureValues = values;
+	_captureMore = 0;
+	_captureSamples = _captureLost = _captureOverflows = 0;
+	_captureStartUs = _captureLastUs = micros();
+	return INV_SUCCESS;
+}
+
+inv_error_t MPU9250_DMP::endCapture(void)
+{
+	select();
+	inv_error_t result = INV_SUCCESS;
+	
+	_captureValues = 0;
+	// The FIFO_EN register is only written by a FIFO reset
+	if ((mpu_configure_fifo(0) != INV_SUCCESS) ||
+	    (mpu_set_high_rate(0) != INV_SUCCESS))
+		result = INV_ERROR;
+	if (_captureDmp)
+	{
+		_captureDmp = false;
+		if (mpu_set_dmp_state(1) != INV_SUCCESS)
+			result = INV_ERROR;
+	}
+	else if (mpu_reset_fifo() != INV_SUCCESS)
+	{
+		result = INV_ERROR;
+	}
+	return result;
+}
+
+unsigned char MPU9250_DMP::captureValues(void)
+{
+	return _captureValues;
+}
+
+inv_error_t MPU9250_DMP::updateCapture(short * values,
+                                       unsigned short maxSamples,
+                                       unsigned short * count,
+                                       unsigned long * index)
+{
+	select();
+	unsigned short more;
+	mpu_fifo_stats_s fifoStats;
+	
+	*count = 0;
+	if (!_captureValues)
+		return INV_ERROR;
+	unsigned long now = micros();
+	int result = mpu_read_fifo_burst(maxSamples, (unsigned char *)values,
+	                                 count, &more);
+	
+	// After an overflow, what arrived since the last read, and what was
+	// left then, is more than the FIFO still holds: the rest was
+	// overwritten (or, if the FIFO was reset, all of it)
+	mpu_get_fifo_stats(&fifoStats);
+	if (fifoStats.overflows != _fifoOverflows)
+	{
+		unsigned long arrived = _captureMore +
+			(unsigned long)((unsigned long long)(now - _captureLastUs) *
+			                _captureRate / 1000000);
+		unsigned long kept = *count + more;
+		if (arrived > kept)
+			_captureLost += arrived - kept;
+		_captureOverflows += fifoStats.overflows - _fifoOverflows;
+		_fifoOverflows = fifoStats.overflows;
+	}
+	_captureLastUs = now;
+	_captureMore = more;
+	if (result != INV_SUCCESS)
+	{
+		*count = 0;
+		_captureMore = 0;
+		return INV_ERROR;
+	}
+	
+	if (index != NULL)
+		*index = _captureSamples + _captureLost;
+	_captureSamples += *count;
+	// The FIFO's big-endian bytes to values, in place: each value's two
+	// bytes are read before they're overwritten
+	const unsigned char * bytes = (const unsigned char *)values;
+	unsigned int n = *count * _captureValues;
+	for (unsigned int i = 0; i < n; i++)
+		values[i] = (short)((bytes[2 * i] << 8) | bytes[2 * i + 1]);
+	return INV_SUCCESS;
+}
+
+inv_error_t MPU9250_DMP::getCaptureStats(capture_stats_s * stats)
+{
+	stats->samples = _captureSamples;
+	stats->lost = _captureLost;
+	stats->overflows = _captureOverflows;
+	stats->elapsedUs = _captureLastUs - _captureStartUs;
+	stats->rate = stats->elapsedUs ?
+		(unsigned long)((unsigned long long)_captureSamples * 1000000 /
+		                stats->elapsedUs) : 0;
+	stats->nominal = _captureRate;
+	return INV_SUCCESS;
+}
+
 unsigned short MPU9250_DMP::fifoAvailable(void)
 {
+	select();
 	unsigned char fifoH, fifoL;
 	
 	if (mpu_read_reg(MPU9250_FIFO_COUNTH, &fifoH) != INV_SUCCESS)
@@ -247,14 +722,24 @@ unsigned short MPU9250_DMP::fifoAvailable(void)
 	return (fifoH << 8 ) | fifoL;
 }
 
+unsigned char MPU9250_DMP::fifoPending(void)
+{
+	return _fifoMore;
+}
+
 inv_error_t MPU9250_DMP::updateFifo(void)
 {
+	select();
 	short gyro[3], accel[3];
 	unsigned long timestamp;
 	unsigned char sensors, more;
 	
 	if (mpu_read_fifo(gyro, accel, &timestamp, &sensors, &more) != INV_SUCCESS)
+	{
+		_fifoMore = 0;
 		return INV_ERROR;
+	}
+	_fifoMore = more;
 	
 	if (sensors & INV_XYZ_ACCEL)
 	{
@@ -276,11 +761,13 @@ inv_error_t MPU9250_DMP::updateFifo(void)
 
 inv_error_t MPU9250_DMP::setSensors(unsigned char sensors)
 {
+	select();
 	return mpu_set_sensors(sensors);
 }
 
 bool MPU9250_DMP::dataReady()
 {
+	select();
 	unsigned char intStatusReg;
 	
 	if (mpu_read_reg(MPU9250_INT_STATUS, &intStatusReg) == INV_SUCCESS)
@@ -311,6 +798,7 @@ inv_error_t MPU9250_DMP::update(unsigned char sensors)
 
 int MPU9250_DMP::updateAccel(void)
 {
+	select();
 	short data[3];
 	
 	if (mpu_get_accel_reg(data, &time))
@@ -325,6 +813,7 @@ int MPU9250_DMP::updateAccel(void)
 
 int MPU9250_DMP::updateGyro(void)
 {
+	select();
 	short data[3];
 	
 	if (mpu_get_gyro_reg(data, &time))
@@ -339,6 +828,7 @@ int MPU9250_DMP::updateGyro(void)
 
 int MPU9250_DMP::updateCompass(void)
 {
+	select();
 	short data[3];
 	
 	if (mpu_get_compass_reg(data, &time))
@@ -353,17 +843,20 @@ int MPU9250_DMP::updateCompass(void)
 
 inv_error_t MPU9250_DMP::updateTemperature(void)
 {
+	select();
 	return mpu_get_temperature(&temperature, &time);
 }
 
 int MPU9250_DMP::selfTest(unsigned char debug)
 {
+	select();
 	long gyro[3], accel[3];
 	return mpu_run_self_test(gyro, accel);
 }
 
 inv_error_t MPU9250_DMP::dmpBegin(unsigned short features, unsigned short fifoRate)
 {
+	select();
 	unsigned short feat = features;
 	unsigned short rate = fifoRate;
 
@@ -395,11 +888,13 @@ inv_error_t MPU9250_DMP::dmpBegin(unsigned short features, unsigned short fifoRa
 
 inv_error_t MPU9250_DMP::dmpLoad(void)
 {
+	select();
 	return dmp_load_motion_driver_firmware();
 }
 
 unsigned short MPU9250_DMP::dmpGetFifoRate(void)
 {
+	select();
 	unsigned short rate;
 	if (dmp_get_fifo_rate(&rate) == INV_SUCCESS)
 		return rate;
@@ -409,12 +904,14 @@ unsigned short MPU9250_DMP::dmpGetFifoRate(void)
 
 inv_error_t MPU9250_DMP::dmpSetFifoRate(unsigned short rate)
 {
+	select();
 	if (rate > MAX_DMP_SAMPLE_RATE) rate = MAX_DMP_SAMPLE_RATE;
 	return dmp_set_fifo_rate(rate);
 }
 
 inv_error_t MPU9250_DMP::dmpUpdateFifo(void)
 {
+	select();
 	short gyro[3];
 	short accel[3];
 	long quat[4];
@@ -425,8 +922,10 @@ inv_error_t MPU9250_DMP::dmpUpdateFifo(void)
 	if (dmp_read_fifo(gyro, accel, quat, &timestamp, &sensors, &more)
 		   != INV_SUCCESS)
     {
+	   _fifoMore = 0;
 	   return INV_ERROR;
     }
+	_fifoMore = more;
 	
 	if (sensors & INV_XYZ_ACCEL)
 	{
@@ -453,8 +952,243 @@ inv_error_t MPU9250_DMP::dmpUpdateFifo(void)
 	return INV_SUCCESS;
 }
 
+inv_error_t MPU9250_DMP::dmpUpdateFifoBurst(dmp_packet_s * packets,
+                                            unsigned char maxPackets, unsigned char * count)
+{
+	select();
+	unsigned long timestamp;
+	unsigned char more;
+	
+	if ((dmp_read_fifo_burst(packets, maxPackets, count, &timestamp, &more)
+		   != INV_SUCCESS) || (*count == 0))
+	{
+		_fifoMore = 0;
+		return INV_ERROR;
+	}
+	_fifoMore = more;
+	
+	loadPacket(&packets[*count - 1]);
+	time = timestamp;
+	
+	return INV_SUCCESS;
+}
+
+inv_error_t MPU9250_DMP::dmpStartFifoBurst(dmp_packet_s * packets,
+                                           unsigned char maxPackets,
+                                           void (*done)(void))
+{
+	if ((_burstResult == INV_PENDING) || !maxPackets)
+		return INV_ERROR;
+	_burstPackets = packets;
+	_burstMax = maxPackets;
+	_burstCount = 0;
+	_burstDone = done;
+	_burstResult = INV_PENDING;
+	
+	_countTxn.slave_addr = _address;
+	_countTxn.reg_addr = MPU9250_FIFO_COUNTH;
+	_countTxn.read = 1;
+	_countTxn.length = 2;
+	_countTxn.data = _countRegs;
+	_countTxn.done = fifoCountRead;
+	_countTxn.context = this;
+	if (arduino_i2c_submit(&_countTxn))
+	{
+		_burstResult = INV_ERROR;
+		return INV_ERROR;
+	}
+	return INV_SUCCESS;
+}
+
+inv_error_t MPU9250_DMP::dmpFifoBurstResult(unsigned char * count)
+{
+	*count = (_burstResult == INV_SUCCESS) ? _burstCount : 0;
+	return _burstResult;
+}
+
+inv_error_t MPU9250_DMP::startCompassRead(void (*done)(void))
+{
+	if (_compassResult == INV_PENDING)
+		return INV_ERROR;
+	_compassDone = done;
+	_compassResult = INV_PENDING;
+	
+	_compassTxn.slave_addr = _address;
+	_compassTxn.reg_addr = MPU9250_EXT_SENS_DATA_00;
+	_compassTxn.read = 1;
+	_compassTxn.length = sizeof(_compassRegs);
+	_compassTxn.data = _compassRegs;
+	_compassTxn.done = compassRead;
+	_compassTxn.context = this;
+	if (arduino_i2c_submit(&_compassTxn))
+	{
+		_compassResult = INV_ERROR;
+		return INV_ERROR;
+	}
+	return INV_SUCCESS;
+}
+
+inv_error_t MPU9250_DMP::compassReadResult(void)
+{
+	return _compassResult;
+}
+
+void MPU9250_DMP::asyncPoll(void)
+{
+	arduino_i2c_poll();
+}
+
+// The FIFO count of a background burst is in: queue reads of the packets
+// it says are there, in whole packets per transaction
+void MPU9250_DMP::fifoCountRead(i2c_txn_s * txn)
+{
+	MPU9250_DMP * imu = (MPU9250_DMP *)txn->context;
+	unsigned char length, packets, more;
+	deviceScope scope(imu);
+	
+	if (txn->status ||
+	    dmp_plan_fifo_burst(imu->_countRegs, imu->_burstMax, imu->_burstData,
+	                        &length, &packets, &more))
+	{
+		imu->_fifoMore = 0;
+		imu->finishBurst(INV_ERROR);
+		return;
+	}
+	imu->_fifoMore = more;
+	imu->_burstRead = packets;
+	imu->_burstFailed = false;
+	
+	unsigned short chunk = (I2C_MAX_READ_LENGTH / length) * length;
+	unsigned short remaining = packets * length;
+	unsigned char * data = imu->_burstData;
+	unsigned char reads = 0;
+	while (remaining)
+	{
+		i2c_txn_s * read = &imu->_dataTxns[reads++];
+		read->slave_addr = imu->_address;
+		read->reg_addr = MPU9250_FIFO_R_W;
+		read->read = 1;
+		read->length = (remaining > chunk) ? chunk : remaining;
+		read->data = data;
+		read->done = fifoDataRead;
+		read->context = imu;
+		data += read->length;
+		remaining -= read->length;
+	}
+	imu->_burstReadsLeft = reads;
+	for (unsigned char i = 0; i < reads; i++)
+		arduino_i2c_submit(&imu->_dataTxns[i]);
+}
+
+// One of a background burst's reads is done. Once they all are, decode
+// the packets.
+void MPU9250_DMP::fifoDataRead(i2c_txn_s * txn)
+{
+	MPU9250_DMP * imu = (MPU9250_DMP *)txn->context;
+	
+	if (txn->status)
+		imu->_burstFailed = true;
+	if (--imu->_burstReadsLeft)
+		return;
+	deviceScope scope(imu);
+	if (imu->_burstFailed)
+	{
+		mpu_fifo_read_failed();
+		imu->_fifoMore = 0;
+		imu->finishBurst(INV_ERROR);
+		return;
+	}
+	if ((dmp_decode_fifo_burst(imu->_burstData, imu->_burstRead,
+	                           imu->_burstPackets, &imu->_burstCount)
+	     != INV_SUCCESS) || !imu->_burstCount)
+	{
+		imu->_fifoMore = 0;
+		imu->finishBurst(INV_ERROR);
+		return;
+	}
+	imu->loadPacket(&imu->_burstPackets[imu->_burstCount - 1]);
+	imu->time = millis();
+	imu->finishBurst(INV_SUCCESS);
+}
+
+void MPU9250_DMP::finishBurst(inv_error_t result)
+{
+	_burstResult = result;
+	if (_burstDone)
+		_burstDone();
+}
+
+void MPU9250_DMP::compassRead(i2c_txn_s * txn)
+{
+	MPU9250_DMP * imu = (MPU9250_DMP *)txn->context;
+	short data[3];
+	deviceScope scope(imu);
+	
+	if (txn->status || mpu_decode_compass(imu->_compassRegs, data))
+	{
+		imu->_compassResult = INV_ERROR;
+	}
+	else
+	{
+		imu->mx = data[X_AXIS];
+		imu->my = data[Y_AXIS];
+		imu->mz = data[Z_AXIS];
+		imu->time = millis();
+		imu->_compassResult = INV_SUCCESS;
+	}
+	if (imu->_compassDone)
+		imu->_compassDone();
+}
+
+// Set the public sensor variables from a packet, for what it holds
+void MPU9250_DMP::loadPacket(const dmp_packet_s * packet)
+{
+	if (packet->sensors & INV_XYZ_ACCEL)
+	{
+		ax = packet->accel[X_AXIS];
+		ay = packet->accel[Y_AXIS];
+		az = packet->accel[Z_AXIS];
+	}
+	if (packet->sensors & INV_X_GYRO)
+		gx = packet->gyro[X_AXIS];
+	if (packet->sensors & INV_Y_GYRO)
+		gy = packet->gyro[Y_AXIS];
+	if (packet->sensors & INV_Z_GYRO)
+		gz = packet->gyro[Z_AXIS];
+	if (packet->sensors & INV_WXYZ_QUAT)
+	{
+		qw = packet->quat[0];
+		qx = packet->quat[1];
+		qy = packet->quat[2];
+		qz = packet->quat[3];
+	}
+	if (packet->sensors & INV_XYZ_COMPASS)
+	{
+		mx = packet->compass[X_AXIS];
+		my = packet->compass[Y_AXIS];
+		mz = packet->compass[Z_AXIS];
+	}
+}
+
+inv_error_t MPU9250_DMP::dmpEnableCompassFifo(unsigned char enable)
+{
+	select();
+	return dmp_enable_compass_fifo(enable);
+}
+
+bool MPU9250_DMP::dmpCompassFifoEnabled(void)
+{
+	select();
+	unsigned char enabled;
+	if (dmp_get_compass_fifo(&enabled) == INV_SUCCESS)
+		return enabled;
+	
+	return false;
+}
+
 inv_error_t MPU9250_DMP::dmpEnableFeatures(unsigned short mask)
 {
+	select();
 	unsigned short enMask = 0;
 	enMask |= mask;
 	// Combat known issue where fifo sample rate is incorrect
@@ -465,6 +1199,7 @@ inv_error_t MPU9250_DMP::dmpEnableFeatures(unsigned short mask)
 
 unsigned short MPU9250_DMP::dmpGetEnabledFeatures(void)
 {
+	select();
 	unsigned short mask;
 	if (dmp_get_enabled_features(&mask) == INV_SUCCESS)
 		return mask;
@@ -475,6 +1210,7 @@ inv_error_t MPU9250_DMP::dmpSetTap(
         unsigned short xThresh, unsigned short yThresh, unsigned short zThresh,
         unsigned char taps, unsigned short tapTime, unsigned short tapMulti)
 {
+	select();
 	unsigned char axes = 0;
 	if (xThresh > 0)
 	{
@@ -506,47 +1242,49 @@ inv_error_t MPU9250_DMP::dmpSetTap(
 	if (dmp_set_tap_time_multi(tapMulti) != INV_SUCCESS)
 		return INV_ERROR;
 	
-    dmp_register_tap_cb(tap_cb);
+    dmp_register_tap_cb(tapCallback);
 	
 	return INV_SUCCESS;
 }
 
 unsigned char MPU9250_DMP::getTapDir(void)
 {
-	_tap_available = false;
-	return tap_direction;
+	_tapAvailable = false;
+	return _tapDirection;
 }
 
 unsigned char MPU9250_DMP::getTapCount(void)
 {
-	_tap_available = false;
-	return tap_count;
+	_tapAvailable = false;
+	return _tapCount;
 }
 
 bool MPU9250_DMP::tapAvailable(void)
 {
-	return _tap_available;
+	return _tapAvailable;
 }
 
 inv_error_t MPU9250_DMP::dmpSetOrientation(const signed char * orientationMatrix)
 {
+	select();
 	unsigned short scalar;
 	scalar = orientation_row_2_scale(orientationMatrix);
 	scalar |= orientation_row_2_scale(orientationMatrix + 3) << 3;
 	scalar |= orientation_row_2_scale(orientationMatrix + 6) << 6;
 	
-    dmp_register_android_orient_cb(orient_cb);
+    dmp_register_android_orient_cb(orientCallback);
 	
 	return dmp_set_orientation(scalar);
 }
 
 unsigned char MPU9250_DMP::dmpGetOrientation(void)
 {
-	return mpu9250_orientation;
+	return _orientation;
 }
 
 inv_error_t MPU9250_DMP::dmpEnable3Quat(void)
 {
+	select();
 	unsigned short dmpFeatures;
 	
 	// 3-axis and 6-axis quat are mutually exclusive
@@ -562,6 +1300,7 @@ inv_error_t MPU9250_DMP::dmpEnable3Quat(void)
 	
 unsigned long MPU9250_DMP::dmpGetPedometerSteps(void)
 {
+	select();
 	unsigned long steps;
 	if (dmp_get_pedometer_step_count(&steps) == INV_SUCCESS)
 	{
@@ -572,11 +1311,13 @@ unsigned long MPU9250_DMP::dmpGetPedometerSteps(void)
 
 inv_error_t MPU9250_DMP::dmpSetPedometerSteps(unsigned long steps)
 {
+	select();
 	return dmp_set_pedometer_step_count(steps);
 }
 
 unsigned long MPU9250_DMP::dmpGetPedometerTime(void)
 {
+	select();
 	unsigned long walkTime;
 	if (dmp_get_pedometer_walk_time(&walkTime) == INV_SUCCESS)
 	{
@@ -587,9 +1328,34 @@ unsigned long MPU9250_DMP::dmpGetPedometerTime(void)
 
 inv_error_t MPU9250_DMP::dmpSetPedometerTime(unsigned long time)
 {
+	select();
 	return dmp_set_pedometer_walk_time(time);
 }
 
+inv_error_t MPU9250_DMP::dmpSetGyroBias(long * bias)
+{
+	select();
+	return dmp_set_gyro_bias(bias);
+}
+
+inv_error_t MPU9250_DMP::dmpSetAccelBias(long * bias)
+{
+	select();
+	return dmp_set_accel_bias(bias);
+}
+
+inv_error_t MPU9250_DMP::dmpGetGyroBias(long * bias)
+{
+	select();
+	return dmp_get_gyro_bias(bias);
+}
+
+inv_error_t MPU9250_DMP::dmpGetAccelBias(long * bias)
+{
+	select();
+	return dmp_get_accel_bias(bias);
+}
+
 float MPU9250_DMP::calcAccel(int axis)
 {
 	return (float) axis / (float) _aSense;
@@ -612,12 +1378,8 @@ float MPU9250_DMP::calcQuat(long axis)
 	
 float MPU9250_DMP::qToFloat(long number, unsigned char q)
 {
-	unsigned long mask;
-	for (int i=0; i<q; i++)
-	{
-		mask |= (1<<i);
-	}
-	return (number >> q) + ((number & mask) / (float) (2<<(q-1)));
+	// Scaling by a power of two is exact, so one multiply does it
+	return (float) number * (1.0f / (float) (1UL << q));
 }
 
 void MPU9250_DMP::computeEulerAngles(bool degrees)
@@ -656,7 +1418,7 @@ void MPU9250_DMP::computeEulerAngles(bool degrees)
 float MPU9250_DMP::computeCompassHeading(void)
 {
 	if (my == 0)
-		heading = (mx < 0) ? 180.0 : 0;
+		heading = (mx < 0) ? PI : 0;
 	else
 		heading = atan2(mx, my);
 	
@@ -669,6 +1431,144 @@ float MPU9250_DMP::computeCompassHeading(void)
 	return heading;
 }
 
+long MPU9250_DMP::calcAccelFixed(int axis)
+{
+	return fix_scale(&_aScale, axis);
+}
+
+long MPU9250_DMP::calcGyroFixed(int axis)
+{
+	return fix_scale(&_gScale, axis);
+}
+
+long MPU9250_DMP::calcMagFixed(int axis)
+{
+	return fix_scale(&_mScale, axis);
+}
+
+long MPU9250_DMP::calcQuatFixed(long axis)
+{
+	return fix_q30_to_q16(axis);
+}
+
+void MPU9250_DMP::computeEulerAnglesFixed(bool degrees)
+{
+	// Twice a Q30 product is the same number in Q29, which leaves room for
+	// the sums. Q30 products keep the precision needed near +/-90 degrees
+	// of pitch, where roll and yaw come from small differences.
+	long ysqr = fix_mul_q30(qy, qy);
+	long t0 = (1L << 29) - (ysqr + fix_mul_q30(qz, qz));
+	long t1 = fix_mul_q30(qx, qy) - fix_mul_q30(qw, qz);
+	long t2 = -(fix_mul_q30(qx, qz) + fix_mul_q30(qw, qy));
+	long t3 = fix_mul_q30(qy, qz) - fix_mul_q30(qw, qx);
+	long t4 = (1L << 29) - (fix_mul_q30(qx, qx) + ysqr);
+	
+	// Keep t2 within range of asin (-1, 1)
+	t2 = t2 > (1L << 29) ? (1L << 29) : t2;
+	t2 = t2 < -(1L << 29) ? -(1L << 29) : t2;
+	
+	pitchFixed = fix_asin(t2 << 1) * 2;
+	rollFixed = fix_atan2(t3, t4);
+	yawFixed = fix_atan2(t1, t0);
+	
+	if (degrees)
+	{
+		pitchFixed = fix_rad_to_deg(pitchFixed);
+		rollFixed = fix_rad_to_deg(rollFixed);
+		yawFixed = fix_rad_to_deg(yawFixed);
+		if (pitchFixed < 0) pitchFixed += FIX_360_Q16;
+		if (rollFixed < 0) rollFixed += FIX_360_Q16;
+		if (yawFixed < 0) yawFixed += FIX_360_Q16;
+	}
+}
+
+long MPU9250_DMP::computeCompassHeadingFixed(void)
+{
+	if (my == 0)
+		headingFixed = (mx < 0) ? (180L << 16) : 0;
+	else
+		headingFixed = fix_rad_to_deg(fix_atan2(mx, my));
+	
+	if (headingFixed < 0) headingFixed += FIX_360_Q16;
+	
+	return headingFixed;
+}
+
+void MPU9250_DMP::calcAccelBlock(const short * counts, float * out,
+                                 unsigned int n)
+{
+	block_scale(counts, out, n, 1.0f / (float) _aSense);
+}
+
+void MPU9250_DMP::calcGyroBlock(const short * counts, float * out,
+                                unsigned int n)
+{
+	block_scale(counts, out, n, 1.0f / _gSense);
+}
+
+void MPU9250_DMP::calcMagBlock(const short * counts, float * out,
+                               unsigned int n)
+{
+	block_scale(counts, out, n, 1.0f / _mSense);
+}
+
+void MPU9250_DMP::calcQuatBlock(const long * q30, float * out, unsigned int n)
+{
+	block_q30_to_float(q30, out, n);
+}
+
+void MPU9250_DMP::calcAccelBlockFixed(const short * counts, long * out,
+                                      unsigned int n)
+{
+	block_scale_fixed(&_aScale, counts, out, n);
+}
+
+void MPU9250_DMP::calcGyroBlockFixed(const short * counts, long * out,
+                                     unsigned int n)
+{
+	block_scale_fixed(&_gScale, counts, out, n);
+}
+
+void MPU9250_DMP::calcMagBlockFixed(const short * counts, long * out,
+                                    unsigned int n)
+{
+	block_scale_fixed(&_mScale, counts, out, n);
+}
+
+void MPU9250_DMP::calcQuatBlockFixed(const long * q30, long * out,
+                                     unsigned int n)
+{
+	block_q30_to_q16(q30, out, n);
+}
+
+void MPU9250_DMP::setFusionGains(float kp, float ki, unsigned short magRate)
+{
+	mag_fusion_set_gains(&_fusion, kp, ki, magRate);
+}
+
+void MPU9250_DMP::resetFusion(void)
+{
+	mag_fusion_reset(&_fusion);
+}
+
+void MPU9250_DMP::updateFusion(bool newMag)
+{
+	const long quat[4] = {qw, qx, qy, qz};
+	mag_fusion_update_quat(&_fusion, quat);
+	if (newMag)
+	{
+		// The AK8963's axes are the MPU-9250's with x and y swapped and z
+		// reversed
+		const long mag[3] = {my, mx, -mz};
+		mag_fusion_update_mag(&_fusion, mag);
+	}
+	fusedQw = _fusion.quat[0];
+	fusedQx = _fusion.quat[1];
+	fusedQy = _fusion.quat[2];
+	fusedQz = _fusion.quat[3];
+	fusedHeading = mag_fusion_heading(&_fusion);
+}
+
 unsigned short MPU9250_DMP::orientation_row_2_scale(const signed char *row)
 {
     unsigned short b;
@@ -690,14 +1590,83 @@ unsigned short MPU9250_DMP::orientation_row_2_scale(const signed char *row)
     return b;
 }
 		
-static void tap_cb(unsigned char direction, unsigned char count)
+inv_error_t MPU9250_DMP::select(void)
+{
+	return mpu_select_device(_device);
+}
+
+MPU9250_DMP::deviceScope::deviceScope(MPU9250_DMP * imu)
 {
-	_tap_available = true;
-	tap_count = count;
-	tap_direction = direction;
+	_saved = mpu_get_device();
+	imu->select();
 }
 
-static void orient_cb(unsigned char orient)
+MPU9250_DMP::deviceScope::~deviceScope()
 {
-	mpu9250_orientation = orient;
-}
\ No newline at end of file
+	mpu_select_device(_saved);
+}
+
+// The DMP driver calls these while reading the FIFO of the selected device
+void MPU9250_DMP::tapCallback(unsigned char direction, unsigned char count)
+{
+	MPU9250_DMP * imu = _instances[mpu_get_device()];
+	imu->_tapAvailable = true;
+	imu->_tapCount = count;
+	imu->_tapDirection = direction;
+}
+
+void MPU9250_DMP::orientCallback(unsigned char orient)
+{
+	_instances[mpu_get_device()]->_orientation = orient;
+}
+MPU9250_DMP_RoundRobin::MPU9250_DMP_RoundRobin(MPU9250_DMP * const * imus,
+                                               unsigned char count)
+{
+	_imus = imus;
+	_count = (count < MPU_MAX_DEVICES) ? count : MPU_MAX_DEVICES;
+	_next = 0;
+	for (unsigned char i = 0; i < MPU_MAX_DEVICES; i++)
+		_signalled[i] = false;
+}
+
+void MPU9250_DMP_RoundRobin::signal(unsigned char index)
+{
+	if (index < _count)
+		_signalled[index] = true;
+}
+
+void MPU9250_DMP_RoundRobin::signalAll(void)
+{
+	for (unsigned char i = 0; i < _count; i++)
+		_signalled[i] = true;
+}
+
+int MPU9250_DMP_RoundRobin::poll(dmp_packet_s * packets,
+                                 unsigned char maxPackets, unsigned char * count)
+{
+	// dmpUpdateFifoBurst() selects each device it reads; put back the one
+	// the caller had selected
+	unsigned char saved = mpu_get_device();
+	int result = -1;
+	*count = 0;
+	for (unsigned char i = 0; i < _count; i++)
+	{
+		unsigned char index = (_next + i) % _count;
+		MPU9250_DMP * imu = _imus[index];
+		if (!_signalled[index] && !imu->fifoPending())
+			continue;
+		// Cleared before reading: a signal that comes in during the read is
+		// for data the next poll will find.
+		_signalled[index] = false;
+		if ((imu->dmpUpdateFifoBurst(packets, maxPackets, count) == INV_SUCCESS)
+		    && (*count > 0))
+		{
+			_next = (index + 1) % _count;
+			result = index;
+			break;
+		}
+		*count = 0;
+	}
+	mpu_select_device(saved);
+	return result;
+}
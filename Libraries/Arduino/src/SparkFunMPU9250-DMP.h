@@ -31,11 +31,17 @@ Supported Platforms:
 extern "C" {
 #include "util/inv_mpu.h"
 #include "util/inv_mpu_dmp_motion_driver.h"
+#include "util/fixed_math.h"
+#include "util/block_convert.h"
+#include "util/mag_fusion.h"
+#include "util/mag_cal.h"
 }
+#include "util/arduino_mpu9250_i2c.h"
 
 typedef int inv_error_t;
 #define INV_SUCCESS 0
 #define INV_ERROR 0x20
+#define INV_PENDING 0x21 // A background read is still running
 
 enum t_axisOrder {
 	X_AXIS, // 0
@@ -54,9 +60,40 @@ enum t_axisOrder {
 #define INT_LATCHED     1
 #define INT_50US_PULSE  0
 
+#define FIFO_RECOVERY_RESET  MPU_FIFO_RECOVERY_RESET
+#define FIFO_RECOVERY_RESYNC MPU_FIFO_RECOVERY_RESYNC
+
+// I2C addresses, with the MPU-9250's AD0 pin low or high
+#define MPU9250_ADDRESS_AD0_LOW  0x68
+#define MPU9250_ADDRESS_AD0_HIGH 0x69
+
+#define COMPASS_MODE_SINGLE     MPU_COMPASS_SINGLE
+#define COMPASS_MODE_CONTINUOUS MPU_COMPASS_CONTINUOUS
+
+// updateMagCalibration() fits the ellipsoid every this many readings it
+// learns from, and only changes the calibration if the fit moves it by
+// more than MAG_CAL_MIN_CHANGE (of the field, about 0.3 degrees of heading)
+#define MAG_CAL_SOLVE_INTERVAL 50
+#define MAG_CAL_MIN_CHANGE 0.005f
+
+// tuneI2CClock() checks each clock with this many rounds of a WHO_AM_I
+// read and a drain of the DMP FIFO
+#define I2C_PROBE_ROUNDS 32
+
 #define MAX_DMP_SAMPLE_RATE 200 // Maximum sample rate for the DMP FIFO (200Hz)
 #define FIFO_BUFFER_SIZE 512 // Max FIFO buffer size
 
+// Progress of a raw capture, from getCaptureStats()
+struct capture_stats_s
+{
+	unsigned long samples;   // Samples read
+	unsigned long lost;      // Samples lost to FIFO overflows (estimated)
+	unsigned long overflows; // FIFO overflows
+	unsigned long elapsedUs; // From beginCapture() to the last read
+	unsigned long rate;      // Samples read per second of that (Hz)
+	unsigned short nominal;  // Sample rate set (Hz)
+};
+
 const signed char defaultOrientation[9] = {
 	1, 0, 0,
 	0, 1, 0,
@@ -78,8 +115,26 @@ public:
 	unsigned long time;
 	float pitch, roll, yaw;
 	float heading;
+	// pitch, roll, yaw and heading in Q16 (1.0 = 65536), from the *Fixed
+	// compute methods
+	long pitchFixed, rollFixed, yawFixed;
+	long headingFixed;
+	// The DMP's quaternion with its yaw corrected by the compass (Q30), and
+	// the heading it gives (degrees, Q16), from updateFusion()
+	long fusedQw, fusedQx, fusedQy, fusedQz;
+	long fusedHeading;
 	
-	MPU9250_DMP();
+	// MPU9250_DMP(unsigned char) -- Each object drives its own MPU-9250: up
+	// to MPU_MAX_DEVICES (2) of them, on one bus at different addresses.
+	// They must be begun one at a time (begin() uses the compass's bypass
+	// mode, where every device's compass shares one address). Objects past
+	// MPU_MAX_DEVICES fail begin().
+	// Input: I2C address - MPU9250_ADDRESS_AD0_LOW (0x68, default) or
+	//  MPU9250_ADDRESS_AD0_HIGH (0x69)
+	MPU9250_DMP(unsigned char address = MPU9250_ADDRESS_AD0_LOW);
+	// ~MPU9250_DMP -- Waits for its background reads to finish, and frees
+	// its device state for another object.
+	~MPU9250_DMP();
 	
 	// begin(void) -- Verifies communication with the MPU-9250 and the AK8963,
 	// and initializes them to the default state:
@@ -91,6 +146,77 @@ public:
 	// Output: INV_SUCCESS (0) on success, otherwise error
 	inv_error_t begin(void);
 	
+	// setFastBoot -- Keeps the DMP image loaded in the MPU-9250 across resets
+	// of the microcontroller alone (watchdog, bootloader, brown-out without
+	// the IMU losing power): begin() finds it and skips the chip reset, and
+	// dmpBegin() skips the load. DMP settings dmpBegin() doesn't make, and
+	// the bias registers, keep their earlier values. Call before begin().
+	// Input: 1 to enable, 0 to disable (always reset and load)
+	// Output: INV_SUCCESS (0) on success, otherwise error
+	inv_error_t setFastBoot(unsigned char enable = 1);
+	// getBootStats -- Returns how long begin() and the DMP load took, and
+	// whether the DMP image was found resident
+	// Input: Pointer to the statistics to fill in
+	// Output: INV_SUCCESS (0) on success, otherwise error
+	inv_error_t getBootStats(mpu_boot_stats_s * stats);
+	
+	// setRegShadow -- The driver keeps a copy of the configuration registers
+	// it writes, so read-modify-write setters don't read them back over I2C,
+	// and writes that change nothing are skipped. On by default. Turn it off
+	// if something else may write the MPU-9250's registers.
+	// Input: 1 to enable, 0 to read and write every register on the bus
+	// Output: INV_SUCCESS (0) on success, otherwise error
+	inv_error_t setRegShadow(unsigned char enable = 1);
+	// deferWrites -- Holds back configuration writes (rates, LPFs, FSRs,
+	// offsets) and FIFO resets until flushWrites(), which writes the changed
+	// registers in bursts, and resets the FIFO once. Use it around several
+	// changes at once. Don't read the FIFO in between.
+	// Output: INV_SUCCESS (0) on success, otherwise error
+	inv_error_t deferWrites(void);
+	// flushWrites -- Writes what deferWrites() held back
+	// Output: INV_SUCCESS (0) on success, otherwise error
+	inv_error_t flushWrites(void);
+	// getShadowStats -- Returns counts of register reads and writes the
+	// shadow saved, and deferred writes merged into bursts
+	// Input: Pointer to the statistics to fill in
+	// Output: INV_SUCCESS (0) on success, otherwise error
+	inv_error_t getShadowStats(mpu_shadow_stats_s * stats);
+	
+	// setI2CRetryBudget -- How long a failed I2C transfer is retried for,
+	// after its first attempt failed. A bus error (a slave holding SDA low)
+	// is recovered from either way, by clocking SCL. The setting is shared
+	// by every device on the bus.
+	// Input: Time in microseconds (I2C_RETRY_BUDGET_US by default), 0 to
+	//        fail on the first error
+	void setI2CRetryBudget(unsigned long us);
+	// getI2CStats -- Returns counts of I2C transfers, retries, transfers
+	// that failed anyway, and bus recoveries, and of failed attempts by
+	// error, for every device on the bus
+	// Input: Pointer to the statistics to fill in
+	// Output: INV_SUCCESS (0) on success, otherwise error
+	inv_error_t getI2CStats(i2c_stats_s * stats);
+	// setI2CClock -- Sets the I2C clock, kept across bus recoveries, for
+	// every device on the bus. begin() leaves it at the Wire library's
+	// default, I2C_CLOCK_STANDARD.
+	// Input: Clock in Hz: I2C_CLOCK_STANDARD (100kHz), I2C_CLOCK_FAST
+	//        (400kHz) or I2C_CLOCK_FAST_PLUS (1MHz)
+	void setI2CClock(unsigned long hz);
+	// getI2CClock -- Returns the I2C clock, in Hz
+	unsigned long getI2CClock(void);
+	// tuneI2CClock -- Finds the fastest I2C clock, up to maxHz, that the bus
+	// runs reliably: tries fast mode plus, fast mode and standard mode,
+	// fastest first, each with I2C_PROBE_ROUNDS rounds of a WHO_AM_I read
+	// and a drain of the DMP FIFO. A clock passes if WHO_AM_I always reads
+	// as it does at the standard clock, every transfer worked the first
+	// time, and no packet failed the driver's checks (the quaternion's
+	// magnitude, if it's sent). Call it after dmpBegin(); the packets it
+	// reads are dropped. It takes about I2C_PROBE_ROUNDS FIFO periods for
+	// the clock it keeps, and stops at the first failure on the others.
+	// Input: The fastest clock to try (Hz)
+	// Output: INV_SUCCESS (0) with the clock set, otherwise error, with
+	//         the clock at I2C_CLOCK_STANDARD
+	inv_error_t tuneI2CClock(unsigned long maxHz = I2C_CLOCK_FAST);
+	
 	// setSensors(unsigned char) -- Turn on or off MPU-9250 sensors. Any of the 
 	// following defines can be combined: INV_XYZ_GYRO, INV_XYZ_ACCEL, 
 	// INV_XYZ_COMPASS, INV_X_GYRO, INV_Y_GYRO, or INV_Z_GYRO
@@ -166,10 +292,49 @@ public:
 	//
 	// Output: set sample rate of the magnetometer. A value between 1-100
 	unsigned short getCompassSampleRate(void);
+	// setCompassMode -- Selects how the magnetometer measures.
+	// Input: COMPASS_MODE_SINGLE to trigger a measurement after every read
+	//        (the default), or COMPASS_MODE_CONTINUOUS to have it measure on
+	//        its own at 100Hz (8Hz for sample rates up to 8Hz), which saves
+	//        a write on the auxiliary bus per sample. Reads that find no new
+	//        measurement then fail with updateCompass().
+	// Output: INV_SUCCESS (0) on success, otherwise error
+	inv_error_t setCompassMode(unsigned char mode);
+	
+	// Hard- and soft-iron calibration: iron on the board offsets and bends
+	// the field the magnetometer sees. Once set, every compass reading
+	// (updateCompass(), and compass data read with the DMP's packets) is
+	// corrected to matrix * (reading - offset), in counts. See
+	// util/mag_cal.h.
+	// setMagCalibration -- Set the correction, e.g. one saved from
+	// getMagCalibration(). begin() clears it.
+	// Input: offset (x, y, z, counts), matrix (row major, Q14, 16384 = 1),
+	//        or NULL for no correction
+	// Output: INV_SUCCESS (0) on success, otherwise error
+	inv_error_t setMagCalibration(const short * offset, const short * matrix);
+	// getMagCalibration -- Get the correction in use
+	// Output: offset and matrix, as for setMagCalibration(), filled in. An
+	//         identity correction if there's none. INV_SUCCESS (0) on
+	//         success, otherwise error
+	inv_error_t getMagCalibration(short * offset, short * matrix);
+	// updateMagCalibration -- Learn the calibration online from the most
+	// recently read mx, my and mz. Call once per new compass reading, while
+	// the board is turned every which way. Every MAG_CAL_SOLVE_INTERVAL
+	// readings learned from, it fits an ellipsoid to them, and if the fit
+	// is good, refines the correction.
+	// Output: true if the correction changed
+	bool updateMagCalibration(void);
+	// resetMagCalibration -- Stop correcting, and forget what was learned
+	void resetMagCalibration(void);
+	// getMagCalFit -- The last fit updateMagCalibration() tried
+	// Output: fit filled in, relative to the correction at the time.
+	//         Returns 0 if it was good, or why it wasn't (MAG_CAL_TOO_FEW
+	//         and so on, see util/mag_cal.h)
+	int getMagCalFit(struct mag_cal_fit_s * fit);
 	
 	// dataReady -- checks to see if new accel/gyro data is available.
-	// (New magnetometer data cannot be checked, as the library runs that sensor 
-	//  in single-conversion mode.)
+	// (New magnetometer data isn't checked here: updateCompass() fails if
+	//  there is none.)
 	// Output: true if new accel/gyro data is available
 	bool dataReady();
 	
@@ -210,9 +375,69 @@ public:
 	// in ax, ay, az, gx, gy, or gz (depending on how the FIFO is configured).
 	// Output: INV_SUCCESS (0) on success, otherwise error
 	inv_error_t updateFifo(void);
+	// fifoPending -- Returns the number of complete packets that were still
+	// waiting in the FIFO after the last updateFifo or dmpUpdateFifo call.
+	// Can be used to keep draining without re-reading the FIFO count.
+	// Output: Number of packets remaining in the FIFO
+	unsigned char fifoPending(void);
 	// resetFifo -- Resets the FIFO's read/write pointers
 	// Output: INV_SUCCESS (0) on success, otherwise error
 	inv_error_t resetFifo(void);
+	// setFifoRecovery -- Selects what the DMP FIFO reads do after the FIFO
+	// overflows. Call it after begin().
+	// Input: FIFO_RECOVERY_RESET to reset the FIFO, losing everything in it
+	//        (the default, >50ms), or FIFO_RECOVERY_RESYNC to realign to the
+	//        next whole packet and carry on, losing only overwritten packets
+	// Output: INV_SUCCESS (0) on success, otherwise error
+	inv_error_t setFifoRecovery(unsigned char mode);
+	// getFifoStats -- Returns counts of FIFO overflows, realignments and
+	// resets since begin()
+	// Input: Pointer to the statistics to fill in
+	// Output: INV_SUCCESS (0) on success, otherwise error
+	inv_error_t getFifoStats(mpu_fifo_stats_s * stats);
+	
+	// Raw capture: the accel and gyro straight from the FIFO, without the
+	// DMP, at up to 1kHz through the DLPF, or with it bypassed, at 8kHz
+	// (gyro, 3600Hz bandwidth) and 4kHz (accel, 1130Hz). Every value read
+	// is two bytes over I2C: a 400kHz bus carries about 40kB/s, so all six
+	// axes at 8kHz (96kB/s) won't keep up, but one or two gyro axes will.
+	// beginCapture -- Stop the DMP, if it's running, and start writing
+	// samples of the chosen sensors into the FIFO. The INT pin's data
+	// ready interrupt is turned off: it would fire at the full rate. Use
+	// updateCapture() to read them.
+	// Input: sensors - any of INV_XYZ_ACCEL, INV_X_GYRO, INV_Y_GYRO and
+	//        INV_Z_GYRO (or INV_XYZ_GYRO); rate - 4 to 1000Hz, with the
+	//        DLPF at half of it, or MPU_HIGH_RATE_HZ (8000) to bypass it
+	// Output: INV_SUCCESS (0) on success, otherwise error, including when
+	//         the I2C clock (setI2CClock()) is too slow for the samples: it
+	//         must be at least 10 times their bytes per second
+	inv_error_t beginCapture(unsigned char sensors,
+	                         unsigned short rate = MPU_HIGH_RATE_HZ);
+	// endCapture -- Stop writing samples into the FIFO, put the DLPF back,
+	// and restart the DMP if beginCapture() stopped it
+	// Output: INV_SUCCESS (0) on success, otherwise error
+	inv_error_t endCapture(void);
+	// captureValues -- Values per captured sample: 3 for the accel, and
+	// 1 for each gyro axis. 0 if not capturing.
+	unsigned char captureValues(void);
+	// updateCapture -- Reads up to maxSamples samples from the FIFO, with
+	// one FIFO count read and as few I2C transfers as possible. Each
+	// sample is captureValues() raw values: accel x, y and z, then gyro x,
+	// y and z, of those captured.
+	// Input: Array of at least maxSamples * captureValues() values, its
+	//        size in samples, a pointer to the number of samples read, and
+	//        optionally to the number of the first one since beginCapture()
+	//        (with those lost to overflows counted, so a gap is a loss)
+	// Output: INV_SUCCESS (0) on success (possibly with no samples),
+	//         otherwise error
+	inv_error_t updateCapture(short * values, unsigned short maxSamples,
+	                          unsigned short * count,
+	                          unsigned long * index = NULL);
+	// getCaptureStats -- Returns what the capture since beginCapture() has
+	// read and lost, and the rate it sustained
+	// Input: Pointer to the statistics to fill in
+	// Output: INV_SUCCESS (0) on success, otherwise error
+	inv_error_t getCaptureStats(capture_stats_s * stats);
 	
 	// enableInterrupt -- Configure the MPU-9250's interrupt output to indicate
 	// when new data is ready.
@@ -270,6 +495,64 @@ public:
 	// Output: INV_SUCCESS (0) on success, otherwise error
 	inv_error_t dmpUpdateFifo(void); 
 	
+	// dmpUpdateFifoBurst -- Reads up to maxPackets packets from the FIFO with a
+	// single FIFO count read and as few I2C transfers as possible. Each packet
+	// is decoded into the packets array (oldest first), and the public
+	// accelerometer, gyroscope, quaternion, and time variables (and compass,
+	// if it's read through the FIFO) are set from the newest one.
+	// Input: Array of decoded packets, its size (up to DMP_MAX_BURST_PACKETS),
+	//        and a pointer to the number of packets read.
+	// Output: INV_SUCCESS (0) on success, otherwise error
+	inv_error_t dmpUpdateFifoBurst(dmp_packet_s * packets,
+	                               unsigned char maxPackets, unsigned char * count);
+	
+	// Background reads, through the I2C transaction queue (see
+	// util/arduino_mpu9250_i2c.h): the bus transfers run without the CPU
+	// (by DMA on the SAMD21), which can get on with something else, calling
+	// asyncPoll() now and then to move the reads along. Only one of each
+	// can run at a time, per object.
+	// dmpStartFifoBurst -- Starts reading what dmpUpdateFifoBurst() reads.
+	// Once the FIFO count is in, the packets are read in the same
+	// transfers, so it takes two asyncPoll()'s at least.
+	// Input: Array of decoded packets, which must stay valid until it's
+	//        done, its size (up to DMP_MAX_BURST_PACKETS), and a function
+	//        to call from asyncPoll() when it's done (or NULL)
+	// Output: INV_SUCCESS (0) if started, otherwise error
+	inv_error_t dmpStartFifoBurst(dmp_packet_s * packets,
+	                              unsigned char maxPackets,
+	                              void (*done)(void) = NULL);
+	// dmpFifoBurstResult -- How the last dmpStartFifoBurst() went. Once
+	// it's done, the public variables are set from the newest packet, as
+	// by dmpUpdateFifoBurst(), and fifoPending() counts the packets left.
+	// Input: Pointer to the number of packets read
+	// Output: INV_PENDING until it's done, then INV_SUCCESS (0) or error
+	inv_error_t dmpFifoBurstResult(unsigned char * count);
+	// startCompassRead -- Starts reading the compass, from the registers
+	// the MPU-9250's auxiliary I2C master reads it into, as updateCompass()
+	// does
+	// Input: A function to call from asyncPoll() when it's done (or NULL)
+	// Output: INV_SUCCESS (0) if started, otherwise error
+	inv_error_t startCompassRead(void (*done)(void) = NULL);
+	// compassReadResult -- How the last startCompassRead() went. Once it's
+	// done, mx, my and mz are set, as by updateCompass().
+	// Output: INV_PENDING until it's done, then INV_SUCCESS (0) or error
+	inv_error_t compassReadResult(void);
+	// asyncPoll -- Moves background reads along, and calls the done
+	// functions of those that finished. Shared by every device on the bus.
+	static void asyncPoll(void);
+	
+	// dmpEnableCompassFifo -- Reads the compass through the FIFO: its data is
+	// written into the FIFO with every sample, and returned with each packet
+	// by dmpUpdateFifoBurst, instead of needing updateCompass(). Only for
+	// FIFO rates of 50Hz and up; it's turned off by lower dmpSetFifoRate's.
+	// Resets the FIFO.
+	// Input: 1 to enable, 0 to disable
+	// Output: INV_SUCCESS (0) on success, otherwise error
+	inv_error_t dmpEnableCompassFifo(unsigned char enable = 1);
+	// dmpCompassFifoEnabled -- Returns true if the compass is read through
+	// the FIFO
+	bool dmpCompassFifoEnabled(void);
+	
 	// dmpEnableFeatures -- Enable one, or multiple DMP features.
 	// Input: An OR'd list of features (see dmpBegin)
 	// Output: INV_SUCCESS (0) on success, otherwise error
@@ -339,12 +622,24 @@ public:
 	// dmpSetInterruptMode --
 	// Output: INV_SUCCESS (0) on success, otherwise error
 	inv_error_t dmpSetInterruptMode(unsigned char mode);
-	// dmpSetGyroBias --
+	// dmpSetGyroBias -- Push gyro biases to the DMP, to be removed from the
+	// quaternion (and calibrated gyro). Gyro calibration replaces them
+	// once it has computed its own.
+	// Input: x, y, z biases in q16, as read by dmpGetGyroBias
 	// Output: INV_SUCCESS (0) on success, otherwise error
 	inv_error_t dmpSetGyroBias(long * bias);
-	// dmpSetAccelBias -- 
+	// dmpSetAccelBias -- Push accel biases to the DMP, to be removed from
+	// the 6-axis quaternion. Push them again after an accel FSR change.
+	// Input: x, y, z biases in q16, as read by dmpGetAccelBias
 	// Output: INV_SUCCESS (0) on success, otherwise error
 	inv_error_t dmpSetAccelBias(long * bias);
+	// dmpGetGyroBias -- Read back the gyro biases the DMP is using: the ones
+	// gyro calibration computed last, or else the ones pushed.
+	// Output: x, y, z biases in q16 in bias. INV_SUCCESS (0) on success
+	inv_error_t dmpGetGyroBias(long * bias);
+	// dmpGetAccelBias -- Read back the accel biases last pushed to the DMP
+	// Output: x, y, z biases in q16 in bias. INV_SUCCESS (0) on success
+	inv_error_t dmpGetAccelBias(long * bias);
 	
 	// lowPowerAccel --
 	// Output: INV_SUCCESS (0) on success, otherwise error
@@ -368,6 +663,68 @@ public:
 	// Output: class variable heading will be updated on exit
 	float computeCompassHeading(void);
 	
+	// The *Fixed versions of the calc and compute methods give the same
+	// results in Q16 (1.0 = 65536), without the floating point the SAMD21
+	// has to do in software. Error bounds are in util/fixed_math.h.
+	// calcAccelFixed -- Convert 16-bit signed acceleration value to g's, Q16
+	long calcAccelFixed(int axis);
+	// calcGyroFixed -- Convert 16-bit signed gyroscope value to degrees per
+	// second, Q16
+	long calcGyroFixed(int axis);
+	// calcMagFixed -- Convert 16-bit signed magnetometer value to microtesla
+	// (uT), Q16
+	long calcMagFixed(int axis);
+	// calcQuatFixed -- Convert Q30-format quaternion to Q16
+	long calcQuatFixed(long axis);
+	// computeEulerAnglesFixed -- computeEulerAngles(), to within 0.01
+	// degrees
+	// Input: boolean indicating whether angle results are presented in degrees or radians
+	// Output: class variables rollFixed, pitchFixed, and yawFixed will be
+	// updated on exit.
+	void computeEulerAnglesFixed(bool degrees = true);
+	// computeCompassHeadingFixed -- computeCompassHeading(), in degrees, Q16
+	// Output: class variable headingFixed will be updated on exit
+	long computeCompassHeadingFixed(void);
+	
+	// The *Block versions of the calc methods convert n samples of one
+	// axis at a time, from an array of counts (e.g. every ax of a FIFO
+	// drain) to an array of results, in one unrollable loop. counts and
+	// out must not overlap. The float versions multiply by the
+	// reciprocal sensitivity, so can differ from calc*() in the last bit.
+	// calcAccelBlock -- calcAccel() for each of counts[0..n-1]
+	void calcAccelBlock(const short * counts, float * out, unsigned int n);
+	// calcGyroBlock -- calcGyro() for each of counts[0..n-1]
+	void calcGyroBlock(const short * counts, float * out, unsigned int n);
+	// calcMagBlock -- calcMag() for each of counts[0..n-1]
+	void calcMagBlock(const short * counts, float * out, unsigned int n);
+	// calcQuatBlock -- calcQuat() for each of q30[0..n-1]
+	void calcQuatBlock(const long * q30, float * out, unsigned int n);
+	// calcAccelBlockFixed -- calcAccelFixed() for each of counts[0..n-1]
+	void calcAccelBlockFixed(const short * counts, long * out, unsigned int n);
+	// calcGyroBlockFixed -- calcGyroFixed() for each of counts[0..n-1]
+	void calcGyroBlockFixed(const short * counts, long * out, unsigned int n);
+	// calcMagBlockFixed -- calcMagFixed() for each of counts[0..n-1]
+	void calcMagBlockFixed(const short * counts, long * out, unsigned int n);
+	// calcQuatBlockFixed -- calcQuatFixed() for each of q30[0..n-1]
+	void calcQuatBlockFixed(const long * q30, long * out, unsigned int n);
+	
+	// 9-axis fusion: the DMP's 6-axis quaternion only has gravity to
+	// correct it, so its yaw drifts. updateFusion() corrects the yaw from
+	// the compass, tilt compensated. See util/mag_fusion.h.
+	// setFusionGains -- Set how fast the yaw follows the compass (kp, 1/s)
+	// and learns the DMP's yaw drift (ki, 1/s^2)
+	// Input: gains, and how often updateFusion() gets a new compass
+	// reading (Hz)
+	void setFusionGains(float kp, float ki, unsigned short magRate);
+	// resetFusion -- Forget the learned yaw. The next compass reading sets
+	// it outright.
+	void resetFusion(void);
+	// updateFusion -- Fuse the most recently read qw, qx, qy and qz with
+	// mx, my and mz, if newMag is true. Call for every DMP quaternion.
+	// Output: class variables fusedQw, fusedQx, fusedQy, fusedQz and
+	// fusedHeading will be updated on exit.
+	void updateFusion(bool newMag = true);
+	
 	// selfTest -- Run gyro and accel self-test.
 	// Output: Returns bit mask, 1 indicates success. A 0x7 is success on all sensors.
 	//         Bit pos 0: gyro
@@ -378,10 +735,103 @@ public:
 private:
 	unsigned short _aSense;
 	float _gSense, _mSense;
+	// Reciprocal multiplies for the *Fixed calc methods, set with the
+	// sensitivities
+	struct fix_scale_s _aScale, _gScale, _mScale;
+	struct mag_fusion_s _fusion;
+	struct mag_cal_s _magCal;
+	struct mag_cal_fit_s _magCalFit;
+	int _magCalStatus;
+	unsigned short _magCalAdded; // Readings learned since the last fit
+	unsigned char _fifoMore;
+	// Background reads, see dmpStartFifoBurst() and startCompassRead()
+	i2c_txn_s _countTxn, _compassTxn;
+	i2c_txn_s _dataTxns[DMP_MAX_BURST_PACKETS];
+	unsigned char _countRegs[2];
+	unsigned char _compassRegs[8]; // ST1 to ST2
+	unsigned char _burstData[DMP_MAX_BURST_BYTES];
+	dmp_packet_s * _burstPackets;
+	unsigned char _burstMax, _burstRead, _burstCount, _burstReadsLeft;
+	bool _burstFailed;
+	volatile inv_error_t _burstResult, _compassResult;
+	void (*_burstDone)(void);
+	void (*_compassDone)(void);
+	// Raw capture state, see beginCapture()
+	unsigned char _captureValues; // Values per sample, 0 if not capturing
+	bool _captureDmp; // The DMP was stopped for it
+	unsigned short _captureRate; // Hz
+	unsigned short _captureMore; // Samples left in the FIFO by the last read
+	unsigned long _captureStartUs, _captureLastUs; // micros()
+	unsigned long _captureSamples, _captureLost, _captureOverflows;
+	unsigned long _fifoOverflows; // The driver's count at the last read
+	unsigned char _address;
+	unsigned char _device; // The driver's device state this object uses
+	unsigned char _orientation;
+	unsigned char _tapCount;
+	unsigned char _tapDirection;
+	bool _tapAvailable;
+	
+	static MPU9250_DMP * _instances[MPU_MAX_DEVICES];
+	
+	// Make the driver work on this object's device. Every method that uses
+	// the driver calls this first.
+	inv_error_t select(void);
+	// Selects a device for as long as it's in scope, then puts back the
+	// one that was selected. For the done functions, which asyncPoll() may
+	// call in the middle of a method working on another device.
+	class deviceScope
+	{
+	public:
+		deviceScope(MPU9250_DMP * imu);
+		~deviceScope();
+	private:
+		unsigned char _saved;
+	};
+	static void fifoCountRead(i2c_txn_s * txn);
+	static void fifoDataRead(i2c_txn_s * txn);
+	static void compassRead(i2c_txn_s * txn);
+	void finishBurst(inv_error_t result);
+	void loadPacket(const dmp_packet_s * packet);
+	bool probeI2CClock(unsigned char whoAmI);
+	static void tapCallback(unsigned char direction, unsigned char count);
+	static void orientCallback(unsigned char orient);
 	
 	// Convert a QN-format number to a float
 	float qToFloat(long number, unsigned char q);
 	unsigned short orientation_row_2_scale(const signed char *row);
 };
 
+// MPU9250_DMP_RoundRobin -- Reads the DMP FIFOs of several MPU9250_DMP's
+// on one bus, one burst from each in turn, so a device with a backlog
+// can't hold the bus while the others' FIFOs fill.
+class MPU9250_DMP_RoundRobin
+{
+public:
+	// MPU9250_DMP_RoundRobin -- Input: An array of count (up to
+	// MPU_MAX_DEVICES) begun MPU9250_DMP's, with their DMPs running. It
+	// isn't copied, so must outlive this object.
+	MPU9250_DMP_RoundRobin(MPU9250_DMP * const * imus, unsigned char count);
+	
+	// signal -- Marks a device as having data to read, e.g. from its INT pin
+	// handler. Safe to call from an interrupt.
+	// Input: Index of the device in the array
+	void signal(unsigned char index);
+	// signalAll -- Marks every device, to poll without interrupts
+	void signalAll(void);
+	
+	// poll -- Reads one dmpUpdateFifoBurst() from the next device, in turn,
+	// that was signalled or had packets left after its last burst.
+	// Input: Array of maxPackets packets to decode into, oldest first
+	// Output: Index of the device read, with its packets in packets and
+	//  their number in count, or -1 if none had data
+	int poll(dmp_packet_s * packets, unsigned char maxPackets,
+	         unsigned char * count);
+	
+private:
+	MPU9250_DMP * const * _imus;
+	unsigned char _count;
+	unsigned char _next; // Index of the device to try first
+	volatile bool _signalled[MPU_MAX_DEVICES];
+};
+
 #endif // _SPARKFUN_MPU9250_DMP_H_
\ No newline at end of file
@@ -19,8 +19,73 @@ Supported Platforms:
 #include <Arduino.h>
 #include <Wire.h>
 
-int arduino_i2c_write(unsigned char slave_addr, unsigned char reg_addr,
-                       unsigned char length, unsigned char * data)
+// The MPU-9250's FIFO and DMP memory ports: every byte moves them on, so a
+// transfer that may have moved some bytes can't be retried
+#define MPU_FIFO_R_W 0x74
+#define MPU_MEM_R_W 0x6F
+
+static unsigned long i2cClock = 0; // 0 to leave Wire's own
+static unsigned long retryBudgetUs = I2C_RETRY_BUDGET_US;
+static struct i2c_stats_s i2cStats;
+
+// Transaction queue. The engine runs active; pending wait behind it, and
+// finished wait for arduino_i2c_poll() to call their done functions.
+static struct i2c_txn_s * pendingHead = NULL, * pendingTail = NULL;
+static struct i2c_txn_s * finishedHead = NULL, * finishedTail = NULL;
+static struct i2c_txn_s * volatile active = NULL;
+static bool activeBlocking; // The engine couldn't take it: poll() makes it
+static unsigned int activeAttempt; // Attempts at it so far, less one
+static unsigned long activeFailedAt; // micros() of its first failure
+static volatile bool wireOwned = false; // A blocking transfer has the bus
+
+// The queue is shared with interrupts (submissions, and the engine's)
+#if defined(__arm__)
+static inline uint32_t lockQueue(void)
+{
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	return primask;
+}
+
+static inline void unlockQueue(uint32_t primask)
+{
+	__set_PRIMASK(primask);
+}
+#else
+// Host builds have no interrupts
+static inline uint32_t lockQueue(void)
+{
+	return 0;
+}
+
+static inline void unlockQueue(uint32_t primask)
+{
+	(void)primask;
+}
+#endif
+
+static void countError(int error)
+{
+	switch (error)
+	{
+	case I2C_ERR_ADDR_NACK:
+		i2cStats.addr_nacks++;
+		break;
+	case I2C_ERR_DATA_NACK:
+		i2cStats.data_nacks++;
+		break;
+	case I2C_ERR_SHORT_READ:
+		i2cStats.short_reads++;
+		break;
+	default:
+		i2cStats.bus_errors++;
+		break;
+	}
+}
+
+// One attempt at a write. moved is set if some data may have gone through.
+static int writeOnce(unsigned char slave_addr, unsigned char reg_addr,
+                     unsigned char length, unsigned char * data, bool * moved)
 {
 	Wire.beginTransmission(slave_addr);
 	Wire.write(reg_addr);
@@ -28,22 +93,349 @@ int arduino_i2c_write(unsigned char slave_addr, unsigned char reg_addr,
 	{
 		Wire.write(data[i]);
 	}
-	Wire.endTransmission(true);
-	
-	return 0;
+	int error = Wire.endTransmission(true);
+	*moved = (error == I2C_ERR_DATA_NACK) || (error == I2C_ERR_BUS);
+	return error;
 }
-int arduino_i2c_read(unsigned char slave_addr, unsigned char reg_addr,
-                       unsigned char length, unsigned char * data)
+
+// One attempt at a read: the register address, then the data after a
+// repeated start. moved is set if some data was read.
+static int readOnce(unsigned char slave_addr, unsigned char reg_addr,
+                    unsigned char length, unsigned char * data, bool * moved)
 {
+	*moved = false;
 	Wire.beginTransmission(slave_addr);
 	Wire.write(reg_addr);
-	Wire.endTransmission(false);
-	Wire.requestFrom(slave_addr, length);
-	for (unsigned char i = 0; i < length; i++)
+	int error = Wire.endTransmission(false);
+	if (error)
+		return error;
+	unsigned char received = Wire.requestFrom(slave_addr, length);
+	for (unsigned char i = 0; i < received; i++)
 	{
 		data[i] = Wire.read();
 	}
-	Wire.endTransmission(true);
-	
+	if (received == length)
+		return 0;
+	*moved = (received > 0);
+	return I2C_ERR_SHORT_READ;
+}
+
+// After a failed attempt: count it, recover the bus from a bus error, and
+// decide whether to try again. failedAt is set at the first failure.
+static bool retry(int error, bool moved, unsigned char reg_addr,
+                  unsigned int attempt, unsigned long * failedAt)
+{
+	countError(error);
+	// A stuck bus would fail every transfer after this one too
+	if (error == I2C_ERR_BUS)
+		arduino_i2c_recover();
+	if (moved && ((reg_addr == MPU_FIFO_R_W) || (reg_addr == MPU_MEM_R_W)))
+		return false;
+	if (!attempt)
+		*failedAt = micros();
+	if (micros() - *failedAt >= retryBudgetUs)
+		return false;
+	i2cStats.retries++;
+	return true;
+}
+
+// Attempt a transfer until it succeeds, the retry budget runs out, or it
+// can't be retried
+static int transfer(bool read, unsigned char slave_addr,
+                    unsigned char reg_addr, unsigned char length,
+                    unsigned char * data)
+{
+	unsigned long failedAt = 0;
+	bool moved;
+	int error;
+
+	if (length > (read ? I2C_MAX_READ_LENGTH : I2C_MAX_WRITE_LENGTH))
+	{
+		i2cStats.failures++;
+		return I2C_ERR_LENGTH;
+	}
+	for (unsigned int attempt = 0; ; attempt++)
+	{
+		if (read)
+			error = readOnce(slave_addr, reg_addr, length, data, &moved);
+		else
+			error = writeOnce(slave_addr, reg_addr, length, data, &moved);
+		if (!error)
+			return 0;
+		if (!retry(error, moved, reg_addr, attempt, &failedAt))
+			break;
+	}
+	i2cStats.failures++;
+	return error;
+}
+
+// Move a transaction to the finished list. Called with the queue locked.
+static void finish(struct i2c_txn_s * txn, int status)
+{
+	txn->status = status;
+	txn->next = NULL;
+	if (finishedTail)
+		finishedTail->next = txn;
+	else
+		finishedHead = txn;
+	finishedTail = txn;
+	if (active == txn)
+		active = NULL;
+}
+
+// Start the transaction at the head of the queue, unless one is running or
+// a blocking transfer has the bus. Called with the queue locked.
+static void startNext(void)
+{
+	if (active || !pendingHead || wireOwned)
+		return;
+	active = pendingHead;
+	pendingHead = pendingHead->next;
+	if (!pendingHead)
+		pendingTail = NULL;
+	activeAttempt = 0;
+	activeBlocking = (arduino_i2c_dma_start(active) != 0);
+}
+
+// Everything arduino_i2c_poll() does but call the done functions
+static void service(void)
+{
+	uint32_t primask = lockQueue();
+	startNext();
+	while (active)
+	{
+		struct i2c_txn_s * txn = active;
+		int status;
+		if (activeBlocking)
+		{
+			// Without an engine. Blocking here is all that's left.
+			unlockQueue(primask);
+			status = transfer(txn->read, txn->slave_addr, txn->reg_addr,
+			                  txn->length, txn->data);
+			primask = lockQueue();
+		}
+		else
+		{
+			unsigned char moved = 0;
+			status = arduino_i2c_dma_status(&moved);
+			if (status == I2C_PENDING)
+				break;
+			if (status)
+			{
+				unlockQueue(primask);
+				arduino_i2c_dma_release(); // Recovery restarts the Wire library
+				bool again = retry(status, moved, txn->reg_addr, activeAttempt,
+				                   &activeFailedAt);
+				primask = lockQueue();
+				if (again)
+				{
+					activeAttempt++;
+					activeBlocking = (arduino_i2c_dma_start(txn) != 0);
+					continue;
+				}
+				i2cStats.failures++;
+			}
+		}
+		finish(txn, status);
+		startNext();
+	}
+	unlockQueue(primask);
+}
+
+// Take the bus for a blocking transfer: wait out the transaction running
+// on the engine, and keep the queue from starting another
+static void lockBus(void)
+{
+	wireOwned = true;
+	while (active)
+	{
+		service();
+		if (active)
+			delayMicroseconds(1);
+	}
+	arduino_i2c_dma_release();
+}
+
+static void unlockBus(void)
+{
+	wireOwned = false;
+	uint32_t primask = lockQueue();
+	startNext();
+	unlockQueue(primask);
+}
+
+int arduino_i2c_write(unsigned char slave_addr, unsigned char reg_addr,
+                       unsigned char length, unsigned char * data)
+{
+	i2cStats.transfers++;
+	lockBus();
+	int result = transfer(false, slave_addr, reg_addr, length, data);
+	unlockBus();
+	return result;
+}
+
+int arduino_i2c_read(unsigned char slave_addr, unsigned char reg_addr,
+                       unsigned char length, unsigned char * data)
+{
+	i2cStats.transfers++;
+	lockBus();
+	int result = transfer(true, slave_addr, reg_addr, length, data);
+	unlockBus();
+	return result;
+}
+
+int arduino_i2c_submit(struct i2c_txn_s * txn)
+{
+	if (txn->length > (txn->read ? I2C_MAX_READ_LENGTH : I2C_MAX_WRITE_LENGTH))
+		return -1;
+	txn->status = I2C_PENDING;
+	txn->next = NULL;
+	uint32_t primask = lockQueue();
+	i2cStats.transfers++;
+	if (pendingTail)
+		pendingTail->next = txn;
+	else
+		pendingHead = txn;
+	pendingTail = txn;
+	startNext();
+	unlockQueue(primask);
 	return 0;
 }
+
+void arduino_i2c_poll(void)
+{
+	service();
+	for (;;)
+	{
+		uint32_t primask = lockQueue();
+		struct i2c_txn_s * txn = finishedHead;
+		if (txn)
+		{
+			finishedHead = txn->next;
+			if (!finishedHead)
+				finishedTail = NULL;
+		}
+		unlockQueue(primask);
+		if (!txn)
+			break;
+		if (txn->done)
+			txn->done(txn);
+	}
+}
+
+int arduino_i2c_idle(void)
+{
+	return !active && !pendingHead;
+}
+
+// A transaction that went through is finished here, and the next started
+// straight away. Failures wait for arduino_i2c_poll(): recovering the bus
+// and retrying aren't for an interrupt.
+void arduino_i2c_dma_done(void)
+{
+	uint32_t primask = lockQueue();
+	unsigned char moved;
+	if (active && !activeBlocking && !arduino_i2c_dma_status(&moved))
+	{
+		finish(active, 0);
+		startNext();
+	}
+	unlockQueue(primask);
+}
+
+void arduino_i2c_begin(void)
+{
+#if defined(PIN_WIRE_SDA) && defined(PIN_WIRE_SCL)
+	// Reset mid-transfer, the SAMD21 can leave a slave holding SDA low
+	pinMode(PIN_WIRE_SDA, INPUT_PULLUP);
+	if (!digitalRead(PIN_WIRE_SDA))
+	{
+		arduino_i2c_recover();
+		return;
+	}
+#endif
+	Wire.begin();
+	if (i2cClock)
+		Wire.setClock(i2cClock);
+}
+
+void arduino_i2c_set_clock(unsigned long hz)
+{
+	i2cClock = hz;
+	Wire.setClock(hz);
+}
+
+unsigned long arduino_i2c_get_clock(void)
+{
+	return i2cClock ? i2cClock : I2C_CLOCK_STANDARD;
+}
+
+void arduino_i2c_set_retry_budget(unsigned long budget_us)
+{
+	retryBudgetUs = budget_us;
+}
+
+#if defined(PIN_WIRE_SDA) && defined(PIN_WIRE_SCL)
+// The bus lines are open drain: a pin only ever pulls its line low, and
+// lets the pull-ups take it high. Driving one high would fight a slave
+// holding it low. The output is set low before the pin is made an output,
+// so it never drives high on the way.
+static void lineLow(uint32_t pin)
+{
+	digitalWrite(pin, LOW);
+	pinMode(pin, OUTPUT);
+}
+
+static void lineRelease(uint32_t pin)
+{
+	pinMode(pin, INPUT_PULLUP);
+}
+
+// Release SCL, and give a slave stretching the clock time to let it go
+static void sclRelease(void)
+{
+	lineRelease(PIN_WIRE_SCL);
+	for (int i = 0; (i < 100) && !digitalRead(PIN_WIRE_SCL); i++)
+		delayMicroseconds(1);
+}
+#endif
+
+int arduino_i2c_recover(void)
+{
+	int stuck = 0;
+
+	i2cStats.recoveries++;
+	Wire.end();
+#if defined(PIN_WIRE_SDA) && defined(PIN_WIRE_SCL)
+	// Clock out whatever byte the slave is in the middle of, at 100 kHz
+	lineRelease(PIN_WIRE_SDA);
+	sclRelease();
+	for (int i = 0; (i < I2C_RECOVERY_CLOCKS) && !digitalRead(PIN_WIRE_SDA);
+	     i++)
+	{
+		delayMicroseconds(5);
+		lineLow(PIN_WIRE_SCL);
+		delayMicroseconds(5);
+		sclRelease();
+	}
+	// Then a stop: SDA rising while SCL is high
+	delayMicroseconds(5);
+	lineLow(PIN_WIRE_SCL);
+	lineLow(PIN_WIRE_SDA);
+	delayMicroseconds(5);
+	sclRelease();
+	delayMicroseconds(5);
+	lineRelease(PIN_WIRE_SDA);
+	delayMicroseconds(5);
+	stuck = !digitalRead(PIN_WIRE_SDA) || !digitalRead(PIN_WIRE_SCL);
+#endif
+	Wire.begin();
+	if (i2cClock)
+		Wire.setClock(i2cClock);
+	return stuck ? -1 : 0;
+}
+
+void arduino_i2c_get_stats(struct i2c_stats_s * stats)
+{
+	*stats = i2cStats;
+}
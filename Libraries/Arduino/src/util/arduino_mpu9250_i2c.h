@@ -18,15 +18,148 @@ Supported Platforms:
 #ifndef _ARDUINO_MPU9250_I2C_H_
 #define _ARDUINO_MPU9250_I2C_H_
 
+// Largest read that fits in the Wire library's receive buffer. Burst
+// reads longer than this must be split into multiple transfers.
+#define I2C_MAX_READ_LENGTH 64
+// Largest write: the register address takes one byte of the Wire library's
+// 64-byte transmit buffer.
+#define I2C_MAX_WRITE_LENGTH 63
+
+// Status from arduino_i2c_write() and arduino_i2c_read(): 0 on success,
+// or the error of the last attempt. 1-4 are the Wire library's
+// endTransmission() codes.
+#define I2C_ERR_LENGTH 1 // Longer than the Wire library's buffers
+#define I2C_ERR_ADDR_NACK 2 // Address not acknowledged
+#define I2C_ERR_DATA_NACK 3 // Data byte not acknowledged
+#define I2C_ERR_BUS 4 // Bus error or lost arbitration, e.g. SDA held low
+#define I2C_ERR_SHORT_READ 5 // Fewer bytes received than requested
+
+// A failed transfer is retried until this long (us) after its first
+// attempt failed, see arduino_i2c_set_retry_budget()
+#define I2C_RETRY_BUDGET_US 1000
+
+// SCL pulses that free a slave holding SDA low: enough to finish any byte
+// and its acknowledge bit
+#define I2C_RECOVERY_CLOCKS 9
+
+// I2C clocks (Hz): standard mode, fast mode, and fast mode plus. The
+// MPU-9250 is rated to fast mode; fast mode plus is beyond its rating, and
+// needs a short, lightly loaded bus (see MPU9250_DMP::tuneI2CClock()).
+#define I2C_CLOCK_STANDARD 100000
+#define I2C_CLOCK_FAST 400000
+#define I2C_CLOCK_FAST_PLUS 1000000
+
+// Status of a queued transaction (see arduino_i2c_submit()) until it's done
+#define I2C_PENDING (-1)
+
+// A transaction for the queue: a write of length bytes to registers from
+// reg_addr on, or a read of them, as arduino_i2c_write() and _read() make.
+// The caller owns it, and its data, until done is called.
+struct i2c_txn_s {
+	unsigned char slave_addr;
+	unsigned char reg_addr;
+	unsigned char read; // 1 to read, 0 to write
+	unsigned char length; // Up to I2C_MAX_READ_LENGTH or _WRITE_LENGTH
+	unsigned char * data;
+	// Called from arduino_i2c_poll() once the transaction is done, with
+	// status set. It may submit more transactions, and use the bus. NULL
+	// for none.
+	void (*done)(struct i2c_txn_s * txn);
+	void * context; // For done's use
+	volatile int status; // I2C_PENDING, then 0 or an I2C_ERR_ code
+	struct i2c_txn_s * next; // For the queue's use
+};
+
+// Transport statistics, see arduino_i2c_get_stats()
+struct i2c_stats_s {
+	unsigned long transfers; // Calls to arduino_i2c_write() and _read(),
+	                         // and transactions queued
+	unsigned long retries; // Attempts after the first
+	unsigned long failures; // Transfers that still failed, out of budget
+	unsigned long recoveries; // Bus recoveries, see arduino_i2c_recover()
+	// Failed attempts, by error
+	unsigned long addr_nacks;
+	unsigned long data_nacks;
+	unsigned long bus_errors;
+	unsigned long short_reads;
+};
+
 #if defined(__cplusplus) 
 extern "C" {
 #endif
 
+// arduino_i2c_write -- Write length bytes to registers from reg_addr on.
+// Failed attempts are retried, within the retry budget, except a write
+// to the FIFO or DMP memory port after some of its bytes may have gone
+// through: those ports don't take the same bytes twice.
+// Output: 0 on success, otherwise an I2C_ERR_ code
 int arduino_i2c_write(unsigned char slave_addr, unsigned char reg_addr,
                        unsigned char length, unsigned char * data);
+// arduino_i2c_read -- Read length bytes from registers from reg_addr on,
+// retried like arduino_i2c_write(). data is only valid on success.
+// Output: 0 on success, otherwise an I2C_ERR_ code
 int arduino_i2c_read(unsigned char slave_addr, unsigned char reg_addr,
                        unsigned char length, unsigned char * data);
 
+// arduino_i2c_begin -- Start the I2C bus, recovering it first if a slave
+// holds SDA low, at the clock last set with arduino_i2c_set_clock()
+void arduino_i2c_begin(void);
+// arduino_i2c_set_clock -- Set the I2C clock, and keep it for bus
+// recoveries, which restart the Wire library
+void arduino_i2c_set_clock(unsigned long hz);
+// arduino_i2c_get_clock -- Output: The I2C clock last set, in Hz, or
+// I2C_CLOCK_STANDARD (the Wire library's default) if it never was
+unsigned long arduino_i2c_get_clock(void);
+// arduino_i2c_set_retry_budget -- Retry failed transfers until budget_us
+// after the first attempt failed. 0 disables retries.
+void arduino_i2c_set_retry_budget(unsigned long budget_us);
+// arduino_i2c_recover -- Free a bus stuck by a slave holding SDA low
+// (e.g. after the SAMD21 was reset mid-transfer): clock SCL until SDA is
+// released, up to I2C_RECOVERY_CLOCKS times, send a stop, and restart the
+// Wire library. Called after every bus error.
+// Output: 0 if SDA and SCL are released
+int arduino_i2c_recover(void);
+// arduino_i2c_get_stats -- Copy the transport statistics, counted since
+// power-up
+void arduino_i2c_get_stats(struct i2c_stats_s * stats);
+
+// Transaction queue: transactions submitted here run one after another in
+// the background, on a transfer engine that doesn't need the CPU (DMA on
+// the SAMD21, see arduino_mpu9250_i2c_dma.cpp), so the caller can get on
+// with something else meanwhile. They're retried like arduino_i2c_read()
+// and _write(), which wait for the transaction on the bus to finish, and
+// run between queued ones. Without an engine, each transaction is made
+// with arduino_i2c_read() or _write() when it gets to the head of the
+// queue.
+// arduino_i2c_submit -- Queue a transaction. Safe to call from an
+// interrupt.
+// Output: 0 if queued, -1 if its length is too long
+int arduino_i2c_submit(struct i2c_txn_s * txn);
+// arduino_i2c_poll -- Move the queue along: retry or finish transactions
+// the engine is done with, start the next, and call the done functions of
+// the finished ones. Call it often while transactions are queued.
+void arduino_i2c_poll(void);
+// arduino_i2c_idle -- Output: 1 if no transactions are queued or running
+// (though done functions may still be waiting for arduino_i2c_poll())
+int arduino_i2c_idle(void);
+
+// Transfer engine the queue runs on. The SAMD21's is in
+// arduino_mpu9250_i2c_dma.cpp; other builds can provide their own.
+// arduino_i2c_dma_start -- Start a transaction in the background
+// Output: 0 if started, -1 if the engine can't make it
+int arduino_i2c_dma_start(const struct i2c_txn_s * txn);
+// arduino_i2c_dma_status -- Output: I2C_PENDING while the transaction runs,
+// then 0 or an I2C_ERR_ code, with moved set if some data may have been
+// transferred
+int arduino_i2c_dma_status(unsigned char * moved);
+// arduino_i2c_dma_release -- Hand the bus back to the Wire library,
+// between transactions
+void arduino_i2c_dma_release(void);
+// arduino_i2c_dma_done -- The engine calls this from its interrupt when a
+// transaction ends, so the queue can start the next without waiting for
+// arduino_i2c_poll()
+void arduino_i2c_dma_done(void);
+
 #if defined(__cplusplus) 
 }
 #endif
@@ -0,0 +1,364 @@
+/******************************************************************************
+arduino_mpu9250_i2c_dma.cpp - MPU-9250 Digital Motion Processor Arduino Library
+Jim Lindblom @ SparkFun Electronics
+original creation date: November 23, 2016
+https://github.com/sparkfun/SparkFun_MPU9250_DMP_Arduino_Library
+
+This library implements motion processing functions of Invensense's MPU-9250.
+It is based on their Emedded MotionDriver 6.12 library.
+	https://www.invensense.com/developers/software-downloads/
+
+Development environment specifics:
+Arduino IDE 1.6.12
+SparkFun 9DoF Razor IMU M0
+
+Supported Platforms:
+- ATSAMD21 (Arduino Zero, SparkFun SAMD21 Breakouts)
+******************************************************************************/
+#include "arduino_mpu9250_i2c.h"
+#include <Arduino.h>
+
+#if defined(__SAMD21G18A__)
+// The transaction queue's engine on the SAMD21: SERCOM3 (the Wire library's
+// I2C port on the 9DoF Razor M0) in I2C master mode, with the DMAC moving
+// the data. The SERCOM's transfer length (ADDR.LENEN) makes it acknowledge
+// each byte a read takes from DATA, and NACK the last and send a stop, so
+// a whole read runs without the CPU. A read is two transfers: the register
+// address, then the data. A DMAC transfer ends when its last byte is
+// loaded, not sent (about 25us at 400 kHz), and the SERCOM's interrupt is
+// Wire's, so the engine doesn't wait for the byte in the DMAC's interrupt:
+// arduino_i2c_dma_status() finds it sent, and starts the read's data or
+// ends the write. A read's data therefore waits for arduino_i2c_poll().
+//
+// The engine takes DMAC channel 0, and the DMAC_Handler interrupt. Its
+// handler is weak, so another DMAC user's (Adafruit_ZeroDMA's, say) takes
+// its place; the engine then gives up, leaving the queue to make its
+// transactions with the Wire library, as it does if something else has
+// set up the DMAC first. Errors and NACKs, which stop the DMAC waiting for
+// data that never comes, are also found by arduino_i2c_dma_status().
+
+#define I2C_DMA_SERCOM SERCOM3
+#define I2C_DMA_TRIGGER_TX SERCOM3_DMAC_ID_TX
+#define I2C_DMA_TRIGGER_RX SERCOM3_DMAC_ID_RX
+#define I2C_DMA_CHANNEL 0
+#define I2C_BUS_STATE_OWNER 2 // STATUS.BUSSTATE
+
+enum dmaPhase
+{
+	DMA_IDLE,
+	DMA_POINTER, // Sending a read's register address
+	DMA_POINTER_SENT, // Loaded: waiting for the SERCOM to send it
+	DMA_READ,
+	DMA_WRITE,
+	DMA_WRITE_SENT, // Loaded: waiting for the SERCOM to send the last byte
+	DMA_DONE
+};
+
+// The engine's DMAC interrupt handler, DMAC_Handler unless another replaces
+// it
+extern "C" void arduino_i2c_dma_handler(void);
+extern "C" void DMAC_Handler(void)
+	__attribute__((weak, alias("arduino_i2c_dma_handler")));
+
+static DmacDescriptor descriptor __attribute__((aligned(16)));
+static DmacDescriptor writeback __attribute__((aligned(16)));
+static bool dmaReady = false; // The DMAC is set up for the engine
+static bool dmaOwnsBus = false; // SERCOM3 is in smart mode, for the DMAC
+static const struct i2c_txn_s * dmaTxn = NULL;
+static volatile unsigned char dmaPhase = DMA_IDLE;
+static volatile int dmaResult = 0;
+static volatile unsigned char dmaMoved = 0;
+static unsigned long dmaStartUs, dmaTimeoutUs;
+// A write's register address and data, sent in one DMA transfer
+static unsigned char dmaBuffer[1 + I2C_MAX_WRITE_LENGTH];
+
+static bool setUpDmac(void)
+{
+	if (dmaReady)
+		return true;
+	if ((DMAC_Handler != arduino_i2c_dma_handler) ||
+	    DMAC->CTRL.bit.DMAENABLE || DMAC->BASEADDR.reg)
+		return false; // Someone else's
+	PM->AHBMASK.reg |= PM_AHBMASK_DMAC;
+	PM->APBBMASK.reg |= PM_APBBMASK_DMAC;
+	DMAC->BASEADDR.reg = (uint32_t)&descriptor;
+	DMAC->WRBADDR.reg = (uint32_t)&writeback;
+	DMAC->CTRL.reg = DMAC_CTRL_DMAENABLE | DMAC_CTRL_LVLEN(0xF);
+	NVIC_SetPriority(DMAC_IRQn, 0);
+	NVIC_EnableIRQ(DMAC_IRQn);
+	dmaReady = true;
+	return true;
+}
+
+// Smart mode acknowledges a byte when DATA is read, which the DMAC needs,
+// and the Wire library doesn't expect. It's enable-protected.
+static void setSmartMode(bool enable)
+{
+	SercomI2cm * i2c = &I2C_DMA_SERCOM->I2CM;
+	i2c->CTRLA.bit.ENABLE = 0;
+	while (i2c->SYNCBUSY.bit.ENABLE)
+		;
+	if (enable)
+		i2c->CTRLB.reg |= SERCOM_I2CM_CTRLB_SMEN;
+	else
+		i2c->CTRLB.reg &= ~SERCOM_I2CM_CTRLB_SMEN;
+	i2c->CTRLA.bit.ENABLE = 1;
+	while (i2c->SYNCBUSY.bit.ENABLE)
+		;
+	i2c->STATUS.bit.BUSSTATE = 1; // Idle
+	while (i2c->SYNCBUSY.bit.SYSOP)
+		;
+	dmaOwnsBus = enable;
+}
+
+static void stopChannel(void)
+{
+	DMAC->CHID.reg = DMAC_CHID_ID(I2C_DMA_CHANNEL);
+	DMAC->CHCTRLA.reg &= ~DMAC_CHCTRLA_ENABLE;
+	while (DMAC->CHCTRLA.reg & DMAC_CHCTRLA_ENABLE)
+		;
+	DMAC->CHINTFLAG.reg = DMAC_CHINTFLAG_MASK;
+}
+
+// Move length bytes between buffer and DATA, as the SERCOM asks for them
+static void startChannel(bool read, unsigned char * buffer,
+                         unsigned char length)
+{
+	stopChannel();
+	DMAC->CHCTRLB.reg = DMAC_CHCTRLB_LVL(0) | DMAC_CHCTRLB_TRIGACT_BEAT |
+		DMAC_CHCTRLB_TRIGSRC(read ? I2C_DMA_TRIGGER_RX : I2C_DMA_TRIGGER_TX);
+	DMAC->CHINTENSET.reg = DMAC_CHINTENSET_TCMPL | DMAC_CHINTENSET_TERR;
+	volatile uint32_t * data =
+		(volatile uint32_t *)&I2C_DMA_SERCOM->I2CM.DATA.reg;
+	// Incrementing addresses are given as the end of the buffer
+	descriptor.BTCTRL.reg = DMAC_BTCTRL_VALID | DMAC_BTCTRL_BEATSIZE_BYTE |
+		(read ? DMAC_BTCTRL_DSTINC : DMAC_BTCTRL_SRCINC);
+	descriptor.BTCNT.reg = length;
+	descriptor.SRCADDR.reg = read ? (uint32_t)data : (uint32_t)(buffer + length);
+	descriptor.DSTADDR.reg = read ? (uint32_t)(buffer + length) : (uint32_t)data;
+	descriptor.DESCADDR.reg = 0;
+	DMAC->CHCTRLA.reg |= DMAC_CHCTRLA_ENABLE;
+}
+
+// Address the slave, with the transfer's length, which starts it
+static void startSercom(unsigned char address, bool read, unsigned char length)
+{
+	SercomI2cm * i2c = &I2C_DMA_SERCOM->I2CM;
+	i2c->INTFLAG.reg = SERCOM_I2CM_INTFLAG_MB | SERCOM_I2CM_INTFLAG_SB |
+	                   SERCOM_I2CM_INTFLAG_ERROR;
+	i2c->ADDR.reg = SERCOM_I2CM_ADDR_ADDR((address << 1) | (read ? 1 : 0)) |
+	                SERCOM_I2CM_ADDR_LENEN | SERCOM_I2CM_ADDR_LEN(length);
+	while (i2c->SYNCBUSY.bit.SYSOP)
+		;
+}
+
+static void sendStop(void)
+{
+	SercomI2cm * i2c = &I2C_DMA_SERCOM->I2CM;
+	if (i2c->STATUS.bit.BUSSTATE == I2C_BUS_STATE_OWNER)
+	{
+		i2c->CTRLB.bit.ACKACT = 1;
+		i2c->CTRLB.bit.CMD = 3;
+		while (i2c->SYNCBUSY.bit.SYSOP)
+			;
+	}
+}
+
+static void endTransfer(int result, bool moved)
+{
+	if (result)
+	{
+		stopChannel();
+		sendStop();
+	}
+	dmaMoved = moved;
+	dmaResult = result;
+	dmaPhase = DMA_DONE;
+}
+
+// How the last byte loaded was taken, or I2C_PENDING while it's going out
+static int lastByteSent(void)
+{
+	SercomI2cm * i2c = &I2C_DMA_SERCOM->I2CM;
+	if (!(i2c->INTFLAG.reg & (SERCOM_I2CM_INTFLAG_MB |
+	                          SERCOM_I2CM_INTFLAG_ERROR)))
+		return I2C_PENDING;
+	if (i2c->STATUS.reg & (SERCOM_I2CM_STATUS_BUSERR |
+	                       SERCOM_I2CM_STATUS_ARBLOST))
+		return I2C_ERR_BUS;
+	if (i2c->STATUS.bit.RXNACK)
+		return I2C_ERR_DATA_NACK;
+	return 0;
+}
+
+// The last byte loaded went out, and was taken as result says: start the
+// read's data, after a repeated start, or end the transfer
+static void afterLastByte(int result)
+{
+	if (dmaPhase == DMA_WRITE_SENT)
+	{
+		if (!result)
+			sendStop();
+		endTransfer(result, true);
+	}
+	else if (result)
+	{
+		endTransfer((result == I2C_ERR_DATA_NACK) ? I2C_ERR_ADDR_NACK : result,
+		            false);
+	}
+	else
+	{
+		dmaPhase = DMA_READ;
+		dmaStartUs = micros(); // However long the address waited to be seen
+		startChannel(true, dmaTxn->data, dmaTxn->length);
+		startSercom(dmaTxn->slave_addr, true, dmaTxn->length);
+	}
+}
+
+int arduino_i2c_dma_start(const struct i2c_txn_s * txn)
+{
+	if ((dmaPhase != DMA_IDLE) && (dmaPhase != DMA_DONE))
+		return -1;
+	if (!setUpDmac())
+		return -1;
+	if (!dmaOwnsBus)
+		setSmartMode(true);
+
+	dmaTxn = txn;
+	dmaResult = 0;
+	dmaMoved = 0;
+	dmaStartUs = micros();
+	// Twice the transfer's time at 100 kHz, and a millisecond
+	dmaTimeoutUs = 2 * 90UL * (txn->length + 3) + 1000;
+	dmaBuffer[0] = txn->reg_addr;
+	if (txn->read)
+	{
+		dmaPhase = DMA_POINTER;
+		startChannel(false, dmaBuffer, 1);
+		startSercom(txn->slave_addr, false, 1);
+	}
+	else
+	{
+		memcpy(dmaBuffer + 1, txn->data, txn->length);
+		dmaPhase = DMA_WRITE;
+		startChannel(false, dmaBuffer, txn->length + 1);
+		startSercom(txn->slave_addr, false, txn->length + 1);
+	}
+	return 0;
+}
+
+int arduino_i2c_dma_status(unsigned char * moved)
+{
+	SercomI2cm * i2c = &I2C_DMA_SERCOM->I2CM;
+
+	// The DMAC's interrupt may be finishing the transfer too
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	if ((dmaPhase == DMA_POINTER_SENT) || (dmaPhase == DMA_WRITE_SENT))
+	{
+		int sent = lastByteSent();
+		if (sent != I2C_PENDING)
+			afterLastByte(sent);
+	}
+	if ((dmaPhase != DMA_IDLE) && (dmaPhase != DMA_DONE))
+	{
+		// The DMAC's interrupt finishes reads that go through. These stop
+		// the SERCOM without telling it.
+		int result = 0;
+		if (i2c->STATUS.reg & (SERCOM_I2CM_STATUS_BUSERR |
+		                       SERCOM_I2CM_STATUS_ARBLOST))
+			result = I2C_ERR_BUS;
+		else if ((i2c->INTFLAG.reg & SERCOM_I2CM_INTFLAG_MB) &&
+		         i2c->STATUS.bit.RXNACK)
+			result = I2C_ERR_DATA_NACK;
+		else if (micros() - dmaStartUs > dmaTimeoutUs)
+			result = I2C_ERR_BUS;
+		if (result)
+		{
+			// The write-back descriptor is up to date once the channel stops
+			stopChannel();
+			bool partway = (dmaPhase == DMA_READ) ||
+				(dmaPhase == DMA_WRITE_SENT) ||
+				((dmaPhase == DMA_WRITE) &&
+				 (writeback.BTCNT.reg != descriptor.BTCNT.reg));
+			if ((result == I2C_ERR_DATA_NACK) && !partway)
+				result = I2C_ERR_ADDR_NACK;
+			endTransfer(result, partway);
+		}
+	}
+	int result = (dmaPhase == DMA_DONE) ? dmaResult :
+	             ((dmaPhase == DMA_IDLE) ? 0 : I2C_PENDING);
+	*moved = dmaMoved;
+	__set_PRIMASK(primask);
+	return result;
+}
+
+void arduino_i2c_dma_release(void)
+{
+	if ((dmaPhase != DMA_IDLE) && (dmaPhase != DMA_DONE))
+		return;
+	dmaPhase = DMA_IDLE;
+	if (dmaOwnsBus)
+		setSmartMode(false);
+}
+
+void arduino_i2c_dma_handler(void)
+{
+	DMAC->CHID.reg = DMAC_CHID_ID(I2C_DMA_CHANNEL);
+	unsigned char flags = DMAC->CHINTFLAG.reg;
+	DMAC->CHINTFLAG.reg = flags;
+	if (flags & DMAC_CHINTFLAG_TERR)
+	{
+		endTransfer(I2C_ERR_BUS, dmaPhase != DMA_POINTER);
+	}
+	else if (flags & DMAC_CHINTFLAG_TCMPL)
+	{
+		int result;
+		switch (dmaPhase)
+		{
+		case DMA_POINTER:
+		case DMA_WRITE:
+			// The last byte is loaded. It's rarely out yet; if not,
+			// arduino_i2c_dma_status() carries on once it is.
+			dmaPhase = (dmaPhase == DMA_POINTER) ? DMA_POINTER_SENT :
+			           DMA_WRITE_SENT;
+			result = lastByteSent();
+			if (result == I2C_PENDING)
+				return;
+			afterLastByte(result);
+			if (dmaPhase != DMA_DONE)
+				return;
+			break;
+		case DMA_READ:
+			// The SERCOM NACKs the last byte and stops by itself
+			endTransfer(0, true);
+			break;
+		default:
+			return;
+		}
+	}
+	else
+	{
+		return;
+	}
+	arduino_i2c_dma_done();
+}
+
+#else
+// No engine: the queue makes its transactions with the Wire library
+int arduino_i2c_dma_start(const struct i2c_txn_s * txn)
+{
+	(void)txn;
+	return -1;
+}
+
+int arduino_i2c_dma_status(unsigned char * moved)
+{
+	*moved = 0;
+	return 0;
+}
+
+void arduino_i2c_dma_release(void)
+{
+}
+#endif
@@ -0,0 +1,75 @@
+/******************************************************************************
+block_convert.c - MPU-9250 Digital Motion Processor Arduino Library
+Unit conversion for blocks of samples
+
+Supported Platforms:
+- ATSAMD21 (Arduino Zero, SparkFun SAMD21 Breakouts)
+******************************************************************************/
+#include "block_convert.h"
+
+/**
+ *  @brief      Convert a block of sensor counts to units.
+ *  @param[in]  counts          Counts, for one axis.
+ *  @param[out] out             Units, n of them.
+ *  @param[in]  n               Number of samples.
+ *  @param[in]  units_per_count Reciprocal of the sensitivity.
+ */
+void block_scale(const short *__restrict counts, float *__restrict out,
+    unsigned int n, float units_per_count)
+{
+    unsigned int ii;
+
+    for (ii = 0; ii < n; ii++)
+        out[ii] = (float)counts[ii] * units_per_count;
+}
+
+/**
+ *  @brief      Convert a block of Q30 numbers to floats.
+ *  Scaling by a power of two is exact, so one multiply does it.
+ *  @param[in]  q30     Numbers in Q30.
+ *  @param[out] out     Floats, n of them.
+ *  @param[in]  n       Number of samples.
+ */
+void block_q30_to_float(const long *__restrict q30, float *__restrict out,
+    unsigned int n)
+{
+    const float scale = 1.f / 1073741824.f;
+    unsigned int ii;
+
+    for (ii = 0; ii < n; ii++)
+        out[ii] = (float)q30[ii] * scale;
+}
+
+/**
+ *  @brief      Convert a block of sensor counts to units, in Q16.
+ *  The multiplier and shift are read once, not once per sample.
+ *  @param[in]  scale   Conversion, from fix_scale_init.
+ *  @param[in]  counts  Counts, for one axis.
+ *  @param[out] out     Units in Q16, n of them.
+ *  @param[in]  n       Number of samples.
+ */
+void block_scale_fixed(const struct fix_scale_s *scale,
+    const short *__restrict counts, long *__restrict out, unsigned int n)
+{
+    const long mult = scale->mult;
+    const unsigned char shift = scale->shift;
+    unsigned int ii;
+
+    for (ii = 0; ii < n; ii++)
+        out[ii] = ((long)counts[ii] * mult) >> shift;
+}
+
+/**
+ *  @brief      Convert a block of Q30 numbers to Q16.
+ *  @param[in]  q30     Numbers in Q30.
+ *  @param[out] out     Numbers in Q16, rounded, n of them.
+ *  @param[in]  n       Number of samples.
+ */
+void block_q30_to_q16(const long *__restrict q30, long *__restrict out,
+    unsigned int n)
+{
+    unsigned int ii;
+
+    for (ii = 0; ii < n; ii++)
+        out[ii] = fix_q30_to_q16(q30[ii]);
+}
@@ -0,0 +1,41 @@
+/******************************************************************************
+block_convert.h - MPU-9250 Digital Motion Processor Arduino Library
+Unit conversion for blocks of samples
+
+Each function converts one axis of a block of samples, held as an array
+(structure of arrays: all the x readings, then all the y readings, ...),
+in a single loop. The scale stays in a register for the whole block, and
+the loop body is a multiply with nothing to branch on or alias, so the
+compiler can unroll it, and vectorize it where the target has SIMD (as on
+a host reprocessing a recorded log). in and out must not overlap.
+
+Supported Platforms:
+- ATSAMD21 (Arduino Zero, SparkFun SAMD21 Breakouts)
+******************************************************************************/
+#ifndef _BLOCK_CONVERT_H_
+#define _BLOCK_CONVERT_H_
+
+#include "fixed_math.h"
+
+/* out[i] = counts[i] * units_per_count. Pass the reciprocal of the
+ * sensitivity, so each sample is a multiply rather than a divide: results
+ * are then within one float LSB of counts[i] / sensitivity.
+ */
+void block_scale(const short *__restrict counts, float *__restrict out,
+    unsigned int n, float units_per_count);
+
+/* out[i] = q30[i] as a float, e.g. for DMP quaternion elements. Exact to
+ * float precision.
+ */
+void block_q30_to_float(const long *__restrict q30, float *__restrict out,
+    unsigned int n);
+
+/* out[i] = fix_scale(scale, counts[i]), in Q16. */
+void block_scale_fixed(const struct fix_scale_s *scale,
+    const short *__restrict counts, long *__restrict out, unsigned int n);
+
+/* out[i] = fix_q30_to_q16(q30[i]). */
+void block_q30_to_q16(const long *__restrict q30, long *__restrict out,
+    unsigned int n);
+
+#endif /* _BLOCK_CONVERT_H_ */
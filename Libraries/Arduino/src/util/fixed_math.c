@@ -0,0 +1,234 @@
+/******************************************************************************
+fixed_math.c - MPU-9250 Digital Motion Processor Arduino Library
+Fixed-point math for processors without an FPU (the SAMD21's Cortex-M0+)
+
+Supported Platforms:
+- ATSAMD21 (Arduino Zero, SparkFun SAMD21 Breakouts)
+******************************************************************************/
+#include "fixed_math.h"
+
+/* CORDIC iterations. Each halves the angle error. The last one turns
+ * by a quarter of a Q16 LSB.
+ */
+#define CORDIC_ITERATIONS   (20)
+
+/* 1 / CORDIC gain, prod(1 / sqrt(1 + 2^-2i)), in Q30. */
+#define CORDIC_SCALE_Q30    (652032874L)
+
+/* pi in Q29. */
+#define CORDIC_PI_Q29       (1686629713L)
+
+/* atan(2^-i) in radians, Q29. */
+static const long cordic_angles[CORDIC_ITERATIONS] = {
+    421657428L, 248918915L, 131521918L, 66762579L, 33510843L, 16771758L,
+    8387925L, 4194219L, 2097141L, 1048575L, 524288L, 262144L, 131072L,
+    65536L, 32768L, 16384L, 8192L, 4096L, 2048L, 1024L
+};
+
+/**
+ *  @brief      Set up a count to unit conversion.
+ *  The reciprocal of the sensitivity is kept with 16 significant bits, so
+ *  a 16-bit count times it still fits in 32 bits.
+ *  @param[out] scale   Conversion, for fix_scale.
+ *  @param[in]  sens    Sensitivity, in counts per unit, at least 1. 0 makes
+ *                      every conversion 0.
+ */
+void fix_scale_init(struct fix_scale_s *scale, float sens)
+{
+    float mult;
+    unsigned char shift = 0;
+
+    if (sens <= 0.f) {
+        scale->mult = 0;
+        scale->shift = 0;
+        return;
+    }
+    /* Q16 units per count, times 2^shift. */
+    mult = 65536.f / sens;
+    while ((mult < 32768.f) && (shift < 31)) {
+        mult *= 2.f;
+        shift++;
+    }
+    scale->mult = (long)(mult + 0.5f);
+    if ((scale->mult >= 65536L) && shift) {
+        scale->mult >>= 1;
+        shift--;
+    }
+    scale->shift = shift;
+}
+
+/**
+ *  @brief      Integer square root.
+ *  One result bit per step, from the top.
+ *  @param[in]  number  Number.
+ *  @return     Square root, rounded down.
+ */
+unsigned long fix_sqrt(unsigned long number)
+{
+    unsigned long root = 0;
+    unsigned long bit = 1UL << 30;
+
+    while (bit > number)
+        bit >>= 2;
+    while (bit) {
+        if (number >= root + bit) {
+            number -= root + bit;
+            root = (root >> 1) + bit;
+        } else
+            root >>= 1;
+        bit >>= 2;
+    }
+    return root;
+}
+
+/**
+ *  @brief      Four-quadrant arc tangent.
+ *  CORDIC in vectoring mode: (x, y) is turned toward the x axis by
+ *  +/-atan(2^-i) at each step, adding up the turns.
+ *  @param[in]  y   y, at the same scale as x, up to +/-2^30.
+ *  @param[in]  x   x.
+ *  @return     Angle of (x, y) in radians, Q16, in [-pi, pi].
+ */
+long fix_atan2(long y, long x)
+{
+    long angle = 0, half_turn = 0, next_x, sign;
+    unsigned long size;
+    unsigned char ii;
+
+    if (!x && !y)
+        return 0;
+
+    /* Work in the right half plane. */
+    if (x < 0) {
+        half_turn = (y < 0) ? -FIX_PI_Q16 : FIX_PI_Q16;
+        x = -x;
+        y = -y;
+    }
+
+    /* Scale so 2^28 <= (|x| | |y|) < 2^29. The CORDIC gain (1.65) can't
+     * overflow then, and small inputs keep their precision.
+     */
+    size = (unsigned long)x | (unsigned long)(y < 0 ? -y : y);
+    if (size >= (1UL << 29)) {
+        x >>= 2;
+        y >>= 2;
+        size >>= 2;
+    }
+    if (size < (1UL << 13)) {
+        x <<= 16;
+        y <<= 16;
+        size <<= 16;
+    }
+    if (size < (1UL << 21)) {
+        x <<= 8;
+        y <<= 8;
+        size <<= 8;
+    }
+    if (size < (1UL << 25)) {
+        x <<= 4;
+        y <<= 4;
+        size <<= 4;
+    }
+    if (size < (1UL << 27)) {
+        x <<= 2;
+        y <<= 2;
+        size <<= 2;
+    }
+    if (size < (1UL << 28)) {
+        x <<= 1;
+        y <<= 1;
+    }
+
+    /* Turn clockwise while y > 0, and back while y < 0. sign is -1 to
+     * turn back, and (v ^ sign) - sign negates v then, with no branch.
+     */
+    for (ii = 0; ii < CORDIC_ITERATIONS; ii++) {
+        sign = -(long)(y < 0);
+        next_x = x + (((y >> ii) ^ sign) - sign);
+        y -= ((x >> ii) ^ sign) - sign;
+        angle += (cordic_angles[ii] ^ sign) - sign;
+        x = next_x;
+    }
+
+    /* From the right half plane, the turn is within +/-pi/2, so adding
+     * the half turn in Q16 can't overflow.
+     */
+    return ((angle + (1L << 12)) >> 13) + half_turn;
+}
+
+/**
+ *  @brief      Sine and cosine.
+ *  CORDIC in rotation mode: (1/gain, 0) is turned by +/-atan(2^-i) at
+ *  each step, toward the angle, and ends up as (cos, sin).
+ *  @param[in]  angle   Angle in radians, Q16, in [-pi, pi].
+ *  @param[out] sine    Sine, Q30.
+ *  @param[out] cosine  Cosine, Q30.
+ */
+void fix_sincos(long angle, long *sine, long *cosine)
+{
+    long x = CORDIC_SCALE_Q30, y = 0, next_x, sign;
+    unsigned char ii, flip = 0;
+
+    /* Work in Q29, like the angle table, and in [-pi/2, pi/2], where
+     * CORDIC converges. A half turn negates both results.
+     */
+    angle <<= 13;
+    if (angle > (CORDIC_PI_Q29 >> 1)) {
+        angle -= CORDIC_PI_Q29;
+        flip = 1;
+    } else if (angle < -(CORDIC_PI_Q29 >> 1)) {
+        angle += CORDIC_PI_Q29;
+        flip = 1;
+    }
+
+    /* Turn counterclockwise while short of the angle, and back once past
+     * it. sign is -1 to turn back.
+     */
+    for (ii = 0; ii < CORDIC_ITERATIONS; ii++) {
+        sign = -(long)(angle < 0);
+        next_x = x - (((y >> ii) ^ sign) - sign);
+        y += ((x >> ii) ^ sign) - sign;
+        angle -= (cordic_angles[ii] ^ sign) - sign;
+        x = next_x;
+    }
+
+    *sine = flip ? -y : y;
+    *cosine = flip ? -x : x;
+}
+
+/**
+ *  @brief      Arc sine.
+ *  asin(s) = atan2(s, sqrt((1 - s)(1 + s))). 1 - s is exact in Q30, so
+ *  angles near +/-pi/2 keep their precision.
+ *  @param[in]  number  Sine in Q30. Clamped to [-1, 1].
+ *  @return     Angle in radians, Q16, in [-pi/2, pi/2].
+ */
+long fix_asin(long number)
+{
+    unsigned long sine, below, above, cos_sq;
+    long angle;
+
+    sine = (unsigned long)(number < 0 ? -number : number);
+    if (sine > (1UL << 30))
+        sine = 1UL << 30;
+    below = (1UL << 30) - sine;         /* 1 - |s|, Q30 */
+    above = ((1UL << 30) + sine) >> 15; /* 1 + |s|, Q15 */
+
+    /* cos^2 = (1 - |s|)(1 + |s|) in Q30, split so each product fits. */
+    cos_sq = (below >> 15) * above + (((below & 0x7FFF) * above) >> 15);
+
+    /* sqrt of Q30 is Q15. Bring it back up to the sine's Q30. */
+    angle = fix_atan2((long)sine, (long)(fix_sqrt(cos_sq) << 15));
+    return (number < 0) ? -angle : angle;
+}
+
+/**
+ *  @brief      Convert radians to degrees.
+ *  180/pi = 57 + 4846 / 2^14, with |rad| * 4846 kept within 32 bits.
+ *  @param[in]  rad     Angle in radians, Q16, up to +/-2 pi.
+ *  @return     Angle in degrees, Q16.
+ */
+long fix_rad_to_deg(long rad)
+{
+    return rad * 57 + ((rad * 4846) >> 14);
+}
@@ -0,0 +1,80 @@
+/******************************************************************************
+fixed_math.h - MPU-9250 Digital Motion Processor Arduino Library
+Fixed-point math for processors without an FPU (the SAMD21's Cortex-M0+)
+
+Values are 32-bit longs in Q16 (16 fractional bits) unless noted. Nothing
+here divides or uses floats, except fix_scale_init(), which runs once per
+full-scale range change, and only fix_mul_q30() multiplies more than 32
+bits. Error bounds are for the exact result, and were checked by
+Firmware/Host's fixed_math_bench.
+
+Supported Platforms:
+- ATSAMD21 (Arduino Zero, SparkFun SAMD21 Breakouts)
+******************************************************************************/
+#ifndef _FIXED_MATH_H_
+#define _FIXED_MATH_H_
+
+#define FIX_ONE_Q16   (65536L)
+#define FIX_PI_Q16    (205887L)       /* pi in Q16 */
+#define FIX_360_Q16   (360L << 16)    /* 360 degrees in Q16 */
+
+/* Sensor count to unit conversion, by a reciprocal multiply. */
+struct fix_scale_s {
+    long mult;              /* 2^(16 + shift) / sensitivity, < 2^16 */
+    unsigned char shift;
+};
+
+/* Set up scale to convert counts to units, at sens counts per unit. */
+void fix_scale_init(struct fix_scale_s *scale, float sens);
+
+/* Convert a 16-bit sensor count to units, Q16, rounded down. Error:
+ * within |result| * 2^-16 + 2^-16, and none if sens is a power of two.
+ */
+static inline long fix_scale(const struct fix_scale_s *scale, long count)
+{
+    return (count * scale->mult) >> scale->shift;
+}
+
+/* Convert Q30 (e.g. a DMP quaternion element) to Q16, rounded. Error:
+ * within 2^-17.
+ */
+static inline long fix_q30_to_q16(long number)
+{
+    return (number + (1L << 13)) >> 14;
+}
+
+/* Multiply two Q30 numbers, for a Q30 result, rounded down. The 64-bit
+ * product is a library call on the Cortex-M0+, but still a fraction of a
+ * float multiply. Error: within 2^-30.
+ */
+static inline long fix_mul_q30(long a, long b)
+{
+    return (long)(((long long)a * b) >> 30);
+}
+
+/* Integer square root, rounded down. Error: within 1. */
+unsigned long fix_sqrt(unsigned long number);
+
+/* Angle of (x, y) from the x axis in radians, Q16, in [-pi, pi], like
+ * atan2(y, x). Takes x and y at any common scale up to +/-2^30, and gives 0
+ * for (0, 0). CORDIC, with no multiplies. Error: within 1.1 * 2^-16
+ * (0.001 degrees), for inputs of at least 8 bits.
+ */
+long fix_atan2(long y, long x);
+
+/* Sine and cosine, in Q30, of angle in radians, Q16, in [-pi, pi]. CORDIC,
+ * with no multiplies. Error: within 2^-19.
+ */
+void fix_sincos(long angle, long *sine, long *cosine);
+
+/* Arc sine in radians, Q16, of number in Q30, clamped to [-1, 1]. Error:
+ * within 3 * 2^-16 (0.003 degrees).
+ */
+long fix_asin(long number);
+
+/* Convert radians to degrees, both Q16, for angles up to +/-2 pi. Error:
+ * within 2.5 * 2^-16 (0.00004 degrees).
+ */
+long fix_rad_to_deg(long rad);
+
+#endif /* _FIXED_MATH_H_ */
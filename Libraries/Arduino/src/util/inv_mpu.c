@@ -40,9 +40,10 @@
 #define MPU9250
 #include "arduino_mpu9250_i2c.h"
 #include "arduino_mpu9250_clk.h"
-#define i2c_write(a, b, c, d) arduino_i2c_write(a, b, c, d)
-#define i2c_read(a, b, c, d)  arduino_i2c_read(a, b, c, d)
-#define delay_ms  arduino_delay_ms
+/* Register accesses go through the register shadow, see reg_write. */
+#define i2c_write(a, b, c, d) reg_write(a, b, c, d)
+#define i2c_read(a, b, c, d)  reg_read(a, b, c, d)
+#define delay_ms  reg_delay_ms
 #define get_ms    arduino_get_clock_ms
 #define log_i     _MLPrintLog
 #define log_e     _MLPrintLog 
@@ -198,6 +199,8 @@ struct chip_cfg_s {
     unsigned char accel_half;
     /* 1 if device in low-power accel-only mode. */
     unsigned char lp_accel_mode;
+    /* 1 if the DLPFs are bypassed, see mpu_set_high_rate. */
+    unsigned char high_rate;
     /* 1 if interrupts are only triggered on motion events. */
     unsigned char int_motion_only;
     struct motion_int_cache_s cache;
@@ -209,13 +212,38 @@ struct chip_cfg_s {
     unsigned char dmp_on;
     /* Ensures that DMP will only be loaded once. */
     unsigned char dmp_loaded;
+    /* 1 to keep a resident DMP image, see mpu_set_fast_boot. */
+    unsigned char fast_boot;
+    /* 1 if mpu_init found a DMP image signature, with the image's length
+     * and CRC.
+     */
+    unsigned char dmp_resident;
+    unsigned short dmp_resident_length;
+    unsigned short dmp_resident_crc;
     /* Sampling rate used when DMP is enabled. */
     unsigned short dmp_sample_rate;
+    /* What to do when the FIFO overflows, see mpu_set_fifo_recovery. */
+    unsigned char fifo_recovery;
+    /* 1 after a failed FIFO read, which may have read part of a packet. */
+    unsigned char fifo_misaligned;
 #ifdef AK89xx_SECONDARY
     /* Compass sample rate. */
     unsigned short compass_sample_rate;
     unsigned char compass_addr;
     short mag_sens_adj[3];
+    /* 1 if the compass data is written to the FIFO in DMP mode. */
+    unsigned char compass_fifo;
+    /* Bytes to discard from the FIFO after a reset, see
+     * mpu_set_compass_fifo.
+     */
+    unsigned short compass_fifo_lead;
+    unsigned short fifo_skip;
+    /* Compass measurement mode, see mpu_set_compass_mode. */
+    unsigned char compass_mode;
+    /* 1 to correct compass readings, see mpu_set_compass_cal. */
+    unsigned char compass_cal;
+    short compass_offset[3];
+    short compass_matrix[9];
 #endif
 };
 
@@ -242,11 +270,38 @@ struct test_s {
 };
 
 /* Gyro driver state variables. */
+/* Copy of the registers the driver writes, see reg_write. */
+#define SHADOW_REGS (128)
+struct reg_shadow_s {
+    unsigned char value[SHADOW_REGS];
+    /* Bit masks, one bit per register. */
+    unsigned char valid[SHADOW_REGS / 8];
+    unsigned char dirty[SHADOW_REGS / 8];
+    /* 1 if the shadow is turned off, see mpu_set_reg_shadow. */
+    unsigned char off;
+    /* 1 while writes are held back, see mpu_defer_writes. */
+    unsigned char deferred;
+    /* 1 if mpu_reset_fifo was called while deferred. */
+    unsigned char reset_pending;
+#ifdef AK89xx_SECONDARY
+    /* Compass CNTL and ASTC, in bypass mode. */
+    unsigned char akm_cntl;
+    unsigned char akm_astc;
+    unsigned char akm_valid;
+#endif
+};
+
 struct gyro_state_s {
     const struct gyro_reg_s *reg;
     const struct hw_s *hw;
     struct chip_cfg_s chip_cfg;
     const struct test_s *test;
+    struct mpu_fifo_stats_s fifo_stats;
+    struct mpu_boot_stats_s boot_stats;
+    /* Copy of *hw with this device's I2C address, see mpu_set_address. */
+    struct hw_s hw_addr;
+    struct reg_shadow_s shadow;
+    struct mpu_shadow_stats_s shadow_stats;
 };
 
 /* Filter configurations. */
@@ -317,6 +372,8 @@ enum lp_accel_rate_e {
 #define BIT_DMP_RST         (0x08)
 #define BIT_FIFO_OVERFLOW   (0x10)
 #define BIT_DATA_RDY_EN     (0x01)
+#define BIT_RAW_RDY         (0x01)
+#define BIT_DMP_INT         (0x02)
 #define BIT_DMP_INT_EN      (0x02)
 #define BIT_MOT_INT_EN      (0x40)
 #define BITS_FSR            (0x18)
@@ -326,10 +383,13 @@ enum lp_accel_rate_e {
 #define BIT_FIFO_SIZE_1024  (0x40)
 #define BIT_FIFO_SIZE_2048  (0x80)
 #define BIT_FIFO_SIZE_4096  (0xC0)
+#define BIT_ACCEL_FCHOICE_B (0x08)
 #define BIT_RESET           (0x80)
 #define BIT_SLEEP           (0x40)
 #define BIT_S0_DELAY_EN     (0x01)
+#define BIT_S1_DELAY_EN     (0x02)
 #define BIT_S2_DELAY_EN     (0x04)
+#define BIT_SLV_0_FIFO_EN   (0x01)
 #define BITS_SLAVE_LENGTH   (0x0F)
 #define BIT_SLAVE_BYTE_SW   (0x40)
 #define BIT_SLAVE_GROUP     (0x10)
@@ -337,6 +397,7 @@ enum lp_accel_rate_e {
 #define BIT_I2C_READ        (0x80)
 #define BITS_I2C_MASTER_DLY (0x1F)
 #define BIT_AUX_IF_EN       (0x20)
+#define BIT_I2C_MST_RST     (0x02)
 #define BIT_ACTL            (0x80)
 #define BIT_LATCH_EN        (0x20)
 #define BIT_ANY_RD_CLR      (0x10)
@@ -382,6 +443,8 @@ enum lp_accel_rate_e {
 
 #define AKM_POWER_DOWN          (0x00 | SUPPORTS_AK89xx_HIGH_SENS)
 #define AKM_SINGLE_MEASUREMENT  (0x01 | SUPPORTS_AK89xx_HIGH_SENS)
+#define AKM_CONTINUOUS_8HZ      (0x02 | SUPPORTS_AK89xx_HIGH_SENS)
+#define AKM_CONTINUOUS_100HZ    (0x06 | SUPPORTS_AK89xx_HIGH_SENS)
 #define AKM_FUSE_ROM_ACCESS     (0x0F | SUPPORTS_AK89xx_HIGH_SENS)
 #define AKM_MODE_SELF_TEST      (0x08 | SUPPORTS_AK89xx_HIGH_SENS)
 
@@ -461,11 +524,6 @@ const struct test_s test = {
     .max_accel_var  = 0.14f
 };
 
-static struct gyro_state_s st = {
-    .reg = &reg,
-    .hw = &hw,
-    .test = &test
-};
 #elif defined MPU6500
 const struct gyro_reg_s reg = {
     .who_am_i       = 0x75,
@@ -543,23 +601,335 @@ const struct test_s test = {
     .sample_wait_ms = 10    //10ms sample time wait
 };
 
-static struct gyro_state_s st = {
-    .reg = &reg,
-    .hw = &hw,
-    .test = &test
+#endif
+
+/* One state per device. The functions below work on the selected device's,
+ * through st; see mpu_select_device.
+ */
+static struct gyro_state_s states[MPU_MAX_DEVICES] = {
+    [0 ... MPU_MAX_DEVICES - 1] = {
+        .reg = &reg,
+        .hw = &hw,
+        .test = &test
+    }
+};
+static unsigned char selected_device = 0;
+#define st (states[selected_device])
+
+/* Registers kept in the shadow: configuration that only the driver
+ * changes, so that it can be read back from the shadow, and a write of the
+ * value it already has can be skipped. SHADOW_DEFER marks those that may
+ * also be held back by mpu_defer_writes, and written in bursts of adjacent
+ * registers: nothing depends on the order they're written in, or on when.
+ * Data, status, FIFO and DMP memory registers, and I2C_SLV4_CTRL (which
+ * the chip clears), aren't kept.
+ */
+#define SHADOW_KEEP     (0x01)
+#define SHADOW_DEFER    (0x02)
+#define SHADOW_BOTH     (SHADOW_KEEP | SHADOW_DEFER)
+static const unsigned char shadow_map[SHADOW_REGS] = {
+#if defined MPU6050
+    [0x06 ... 0x0B] = SHADOW_BOTH,      /* Accel offsets */
+    [0x13 ... 0x18] = SHADOW_BOTH,      /* Gyro offsets */
+    [0x19 ... 0x1C] = SHADOW_BOTH,      /* Rate divider, DLPF, FSRs */
+    [0x1F ... 0x22] = SHADOW_BOTH,      /* Motion thresholds */
+#elif defined MPU6500
+    [0x13 ... 0x18] = SHADOW_BOTH,      /* Gyro offsets */
+    [0x19 ... 0x1F] = SHADOW_BOTH,      /* Rate divider, DLPFs, FSRs, LP
+                                         * accel rate, motion threshold */
+    [0x77 ... 0x7E] = SHADOW_BOTH,      /* Accel offsets */
+#endif
+    [0x23]          = SHADOW_KEEP,      /* FIFO_EN */
+    [0x24 ... 0x33] = SHADOW_BOTH,      /* I2C master, slaves 0-4 */
+    [0x37 ... 0x38] = SHADOW_KEEP,      /* INT_PIN_CFG, INT_ENABLE */
+    [0x63 ... 0x67] = SHADOW_BOTH,      /* Slave data out, master delay */
+    [0x69 ... 0x6C] = SHADOW_KEEP       /* Motion detect, USER_CTRL,
+                                         * PWR_MGMT_1 and 2 */
 };
+
+/* USER_CTRL bits that reset something and clear themselves, and
+ * PWR_MGMT_1's: a write with them set is never skipped, and they're never
+ * kept.
+ */
+#define USER_CTRL_RESETS    (BIT_DMP_RST | BIT_FIFO_RST | BIT_I2C_MST_RST | 0x01)
+
+#define SHADOW_BIT(mask, reg)   ((mask)[(reg) >> 3] & (1 << ((reg) & 7)))
+#define SHADOW_SET(mask, reg)   ((mask)[(reg) >> 3] |= (1 << ((reg) & 7)))
+#define SHADOW_CLEAR(mask, reg) ((mask)[(reg) >> 3] &= ~(1 << ((reg) & 7)))
+
+/* Forget every register, but not whether the shadow is on. */
+static void shadow_clear(void)
+{
+    memset(st.shadow.valid, 0, sizeof(st.shadow.valid));
+    memset(st.shadow.dirty, 0, sizeof(st.shadow.dirty));
+    st.shadow.reset_pending = 0;
+#ifdef AK89xx_SECONDARY
+    st.shadow.akm_valid = 0;
+#endif
+}
+
+/* 1 if every register from reg on is kept with all of flags. */
+static int shadow_covers(unsigned char reg, unsigned char length,
+    unsigned char flags)
+{
+    unsigned char ii;
+
+    if (st.shadow.off || (reg + length > SHADOW_REGS))
+        return 0;
+    for (ii = 0; ii < length; ii++)
+        if ((shadow_map[reg + ii] & flags) != flags)
+            return 0;
+    return 1;
+}
+
+/* Write the registers mpu_defer_writes held back. Runs of adjacent dirty
+ * registers go in one burst, with up to two clean ones between them
+ * rewritten: a byte each is less than another transfer.
+ */
+static int shadow_flush(void)
+{
+    unsigned char reg, first, last, ii;
+    int result = 0;
+
+    for (reg = 0; reg < SHADOW_REGS; reg++) {
+        if (!SHADOW_BIT(st.shadow.dirty, reg))
+            continue;
+        first = last = reg;
+        for (ii = reg + 1; (ii < SHADOW_REGS) && (ii <= last + 3) &&
+                (ii - first < I2C_MAX_WRITE_LENGTH); ii++) {
+            if (!(shadow_map[ii] & SHADOW_DEFER) ||
+                    !SHADOW_BIT(st.shadow.valid, ii))
+                break;
+            if (SHADOW_BIT(st.shadow.dirty, ii))
+                last = ii;
+        }
+        for (ii = first; ii <= last; ii++) {
+            if (SHADOW_BIT(st.shadow.dirty, ii) && (ii != first))
+                st.shadow_stats.writes_merged++;
+            SHADOW_CLEAR(st.shadow.dirty, ii);
+        }
+        if (arduino_i2c_write(st.hw->addr, first, last - first + 1,
+                &st.shadow.value[first])) {
+            for (ii = first; ii <= last; ii++)
+                SHADOW_CLEAR(st.shadow.valid, ii);
+            result = -1;
+        }
+        reg = last;
+    }
+    return result;
+}
+
+/**
+ *  @brief      Write registers, through the register shadow.
+ *  Registers in shadow_map are kept as written. Writing one the value it
+ *  already has is skipped, and while writes are deferred (see
+ *  mpu_defer_writes), those marked SHADOW_DEFER are only kept until
+ *  mpu_flush_writes. Anything else goes straight to the bus, after the
+ *  deferred writes, so the chip sees writes in order. A chip reset forgets
+ *  every register.
+ *  \n In bypass mode, the compass's CNTL and ASTC registers are kept the
+ *  same way, except for modes the compass leaves by itself (single
+ *  measurement and self-test).
+ */
+static int reg_write(unsigned char addr, unsigned char reg,
+    unsigned char length, unsigned char *data)
+{
+    unsigned char ii, skip = 1;
+
+#ifdef AK89xx_SECONDARY
+    if ((addr == st.chip_cfg.compass_addr) && (addr != st.hw->addr) &&
+            (length == 1) && !st.shadow.off &&
+            ((reg == AKM_REG_CNTL) || (reg == AKM_REG_ASTC))) {
+        unsigned char *kept = (reg == AKM_REG_CNTL) ?
+            &st.shadow.akm_cntl : &st.shadow.akm_astc;
+        unsigned char bit = (reg == AKM_REG_CNTL) ? 0x01 : 0x02;
+        if ((st.shadow.akm_valid & bit) && (*kept == data[0])) {
+            st.shadow_stats.writes_saved++;
+            return 0;
+        }
+        if (shadow_flush())
+            return -1;
+        st.shadow.akm_valid &= ~bit;
+        if (arduino_i2c_write(addr, reg, length, data))
+            return -1;
+        *kept = data[0];
+        if ((reg == AKM_REG_ASTC) || ((data[0] != AKM_SINGLE_MEASUREMENT) &&
+                (data[0] != AKM_MODE_SELF_TEST)))
+            st.shadow.akm_valid |= bit;
+        return 0;
+    }
 #endif
+    if (addr != st.hw->addr) {
+        if (shadow_flush())
+            return -1;
+        return arduino_i2c_write(addr, reg, length, data);
+    }
+
+    if (!shadow_covers(reg, length, SHADOW_KEEP)) {
+        if (shadow_flush())
+            return -1;
+        /* FIFO and memory bursts stay on one register. */
+        if ((reg != st.reg->fifo_r_w) && (reg != st.reg->mem_r_w))
+            for (ii = 0; (ii < length) && (reg + ii < SHADOW_REGS); ii++)
+                SHADOW_CLEAR(st.shadow.valid, reg + ii);
+        return arduino_i2c_write(addr, reg, length, data);
+    }
+
+    for (ii = 0; ii < length; ii++) {
+        unsigned char r = reg + ii;
+        if (!SHADOW_BIT(st.shadow.valid, r) || (st.shadow.value[r] != data[ii]))
+            skip = 0;
+        if ((r == st.reg->user_ctrl) && (data[ii] & USER_CTRL_RESETS))
+            skip = 0;
+        if ((r == st.reg->pwr_mgmt_1) && (data[ii] & BIT_RESET))
+            skip = 0;
+    }
+    if (skip) {
+        st.shadow_stats.writes_saved += length;
+        return 0;
+    }
+
+    if (st.shadow.deferred && shadow_covers(reg, length, SHADOW_BOTH)) {
+        for (ii = 0; ii < length; ii++) {
+            st.shadow.value[reg + ii] = data[ii];
+            SHADOW_SET(st.shadow.valid, reg + ii);
+            SHADOW_SET(st.shadow.dirty, reg + ii);
+        }
+        return 0;
+    }
+
+    if (shadow_flush())
+        return -1;
+    for (ii = 0; ii < length; ii++) {
+        SHADOW_CLEAR(st.shadow.valid, reg + ii);
+        SHADOW_CLEAR(st.shadow.dirty, reg + ii);
+    }
+    if (arduino_i2c_write(addr, reg, length, data))
+        return -1;
+    for (ii = 0; ii < length; ii++) {
+        unsigned char r = reg + ii;
+        st.shadow.value[r] = data[ii];
+        if (r == st.reg->user_ctrl)
+            st.shadow.value[r] &= ~USER_CTRL_RESETS;
+        SHADOW_SET(st.shadow.valid, r);
+        if ((r == st.reg->pwr_mgmt_1) && (data[ii] & BIT_RESET))
+            shadow_clear();
+    }
+    return 0;
+}
+
+/* Read registers, from the shadow if it has them all. */
+static int reg_read(unsigned char addr, unsigned char reg,
+    unsigned char length, unsigned char *data)
+{
+    unsigned char ii;
+
+    if ((addr == st.hw->addr) && shadow_covers(reg, length, SHADOW_KEEP)) {
+        for (ii = 0; ii < length; ii++)
+            if (!SHADOW_BIT(st.shadow.valid, reg + ii))
+                break;
+        if (ii == length) {
+            memcpy(data, &st.shadow.value[reg], length);
+            st.shadow_stats.reads_saved += length;
+            return 0;
+        }
+        if (shadow_flush() || arduino_i2c_read(addr, reg, length, data))
+            return -1;
+        for (ii = 0; ii < length; ii++) {
+            st.shadow.value[reg + ii] = data[ii];
+            SHADOW_SET(st.shadow.valid, reg + ii);
+        }
+        return 0;
+    }
+    if (shadow_flush())
+        return -1;
+    if (arduino_i2c_read(addr, reg, length, data)) {
+        /* The transfer may have got part-way, so the FIFO's read pointer
+         * is anywhere: the next FIFO read realigns it.
+         */
+        if ((addr == st.hw->addr) && (reg == st.reg->fifo_r_w))
+            st.chip_cfg.fifo_misaligned = 1;
+        return -1;
+    }
+    return 0;
+}
+
+/* Deferred writes are made before a delay: it's there for them to settle. */
+static void reg_delay_ms(unsigned long num_ms)
+{
+    shadow_flush();
+    arduino_delay_ms(num_ms);
+}
 
 #define MAX_PACKET_LENGTH (12)
 #ifdef MPU6500
 #define HWST_MAX_PACKET_LENGTH (512)
 #endif
 
+/* mpu_load_firmware signs the DMP image it loads, in the last bytes of the
+ * DMP's 3kB of memory (the FIFO uses the 1kB above), so that mpu_init can
+ * find it resident after an MCU reset. Images must end before it. The
+ * signature is DMP_SIGNATURE_MAGIC, then the image's length and CRC.
+ */
+#define DMP_SIGNATURE_LENGTH    (8)
+#define DMP_SIGNATURE_ADDR      (3072 - DMP_SIGNATURE_LENGTH)
+static const unsigned char DMP_SIGNATURE_MAGIC[4] = {'e', 'M', 'P', 'L'};
+static int find_dmp_signature(void);
+
 #ifdef AK89xx_SECONDARY
 static int setup_compass(void);
+static int compass_write_mode(unsigned char mode);
+static unsigned char compass_continuous_mode(void);
 #define MAX_COMPASS_SAMPLE_RATE (100)
 #endif
 
+/**
+ *  @brief      Select the device the other functions work on.
+ *  The driver keeps a separate state for each of up to MPU_MAX_DEVICES
+ *  devices. Every call works on the selected one's, until another is
+ *  selected. Device 0 is selected at start-up. Each device needs its own
+ *  I2C address (see mpu_set_address) before mpu_init.\n
+ *  The selection is shared by all callers. Code that can run in the
+ *  middle of another call, e.g. from an interrupt, must put back the
+ *  device it found selected (see mpu_get_device) before returning.
+ *  @param[in]  device  Device index, less than MPU_MAX_DEVICES.
+ *  @return     0 if successful.
+ */
+int mpu_select_device(unsigned char device)
+{
+    if (device >= MPU_MAX_DEVICES)
+        return -1;
+    selected_device = device;
+    return 0;
+}
+
+/**
+ *  @brief      Get the selected device.
+ *  @return     Device index.
+ */
+unsigned char mpu_get_device(void)
+{
+    return selected_device;
+}
+
+/**
+ *  @brief      Set the selected device's I2C address.
+ *  The MPU-9250 answers at 0x68, or 0x69 with its AD0 pin high.\n
+ *  In bypass mode, every device's compass answers at the same address, so
+ *  only one device at a time may be in bypass mode, e.g. while mpu_init
+ *  sets up its compass. With the compass on, mpu_set_sensors runs it from
+ *  the device's own I2C master instead.
+ *  @param[in]  addr    7-bit I2C address.
+ *  @return     0 if successful.
+ */
+int mpu_set_address(unsigned char addr)
+{
+    st.hw_addr = *st.hw;
+    st.hw_addr.addr = addr;
+    st.hw = &st.hw_addr;
+    return 0;
+}
+
 /**
  *  @brief      Enable/disable data ready interrupt.
  *  If the DMP is on, the DMP interrupt is enabled. Otherwise, the data ready
@@ -607,7 +977,7 @@ int mpu_reg_dump(void)
     for (ii = 0; ii < st.hw->num_reg; ii++) {
         if (ii == st.reg->fifo_r_w || ii == st.reg->mem_r_w)
             continue;
-        if (i2c_read(st.hw->addr, ii, 1, &data))
+        if (shadow_flush() || arduino_i2c_read(st.hw->addr, ii, 1, &data))
             return -1;
         log_i("%#5x: %#5x\r\n", ii, data);
     }
@@ -616,6 +986,7 @@ int mpu_reg_dump(void)
 
 /**
  *  @brief      Read from a single register.
+ *  The register is read from the chip, not the register shadow.
  *  NOTE: The memory and FIFO read/write registers cannot be accessed.
  *  @param[in]  reg     Register address.
  *  @param[out] data    Register data.
@@ -627,7 +998,9 @@ int mpu_read_reg(unsigned char reg, unsigned char *data)
         return -1;
     if (reg >= st.hw->num_reg)
         return -1;
-    return i2c_read(st.hw->addr, reg, 1, data);
+    if (shadow_flush())
+        return -1;
+    return arduino_i2c_read(st.hw->addr, reg, 1, data);
 }
 
 /**
@@ -646,12 +1019,36 @@ int mpu_read_reg(unsigned char reg, unsigned char *data)
 int mpu_init(struct int_param_s *int_param)
 {
     unsigned char data[6];
+    unsigned long start_ms, end_ms;
 
-    /* Reset device. */
-    data[0] = BIT_RESET;
-    if (i2c_write(st.hw->addr, st.reg->pwr_mgmt_1, 1, data))
+    get_ms(&start_ms);
+    memset(&st.boot_stats, 0, sizeof(st.boot_stats));
+    /* Nothing is known about the registers until they're written or read. */
+    shadow_clear();
+    st.shadow.deferred = 0;
+    st.chip_cfg.dmp_resident = 0;
+    if (st.chip_cfg.fast_boot && find_dmp_signature())
         return -1;
-    delay_ms(100);
+
+    if (st.chip_cfg.dmp_resident) {
+        /* Keep the DMP memory: stop the DMP, FIFO and I2C master and reset
+         * them, instead of the whole chip.
+         */
+        data[0] = BIT_FIFO_RST | BIT_DMP_RST | BIT_I2C_MST_RST;
+        if (i2c_write(st.hw->addr, st.reg->user_ctrl, 1, data))
+            return -1;
+        data[0] = 0;
+        if (i2c_write(st.hw->addr, st.reg->int_enable, 1, data))
+            return -1;
+        if (i2c_write(st.hw->addr, st.reg->fifo_en, 1, data))
+            return -1;
+    } else {
+        /* Reset device. */
+        data[0] = BIT_RESET;
+        if (i2c_write(st.hw->addr, st.reg->pwr_mgmt_1, 1, data))
+            return -1;
+        delay_ms(100);
+    }
 
     /* Wake up chip. */
     data[0] = 0x00;
@@ -679,6 +1076,11 @@ int mpu_init(struct int_param_s *int_param)
     st.chip_cfg.bypass_mode = 0xFF;
 #ifdef AK89xx_SECONDARY
     st.chip_cfg.compass_sample_rate = 0xFFFF;
+    st.chip_cfg.compass_fifo = 0;
+    st.chip_cfg.compass_fifo_lead = 0;
+    st.chip_cfg.fifo_skip = 0;
+    st.chip_cfg.compass_mode = MPU_COMPASS_SINGLE;
+    st.chip_cfg.compass_cal = 0;
 #endif
     /* mpu_set_sensors always preserves this setting. */
     st.chip_cfg.clk_src = INV_CLK_PLL;
@@ -687,10 +1089,14 @@ int mpu_init(struct int_param_s *int_param)
     st.chip_cfg.latched_int = 0;
     st.chip_cfg.int_motion_only = 0;
     st.chip_cfg.lp_accel_mode = 0;
+    st.chip_cfg.high_rate = 0;
     memset(&st.chip_cfg.cache, 0, sizeof(st.chip_cfg.cache));
     st.chip_cfg.dmp_on = 0;
     st.chip_cfg.dmp_loaded = 0;
     st.chip_cfg.dmp_sample_rate = 0;
+    st.chip_cfg.fifo_recovery = MPU_FIFO_RECOVERY_RESET;
+    st.chip_cfg.fifo_misaligned = 0;
+    memset(&st.fifo_stats, 0, sizeof(st.fifo_stats));
 
     if (mpu_set_gyro_fsr(2000))
         return -1;
@@ -719,6 +1125,39 @@ int mpu_init(struct int_param_s *int_param)
 #endif
 
     mpu_set_sensors(0);
+    get_ms(&end_ms);
+    st.boot_stats.init_ms = end_ms - start_ms;
+    return 0;
+}
+
+/**
+ *  @brief      Keep a resident DMP image across MCU resets.
+ *  With fast boot on, mpu_init looks for the signature mpu_load_firmware
+ *  leaves after the DMP image. If it's there, the chip hasn't been power
+ *  cycled since the image was loaded: mpu_init resets only the DMP, FIFO
+ *  and I2C master instead of the whole chip (saving the 100ms reset delay),
+ *  and mpu_load_firmware skips the load if the image is the same.\n
+ *  Everything mpu_init and the DMP setup functions don't write keeps its
+ *  value from the earlier run, e.g. the accel and gyro bias registers, and
+ *  DMP settings such as the orientation and tap thresholds. Set those again
+ *  if they may have changed.
+ *  @param[in]  enable  1 to enable fast boot. Call before mpu_init.
+ *  @return     0 if successful.
+ */
+int mpu_set_fast_boot(unsigned char enable)
+{
+    st.chip_cfg.fast_boot = enable ? 1 : 0;
+    return 0;
+}
+
+/**
+ *  @brief      Get the time spent by the last mpu_init and DMP load.
+ *  @param[out] stats   Boot timings and whether the DMP image was resident.
+ *  @return     0 if successful.
+ */
+int mpu_get_boot_stats(struct mpu_boot_stats_s *stats)
+{
+    memcpy(stats, &st.boot_stats, sizeof(st.boot_stats));
     return 0;
 }
 
@@ -743,6 +1182,8 @@ int mpu_lp_accel_mode(unsigned short rate)
 
     if (rate > 40)
         return -1;
+    if (rate && st.chip_cfg.high_rate)
+        return -1;
 
     if (!rate) {
         mpu_set_int_latched(0);
@@ -1059,6 +1500,12 @@ int mpu_reset_fifo(void)
 
     if (!(st.chip_cfg.sensors))
         return -1;
+    st.chip_cfg.fifo_misaligned = 0;
+    /* One reset will do for everything until mpu_flush_writes. */
+    if (st.shadow.deferred) {
+        st.shadow.reset_pending = 1;
+        return 0;
+    }
 
     data = 0;
     if (i2c_write(st.hw->addr, st.reg->int_enable, 1, &data))
@@ -1073,6 +1520,17 @@ int mpu_reset_fifo(void)
         if (i2c_write(st.hw->addr, st.reg->user_ctrl, 1, &data))
             return -1;
         delay_ms(50);
+#ifdef AK89xx_SECONDARY
+        /* Select the compass data before the FIFO starts, so that the
+         * first sample written already has it.
+         */
+        if (st.chip_cfg.compass_fifo) {
+            data = BIT_SLV_0_FIFO_EN;
+            if (i2c_write(st.hw->addr, st.reg->fifo_en, 1, &data))
+                return -1;
+        }
+        st.chip_cfg.fifo_skip = st.chip_cfg.compass_fifo_lead;
+#endif
         data = BIT_DMP_EN | BIT_FIFO_EN;
         if (st.chip_cfg.sensors & INV_XYZ_COMPASS)
             data |= BIT_AUX_IF_EN;
@@ -1084,9 +1542,6 @@ int mpu_reset_fifo(void)
             data = 0;
         if (i2c_write(st.hw->addr, st.reg->int_enable, 1, &data))
             return -1;
-        data = 0;
-        if (i2c_write(st.hw->addr, st.reg->fifo_en, 1, &data))
-            return -1;
     } else {
         data = BIT_FIFO_RST;
         if (i2c_write(st.hw->addr, st.reg->user_ctrl, 1, &data))
@@ -1110,6 +1565,173 @@ int mpu_reset_fifo(void)
     return 0;
 }
 
+/**
+ *  @brief  Reset the FIFO after its contents were lost or corrupted.
+ *  Same as mpu_reset_fifo, but counted in the FIFO statistics.
+ *  @return 0 if successful.
+ */
+int mpu_recover_fifo(void)
+{
+    st.fifo_stats.resets++;
+    return mpu_reset_fifo();
+}
+
+/**
+ *  @brief      Select how FIFO overflows are handled in DMP mode.
+ *  When the FIFO fills up, the oldest bytes are overwritten, and the read
+ *  pointer may end up part-way into a packet.
+ *  \n MPU_FIFO_RECOVERY_RESET resets the FIFO (and the DMP), as the
+ *  original driver did. Everything in the FIFO is lost, and the reset takes
+ *  over 50ms, during which more packets are lost.
+ *  \n MPU_FIFO_RECOVERY_RESYNC keeps the FIFO running. The newest packet
+ *  always ends at the end of the FIFO, so the FIFO count modulo the packet
+ *  length is the number of bytes left of the oldest, overwritten packet.
+ *  They are read and discarded, and reading carries on from the next packet
+ *  boundary. Only the overwritten packets are lost. If the packets still
+ *  turn out to be misaligned, the DMP's quaternion check resets the FIFO.
+ *  \n Either way, the FIFO statistics count what happened.
+ *  @param[in]  mode    MPU_FIFO_RECOVERY_RESET or MPU_FIFO_RECOVERY_RESYNC.
+ *  @return     0 if successful.
+ */
+int mpu_set_fifo_recovery(unsigned char mode)
+{
+    if (mode > MPU_FIFO_RECOVERY_RESYNC)
+        return -1;
+    st.chip_cfg.fifo_recovery = mode;
+    return 0;
+}
+
+/**
+ *  @brief      Write the compass data into the FIFO in DMP mode.
+ *  Slave 0 of the auxiliary I2C master reads the compass's eight data
+ *  registers (ST1 to ST2) into the external sensor data registers. With this
+ *  enabled, the MPU also writes those eight bytes to the FIFO at every
+ *  sample, ahead of the DMP's packet for that sample, so the compass comes
+ *  back with the FIFO read instead of needing mpu_get_compass_reg.
+ *  \n The DMP outputs a packet every few samples, so one packet in the FIFO
+ *  is preceded by that many compass blocks. After a FIFO reset the DMP
+ *  writes its first packet with the first sample, so the FIFO starts with a
+ *  shorter packet. @e lead is its length: it is read and discarded before
+ *  the next FIFO read, and reading starts at a whole packet.
+ *  \n Compass data is written into the FIFO from the next FIFO reset; call
+ *  mpu_reset_fifo if needed. Overflows are recovered from as set by
+ *  mpu_set_fifo_recovery, but realigning has to wait for the DMP's next
+ *  packet: only then does the FIFO end at a packet boundary.
+ *  @param[in]  enable  1 to write the compass data into the FIFO.
+ *  @param[in]  lead    Bytes to discard after each FIFO reset.
+ *  @return     0 if successful.
+ */
+int mpu_set_compass_fifo(unsigned char enable, unsigned short lead)
+{
+#ifdef AK89xx_SECONDARY
+    if (enable && !(st.chip_cfg.sensors & INV_XYZ_COMPASS))
+        return -1;
+    st.chip_cfg.compass_fifo = enable ? 1 : 0;
+    st.chip_cfg.compass_fifo_lead = enable ? lead : 0;
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/**
+ *  @brief      Check whether the compass data is written into the FIFO.
+ *  @param[out] enabled 1 if it is, see mpu_set_compass_fifo.
+ *  @return     0 if successful.
+ */
+int mpu_get_compass_fifo(unsigned char *enabled)
+{
+#ifdef AK89xx_SECONDARY
+    enabled[0] = st.chip_cfg.compass_fifo;
+#else
+    enabled[0] = 0;
+#endif
+    return 0;
+}
+
+/**
+ *  @brief      Get the FIFO overflow and recovery statistics.
+ *  The counts start from zero in mpu_init.
+ *  @param[out] stats   Statistics.
+ *  @return     0 if successful.
+ */
+int mpu_get_fifo_stats(struct mpu_fifo_stats_s *stats)
+{
+    memcpy(stats, &st.fifo_stats, sizeof(st.fifo_stats));
+    return 0;
+}
+
+/**
+ *  @brief      Turn the register shadow on or off.
+ *  The driver keeps a copy of the configuration registers it writes (see
+ *  reg_write), so that reading one back, as the read-modify-write setters
+ *  do, costs no I2C transfer, and writing one the value it already has is
+ *  skipped. The shadow is on by default. It assumes nothing else writes
+ *  those registers: if the chip may have been reset behind the driver's
+ *  back, turn it off and on again to forget them.
+ *  @param[in]  enable  1 to keep the shadow, 0 to read and write every
+ *                      register on the bus.
+ *  @return     0 if successful.
+ */
+int mpu_set_reg_shadow(unsigned char enable)
+{
+    if (mpu_flush_writes())
+        return -1;
+    shadow_clear();
+    st.shadow.off = !enable;
+    return 0;
+}
+
+/**
+ *  @brief      Hold back configuration writes until mpu_flush_writes.
+ *  Writes to the registers marked SHADOW_DEFER (rate divider, DLPFs, FSRs,
+ *  offsets, I2C master setup) only update the register shadow. FIFO resets
+ *  are held back too, and made once. mpu_flush_writes writes every
+ *  changed register, in bursts of adjacent ones, then resets the FIFO if
+ *  asked to. Any other access on the bus writes them first, so the chip
+ *  still sees writes in order.
+ *  \n Use it around a reconfiguration that makes several changes. The FIFO
+ *  must not be read until mpu_flush_writes.
+ *  @return     0 if successful, -1 if the shadow is off.
+ */
+int mpu_defer_writes(void)
+{
+    if (st.shadow.off)
+        return -1;
+    st.shadow.deferred = 1;
+    return 0;
+}
+
+/**
+ *  @brief      Write what mpu_defer_writes held back, and stop deferring.
+ *  @return     0 if successful.
+ */
+int mpu_flush_writes(void)
+{
+    int result;
+
+    st.shadow.deferred = 0;
+    result = shadow_flush();
+    if (st.shadow.reset_pending) {
+        st.shadow.reset_pending = 0;
+        if (mpu_reset_fifo())
+            result = -1;
+    }
+    return result;
+}
+
+/**
+ *  @brief      Get the register shadow's statistics.
+ *  The counts start from zero at power-up.
+ *  @param[out] stats   Statistics.
+ *  @return     0 if successful.
+ */
+int mpu_get_shadow_stats(struct mpu_shadow_stats_s *stats)
+{
+    memcpy(stats, &st.shadow_stats, sizeof(st.shadow_stats));
+    return 0;
+}
+
 /**
  *  @brief      Get the gyro full-scale range.
  *  @param[out] fsr Current full-scale range.
@@ -1277,6 +1899,7 @@ int mpu_get_lpf(unsigned short *lpf)
 /**
  *  @brief      Set digital low pass filter.
  *  The following LPF settings are supported: 188, 98, 42, 20, 10, 5.
+ *  Fails while the DLPFs are bypassed, see mpu_set_high_rate.
  *  @param[in]  lpf Desired LPF setting.
  *  @return     0 if successful.
  */
@@ -1286,6 +1909,8 @@ int mpu_set_lpf(unsigned short lpf)
 
     if (!(st.chip_cfg.sensors))
         return -1;
+    if (st.chip_cfg.high_rate)
+        return -1;
 
     if (lpf >= 188)
         data = INV_FILTER_188HZ;
@@ -1317,6 +1942,8 @@ int mpu_get_sample_rate(unsigned short *rate)
 {
     if (st.chip_cfg.dmp_on)
         return -1;
+    else if (st.chip_cfg.high_rate)
+        rate[0] = MPU_HIGH_RATE_HZ;
     else
         rate[0] = st.chip_cfg.sample_rate;
     return 0;
@@ -1324,7 +1951,8 @@ int mpu_get_sample_rate(unsigned short *rate)
 
 /**
  *  @brief      Set sampling rate.
- *  Sampling rate must be between 4Hz and 1kHz.
+ *  Sampling rate must be between 4Hz and 1kHz. For more, see
+ *  mpu_set_high_rate; this fails while that's enabled.
  *  @param[in]  rate    Desired sampling rate (Hz).
  *  @return     0 if successful.
  */
@@ -1335,7 +1963,7 @@ int mpu_set_sample_rate(unsigned short rate)
     if (!(st.chip_cfg.sensors))
         return -1;
 
-    if (st.chip_cfg.dmp_on)
+    if (st.chip_cfg.dmp_on || st.chip_cfg.high_rate)
         return -1;
     else {
         if (st.chip_cfg.lp_accel_mode) {
@@ -1371,18 +1999,79 @@ int mpu_set_sample_rate(unsigned short rate)
 }
 
 /**
- *  @brief      Get compass sampling rate.
- *  @param[out] rate    Current compass sampling rate (Hz).
+ *  @brief      Bypass the digital low pass filters, for high-rate sampling.
+ *  The gyro is then sampled at 8kHz with a 3600Hz bandwidth (DLPF_CFG 7,
+ *  FCHOICE_B 0), and the accel at 4kHz with a 1130Hz bandwidth
+ *  (ACCEL_FCHOICE_B 1). The FIFO is written at the gyro's 8kHz, so each
+ *  accel reading appears in it twice. The sample rate divider has no
+ *  effect. The gyro's FCHOICE_B bypass isn't used: it samples at 32kHz,
+ *  more than the FIFO can be drained at over I2C.
+ *  \n Not available with the DMP running, or in low-power accel mode.
+ *  While enabled, mpu_get_sample_rate gives MPU_HIGH_RATE_HZ, and
+ *  mpu_set_sample_rate and mpu_set_lpf fail. Disabling goes back to the
+ *  DLPF setting for the sample rate set before.
+ *  @param[in]  enable  1 to bypass the filters.
  *  @return     0 if successful.
  */
-int mpu_get_compass_sample_rate(unsigned short *rate)
+int mpu_set_high_rate(unsigned char enable)
 {
-#ifdef AK89xx_SECONDARY
-    rate[0] = st.chip_cfg.compass_sample_rate;
-    return 0;
-#else
-    rate[0] = 0;
-    return -1;
+    unsigned char data;
+
+    if (!(st.chip_cfg.sensors))
+        return -1;
+    if (st.chip_cfg.dmp_on || st.chip_cfg.lp_accel_mode)
+        return -1;
+    enable = enable ? 1 : 0;
+    if (st.chip_cfg.high_rate == enable)
+        return 0;
+
+    if (enable) {
+        data = INV_FILTER_2100HZ_NOLPF;
+        if (i2c_write(st.hw->addr, st.reg->lpf, 1, &data))
+            return -1;
+        st.chip_cfg.lpf = data;
+#ifdef MPU6500
+        /* mpu_init already leaves the accel filter bypassed, but make
+         * sure.
+         */
+        data = BIT_FIFO_SIZE_1024 | BIT_ACCEL_FCHOICE_B;
+        if (i2c_write(st.hw->addr, st.reg->accel_cfg2, 1, &data))
+            return -1;
+#endif
+        st.chip_cfg.high_rate = 1;
+    } else {
+        st.chip_cfg.high_rate = 0;
+        /* As mpu_set_sample_rate sets it. */
+        if (mpu_set_lpf(st.chip_cfg.sample_rate >> 1))
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ *  @brief      Check whether the DLPFs are bypassed.
+ *  @param[out] enabled 1 if they are, see mpu_set_high_rate.
+ *  @return     0 if successful.
+ */
+int mpu_get_high_rate(unsigned char *enabled)
+{
+    enabled[0] = st.chip_cfg.high_rate;
+    return 0;
+}
+
+/**
+ *  @brief      Get compass sampling rate.
+ *  @param[out] rate    Current compass sampling rate (Hz).
+ *  @return     0 if successful.
+ */
+int mpu_get_compass_sample_rate(unsigned short *rate)
+{
+#ifdef AK89xx_SECONDARY
+    rate[0] = st.chip_cfg.compass_sample_rate;
+    return 0;
+#else
+    rate[0] = 0;
+    return -1;
 #endif
 }
 
@@ -1391,6 +2080,8 @@ int mpu_get_compass_sample_rate(unsigned short *rate)
  *  The compass on the auxiliary I2C bus is read by the MPU hardware at a
  *  maximum of 100Hz. The actual rate can be set to a fraction of the gyro
  *  sampling rate.
+ *  \n In continuous mode (see mpu_set_compass_mode), the compass measures at
+ *  100Hz, or 8Hz for rates up to 8Hz, and is read at that rate.
  *
  *  \n WARNING: The new rate may be different than what was requested. Call
  *  mpu_get_compass_sample_rate to check the actual setting.
@@ -1400,10 +2091,26 @@ int mpu_get_compass_sample_rate(unsigned short *rate)
 int mpu_set_compass_sample_rate(unsigned short rate)
 {
 #ifdef AK89xx_SECONDARY
-    unsigned char div;
+    unsigned char div, mode;
     if (!rate || rate > st.chip_cfg.sample_rate || rate > MAX_COMPASS_SAMPLE_RATE)
         return -1;
 
+    if (st.chip_cfg.compass_mode == MPU_COMPASS_CONTINUOUS) {
+        mode = compass_continuous_mode();
+        rate = (rate <= 8) ? 8 : 100;
+        if (rate > st.chip_cfg.sample_rate)
+            return -1;
+        div = st.chip_cfg.sample_rate / rate - 1;
+        if (i2c_write(st.hw->addr, st.reg->s4_ctrl, 1, &div))
+            return -1;
+        st.chip_cfg.compass_sample_rate = rate;
+        /* Switch between 8Hz and 100Hz if needed. */
+        if ((compass_continuous_mode() != mode) &&
+            (st.chip_cfg.sensors & INV_XYZ_COMPASS))
+            return compass_write_mode(compass_continuous_mode());
+        return 0;
+    }
+
     div = st.chip_cfg.sample_rate / rate - 1;
     if (i2c_write(st.hw->addr, st.reg->s4_ctrl, 1, &div))
         return -1;
@@ -1414,6 +2121,75 @@ int mpu_set_compass_sample_rate(unsigned short rate)
 #endif
 }
 
+/**
+ *  @brief      Select how the compass measures.
+ *  MPU_COMPASS_SINGLE is the original scheme: slave 1 of the auxiliary I2C
+ *  master writes a single measurement command to the compass after every
+ *  read, so the compass only measures when it's read.
+ *  \n MPU_COMPASS_CONTINUOUS (AK8963 only) has the compass measure on its
+ *  own, at 100Hz (8Hz for compass sample rates up to 8Hz), with 16-bit
+ *  output. Slave 1 only writes the mode once, and is then disabled, so each
+ *  compass sample is a single read on the auxiliary bus instead of a read
+ *  and a write. The compass is read at its measurement rate, but by the
+ *  MPU's clock, so the two drift: now and then a read finds no new
+ *  measurement, and mpu_get_compass_reg and mpu_decode_compass return -2,
+ *  or the compass overruns (a measurement was replaced before it was read)
+ *  and the next one is returned as usual.
+ *  @param[in]  mode    MPU_COMPASS_SINGLE or MPU_COMPASS_CONTINUOUS.
+ *  @return     0 if successful.
+ */
+int mpu_set_compass_mode(unsigned char mode)
+{
+#ifdef AK8963_SECONDARY
+    unsigned char data;
+
+    if (mode > MPU_COMPASS_CONTINUOUS)
+        return -1;
+    if (mode == st.chip_cfg.compass_mode)
+        return 0;
+    st.chip_cfg.compass_mode = mode;
+    /* The read rate depends on the mode. */
+    if (st.chip_cfg.compass_sample_rate <= MAX_COMPASS_SAMPLE_RATE)
+        mpu_set_compass_sample_rate(st.chip_cfg.compass_sample_rate);
+    if (!(st.chip_cfg.sensors & INV_XYZ_COMPASS))
+        return 0;
+
+    if (mode == MPU_COMPASS_CONTINUOUS)
+        return compass_write_mode(compass_continuous_mode());
+
+    /* Back to a single measurement after every read. */
+    if (compass_write_mode(AKM_POWER_DOWN))
+        return -1;
+#ifndef AK89xx_BYPASS
+    data = AKM_SINGLE_MEASUREMENT;
+    if (i2c_write(st.hw->addr, st.reg->s1_do, 1, &data))
+        return -1;
+    data = BIT_SLAVE_EN | 1;
+    if (i2c_write(st.hw->addr, st.reg->s1_ctrl, 1, &data))
+        return -1;
+#endif
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/**
+ *  @brief      Get the compass measurement mode.
+ *  @param[out] mode    MPU_COMPASS_SINGLE or MPU_COMPASS_CONTINUOUS.
+ *  @return     0 if successful.
+ */
+int mpu_get_compass_mode(unsigned char *mode)
+{
+#ifdef AK89xx_SECONDARY
+    mode[0] = st.chip_cfg.compass_mode;
+    return 0;
+#else
+    mode[0] = MPU_COMPASS_SINGLE;
+    return -1;
+#endif
+}
+
 /**
  *  @brief      Get gyro sensitivity scale factor.
  *  @param[out] sens    Conversion from hardware units to dps.
@@ -1611,11 +2387,23 @@ int mpu_set_sensors(unsigned char sensors)
         user_ctrl |= BIT_DMP_EN;
     else
         user_ctrl &= ~BIT_DMP_EN;
-    if (i2c_write(st.hw->addr, st.reg->s1_do, 1, &data))
-        return -1;
+    if (st.chip_cfg.compass_mode == MPU_COMPASS_SINGLE) {
+        if (i2c_write(st.hw->addr, st.reg->s1_do, 1, &data))
+            return -1;
+    } else if (!(sensors & INV_XYZ_COMPASS) &&
+        (st.chip_cfg.sensors & INV_XYZ_COMPASS)) {
+        /* Stop measuring while the I2C master still runs. */
+        if (compass_write_mode(AKM_POWER_DOWN))
+            return -1;
+    }
     /* Enable/disable I2C master mode. */
     if (i2c_write(st.hw->addr, st.reg->user_ctrl, 1, &user_ctrl))
         return -1;
+    if ((st.chip_cfg.compass_mode == MPU_COMPASS_CONTINUOUS) &&
+        (sensors & INV_XYZ_COMPASS)) {
+        if (compass_write_mode(compass_continuous_mode()))
+            return -1;
+    }
 #endif
 #endif
 
@@ -1642,134 +2430,502 @@ int mpu_get_int_status(short *status)
 }
 
 /**
- *  @brief      Get one packet from the FIFO.
- *  If @e sensors does not contain a particular sensor, disregard the data
- *  returned to that pointer.
- *  \n @e sensors can contain a combination of the following flags:
- *  \n INV_X_GYRO, INV_Y_GYRO, INV_Z_GYRO
- *  \n INV_XYZ_GYRO
- *  \n INV_XYZ_ACCEL
- *  \n If the FIFO has no new data, @e sensors will be zero.
- *  \n If the FIFO is disabled, @e sensors will be zero and this function will
- *  return a non-zero error code.
- *  @param[out] gyro        Gyro data in hardware units.
- *  @param[out] accel       Accel data in hardware units.
- *  @param[out] timestamp   Timestamp in milliseconds.
- *  @param[out] sensors     Mask of sensors read from FIFO.
+ *  @brief      Get one packet from the FIFO.
+ *  If @e sensors does not contain a particular sensor, disregard the data
+ *  returned to that pointer.
+ *  \n @e sensors can contain a combination of the following flags:
+ *  \n INV_X_GYRO, INV_Y_GYRO, INV_Z_GYRO
+ *  \n INV_XYZ_GYRO
+ *  \n INV_XYZ_ACCEL
+ *  \n If the FIFO has no new data, @e sensors will be zero.
+ *  \n If the FIFO is disabled, @e sensors will be zero and this function will
+ *  return a non-zero error code.
+ *  @param[out] gyro        Gyro data in hardware units.
+ *  @param[out] accel       Accel data in hardware units.
+ *  @param[out] timestamp   Timestamp in milliseconds.
+ *  @param[out] sensors     Mask of sensors read from FIFO.
+ *  @param[out] more        Number of remaining packets.
+ *  @return     0 if successful.
+ */
+int mpu_read_fifo(short *gyro, short *accel, unsigned long *timestamp,
+        unsigned char *sensors, unsigned char *more)
+{
+    /* Assumes maximum packet size is gyro (6) + accel (6). */
+    unsigned char data[MAX_PACKET_LENGTH];
+    unsigned char packet_size = 0;
+    unsigned short fifo_count, index = 0;
+
+    if (st.chip_cfg.dmp_on)
+        return -1;
+
+    sensors[0] = 0;
+    if (!st.chip_cfg.sensors)
+        return -1;
+    if (!st.chip_cfg.fifo_enable)
+        return -1;
+
+    if (st.chip_cfg.fifo_enable & INV_X_GYRO)
+        packet_size += 2;
+    if (st.chip_cfg.fifo_enable & INV_Y_GYRO)
+        packet_size += 2;
+    if (st.chip_cfg.fifo_enable & INV_Z_GYRO)
+        packet_size += 2;
+    if (st.chip_cfg.fifo_enable & INV_XYZ_ACCEL)
+        packet_size += 6;
+
+    if (i2c_read(st.hw->addr, st.reg->fifo_count_h, 2, data))
+        return -1;
+    fifo_count = (data[0] << 8) | data[1];
+    if (fifo_count < packet_size)
+        return 0;
+//    log_i("FIFO count: %hd\n", fifo_count);
+    if (fifo_count > (st.hw->max_fifo >> 1)) {
+        /* FIFO is 50% full, better check overflow bit. */
+        if (i2c_read(st.hw->addr, st.reg->int_status, 1, data))
+            return -1;
+        if (data[0] & BIT_FIFO_OVERFLOW) {
+            mpu_reset_fifo();
+            return -2;
+        }
+    }
+    get_ms((unsigned long*)timestamp);
+
+    if (i2c_read(st.hw->addr, st.reg->fifo_r_w, packet_size, data))
+        return -1;
+    more[0] = fifo_count / packet_size - 1;
+    sensors[0] = 0;
+
+    if ((index != packet_size) && st.chip_cfg.fifo_enable & INV_XYZ_ACCEL) {
+        accel[0] = (data[index+0] << 8) | data[index+1];
+        accel[1] = (data[index+2] << 8) | data[index+3];
+        accel[2] = (data[index+4] << 8) | data[index+5];
+        sensors[0] |= INV_XYZ_ACCEL;
+        index += 6;
+    }
+    if ((index != packet_size) && st.chip_cfg.fifo_enable & INV_X_GYRO) {
+        gyro[0] = (data[index+0] << 8) | data[index+1];
+        sensors[0] |= INV_X_GYRO;
+        index += 2;
+    }
+    if ((index != packet_size) && st.chip_cfg.fifo_enable & INV_Y_GYRO) {
+        gyro[1] = (data[index+0] << 8) | data[index+1];
+        sensors[0] |= INV_Y_GYRO;
+        index += 2;
+    }
+    if ((index != packet_size) && st.chip_cfg.fifo_enable & INV_Z_GYRO) {
+        gyro[2] = (data[index+0] << 8) | data[index+1];
+        sensors[0] |= INV_Z_GYRO;
+        index += 2;
+    }
+
+    return 0;
+}
+
+/* Discard the lead of a DMP FIFO after a reset, see mpu_set_compass_fifo.
+ * fifo_count is updated. data must hold the lead.
+ * Returns 0 if the FIFO is now at a packet boundary, -1 if not yet.
+ */
+static int skip_fifo_lead(unsigned short *fifo_count, unsigned char *data)
+{
+#ifdef AK89xx_SECONDARY
+    if (!st.chip_cfg.fifo_skip)
+        return 0;
+    if (fifo_count[0] < st.chip_cfg.fifo_skip)
+        return -1;
+    if (i2c_read(st.hw->addr, st.reg->fifo_r_w, st.chip_cfg.fifo_skip, data))
+        return -1;
+    fifo_count[0] -= st.chip_cfg.fifo_skip;
+    st.chip_cfg.fifo_skip = 0;
+#endif
+    return 0;
+}
+
+#ifdef AK89xx_SECONDARY
+/* Longest to wait for the DMP's next packet, see realign_compass_fifo. */
+#define COMPASS_FIFO_PACKET_WAIT_MS (50)
+
+/* Realign a DMP FIFO with the compass data in it (see
+ * mpu_set_compass_fifo). The compass blocks of the samples after the
+ * newest DMP packet are already in the FIFO, ahead of the next packet, so
+ * the FIFO count only gives the packet boundary just after the DMP wrote a
+ * packet. Wait for its next one, then read the count and discard what's
+ * left of the oldest, overwritten packet, as for a FIFO without the
+ * compass. If no packet comes, the FIFO is reset. fifo_count is the new
+ * count, less the bytes discarded.
+ * Returns 0 to carry on reading, -2 if the FIFO was reset.
+ */
+static int realign_compass_fifo(unsigned short length,
+    unsigned short *fifo_count, unsigned char *data)
+{
+    unsigned char tmp[2];
+    unsigned short waited, partial;
+
+    /* Reading INT_STATUS clears it, so the DMP interrupt it shows next is
+     * for a packet written after this read.
+     */
+    if (i2c_read(st.hw->addr, st.reg->int_status, 1, tmp))
+        return -1;
+    for (waited = 0; ; waited++) {
+        if (waited >= COMPASS_FIFO_PACKET_WAIT_MS) {
+            mpu_recover_fifo();
+            return -2;
+        }
+        delay_ms(1);
+        if (i2c_read(st.hw->addr, st.reg->int_status, 1, tmp))
+            return -1;
+        if (tmp[0] & BIT_DMP_INT)
+            break;
+    }
+    if (i2c_read(st.hw->addr, st.reg->fifo_count_h, 2, tmp))
+        return -1;
+    fifo_count[0] = (tmp[0] << 8) | tmp[1];
+    partial = fifo_count[0] % length;
+    if (partial) {
+        if (i2c_read(st.hw->addr, st.reg->fifo_r_w, partial, data))
+            return -1;
+        fifo_count[0] -= partial;
+        st.fifo_stats.bytes_discarded += partial;
+    }
+    st.fifo_stats.resyncs++;
+    return 0;
+}
+#endif
+
+/* Realign a DMP FIFO after a failed FIFO read, as check_fifo_overflow
+ * realigns it after an overflow: the newest packet ends at the end of the
+ * FIFO, so the FIFO count modulo the packet length is what's left of a
+ * packet read part-way. Where an overflow would reset the FIFO, so does
+ * this. fifo_count is updated for the bytes discarded.
+ * Returns 0 to carry on reading, -2 if the FIFO was reset.
+ */
+static int realign_fifo(unsigned short length, unsigned short *fifo_count,
+    unsigned char *data)
+{
+    unsigned short partial;
+
+    st.chip_cfg.fifo_misaligned = 0;
+    if (st.chip_cfg.fifo_recovery == MPU_FIFO_RECOVERY_RESET) {
+        mpu_recover_fifo();
+        return -2;
+    }
+#ifdef AK89xx_SECONDARY
+    if (st.chip_cfg.compass_fifo && st.chip_cfg.dmp_on)
+        return realign_compass_fifo(length, fifo_count, data);
+#endif
+    partial = fifo_count[0] % length;
+    if (partial) {
+        if (i2c_read(st.hw->addr, st.reg->fifo_r_w, partial, data))
+            return -1;
+        fifo_count[0] -= partial;
+        st.fifo_stats.bytes_discarded += partial;
+    }
+    st.fifo_stats.resyncs++;
+    return 0;
+}
+
+/* Check a DMP FIFO for an overflow before reading packets from it, and
+ * recover from one as set by mpu_set_fifo_recovery, or realign it after a
+ * failed read. fifo_count is updated for any bytes discarded to realign the
+ * FIFO. data must hold at least length bytes; it's used to read them.
+ * Returns 0 to carry on reading, -2 if the FIFO was reset.
+ */
+static int check_fifo_overflow(unsigned short length,
+    unsigned short *fifo_count, unsigned char *data)
+{
+    unsigned char tmp;
+    unsigned short partial;
+
+    if (st.chip_cfg.fifo_misaligned)
+        return realign_fifo(length, fifo_count, data);
+    if (fifo_count[0] <= (st.hw->max_fifo >> 1))
+        return 0;
+    /* FIFO is 50% full, better check overflow bit. */
+    if (i2c_read(st.hw->addr, st.reg->int_status, 1, &tmp))
+        return -1;
+    /* With latched interrupts, reading the FIFO count may already have
+     * cleared the overflow bit, so treat a full FIFO as overflowed too.
+     */
+    if (!(tmp & BIT_FIFO_OVERFLOW) &&
+        (fifo_count[0] <= st.hw->max_fifo - length))
+        return 0;
+    st.fifo_stats.overflows++;
+    if (st.chip_cfg.fifo_recovery == MPU_FIFO_RECOVERY_RESET) {
+        mpu_recover_fifo();
+        return -2;
+    }
+#ifdef AK89xx_SECONDARY
+    if (st.chip_cfg.compass_fifo && st.chip_cfg.dmp_on)
+        return realign_compass_fifo(length, fifo_count, data);
+#endif
+    partial = fifo_count[0] % length;
+    if (partial) {
+        if (i2c_read(st.hw->addr, st.reg->fifo_r_w, partial, data))
+            return -1;
+        fifo_count[0] -= partial;
+        st.fifo_stats.bytes_discarded += partial;
+    }
+    st.fifo_stats.resyncs++;
+    return 0;
+}
+
+/**
+ *  @brief      Get one unparsed packet from the FIFO.
+ *  This function should be used if the packet is to be parsed elsewhere.
+ *  @param[in]  length  Length of one FIFO packet.
+ *  @param[in]  data    FIFO packet.
+ *  @param[in]  more    Number of remaining packets.
+ */
+int mpu_read_fifo_stream(unsigned short length, unsigned char *data,
+    unsigned char *more)
+{
+    unsigned char tmp[2];
+    unsigned short fifo_count;
+    int result;
+    if (!st.chip_cfg.dmp_on)
+        return -1;
+    if (!st.chip_cfg.sensors)
+        return -1;
+
+    if (i2c_read(st.hw->addr, st.reg->fifo_count_h, 2, tmp))
+        return -1;
+    fifo_count = (tmp[0] << 8) | tmp[1];
+    if (skip_fifo_lead(&fifo_count, data) || (fifo_count < length)) {
+        more[0] = 0;
+        return -1;
+    }
+    result = check_fifo_overflow(length, &fifo_count, data);
+    if (result)
+        return result;
+    if (fifo_count < length) {
+        more[0] = 0;
+        return -1;
+    }
+
+    if (i2c_read(st.hw->addr, st.reg->fifo_r_w, length, data))
+        return -1;
+    more[0] = fifo_count / length - 1;
+    return 0;
+}
+
+/**
+ *  @brief      Size up a burst of DMP packets from a FIFO count read elsewhere.
+ *  For FIFO reads made outside the driver, e.g. queued with
+ *  arduino_i2c_submit: does what mpu_read_fifo_stream_burst does before it
+ *  reads the packets. Leads and partly overwritten packets are discarded,
+ *  and overflows recovered from, as set by mpu_set_fifo_recovery; these
+ *  read the FIFO themselves. If the packets' read fails, call
+ *  mpu_fifo_read_failed.
+ *  @param[in]  length      Length of one packet.
+ *  @param[in]  max_packets Maximum number of packets to read.
+ *  @param[in]  count_regs  FIFO_COUNTH and FIFO_COUNTL, as read.
+ *  @param[in]  data        Scratch for discarded bytes, at least @e length.
+ *  @param[out] packets     Number of packets to read.
+ *  @param[out] more        Number of packets left after them.
+ *  @return     0 if there are packets to read, -2 if the FIFO was reset.
+ */
+int mpu_plan_fifo_stream_burst(unsigned short length,
+    unsigned char max_packets, const unsigned char *count_regs,
+    unsigned char *data, unsigned char *packets, unsigned char *more)
+{
+    unsigned short fifo_count, available;
+    int result;
+
+    packets[0] = 0;
+    more[0] = 0;
+    if (!st.chip_cfg.dmp_on)
+        return -1;
+    if (!st.chip_cfg.sensors)
+        return -1;
+    if (!length || (length > I2C_MAX_READ_LENGTH))
+        return -1;
+
+    fifo_count = (count_regs[0] << 8) | count_regs[1];
+    if (skip_fifo_lead(&fifo_count, data) || (fifo_count < length))
+        return -1;
+    result = check_fifo_overflow(length, &fifo_count, data);
+    if (result)
+        return result;
+    if (fifo_count < length)
+        return -1;
+
+    available = fifo_count / length;
+    packets[0] = (available > max_packets) ? max_packets : available;
+    more[0] = available - packets[0];
+    return 0;
+}
+
+/**
+ *  @brief      Note a failed FIFO read made outside the driver.
+ *  It may have read part of a packet, so the next read realigns the FIFO,
+ *  as after a failed read of the driver's own.
+ *  @return     0 if successful.
+ */
+int mpu_fifo_read_failed(void)
+{
+    st.chip_cfg.fifo_misaligned = 1;
+    return 0;
+}
+
+/**
+ *  @brief      Get several packets from the FIFO with one count read.
+ *  The FIFO count is read once, then as many whole packets as are available
+ *  (up to @e max_packets) are read back-to-back. Each transfer is sized to
+ *  the largest multiple of @e length that fits in I2C_MAX_READ_LENGTH.
+ *  @e data must hold at least @e max_packets * @e length bytes.
+ *  @param[in]  length      Length of one packet.
+ *  @param[in]  max_packets Maximum number of packets to read.
+ *  @param[in]  data        FIFO packets.
+ *  @param[out] count       Number of packets read.
  *  @param[out] more        Number of remaining packets.
  *  @return     0 if successful.
  */
-int mpu_read_fifo(short *gyro, short *accel, unsigned long *timestamp,
-        unsigned char *sensors, unsigned char *more)
+int mpu_read_fifo_stream_burst(unsigned short length,
+    unsigned char max_packets, unsigned char *data, unsigned char *count,
+    unsigned char *more)
 {
-    /* Assumes maximum packet size is gyro (6) + accel (6). */
-    unsigned char data[MAX_PACKET_LENGTH];
-    unsigned char packet_size = 0;
-    unsigned short fifo_count, index = 0;
+    unsigned char tmp[2], packets;
+    unsigned short chunk, remaining;
+    int result;
 
-    if (st.chip_cfg.dmp_on)
+    count[0] = 0;
+    more[0] = 0;
+    if (!st.chip_cfg.dmp_on)
         return -1;
-
-    sensors[0] = 0;
     if (!st.chip_cfg.sensors)
         return -1;
-    if (!st.chip_cfg.fifo_enable)
-        return -1;
-
-    if (st.chip_cfg.fifo_enable & INV_X_GYRO)
-        packet_size += 2;
-    if (st.chip_cfg.fifo_enable & INV_Y_GYRO)
-        packet_size += 2;
-    if (st.chip_cfg.fifo_enable & INV_Z_GYRO)
-        packet_size += 2;
-    if (st.chip_cfg.fifo_enable & INV_XYZ_ACCEL)
-        packet_size += 6;
 
-    if (i2c_read(st.hw->addr, st.reg->fifo_count_h, 2, data))
+    if (i2c_read(st.hw->addr, st.reg->fifo_count_h, 2, tmp))
         return -1;
-    fifo_count = (data[0] << 8) | data[1];
-    if (fifo_count < packet_size)
-        return 0;
-//    log_i("FIFO count: %hd\n", fifo_count);
-    if (fifo_count > (st.hw->max_fifo >> 1)) {
-        /* FIFO is 50% full, better check overflow bit. */
-        if (i2c_read(st.hw->addr, st.reg->int_status, 1, data))
+    result = mpu_plan_fifo_stream_burst(length, max_packets, tmp, data,
+        &packets, more);
+    if (result)
+        return result;
+
+    /* Only read whole packets per transfer so a failed read never leaves
+     * the FIFO misaligned mid-packet.
+     */
+    chunk = (I2C_MAX_READ_LENGTH / length) * length;
+    remaining = packets * length;
+    while (remaining) {
+        unsigned short this_len = (remaining > chunk) ? chunk : remaining;
+        if (i2c_read(st.hw->addr, st.reg->fifo_r_w, this_len, data)) {
+            more[0] = 0;
             return -1;
-        if (data[0] & BIT_FIFO_OVERFLOW) {
-            mpu_reset_fifo();
-            return -2;
         }
+        data += this_len;
+        remaining -= this_len;
+        count[0] += this_len / length;
     }
-    get_ms((unsigned long*)timestamp);
-
-    if (i2c_read(st.hw->addr, st.reg->fifo_r_w, packet_size, data))
-        return -1;
-    more[0] = fifo_count / packet_size - 1;
-    sensors[0] = 0;
+    return 0;
+}
 
-    if ((index != packet_size) && st.chip_cfg.fifo_enable & INV_XYZ_ACCEL) {
-        accel[0] = (data[index+0] << 8) | data[index+1];
-        accel[1] = (data[index+2] << 8) | data[index+3];
-        accel[2] = (data[index+4] << 8) | data[index+5];
-        sensors[0] |= INV_XYZ_ACCEL;
-        index += 6;
-    }
-    if ((index != packet_size) && st.chip_cfg.fifo_enable & INV_X_GYRO) {
-        gyro[0] = (data[index+0] << 8) | data[index+1];
-        sensors[0] |= INV_X_GYRO;
-        index += 2;
-    }
-    if ((index != packet_size) && st.chip_cfg.fifo_enable & INV_Y_GYRO) {
-        gyro[1] = (data[index+0] << 8) | data[index+1];
-        sensors[0] |= INV_Y_GYRO;
-        index += 2;
-    }
-    if ((index != packet_size) && st.chip_cfg.fifo_enable & INV_Z_GYRO) {
-        gyro[2] = (data[index+0] << 8) | data[index+1];
-        sensors[0] |= INV_Z_GYRO;
-        index += 2;
-    }
+/* Reset the FIFO after an overflow in mpu_read_fifo_burst, in one write,
+ * and count it.
+ */
+static int restart_fifo_burst(void)
+{
+    unsigned char tmp;
 
-    return 0;
+    if (!st.chip_cfg.fifo_misaligned)
+        st.fifo_stats.overflows++;
+    st.chip_cfg.fifo_misaligned = 0;
+    st.fifo_stats.resets++;
+    tmp = BIT_FIFO_RST | BIT_FIFO_EN;
+    if (!st.chip_cfg.bypass_mode && (st.chip_cfg.sensors & INV_XYZ_COMPASS))
+        tmp |= BIT_AUX_IF_EN;
+    if (i2c_write(st.hw->addr, st.reg->user_ctrl, 1, &tmp))
+        return -1;
+    return -2;
 }
 
 /**
- *  @brief      Get one unparsed packet from the FIFO.
- *  This function should be used if the packet is to be parsed elsewhere.
- *  @param[in]  length  Length of one FIFO packet.
- *  @param[in]  data    FIFO packet.
- *  @param[in]  more    Number of remaining packets.
+ *  @brief      Read whole sensor samples from the FIFO, with one count read.
+ *  For the FIFO set up by mpu_configure_fifo, without the DMP. A sample is
+ *  the selected sensors' output registers, big-endian: accel x, y and z
+ *  (if selected), then gyro x, y and z (each, if selected). As many whole
+ *  samples as are available (up to @e max_samples) are read back-to-back,
+ *  each transfer sized to the largest multiple of a sample that fits in
+ *  I2C_MAX_READ_LENGTH. After an overflow, the FIFO is reset whatever
+ *  mpu_set_fifo_recovery selected, and the overflow counted in the FIFO
+ *  statistics. That includes an overflow while the samples were read:
+ *  INT_STATUS is checked after the read, and if the FIFO filled, nothing
+ *  read is returned.
+ *  \n @e data must hold at least @e max_samples samples.
+ *  @param[in]  max_samples Maximum number of samples to read.
+ *  @param[out] data        Samples, as read.
+ *  @param[out] count       Number of samples read.
+ *  @param[out] more        Number of samples left in the FIFO.
+ *  @return     0 if successful, -2 if the FIFO was reset.
  */
-int mpu_read_fifo_stream(unsigned short length, unsigned char *data,
-    unsigned char *more)
+int mpu_read_fifo_burst(unsigned short max_samples, unsigned char *data,
+    unsigned short *count, unsigned short *more)
 {
     unsigned char tmp[2];
-    unsigned short fifo_count;
-    if (!st.chip_cfg.dmp_on)
+    unsigned short length = 0, fifo_count, samples, chunk, remaining;
+
+    count[0] = 0;
+    more[0] = 0;
+    if (st.chip_cfg.dmp_on)
         return -1;
     if (!st.chip_cfg.sensors)
         return -1;
 
+    if (st.chip_cfg.fifo_enable & INV_X_GYRO)
+        length += 2;
+    if (st.chip_cfg.fifo_enable & INV_Y_GYRO)
+        length += 2;
+    if (st.chip_cfg.fifo_enable & INV_Z_GYRO)
+        length += 2;
+    if (st.chip_cfg.fifo_enable & INV_XYZ_ACCEL)
+        length += 6;
+    if (!length)
+        return -1;
+
     if (i2c_read(st.hw->addr, st.reg->fifo_count_h, 2, tmp))
         return -1;
     fifo_count = (tmp[0] << 8) | tmp[1];
-    if (fifo_count < length) {
-        more[0] = 0;
-        return -1;
+    if (fifo_count < length)
+        return 0;
+    /* A full FIFO keeps dropping its oldest bytes while it's read, faster
+     * than the bus can catch up at these rates, so it can't be realigned
+     * from its count as check_fifo_overflow does. It's reset instead, in
+     * one write: mpu_reset_fifo's settling delay would lose another 50ms.
+     * So is a FIFO left misaligned by a failed read.
+     */
+    if (fifo_count > (st.hw->max_fifo >> 1) || st.chip_cfg.fifo_misaligned) {
+        if (i2c_read(st.hw->addr, st.reg->int_status, 1, &tmp[0]))
+            return -1;
+        if ((tmp[0] & BIT_FIFO_OVERFLOW) || st.chip_cfg.fifo_misaligned ||
+            (fifo_count > st.hw->max_fifo - length))
+            return restart_fifo_burst();
     }
-    if (fifo_count > (st.hw->max_fifo >> 1)) {
-        /* FIFO is 50% full, better check overflow bit. */
-        if (i2c_read(st.hw->addr, st.reg->int_status, 1, tmp))
+
+    samples = fifo_count / length;
+    if (samples > max_samples)
+        samples = max_samples;
+    /* Whole samples per transfer, as for mpu_read_fifo_stream_burst. */
+    chunk = (I2C_MAX_READ_LENGTH / length) * length;
+    remaining = samples * length;
+    while (remaining) {
+        unsigned short this_len = (remaining > chunk) ? chunk : remaining;
+        if (i2c_read(st.hw->addr, st.reg->fifo_r_w, this_len, data))
             return -1;
-        if (tmp[0] & BIT_FIFO_OVERFLOW) {
-            mpu_reset_fifo();
-            return -2;
-        }
+        data += this_len;
+        remaining -= this_len;
+        count[0] += this_len / length;
     }
 
-    if (i2c_read(st.hw->addr, st.reg->fifo_r_w, length, data))
+    /* The FIFO may have filled while it was read: then the bytes read after
+     * that point belong to different samples than they seem to. Nothing
+     * read can be told apart, so the whole burst is dropped.
+     */
+    if (i2c_read(st.hw->addr, st.reg->int_status, 1, &tmp[0]))
         return -1;
-    more[0] = fifo_count / length - 1;
+    if (tmp[0] & BIT_FIFO_OVERFLOW) {
+        count[0] = 0;
+        return restart_fifo_burst();
+    }
+    more[0] = fifo_count / length - samples;
     return 0;
 }
 
@@ -1785,6 +2941,10 @@ int mpu_set_bypass(unsigned char bypass_on)
     if (st.chip_cfg.bypass_mode == bypass_on)
         return 0;
 
+#ifdef AK89xx_SECONDARY
+    /* The I2C master may write the compass's CNTL without bypass. */
+    st.shadow.akm_valid = 0;
+#endif
     if (bypass_on) {
         if (i2c_read(st.hw->addr, st.reg->user_ctrl, 1, &tmp))
             return -1;
@@ -2727,8 +3887,16 @@ int mpu_write_mem(unsigned short mem_addr, unsigned short length,
 
     if (i2c_write(st.hw->addr, st.reg->bank_sel, 2, tmp))
         return -1;
-    if (i2c_write(st.hw->addr, st.reg->mem_r_w, length, data))
-        return -1;
+    /* The start address increments with each byte, so longer writes carry
+     * on where the last transfer ended.
+     */
+    while (length) {
+        unsigned short this_write = min(I2C_MAX_WRITE_LENGTH, length);
+        if (i2c_write(st.hw->addr, st.reg->mem_r_w, this_write, data))
+            return -1;
+        data += this_write;
+        length -= this_write;
+    }
     return 0;
 }
 
@@ -2760,13 +3928,63 @@ int mpu_read_mem(unsigned short mem_addr, unsigned short length,
 
     if (i2c_write(st.hw->addr, st.reg->bank_sel, 2, tmp))
         return -1;
-    if (i2c_read(st.hw->addr, st.reg->mem_r_w, length, data))
+    while (length) {
+        unsigned short this_read = min(I2C_MAX_READ_LENGTH, length);
+        if (i2c_read(st.hw->addr, st.reg->mem_r_w, this_read, data))
+            return -1;
+        data += this_read;
+        length -= this_read;
+    }
+    return 0;
+}
+
+/* CRC-16/CCITT, for checking DMP images. */
+static unsigned short crc16(unsigned short crc, const unsigned char *data,
+    unsigned short length)
+{
+    unsigned char ii;
+
+    while (length--) {
+        crc ^= (unsigned short)*data++ << 8;
+        for (ii = 0; ii < 8; ii++)
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+    }
+    return crc;
+}
+
+/**
+ *  @brief      Look for a DMP image left from an earlier run.
+ *  Sets st.chip_cfg.dmp_resident, with the image's length and CRC, if the
+ *  signature is in DMP memory. Wakes the chip to read it.
+ *  @return     0 if successful (whether or not the signature is there).
+ */
+static int find_dmp_signature(void)
+{
+    unsigned char tmp[2], sig[DMP_SIGNATURE_LENGTH];
+
+    /* mpu_read_mem needs the driver set up; this runs before that. */
+    tmp[0] = 0x00;
+    if (i2c_write(st.hw->addr, st.reg->pwr_mgmt_1, 1, tmp))
+        return -1;
+    tmp[0] = (unsigned char)(DMP_SIGNATURE_ADDR >> 8);
+    tmp[1] = (unsigned char)(DMP_SIGNATURE_ADDR & 0xFF);
+    if (i2c_write(st.hw->addr, st.reg->bank_sel, 2, tmp))
+        return -1;
+    if (i2c_read(st.hw->addr, st.reg->mem_r_w, DMP_SIGNATURE_LENGTH, sig))
         return -1;
+    if (memcmp(sig, DMP_SIGNATURE_MAGIC, sizeof(DMP_SIGNATURE_MAGIC)))
+        return 0;
+    st.chip_cfg.dmp_resident = 1;
+    st.chip_cfg.dmp_resident_length = ((unsigned short)sig[4] << 8) | sig[5];
+    st.chip_cfg.dmp_resident_crc = ((unsigned short)sig[6] << 8) | sig[7];
     return 0;
 }
 
 /**
  *  @brief      Load and verify DMP image.
+ *  The image is written a bank at a time, then read back once and checked
+ *  against its CRC. If fast boot found the same image resident (see
+ *  mpu_set_fast_boot), it isn't loaded again.
  *  @param[in]  length      Length of DMP image.
  *  @param[in]  firmware    DMP code.
  *  @param[in]  start_addr  Starting address of DMP code memory.
@@ -2776,11 +3994,11 @@ int mpu_read_mem(unsigned short mem_addr, unsigned short length,
 int mpu_load_firmware(unsigned short length, const unsigned char *firmware,
     unsigned short start_addr, unsigned short sample_rate)
 {
-    unsigned short ii;
+    unsigned short ii, crc, check;
     unsigned short this_write;
-    /* Must divide evenly into st.hw->bank_size to avoid bank crossings. */
-#define LOAD_CHUNK  (16)
-    unsigned char cur[LOAD_CHUNK], tmp[2];
+    unsigned long start_ms, end_ms;
+    unsigned char cur[I2C_MAX_READ_LENGTH], tmp[2];
+    unsigned char sig[DMP_SIGNATURE_LENGTH];
 
     if (st.chip_cfg.dmp_loaded)
         /* DMP should only be loaded once. */
@@ -2788,15 +4006,50 @@ int mpu_load_firmware(unsigned short length, const unsigned char *firmware,
 
     if (!firmware)
         return -1;
-    for (ii = 0; ii < length; ii += this_write) {
-        this_write = min(LOAD_CHUNK, length - ii);
-        if (mpu_write_mem(ii, this_write, (unsigned char*)&firmware[ii]))
-            return -1;
-        if (mpu_read_mem(ii, this_write, cur))
-            return -1;
-        if (memcmp(firmware+ii, cur, this_write))
+    if (length > DMP_SIGNATURE_ADDR)
+        return -1;
+
+    crc = crc16(0xFFFF, firmware, length);
+    if (!st.chip_cfg.dmp_resident ||
+        (st.chip_cfg.dmp_resident_length != length) ||
+        (st.chip_cfg.dmp_resident_crc != crc)) {
+        st.chip_cfg.dmp_resident = 0;
+
+        /* mpu_write_mem splits each bank into I2C-sized transfers. */
+        get_ms(&start_ms);
+        for (ii = 0; ii < length; ii += this_write) {
+            this_write = min(st.hw->bank_size - (ii % st.hw->bank_size),
+                length - ii);
+            if (mpu_write_mem(ii, this_write, (unsigned char*)&firmware[ii]))
+                return -1;
+        }
+        get_ms(&end_ms);
+        st.boot_stats.load_ms = end_ms - start_ms;
+
+        start_ms = end_ms;
+        check = 0xFFFF;
+        for (ii = 0; ii < length; ii += this_write) {
+            this_write = min(st.hw->bank_size - (ii % st.hw->bank_size),
+                length - ii);
+            this_write = min(I2C_MAX_READ_LENGTH, this_write);
+            if (mpu_read_mem(ii, this_write, cur))
+                return -1;
+            check = crc16(check, cur, this_write);
+        }
+        get_ms(&end_ms);
+        st.boot_stats.verify_ms = end_ms - start_ms;
+        if (check != crc)
             return -2;
+
+        memcpy(sig, DMP_SIGNATURE_MAGIC, sizeof(DMP_SIGNATURE_MAGIC));
+        sig[4] = (unsigned char)(length >> 8);
+        sig[5] = (unsigned char)(length & 0xFF);
+        sig[6] = (unsigned char)(crc >> 8);
+        sig[7] = (unsigned char)(crc & 0xFF);
+        if (mpu_write_mem(DMP_SIGNATURE_ADDR, DMP_SIGNATURE_LENGTH, sig))
+            return -1;
     }
+    st.boot_stats.resident = st.chip_cfg.dmp_resident;
 
     /* Set program start address. */
     tmp[0] = start_addr >> 8;
@@ -2821,7 +4074,7 @@ int mpu_set_dmp_state(unsigned char enable)
         return 0;
 
     if (enable) {
-        if (!st.chip_cfg.dmp_loaded)
+        if (!st.chip_cfg.dmp_loaded || st.chip_cfg.high_rate)
             return -1;
         /* Disable data ready interrupt. */
         set_int_enable(0);
@@ -2961,6 +4214,93 @@ static int setup_compass(void)
 
     return 0;
 }
+
+/* The continuous measurement mode for the compass sample rate. */
+static unsigned char compass_continuous_mode(void)
+{
+    if (st.chip_cfg.compass_sample_rate <= 8)
+        return AKM_CONTINUOUS_8HZ;
+    return AKM_CONTINUOUS_100HZ;
+}
+
+#ifndef AK89xx_BYPASS
+/* Wait until the MPU has taken a sample, and so run the I2C master's
+ * slaves, since this was called. A sample period isn't enough: a new rate
+ * divider only takes effect after the next sample at the old rate, and the
+ * chip samples nothing for a while after waking. So this polls the raw data
+ * ready flag, for at most the longest sample period and then some. Reading
+ * INT_STATUS clears it; a FIFO overflow it reports is left for the next
+ * FIFO read to find, as after a failed read.
+ */
+#define AUX_SAMPLE_WAIT_MS  (300)
+static int wait_for_aux_sample(void)
+{
+    unsigned char status;
+    unsigned short waited;
+
+    if (i2c_read(st.hw->addr, st.reg->int_status, 1, &status))
+        return -1;
+    for (waited = 0; waited < AUX_SAMPLE_WAIT_MS; waited++) {
+        if (status & BIT_FIFO_OVERFLOW)
+            st.chip_cfg.fifo_misaligned = 1;
+        delay_ms(1);
+        if (i2c_read(st.hw->addr, st.reg->int_status, 1, &status))
+            return -1;
+        if (status & BIT_RAW_RDY)
+            break;
+    }
+    if (status & BIT_FIFO_OVERFLOW)
+        st.chip_cfg.fifo_misaligned = 1;
+    return 0;
+}
+#endif
+
+/* Write the compass's mode register once. Without bypass, slave 1 of the
+ * I2C master is enabled until the MPU has taken a sample, then disabled
+ * again, so it doesn't keep writing it; the I2C master must be running. A
+ * new measurement mode is entered through power-down, as the AKM requires.
+ */
+static int compass_write_mode(unsigned char mode)
+{
+    unsigned char data;
+#ifdef AK89xx_BYPASS
+    data = AKM_POWER_DOWN;
+    if (i2c_write(st.chip_cfg.compass_addr, AKM_REG_CNTL, 1, &data))
+        return -1;
+    delay_ms(1);
+    if (mode != AKM_POWER_DOWN) {
+        if (i2c_write(st.chip_cfg.compass_addr, AKM_REG_CNTL, 1, &mode))
+            return -1;
+    }
+    return 0;
+#else
+    /* Slave 1 runs at every sample while this is done. */
+    data = BIT_S0_DELAY_EN;
+    if (i2c_write(st.hw->addr, st.reg->i2c_delay_ctrl, 1, &data))
+        return -1;
+    data = AKM_POWER_DOWN;
+    if (i2c_write(st.hw->addr, st.reg->s1_do, 1, &data))
+        return -1;
+    data = BIT_SLAVE_EN | 1;
+    if (i2c_write(st.hw->addr, st.reg->s1_ctrl, 1, &data))
+        return -1;
+    if (wait_for_aux_sample())
+        return -1;
+    if (mode != AKM_POWER_DOWN) {
+        if (i2c_write(st.hw->addr, st.reg->s1_do, 1, &mode))
+            return -1;
+        if (wait_for_aux_sample())
+            return -1;
+    }
+    data = 0;
+    if (i2c_write(st.hw->addr, st.reg->s1_ctrl, 1, &data))
+        return -1;
+    data = BIT_S0_DELAY_EN | BIT_S1_DELAY_EN;
+    if (i2c_write(st.hw->addr, st.reg->i2c_delay_ctrl, 1, &data))
+        return -1;
+    return 0;
+#endif
+}
 #endif
 
 /**
@@ -2973,6 +4313,7 @@ int mpu_get_compass_reg(short *data, unsigned long *timestamp)
 {
 #ifdef AK89xx_SECONDARY
     unsigned char tmp[9];
+    int result;
 
     if (!(st.chip_cfg.sensors & INV_XYZ_COMPASS))
         return -1;
@@ -2981,36 +4322,149 @@ int mpu_get_compass_reg(short *data, unsigned long *timestamp)
     if (i2c_read(st.chip_cfg.compass_addr, AKM_REG_ST1, 8, tmp))
         return -1;
     tmp[8] = AKM_SINGLE_MEASUREMENT;
-    if (i2c_write(st.chip_cfg.compass_addr, AKM_REG_CNTL, 1, tmp+8))
+    if ((st.chip_cfg.compass_mode == MPU_COMPASS_SINGLE) &&
+        i2c_write(st.chip_cfg.compass_addr, AKM_REG_CNTL, 1, tmp+8))
         return -1;
 #else
     if (i2c_read(st.hw->addr, st.reg->raw_compass, 8, tmp))
         return -1;
 #endif
 
+    result = mpu_decode_compass(tmp, data);
+    if (result)
+        return result;
+
+    if (timestamp)
+        get_ms(timestamp);
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/**
+ *  @brief      Convert the compass's data registers to a reading.
+ *  @e raw is the eight bytes from ST1 to ST2, as read by
+ *  mpu_get_compass_reg or written into the FIFO (see mpu_set_compass_fifo).
+ *  @param[in]  raw     Compass data registers.
+ *  @param[out] data    Raw data in hardware units.
+ *  @return     0 if successful, -2 if the data isn't new, -3 if it
+ *              overflowed.
+ */
+int mpu_decode_compass(const unsigned char *raw, short *data)
+{
+#ifdef AK89xx_SECONDARY
 #if defined AK8975_SECONDARY
     /* AK8975 doesn't have the overrun error bit. */
-    if (!(tmp[0] & AKM_DATA_READY))
+    if (!(raw[0] & AKM_DATA_READY))
         return -2;
-    if ((tmp[7] & AKM_OVERFLOW) || (tmp[7] & AKM_DATA_ERROR))
+    if ((raw[7] & AKM_OVERFLOW) || (raw[7] & AKM_DATA_ERROR))
         return -3;
 #elif defined AK8963_SECONDARY
-    /* AK8963 doesn't have the data read error bit. */
-    if (!(tmp[0] & AKM_DATA_READY) || (tmp[0] & AKM_DATA_OVERRUN))
+    /* AK8963 doesn't have the data read error bit. In continuous mode, an
+     * overrun only means a measurement was missed; this one is new.
+     */
+    if (!(raw[0] & AKM_DATA_READY))
+        return -2;
+    if ((raw[0] & AKM_DATA_OVERRUN) &&
+        (st.chip_cfg.compass_mode != MPU_COMPASS_CONTINUOUS))
         return -2;
-    if (tmp[7] & AKM_OVERFLOW)
+    if (raw[7] & AKM_OVERFLOW)
         return -3;
 #endif
-    data[0] = (tmp[2] << 8) | tmp[1];
-    data[1] = (tmp[4] << 8) | tmp[3];
-    data[2] = (tmp[6] << 8) | tmp[5];
+    data[0] = (raw[2] << 8) | raw[1];
+    data[1] = (raw[4] << 8) | raw[3];
+    data[2] = (raw[6] << 8) | raw[5];
 
-    data[0] = ((long)data[0] * st.chip_cfg.mag_sens_adj[0]) >> 8;
-    data[1] = ((long)data[1] * st.chip_cfg.mag_sens_adj[1]) >> 8;
-    data[2] = ((long)data[2] * st.chip_cfg.mag_sens_adj[2]) >> 8;
+    /* Rounded: a truncating shift reads half an LSB low on average, which
+     * biases a heading taken from noisy readings.
+     */
+    data[0] = ((long)data[0] * st.chip_cfg.mag_sens_adj[0] + 128) >> 8;
+    data[1] = ((long)data[1] * st.chip_cfg.mag_sens_adj[1] + 128) >> 8;
+    data[2] = ((long)data[2] * st.chip_cfg.mag_sens_adj[2] + 128) >> 8;
 
-    if (timestamp)
-        get_ms(timestamp);
+    if (st.chip_cfg.compass_cal) {
+        const short *matrix = st.chip_cfg.compass_matrix;
+        long in[3], out;
+        unsigned char ii;
+
+        /* Clamped to 2^14 (2,400 uT, far past any field worth correcting),
+         * so each sum of three Q14 products stays within 2^31.
+         */
+        for (ii = 0; ii < 3; ii++) {
+            in[ii] = (long)data[ii] - st.chip_cfg.compass_offset[ii];
+            in[ii] = (in[ii] > 16383L) ? 16383L :
+                ((in[ii] < -16383L) ? -16383L : in[ii]);
+        }
+        for (ii = 0; ii < 3; ii++, matrix += 3) {
+            out = (matrix[0] * in[0] + matrix[1] * in[1] +
+                matrix[2] * in[2] + (1L << 13)) >> 14;
+            data[ii] = (out > 32767) ? 32767 :
+                ((out < -32768) ? -32768 : (short)out);
+        }
+    }
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/**
+ *  @brief      Correct compass readings for hard and soft iron.
+ *  From then on, mpu_get_compass_reg and mpu_decode_compass (and so the
+ *  compass data in the DMP's packets) give
+ *  \n      matrix * (reading - offset)
+ *  \n where reading is in hardware units, sensitivity adjusted. Three
+ *  multiply-adds per axis. The correction is cleared by mpu_init.
+ *  @param[in]  offset  Hard-iron offset, x, y, z, in hardware units. NULL
+ *                      to stop correcting.
+ *  @param[in]  matrix  Soft-iron correction, row major, Q14.
+ *  @return     0 if successful.
+ */
+int mpu_set_compass_cal(const short *offset, const short *matrix)
+{
+#ifdef AK89xx_SECONDARY
+    unsigned char ii;
+
+    if (!offset || !matrix) {
+        st.chip_cfg.compass_cal = 0;
+        return 0;
+    }
+    for (ii = 0; ii < 3; ii++)
+        st.chip_cfg.compass_offset[ii] = offset[ii];
+    for (ii = 0; ii < 9; ii++)
+        st.chip_cfg.compass_matrix[ii] = matrix[ii];
+    st.chip_cfg.compass_cal = 1;
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/**
+ *  @brief      Get the compass correction.
+ *  An identity correction if there is none.
+ *  @param[out] offset  Hard-iron offset, x, y, z, in hardware units.
+ *  @param[out] matrix  Soft-iron correction, row major, Q14.
+ *  @param[out] enabled 1 if readings are corrected. Null if not needed.
+ *  @return     0 if successful.
+ */
+int mpu_get_compass_cal(short *offset, short *matrix, unsigned char *enabled)
+{
+#ifdef AK89xx_SECONDARY
+    unsigned char ii;
+
+    for (ii = 0; ii < 3; ii++)
+        offset[ii] = st.chip_cfg.compass_cal ?
+            st.chip_cfg.compass_offset[ii] : 0;
+    for (ii = 0; ii < 9; ii++) {
+        if (st.chip_cfg.compass_cal)
+            matrix[ii] = st.chip_cfg.compass_matrix[ii];
+        else
+            matrix[ii] = (ii % 4) ? 0 : (1 << 14);
+    }
+    if (enabled)
+        enabled[0] = st.chip_cfg.compass_cal;
     return 0;
 #else
     return -1;
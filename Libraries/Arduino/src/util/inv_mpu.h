@@ -58,9 +58,69 @@ struct int_param_s {
 #define MPU_INT_STATUS_DMP_4            (0x1000)
 #define MPU_INT_STATUS_DMP_5            (0x2000)
 
+/* FIFO overflow handling, see mpu_set_fifo_recovery. */
+#define MPU_FIFO_RECOVERY_RESET         (0)
+#define MPU_FIFO_RECOVERY_RESYNC        (1)
+
+/* Sample rate with the DLPFs bypassed, see mpu_set_high_rate. */
+#define MPU_HIGH_RATE_HZ                (8000)
+
+/* Compass measurement modes, see mpu_set_compass_mode. */
+#define MPU_COMPASS_SINGLE              (0)
+#define MPU_COMPASS_CONTINUOUS          (1)
+
+/* Devices the driver keeps state for, see mpu_select_device. Two covers
+ * both AD0 addresses (0x68 and 0x69) on one bus.
+ */
+#ifndef MPU_MAX_DEVICES
+#define MPU_MAX_DEVICES                 (2)
+#endif
+
+struct mpu_fifo_stats_s {
+    /* Overflows found while reading DMP packets. */
+    unsigned long overflows;
+    /* Overflows and failed reads recovered by realigning to a packet
+     * boundary.
+     */
+    unsigned long resyncs;
+    /* Bytes of partly overwritten packets discarded to realign. */
+    unsigned long bytes_discarded;
+    /* FIFO resets after an overflow, a failed read or a corrupted packet. */
+    unsigned long resets;
+};
+
+/* Bus transfers the register shadow saved, see mpu_get_shadow_stats. */
+struct mpu_shadow_stats_s {
+    /* Register reads answered from the shadow, in registers. */
+    unsigned long reads_saved;
+    /* Register writes skipped, as they wouldn't change anything. */
+    unsigned long writes_saved;
+    /* Deferred register writes that went out in another's burst. */
+    unsigned long writes_merged;
+};
+
+/* DMP image loading at boot, see mpu_get_boot_stats. */
+struct mpu_boot_stats_s {
+    /* 1 if mpu_init found the DMP image left from an earlier run, and
+     * neither it nor mpu_load_firmware reset or reloaded the chip.
+     */
+    unsigned char resident;
+    /* Time spent in mpu_init (ms), including the reset. */
+    unsigned long init_ms;
+    /* Time spent writing the DMP image (ms), 0 if it was resident. */
+    unsigned long load_ms;
+    /* Time spent reading it back to verify it (ms). */
+    unsigned long verify_ms;
+};
+
 /* Set up APIs */
+int mpu_select_device(unsigned char device);
+unsigned char mpu_get_device(void);
+int mpu_set_address(unsigned char addr);
 int set_int_enable(unsigned char enable);
 int mpu_init(struct int_param_s *int_param);
+int mpu_set_fast_boot(unsigned char enable);
+int mpu_get_boot_stats(struct mpu_boot_stats_s *stats);
 int mpu_init_slave(void);
 int mpu_set_bypass(unsigned char bypass_on);
 
@@ -90,8 +150,14 @@ int mpu_get_accel_sens(unsigned short *sens);
 
 int mpu_get_sample_rate(unsigned short *rate);
 int mpu_set_sample_rate(unsigned short rate);
+int mpu_set_high_rate(unsigned char enable);
+int mpu_get_high_rate(unsigned char *enabled);
 int mpu_get_compass_sample_rate(unsigned short *rate);
 int mpu_set_compass_sample_rate(unsigned short rate);
+int mpu_set_compass_mode(unsigned char mode);
+int mpu_get_compass_mode(unsigned char *mode);
+int mpu_set_compass_cal(const short *offset, const short *matrix);
+int mpu_get_compass_cal(short *offset, short *matrix, unsigned char *enabled);
 
 int mpu_get_fifo_config(unsigned char *sensors);
 int mpu_configure_fifo(unsigned char sensors);
@@ -109,6 +175,7 @@ int mpu_set_accel_bias_6050_reg(const long *accel_bias);
 int mpu_get_gyro_reg(short *data, unsigned long *timestamp);
 int mpu_get_accel_reg(short *data, unsigned long *timestamp);
 int mpu_get_compass_reg(short *data, unsigned long *timestamp);
+int mpu_decode_compass(const unsigned char *raw, short *data);
 int mpu_get_temperature(long *data, unsigned long *timestamp);
 
 int mpu_get_int_status(short *status);
@@ -116,7 +183,25 @@ int mpu_read_fifo(short *gyro, short *accel, unsigned long *timestamp,
     unsigned char *sensors, unsigned char *more);
 int mpu_read_fifo_stream(unsigned short length, unsigned char *data,
     unsigned char *more);
+int mpu_read_fifo_stream_burst(unsigned short length,
+    unsigned char max_packets, unsigned char *data, unsigned char *count,
+    unsigned char *more);
+int mpu_plan_fifo_stream_burst(unsigned short length,
+    unsigned char max_packets, const unsigned char *count_regs,
+    unsigned char *data, unsigned char *packets, unsigned char *more);
+int mpu_fifo_read_failed(void);
+int mpu_read_fifo_burst(unsigned short max_samples, unsigned char *data,
+    unsigned short *count, unsigned short *more);
 int mpu_reset_fifo(void);
+int mpu_recover_fifo(void);
+int mpu_set_fifo_recovery(unsigned char mode);
+int mpu_get_fifo_stats(struct mpu_fifo_stats_s *stats);
+int mpu_set_reg_shadow(unsigned char enable);
+int mpu_defer_writes(void);
+int mpu_flush_writes(void);
+int mpu_get_shadow_stats(struct mpu_shadow_stats_s *stats);
+int mpu_set_compass_fifo(unsigned char enable, unsigned short lead);
+int mpu_get_compass_fifo(unsigned char *enabled);
 
 int mpu_write_mem(unsigned short mem_addr, unsigned short length,
     unsigned char *data);
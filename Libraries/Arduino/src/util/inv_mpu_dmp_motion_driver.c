@@ -439,6 +439,12 @@ static const unsigned short sStartAddress = 0x0400;
                                      DMP_FEATURE_SEND_CAL_GYRO)
 
 #define MAX_PACKET_LENGTH   (32)
+/* Compass data written into the FIFO each sample, see
+ * dmp_enable_compass_fifo.
+ */
+#define COMPASS_BLOCK_LENGTH    (8)
+#define MAX_FIFO_PACKET_LENGTH  (MAX_PACKET_LENGTH + \
+                                 DMP_MAX_COMPASS_BLOCKS * COMPASS_BLOCK_LENGTH)
 
 #define DMP_SAMPLE_RATE     (200)
 #define GYRO_SF             (46850825LL * 200 / DMP_SAMPLE_RATE)
@@ -451,6 +457,22 @@ static const unsigned short sStartAddress = 0x0400;
 #define QUAT_MAG_SQ_MAX         (QUAT_MAG_SQ_NORMALIZED + QUAT_ERROR_THRESH)
 #endif
 
+/* Where each part of a DMP packet is, worked out by dmp_enable_feature so
+ * decoding a packet needn't go through the feature mask.
+ */
+#define PLAN_ABSENT         (0xFF)
+struct decode_plan_s {
+    /* Offsets into the packet, PLAN_ABSENT if it isn't there. The
+     * quaternion is always first.
+     */
+    unsigned char quat;
+    unsigned char accel;
+    unsigned char gyro;
+    unsigned char gesture;
+    /* Sensors flagged in each good packet. */
+    short sensors;
+};
+
 struct dmp_s {
     void (*tap_cb)(unsigned char count, unsigned char direction);
     void (*android_orient_cb)(unsigned char orientation);
@@ -458,16 +480,94 @@ struct dmp_s {
     unsigned short feature_mask;
     unsigned short fifo_rate;
     unsigned char packet_length;
+    struct decode_plan_s plan;
+    /* Compass blocks ahead of each packet, 0 if not in the FIFO. */
+    unsigned char compass_blocks;
+    /* Set when the DMP's memory holds what dmp_enable_feature wrote for
+     * feature_mask, so it only needs to write what a new mask changes.
+     */
+    unsigned char features_written;
+    /* Set when the DMP's memory holds dmp_set_fifo_rate's CFG_6 program,
+     * which is the same for every rate, so it's only written once.
+     */
+    unsigned char rate_end_written;
 };
 
-static struct dmp_s dmp = {
-    .tap_cb = NULL,
-    .android_orient_cb = NULL,
-    .orient = 0,
-    .feature_mask = 0,
-    .fifo_rate = 0,
-    .packet_length = 0
+/* One state per device, like inv_mpu.c's. The functions below work on the
+ * device selected with mpu_select_device.
+ */
+static struct dmp_s dmps[MPU_MAX_DEVICES] = {
+    [0 ... MPU_MAX_DEVICES - 1] = {
+        .tap_cb = NULL,
+        .android_orient_cb = NULL,
+        /* Identity, which is what the DMP image starts with. */
+        .orient = 0x88,
+        .feature_mask = 0,
+        .fifo_rate = 0,
+        .packet_length = 0,
+        .plan = {
+            .quat = PLAN_ABSENT,
+            .accel = PLAN_ABSENT,
+            .gyro = PLAN_ABSENT,
+            .gesture = PLAN_ABSENT,
+            .sensors = 0
+        },
+        .compass_blocks = 0,
+        .features_written = 0,
+        .rate_end_written = 0
+    }
 };
+#define dmp (dmps[mpu_get_device()])
+
+/* Have the MPU write the compass data into the FIFO, for blocks samples per
+ * DMP packet (0 to stop). Takes effect at the next FIFO reset.
+ */
+static int set_compass_fifo(unsigned char blocks)
+{
+    unsigned short lead = 0;
+
+    /* The DMP writes its first packet after a reset with the first sample,
+     * so it only has one compass block.
+     */
+    if (blocks > 1)
+        lead = COMPASS_BLOCK_LENGTH + dmp.packet_length;
+    if (mpu_set_compass_fifo(blocks ? 1 : 0, lead))
+        return -1;
+    dmp.compass_blocks = blocks;
+    return 0;
+}
+
+/* The DMP code for dmp_enable_lp_quat and dmp_enable_6x_lp_quat, without
+ * the FIFO reset.
+ */
+static int write_lp_quat(unsigned char enable)
+{
+    unsigned char regs[4];
+    if (enable) {
+        regs[0] = DINBC0;
+        regs[1] = DINBC2;
+        regs[2] = DINBC4;
+        regs[3] = DINBC6;
+    }
+    else
+        memset(regs, 0x8B, 4);
+
+    return mpu_write_mem(CFG_LP_QUAT, 4, regs);
+}
+
+static int write_6x_lp_quat(unsigned char enable)
+{
+    unsigned char regs[4];
+    if (enable) {
+        regs[0] = DINA20;
+        regs[1] = DINA28;
+        regs[2] = DINA30;
+        regs[3] = DINA38;
+    } else
+        memset(regs, 0xA3, 4);
+
+    return mpu_write_mem(CFG_8, 4, regs);
+}
 
 /**
  *  @brief  Load the DMP with this image.
@@ -475,6 +575,10 @@ static struct dmp_s dmp = {
  */
 int dmp_load_motion_driver_firmware(void)
 {
+    /* mpu_init has turned off compass data in the FIFO. */
+    dmp.compass_blocks = 0;
+    dmp.features_written = 0;
+    dmp.rate_end_written = 0;
     return mpu_load_firmware(DMP_CODE_SIZE, dmp_memory, sStartAddress,
         DMP_SAMPLE_RATE);
 }
@@ -639,6 +743,81 @@ int dmp_set_accel_bias(long *bias)
     return mpu_write_mem(D_ACCEL_BIAS, 12, regs);
 }
 
+/* Undo the chip-to-body mapping done by dmp_set_gyro_bias and
+ * dmp_set_accel_bias.
+ */
+static void body_to_chip(const long *body, long *bias)
+{
+    bias[dmp.orient & 3] = (dmp.orient & 4) ? -body[0] : body[0];
+    bias[(dmp.orient >> 3) & 3] = (dmp.orient & 0x20) ? -body[1] : body[1];
+    bias[(dmp.orient >> 6) & 3] = (dmp.orient & 0x100) ? -body[2] : body[2];
+}
+
+/**
+ *  @brief      Read the gyro biases back from the DMP.
+ *  If the DMP-based gyro calibration is enabled, these are the biases it
+ *  computed last, otherwise the ones pushed with dmp_set_gyro_bias. Either
+ *  way they can be pushed back with dmp_set_gyro_bias, e.g. after a reset.
+ *  @param[out] bias    Gyro biases in q16, as taken by dmp_set_gyro_bias.
+ *  @return     0 if successful.
+ */
+int dmp_get_gyro_bias(long *bias)
+{
+    long gyro_bias_body[3];
+    unsigned char regs[12];
+    unsigned char ii;
+
+    /* D_EXT_GYRO_BIAS_X..Z are consecutive. */
+    if (mpu_read_mem(D_EXT_GYRO_BIAS_X, 12, regs))
+        return -1;
+    for (ii = 0; ii < 3; ii++) {
+        gyro_bias_body[ii] = (int32_t)(((uint32_t)regs[ii * 4] << 24) |
+            ((uint32_t)regs[ii * 4 + 1] << 16) |
+            ((uint32_t)regs[ii * 4 + 2] << 8) | regs[ii * 4 + 3]);
+#ifdef EMPL_NO_64BIT
+        gyro_bias_body[ii] = (long)(((float)gyro_bias_body[ii] * 1073741824.f) / GYRO_SF);
+#else
+        gyro_bias_body[ii] = (long)(((long long)gyro_bias_body[ii] << 30) / GYRO_SF);
+#endif
+    }
+    body_to_chip(gyro_bias_body, bias);
+    return 0;
+}
+
+/**
+ *  @brief      Read the accel biases back from the DMP.
+ *  The DMP doesn't compute these itself: they're the ones last pushed with
+ *  dmp_set_accel_bias, at the current accel full-scale range.
+ *  @param[out] bias    Accel biases in q16, as taken by dmp_set_accel_bias.
+ *  @return     0 if successful.
+ */
+int dmp_get_accel_bias(long *bias)
+{
+    long accel_bias_body[3];
+    unsigned char regs[12];
+    long long accel_sf;
+    unsigned short accel_sens;
+    unsigned char ii;
+
+    mpu_get_accel_sens(&accel_sens);
+    accel_sf = (long long)accel_sens << 15;
+
+    if (mpu_read_mem(D_ACCEL_BIAS, 12, regs))
+        return -1;
+    for (ii = 0; ii < 3; ii++) {
+        accel_bias_body[ii] = (int32_t)(((uint32_t)regs[ii * 4] << 24) |
+            ((uint32_t)regs[ii * 4 + 1] << 16) |
+            ((uint32_t)regs[ii * 4 + 2] << 8) | regs[ii * 4 + 3]);
+#ifdef EMPL_NO_64BIT
+        accel_bias_body[ii] = (long)(((float)accel_bias_body[ii] * 1073741824.f) / accel_sf);
+#else
+        accel_bias_body[ii] = (long)(((long long)accel_bias_body[ii] << 30) / accel_sf);
+#endif
+    }
+    body_to_chip(accel_bias_body, bias);
+    return 0;
+}
+
 /**
  *  @brief      Set DMP output rate.
  *  Only used when DMP is on.
@@ -659,10 +838,19 @@ int dmp_set_fifo_rate(unsigned short rate)
     tmp[1] = (unsigned char)(div & 0xFF);
     if (mpu_write_mem(D_0_22, 2, tmp))
         return -1;
-    if (mpu_write_mem(CFG_6, 12, (unsigned char*)regs_end))
-        return -1;
+    if (!dmp.rate_end_written) {
+        if (mpu_write_mem(CFG_6, 12, (unsigned char*)regs_end))
+            return -1;
+        dmp.rate_end_written = 1;
+    }
 
     dmp.fifo_rate = rate;
+    /* One compass block per sample: stop when there are too many. */
+    if (dmp.compass_blocks) {
+        if (set_compass_fifo((div + 1 > DMP_MAX_COMPASS_BLOCKS) ? 0 : div + 1))
+            return -1;
+        return mpu_reset_fifo();
+    }
     return 0;
 }
 
@@ -677,6 +865,46 @@ int dmp_get_fifo_rate(unsigned short *rate)
     return 0;
 }
 
+/**
+ *  @brief      Read the compass through the FIFO.
+ *  The MPU writes the compass data (read by its auxiliary I2C master) into
+ *  the FIFO at every sample, ahead of the DMP's packets, and
+ *  dmp_read_fifo_burst returns it with each packet. This saves a separate
+ *  compass read for every batch of packets, but adds eight bytes to the FIFO
+ *  per sample: a packet carries DMP_SAMPLE_RATE / (FIFO rate) compass
+ *  blocks, of which only the newest is used. It's available for FIFO rates
+ *  where that's at most DMP_MAX_COMPASS_BLOCKS, and is turned off if
+ *  dmp_set_fifo_rate sets a lower one.
+ *  \n The FIFO is reset.
+ *  @param[in]  enable  1 to read the compass through the FIFO.
+ *  @return     0 if successful.
+ */
+int dmp_enable_compass_fifo(unsigned char enable)
+{
+    unsigned char blocks = 0;
+
+    if (enable) {
+        if (!dmp.fifo_rate ||
+            (DMP_SAMPLE_RATE / dmp.fifo_rate > DMP_MAX_COMPASS_BLOCKS))
+            return -1;
+        blocks = DMP_SAMPLE_RATE / dmp.fifo_rate;
+    }
+    if (set_compass_fifo(blocks))
+        return -1;
+    return mpu_reset_fifo();
+}
+
+/**
+ *  @brief      Check whether the compass is read through the FIFO.
+ *  @param[out] enabled 1 if it is, see dmp_enable_compass_fifo.
+ *  @return     0 if successful.
+ */
+int dmp_get_compass_fifo(unsigned char *enabled)
+{
+    enabled[0] = dmp.compass_blocks ? 1 : 0;
+    return 0;
+}
+
 /**
  *  @brief      Set tap threshold for a specific axis.
  *  @param[in]  axis    1, 2, and 4 for XYZ accel, respectively.
@@ -941,6 +1169,44 @@ int dmp_set_pedometer_walk_time(unsigned long time)
     return mpu_write_mem(D_PEDSTD_TIMECTR, 4, tmp);
 }
 
+/* Work out the packet length and decode plan for the features in mask. The
+ * DMP writes the quaternion, accel, gyro and gesture data, in that order.
+ */
+static void plan_packet(unsigned short mask)
+{
+    struct decode_plan_s *plan = &dmp.plan;
+    unsigned char length = 0;
+
+    plan->quat = PLAN_ABSENT;
+    plan->accel = PLAN_ABSENT;
+    plan->gyro = PLAN_ABSENT;
+    plan->gesture = PLAN_ABSENT;
+    plan->sensors = 0;
+    if (mask & (DMP_FEATURE_LP_QUAT | DMP_FEATURE_6X_LP_QUAT)) {
+        plan->quat = length;
+        length += 16;
+#ifdef FIFO_CORRUPTION_CHECK
+        /* Only flagged once its magnitude has been checked. */
+        plan->sensors |= INV_WXYZ_QUAT;
+#endif
+    }
+    if (mask & DMP_FEATURE_SEND_RAW_ACCEL) {
+        plan->accel = length;
+        length += 6;
+        plan->sensors |= INV_XYZ_ACCEL;
+    }
+    if (mask & DMP_FEATURE_SEND_ANY_GYRO) {
+        plan->gyro = length;
+        length += 6;
+        plan->sensors |= INV_XYZ_GYRO;
+    }
+    if (mask & (DMP_FEATURE_TAP | DMP_FEATURE_ANDROID_ORIENT)) {
+        plan->gesture = length;
+        length += 4;
+    }
+    dmp.packet_length = length;
+}
+
 /**
  *  @brief      Enable DMP features.
  *  The following \#define's are used in the input mask:
@@ -955,61 +1221,83 @@ int dmp_set_pedometer_walk_time(unsigned long time)
  *  exclusive.
  *  \n NOTE: DMP_FEATURE_SEND_RAW_GYRO and DMP_FEATURE_SEND_CAL_GYRO are also
  *  mutually exclusive.
+ *  \n After the first call since the DMP image was loaded, only the DMP
+ *  settings for features that change are written, and the FIFO is reset
+ *  once. The tap settings are set to their defaults when tap is turned on,
+ *  so ones set with dmp_set_tap_thresh etc. while it's on are kept.
  *  @param[in]  mask    Mask of features to enable.
  *  @return     0 if successful.
  */
 int dmp_enable_feature(unsigned short mask)
 {
     unsigned char tmp[10];
+    unsigned short changed;
+
+    if (dmp.features_written)
+        changed = mask ^ (dmp.feature_mask & ~DMP_FEATURE_PEDOMETER);
+    else
+        changed = 0xFFFF;
+    /* Written again below if it succeeds. */
+    dmp.features_written = 0;
 
     /* TODO: All of these settings can probably be integrated into the default
      * DMP image.
      */
     /* Set integration scale factor. */
-    tmp[0] = (unsigned char)((GYRO_SF >> 24) & 0xFF);
-    tmp[1] = (unsigned char)((GYRO_SF >> 16) & 0xFF);
-    tmp[2] = (unsigned char)((GYRO_SF >> 8) & 0xFF);
-    tmp[3] = (unsigned char)(GYRO_SF & 0xFF);
-    mpu_write_mem(D_0_104, 4, tmp);
+    if (changed == 0xFFFF) {
+        tmp[0] = (unsigned char)((GYRO_SF >> 24) & 0xFF);
+        tmp[1] = (unsigned char)((GYRO_SF >> 16) & 0xFF);
+        tmp[2] = (unsigned char)((GYRO_SF >> 8) & 0xFF);
+        tmp[3] = (unsigned char)(GYRO_SF & 0xFF);
+        if (mpu_write_mem(D_0_104, 4, tmp))
+            return -1;
+    }
 
     /* Send sensor data to the FIFO. */
-    tmp[0] = 0xA3;
-    if (mask & DMP_FEATURE_SEND_RAW_ACCEL) {
-        tmp[1] = 0xC0;
-        tmp[2] = 0xC8;
-        tmp[3] = 0xC2;
-    } else {
-        tmp[1] = 0xA3;
-        tmp[2] = 0xA3;
-        tmp[3] = 0xA3;
-    }
-    if (mask & DMP_FEATURE_SEND_ANY_GYRO) {
-        tmp[4] = 0xC4;
-        tmp[5] = 0xCC;
-        tmp[6] = 0xC6;
-    } else {
-        tmp[4] = 0xA3;
-        tmp[5] = 0xA3;
-        tmp[6] = 0xA3;
+    if (changed & (DMP_FEATURE_SEND_RAW_ACCEL | DMP_FEATURE_SEND_ANY_GYRO)) {
+        tmp[0] = 0xA3;
+        if (mask & DMP_FEATURE_SEND_RAW_ACCEL) {
+            tmp[1] = 0xC0;
+            tmp[2] = 0xC8;
+            tmp[3] = 0xC2;
+        } else {
+            tmp[1] = 0xA3;
+            tmp[2] = 0xA3;
+            tmp[3] = 0xA3;
+        }
+        if (mask & DMP_FEATURE_SEND_ANY_GYRO) {
+            tmp[4] = 0xC4;
+            tmp[5] = 0xCC;
+            tmp[6] = 0xC6;
+        } else {
+            tmp[4] = 0xA3;
+            tmp[5] = 0xA3;
+            tmp[6] = 0xA3;
+        }
+        tmp[7] = 0xA3;
+        tmp[8] = 0xA3;
+        tmp[9] = 0xA3;
+        if (mpu_write_mem(CFG_15,10,tmp))
+            return -1;
     }
-    tmp[7] = 0xA3;
-    tmp[8] = 0xA3;
-    tmp[9] = 0xA3;
-    mpu_write_mem(CFG_15,10,tmp);
 
     /* Send gesture data to the FIFO. */
-    if (mask & (DMP_FEATURE_TAP | DMP_FEATURE_ANDROID_ORIENT))
-        tmp[0] = DINA20;
-    else
-        tmp[0] = 0xD8;
-    mpu_write_mem(CFG_27,1,tmp);
+    if (changed & (DMP_FEATURE_TAP | DMP_FEATURE_ANDROID_ORIENT)) {
+        if (mask & (DMP_FEATURE_TAP | DMP_FEATURE_ANDROID_ORIENT))
+            tmp[0] = DINA20;
+        else
+            tmp[0] = 0xD8;
+        if (mpu_write_mem(CFG_27,1,tmp))
+            return -1;
+    }
 
-    if (mask & DMP_FEATURE_GYRO_CAL)
-        dmp_enable_gyro_cal(1);
-    else
-        dmp_enable_gyro_cal(0);
+    if (changed & DMP_FEATURE_GYRO_CAL) {
+        if (dmp_enable_gyro_cal(!!(mask & DMP_FEATURE_GYRO_CAL)))
+            return -1;
+    }
 
-    if (mask & DMP_FEATURE_SEND_ANY_GYRO) {
+    if ((mask & DMP_FEATURE_SEND_ANY_GYRO) &&
+        (changed & DMP_FEATURE_SEND_ANY_GYRO)) {
         if (mask & DMP_FEATURE_SEND_CAL_GYRO) {
             tmp[0] = 0xB2;
             tmp[1] = 0x8B;
@@ -1021,57 +1309,61 @@ int dmp_enable_feature(unsigned short mask)
             tmp[2] = DINAC2;
             tmp[3] = DINA90;
         }
-        mpu_write_mem(CFG_GYRO_RAW_DATA, 4, tmp);
+        if (mpu_write_mem(CFG_GYRO_RAW_DATA, 4, tmp))
+            return -1;
     }
 
-    if (mask & DMP_FEATURE_TAP) {
-        /* Enable tap. */
-        tmp[0] = 0xF8;
-        mpu_write_mem(CFG_20, 1, tmp);
-        dmp_set_tap_thresh(TAP_XYZ, 250);
-        dmp_set_tap_axes(TAP_XYZ);
-        dmp_set_tap_count(1);
-        dmp_set_tap_time(100);
-        dmp_set_tap_time_multi(500);
-
-        dmp_set_shake_reject_thresh(GYRO_SF, 200);
-        dmp_set_shake_reject_time(40);
-        dmp_set_shake_reject_timeout(10);
-    } else {
-        tmp[0] = 0xD8;
-        mpu_write_mem(CFG_20, 1, tmp);
+    if (changed & DMP_FEATURE_TAP) {
+        if (mask & DMP_FEATURE_TAP) {
+            /* Enable tap. */
+            tmp[0] = 0xF8;
+            mpu_write_mem(CFG_20, 1, tmp);
+            dmp_set_tap_thresh(TAP_XYZ, 250);
+            dmp_set_tap_axes(TAP_XYZ);
+            dmp_set_tap_count(1);
+            dmp_set_tap_time(100);
+            dmp_set_tap_time_multi(500);
+
+            dmp_set_shake_reject_thresh(GYRO_SF, 200);
+            dmp_set_shake_reject_time(40);
+            dmp_set_shake_reject_timeout(10);
+        } else {
+            tmp[0] = 0xD8;
+            mpu_write_mem(CFG_20, 1, tmp);
+        }
     }
 
-    if (mask & DMP_FEATURE_ANDROID_ORIENT) {
-        tmp[0] = 0xD9;
-    } else
-        tmp[0] = 0xD8;
-    mpu_write_mem(CFG_ANDROID_ORIENT_INT, 1, tmp);
-
-    if (mask & DMP_FEATURE_LP_QUAT)
-        dmp_enable_lp_quat(1);
-    else
-        dmp_enable_lp_quat(0);
+    if (changed & DMP_FEATURE_ANDROID_ORIENT) {
+        if (mask & DMP_FEATURE_ANDROID_ORIENT) {
+            tmp[0] = 0xD9;
+        } else
+            tmp[0] = 0xD8;
+        if (mpu_write_mem(CFG_ANDROID_ORIENT_INT, 1, tmp))
+            return -1;
+    }
 
-    if (mask & DMP_FEATURE_6X_LP_QUAT)
-        dmp_enable_6x_lp_quat(1);
-    else
-        dmp_enable_6x_lp_quat(0);
+    /* The FIFO is reset once, below. */
+    if (changed & DMP_FEATURE_LP_QUAT) {
+        if (write_lp_quat(!!(mask & DMP_FEATURE_LP_QUAT)))
+            return -1;
+    }
+    if (changed & DMP_FEATURE_6X_LP_QUAT) {
+        if (write_6x_lp_quat(!!(mask & DMP_FEATURE_6X_LP_QUAT)))
+            return -1;
+    }
 
     /* Pedometer is always enabled. */
     dmp.feature_mask = mask | DMP_FEATURE_PEDOMETER;
-    mpu_reset_fifo();
-
-    dmp.packet_length = 0;
-    if (mask & DMP_FEATURE_SEND_RAW_ACCEL)
-        dmp.packet_length += 6;
-    if (mask & DMP_FEATURE_SEND_ANY_GYRO)
-        dmp.packet_length += 6;
-    if (mask & (DMP_FEATURE_LP_QUAT | DMP_FEATURE_6X_LP_QUAT))
-        dmp.packet_length += 16;
-    if (mask & (DMP_FEATURE_TAP | DMP_FEATURE_ANDROID_ORIENT))
-        dmp.packet_length += 4;
 
+    plan_packet(mask);
+
+    /* The lead after a reset depends on the packet length. */
+    if (dmp.compass_blocks)
+        set_compass_fifo(dmp.compass_blocks);
+    if (mpu_reset_fifo())
+        return -1;
+
+    dmp.features_written = 1;
     return 0;
 }
 
@@ -1097,6 +1389,8 @@ int dmp_get_enabled_features(unsigned short *mask)
  */
 int dmp_enable_gyro_cal(unsigned char enable)
 {
+    /* dmp_enable_feature can't tell what's in the DMP's memory now. */
+    dmp.features_written = 0;
     if (enable) {
         unsigned char regs[9] = {0xb8, 0xaa, 0xb3, 0x8d, 0xb4, 0x98, 0x0d, 0x35, 0x5d};
         return mpu_write_mem(CFG_MOTION_BIAS, 9, regs);
@@ -1115,18 +1409,9 @@ int dmp_enable_gyro_cal(unsigned char enable)
  */
 int dmp_enable_lp_quat(unsigned char enable)
 {
-    unsigned char regs[4];
-    if (enable) {
-        regs[0] = DINBC0;
-        regs[1] = DINBC2;
-        regs[2] = DINBC4;
-        regs[3] = DINBC6;
-    }
-    else
-        memset(regs, 0x8B, 4);
-
-    mpu_write_mem(CFG_LP_QUAT, 4, regs);
-
+    dmp.features_written = 0;
+    if (write_lp_quat(enable))
+        return -1;
     return mpu_reset_fifo();
 }
 
@@ -1139,17 +1424,9 @@ int dmp_enable_lp_quat(unsigned char enable)
  */
 int dmp_enable_6x_lp_quat(unsigned char enable)
 {
-    unsigned char regs[4];
-    if (enable) {
-        regs[0] = DINA20;
-        regs[1] = DINA28;
-        regs[2] = DINA30;
-        regs[3] = DINA38;
-    } else
-        memset(regs, 0xA3, 4);
-
-    mpu_write_mem(CFG_8, 4, regs);
-
+    dmp.features_written = 0;
+    if (write_6x_lp_quat(enable))
+        return -1;
     return mpu_reset_fifo();
 }
 
@@ -1209,55 +1486,35 @@ int dmp_set_interrupt_mode(unsigned char mode)
     }
 }
 
-/**
- *  @brief      Get one packet from the FIFO.
- *  If @e sensors does not contain a particular sensor, disregard the data
- *  returned to that pointer.
- *  \n @e sensors can contain a combination of the following flags:
- *  \n INV_X_GYRO, INV_Y_GYRO, INV_Z_GYRO
- *  \n INV_XYZ_GYRO
- *  \n INV_XYZ_ACCEL
- *  \n INV_WXYZ_QUAT
- *  \n If the FIFO has no new data, @e sensors will be zero.
- *  \n If the FIFO is disabled, @e sensors will be zero and this function will
- *  return a non-zero error code.
- *  @param[out] gyro        Gyro data in hardware units.
- *  @param[out] accel       Accel data in hardware units.
- *  @param[out] quat        3-axis quaternion data in hardware units.
- *  @param[out] timestamp   Timestamp in milliseconds.
- *  @param[out] sensors     Mask of sensors read from FIFO.
- *  @param[out] more        Number of remaining packets.
- *  @return     0 if successful.
+/* Big-endian FIFO data. The quaternion elements are signed 32-bit values,
+ * so sign-extend them where long is wider.
  */
-int dmp_read_fifo(short *gyro, short *accel, long *quat,
-    unsigned long *timestamp, short *sensors, unsigned char *more)
+static inline long fifo_long(const unsigned char *data)
 {
-    unsigned char fifo_data[MAX_PACKET_LENGTH];
-    unsigned char ii = 0;
-
-    /* TODO: sensors[0] only changes when dmp_enable_feature is called. We can
-     * cache this value and save some cycles.
-     */
-    sensors[0] = 0;
+    return (int32_t)(((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) |
+        ((uint32_t)data[2] << 8) | data[3]);
+}
 
-    /* Get a packet. */
-    if (mpu_read_fifo_stream(dmp.packet_length, fifo_data, more))
-        return -1;
+static inline short fifo_short(const unsigned char *data)
+{
+    return (short)(((unsigned short)data[0] << 8) | data[1]);
+}
 
-    /* Parse DMP packet. */
-    if (dmp.feature_mask & (DMP_FEATURE_LP_QUAT | DMP_FEATURE_6X_LP_QUAT)) {
+/* Parse one DMP packet, laid out as plan says. Returns -1 if the packet
+ * looks corrupted, in which case the FIFO has already been reset.
+ */
+static int decode_packet(const struct decode_plan_s *plan,
+    unsigned char *fifo_data, short *gyro, short *accel, long *quat,
+    short *sensors)
+{
+    if (plan->quat != PLAN_ABSENT) {
 #ifdef FIFO_CORRUPTION_CHECK
         long quat_q14[4], quat_mag_sq;
 #endif
-        quat[0] = ((long)fifo_data[0] << 24) | ((long)fifo_data[1] << 16) |
-            ((long)fifo_data[2] << 8) | fifo_data[3];
-        quat[1] = ((long)fifo_data[4] << 24) | ((long)fifo_data[5] << 16) |
-            ((long)fifo_data[6] << 8) | fifo_data[7];
-        quat[2] = ((long)fifo_data[8] << 24) | ((long)fifo_data[9] << 16) |
-            ((long)fifo_data[10] << 8) | fifo_data[11];
-        quat[3] = ((long)fifo_data[12] << 24) | ((long)fifo_data[13] << 16) |
-            ((long)fifo_data[14] << 8) | fifo_data[15];
-        ii += 16;
+        quat[0] = fifo_long(fifo_data);
+        quat[1] = fifo_long(fifo_data + 4);
+        quat[2] = fifo_long(fifo_data + 8);
+        quat[3] = fifo_long(fifo_data + 12);
 #ifdef FIFO_CORRUPTION_CHECK
         /* We can detect a corrupted FIFO by monitoring the quaternion data and
          * ensuring that the magnitude is always normalized to one. This
@@ -1276,40 +1533,203 @@ int dmp_read_fifo(short *gyro, short *accel, long *quat,
         if ((quat_mag_sq < QUAT_MAG_SQ_MIN) ||
             (quat_mag_sq > QUAT_MAG_SQ_MAX)) {
             /* Quaternion is outside of the acceptable threshold. */
-            mpu_reset_fifo();
+            mpu_recover_fifo();
             sensors[0] = 0;
             return -1;
         }
-        sensors[0] |= INV_WXYZ_QUAT;
 #endif
     }
 
-    if (dmp.feature_mask & DMP_FEATURE_SEND_RAW_ACCEL) {
-        accel[0] = ((short)fifo_data[ii+0] << 8) | fifo_data[ii+1];
-        accel[1] = ((short)fifo_data[ii+2] << 8) | fifo_data[ii+3];
-        accel[2] = ((short)fifo_data[ii+4] << 8) | fifo_data[ii+5];
-        ii += 6;
-        sensors[0] |= INV_XYZ_ACCEL;
+    if (plan->accel != PLAN_ABSENT) {
+        accel[0] = fifo_short(fifo_data + plan->accel);
+        accel[1] = fifo_short(fifo_data + plan->accel + 2);
+        accel[2] = fifo_short(fifo_data + plan->accel + 4);
     }
 
-    if (dmp.feature_mask & DMP_FEATURE_SEND_ANY_GYRO) {
-        gyro[0] = ((short)fifo_data[ii+0] << 8) | fifo_data[ii+1];
-        gyro[1] = ((short)fifo_data[ii+2] << 8) | fifo_data[ii+3];
-        gyro[2] = ((short)fifo_data[ii+4] << 8) | fifo_data[ii+5];
-        ii += 6;
-        sensors[0] |= INV_XYZ_GYRO;
+    if (plan->gyro != PLAN_ABSENT) {
+        gyro[0] = fifo_short(fifo_data + plan->gyro);
+        gyro[1] = fifo_short(fifo_data + plan->gyro + 2);
+        gyro[2] = fifo_short(fifo_data + plan->gyro + 4);
     }
+    sensors[0] = plan->sensors;
 
     /* Gesture data is at the end of the DMP packet. Parse it and call
      * the gesture callbacks (if registered).
      */
-    if (dmp.feature_mask & (DMP_FEATURE_TAP | DMP_FEATURE_ANDROID_ORIENT))
-        decode_gesture(fifo_data + ii);
+    if (plan->gesture != PLAN_ABSENT)
+        decode_gesture(fifo_data + plan->gesture);
+
+    return 0;
+}
+
+/**
+ *  @brief      Get one packet from the FIFO.
+ *  If @e sensors does not contain a particular sensor, disregard the data
+ *  returned to that pointer.
+ *  \n @e sensors can contain a combination of the following flags:
+ *  \n INV_X_GYRO, INV_Y_GYRO, INV_Z_GYRO
+ *  \n INV_XYZ_GYRO
+ *  \n INV_XYZ_ACCEL
+ *  \n INV_WXYZ_QUAT
+ *  \n If the FIFO has no new data, @e sensors will be zero.
+ *  \n If the FIFO is disabled, @e sensors will be zero and this function will
+ *  return a non-zero error code.
+ *  @param[out] gyro        Gyro data in hardware units.
+ *  @param[out] accel       Accel data in hardware units.
+ *  @param[out] quat        3-axis quaternion data in hardware units.
+ *  @param[out] timestamp   Timestamp in milliseconds.
+ *  @param[out] sensors     Mask of sensors read from FIFO.
+ *  @param[out] more        Number of remaining packets.
+ *  @return     0 if successful.
+ */
+int dmp_read_fifo(short *gyro, short *accel, long *quat,
+    unsigned long *timestamp, short *sensors, unsigned char *more)
+{
+    unsigned char fifo_data[MAX_FIFO_PACKET_LENGTH];
+    unsigned char compass_length;
+
+    sensors[0] = 0;
+
+    /* Get a packet, skipping any compass data ahead of it. */
+    compass_length = dmp.compass_blocks * COMPASS_BLOCK_LENGTH;
+    if (mpu_read_fifo_stream(compass_length + dmp.packet_length, fifo_data,
+            more))
+        return -1;
+
+    if (decode_packet(&dmp.plan, fifo_data + compass_length, gyro, accel,
+            quat, sensors))
+        return -1;
 
     get_ms(timestamp);
     return 0;
 }
 
+/* Length of a packet in the FIFO, with any compass data ahead of it, and
+ * the most packets that fit in a burst's buffer.
+ */
+static unsigned char burst_packet_length(unsigned char *max_packets)
+{
+    unsigned char length;
+
+    if (max_packets[0] > DMP_MAX_BURST_PACKETS)
+        max_packets[0] = DMP_MAX_BURST_PACKETS;
+    /* Packets with compass data ahead of them may not all fit. */
+    length = dmp.compass_blocks * COMPASS_BLOCK_LENGTH + dmp.packet_length;
+    if (max_packets[0] > DMP_MAX_BURST_BYTES / length)
+        max_packets[0] = DMP_MAX_BURST_BYTES / length;
+    return length;
+}
+
+/**
+ *  @brief      Size up a burst of packets from a FIFO count read elsewhere.
+ *  For FIFO reads made outside the driver, e.g. queued with
+ *  arduino_i2c_submit: see mpu_plan_fifo_stream_burst. The packets are
+ *  @e packets * @e length bytes, read in transfers of whole packets of up
+ *  to I2C_MAX_READ_LENGTH bytes, then decoded with dmp_decode_fifo_burst.
+ *  @param[in]  count_regs  FIFO_COUNTH and FIFO_COUNTL, as read.
+ *  @param[in]  max_packets Most packets to read, at most
+ *                          DMP_MAX_BURST_PACKETS.
+ *  @param[in]  data        Scratch, at least DMP_MAX_BURST_BYTES.
+ *  @param[out] length      Length of a packet in the FIFO.
+ *  @param[out] packets     Number of packets to read.
+ *  @param[out] more        Number of packets left after them.
+ *  @return     0 if there are packets to read.
+ */
+int dmp_plan_fifo_burst(const unsigned char *count_regs,
+    unsigned char max_packets, unsigned char *data, unsigned char *length,
+    unsigned char *packets, unsigned char *more)
+{
+    length[0] = burst_packet_length(&max_packets);
+    return mpu_plan_fifo_stream_burst(length[0], max_packets, count_regs,
+        data, packets, more);
+}
+
+/**
+ *  @brief      Decode packets read from the FIFO.
+ *  As dmp_read_fifo_burst decodes the packets it reads, in one pass with
+ *  the packet layout worked out by dmp_enable_feature. If a corrupted
+ *  packet is found, the FIFO is reset, @e count holds the number of good
+ *  packets decoded before it, and a non-zero error code is returned.
+ *  @param[in]  data        Packets, as read, each with any compass data
+ *                          ahead of it.
+ *  @param[in]  read        Number of packets.
+ *  @param[out] packets     Decoded packets, oldest first.
+ *  @param[out] count       Number of packets decoded.
+ *  @return     0 if successful.
+ */
+int dmp_decode_fifo_burst(unsigned char *data, unsigned char read,
+    struct dmp_packet_s *packets, unsigned char *count)
+{
+    /* The state is looked up once for the whole burst, not per field. */
+    const struct dmp_s *state = &dmp;
+    const unsigned char compass_length =
+        state->compass_blocks * COMPASS_BLOCK_LENGTH;
+    struct dmp_packet_s *packet = packets;
+    struct dmp_packet_s *end = packets + read;
+    unsigned char jj;
+
+    count[0] = 0;
+    for (; packet < end; packet++) {
+        data += compass_length;
+        if (decode_packet(&state->plan, data, packet->gyro, packet->accel,
+                packet->quat, &packet->sensors))
+            return -1;
+        /* Use the newest new reading: the blocks are oldest first, and
+         * a compass in continuous mode isn't always new in the last one.
+         * A reading is only written if it's new, so stop at the first.
+         */
+        for (jj = 1; jj <= state->compass_blocks; jj++) {
+            if (!mpu_decode_compass(data - jj * COMPASS_BLOCK_LENGTH,
+                    packet->compass)) {
+                packet->sensors |= INV_XYZ_COMPASS;
+                break;
+            }
+        }
+        data += state->packet_length;
+        count[0]++;
+    }
+    return 0;
+}
+
+/**
+ *  @brief      Get several packets from the FIFO.
+ *  The FIFO count is read once and up to @e max_packets packets are read in
+ *  as few I2C transfers as possible, then each is decoded into @e packets.
+ *  All packets share the same @e timestamp, taken after the transfer.
+ *  \n If the compass is read through the FIFO (see dmp_enable_compass_fifo),
+ *  each packet also has the newest compass reading, and INV_XYZ_COMPASS in
+ *  its sensors if that was new and valid.
+ *  \n If a corrupted packet is found, the FIFO is reset, @e count holds the
+ *  number of good packets decoded before it, and a non-zero error code is
+ *  returned.
+ *  @param[out] packets     Decoded packets, oldest first.
+ *  @param[in]  max_packets Size of @e packets, at most DMP_MAX_BURST_PACKETS.
+ *  @param[out] count       Number of packets decoded.
+ *  @param[out] timestamp   Timestamp in milliseconds.
+ *  @param[out] more        Number of remaining packets.
+ *  @return     0 if successful.
+ */
+int dmp_read_fifo_burst(struct dmp_packet_s *packets,
+    unsigned char max_packets, unsigned char *count,
+    unsigned long *timestamp, unsigned char *more)
+{
+    unsigned char fifo_data[DMP_MAX_BURST_BYTES];
+    unsigned char length, read;
+
+    count[0] = 0;
+    length = burst_packet_length(&max_packets);
+    if (mpu_read_fifo_stream_burst(length, max_packets, fifo_data, &read,
+            more))
+        return -1;
+    get_ms(timestamp);
+
+    if (dmp_decode_fifo_burst(fifo_data, read, packets, count)) {
+        more[0] = 0;
+        return -1;
+    }
+    return 0;
+}
+
 /**
  *  @brief      Register a function to be executed on a tap event.
  *  The tap direction is represented by one of the following:
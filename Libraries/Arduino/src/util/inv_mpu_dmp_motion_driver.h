@@ -34,6 +34,23 @@
 #define ANDROID_ORIENT_REVERSE_PORTRAIT     (0x02)
 #define ANDROID_ORIENT_REVERSE_LANDSCAPE    (0x03)
 
+/* Maximum number of packets returned by one dmp_read_fifo_burst call. */
+#define DMP_MAX_BURST_PACKETS   (8)
+/* Most bytes of FIFO data they're read from. */
+#define DMP_MAX_BURST_BYTES     (DMP_MAX_BURST_PACKETS * 32)
+/* Most samples per packet for reading the compass through the FIFO, so a
+ * packet fits in one read (FIFO rates of 50Hz and up).
+ */
+#define DMP_MAX_COMPASS_BLOCKS  (4)
+
+struct dmp_packet_s {
+    long quat[4];
+    short gyro[3];
+    short accel[3];
+    short compass[3];
+    short sensors;
+};
+
 #define DMP_INT_GESTURE     (0x01)
 #define DMP_INT_CONTINUOUS  (0x02)
 
@@ -59,6 +76,10 @@ int dmp_set_interrupt_mode(unsigned char mode);
 int dmp_set_orientation(unsigned short orient);
 int dmp_set_gyro_bias(long *bias);
 int dmp_set_accel_bias(long *bias);
+int dmp_get_gyro_bias(long *bias);
+int dmp_get_accel_bias(long *bias);
+int dmp_enable_compass_fifo(unsigned char enable);
+int dmp_get_compass_fifo(unsigned char *enabled);
 
 /* Tap functions. */
 int dmp_register_tap_cb(void (*func)(unsigned char, unsigned char));
@@ -92,6 +113,14 @@ int dmp_enable_gyro_cal(unsigned char enable);
  */
 int dmp_read_fifo(short *gyro, short *accel, long *quat,
     unsigned long *timestamp, short *sensors, unsigned char *more);
+int dmp_read_fifo_burst(struct dmp_packet_s *packets,
+    unsigned char max_packets, unsigned char *count,
+    unsigned long *timestamp, unsigned char *more);
+int dmp_plan_fifo_burst(const unsigned char *count_regs,
+    unsigned char max_packets, unsigned char *data, unsigned char *length,
+    unsigned char *packets, unsigned char *more);
+int dmp_decode_fifo_burst(unsigned char *data, unsigned char read,
+    struct dmp_packet_s *packets, unsigned char *count);
 
 #endif  /* #ifndef _INV_MPU_DMP_MOTION_DRIVER_H_ */
 
@@ -0,0 +1,352 @@
+/******************************************************************************
+mag_cal.c - MPU-9250 Digital Motion Processor Arduino Library
+Online hard- and soft-iron calibration of the magnetometer
+
+Supported Platforms:
+- ATSAMD21 (Arduino Zero, SparkFun SAMD21 Breakouts)
+******************************************************************************/
+#include <math.h>
+#include <stdlib.h>
+#include "mag_cal.h"
+
+/* Largest reading added, counts (307 uT). */
+#define MAX_COUNT       (2047)
+
+/* Exponents of x, y and z in each sum, in the order mag_cal_add keeps
+ * them.
+ */
+static const unsigned char moment_exps[MAG_CAL_MOMENTS][3] = {
+    {1,0,0}, {0,1,0}, {0,0,1},
+    {2,0,0}, {0,2,0}, {0,0,2}, {1,1,0}, {1,0,1}, {0,1,1},
+    {3,0,0}, {0,3,0}, {0,0,3}, {2,1,0}, {2,0,1}, {1,2,0}, {0,2,1},
+    {1,0,2}, {0,1,2}, {1,1,1},
+    {4,0,0}, {0,4,0}, {0,0,4}, {3,1,0}, {3,0,1}, {1,3,0}, {0,3,1},
+    {1,0,3}, {0,1,3}, {2,2,0}, {2,0,2}, {0,2,2}, {2,1,1}, {1,2,1},
+    {1,1,2}
+};
+
+/* Terms of the fit, x^2, y^2, z^2, xy, xz, yz, x, y, z. */
+static const unsigned char term_exps[9][3] = {
+    {2,0,0}, {0,2,0}, {0,0,2}, {1,1,0}, {1,0,1}, {0,1,1},
+    {1,0,0}, {0,1,0}, {0,0,1}
+};
+
+static int moment_index(unsigned char x, unsigned char y, unsigned char z)
+{
+    int ii;
+
+    for (ii = 0; ii < MAG_CAL_MOMENTS; ii++) {
+        if ((moment_exps[ii][0] == x) && (moment_exps[ii][1] == y) &&
+            (moment_exps[ii][2] == z))
+            return ii;
+    }
+    return -1;
+}
+
+/* Eigen decomposition of a symmetric 3x3 matrix by Jacobi rotations.
+ * a is diagonalized in place, and vec's columns are the eigenvectors.
+ */
+static void eigen3(double a[3][3], double vec[3][3])
+{
+    unsigned char sweep, p, q, k;
+    double theta, t, c, s, x, y;
+
+    for (p = 0; p < 3; p++)
+        for (q = 0; q < 3; q++)
+            vec[p][q] = (p == q) ? 1.0 : 0.0;
+
+    for (sweep = 0; sweep < 16; sweep++) {
+        if (fabs(a[0][1]) + fabs(a[0][2]) + fabs(a[1][2]) <
+            1e-15 * (fabs(a[0][0]) + fabs(a[1][1]) + fabs(a[2][2])))
+            break;
+        for (p = 0; p < 2; p++) {
+            for (q = p + 1; q < 3; q++) {
+                if (a[p][q] == 0.0)
+                    continue;
+                theta = (a[q][q] - a[p][p]) / (2.0 * a[p][q]);
+                t = 1.0 / (fabs(theta) + sqrt(theta * theta + 1.0));
+                if (theta < 0.0)
+                    t = -t;
+                c = 1.0 / sqrt(t * t + 1.0);
+                s = t * c;
+                for (k = 0; k < 3; k++) {
+                    x = a[k][p];
+                    y = a[k][q];
+                    a[k][p] = c * x - s * y;
+                    a[k][q] = s * x + c * y;
+                }
+                for (k = 0; k < 3; k++) {
+                    x = a[p][k];
+                    y = a[q][k];
+                    a[p][k] = c * x - s * y;
+                    a[q][k] = s * x + c * y;
+                }
+                for (k = 0; k < 3; k++) {
+                    x = vec[k][p];
+                    y = vec[k][q];
+                    vec[k][p] = c * x - s * y;
+                    vec[k][q] = s * x + c * y;
+                }
+            }
+        }
+    }
+}
+
+/**
+ *  @brief      Forget every reading.
+ *  @param[out] cal         Calibration state.
+ *  @param[in]  min_step    Distance from the last reading added, in counts,
+ *                          for the next one to be added.
+ */
+void mag_cal_reset(struct mag_cal_s *cal, unsigned short min_step)
+{
+    unsigned char ii;
+
+    for (ii = 0; ii < MAG_CAL_MOMENTS; ii++)
+        cal->sum[ii] = 0;
+    cal->count = 0;
+    cal->min_step = min_step;
+    /* Out of range, so the first reading is always far enough. */
+    cal->last[0] = cal->last[1] = cal->last[2] = -32768;
+}
+
+/**
+ *  @brief      Add a reading to the sums.
+ *  The second powers fit in 32 bits; the third and fourth are 32x32-bit
+ *  products with 64-bit results.
+ *  @param[in]  cal     Calibration state.
+ *  @param[in]  mag     x, y, z, counts.
+ *  @return     1 if the reading was added.
+ */
+int mag_cal_add(struct mag_cal_s *cal, const short *mag)
+{
+    const long x = mag[0], y = mag[1], z = mag[2];
+    long xx, yy, zz, xy, xz, yz, step;
+    long long *sum = cal->sum;
+    unsigned char ii;
+
+    if ((x > MAX_COUNT) || (x < -MAX_COUNT) || (y > MAX_COUNT) ||
+        (y < -MAX_COUNT) || (z > MAX_COUNT) || (z < -MAX_COUNT))
+        return 0;
+    step = labs(x - cal->last[0]) + labs(y - cal->last[1]) +
+        labs(z - cal->last[2]);
+    if (step < cal->min_step)
+        return 0;
+    cal->last[0] = (short)x;
+    cal->last[1] = (short)y;
+    cal->last[2] = (short)z;
+
+    /* Let the oldest readings fade, instead of overflowing. */
+    if (cal->count >= MAG_CAL_MAX_SAMPLES) {
+        for (ii = 0; ii < MAG_CAL_MOMENTS; ii++)
+            sum[ii] /= 2;
+        cal->count /= 2;
+    }
+    cal->count++;
+
+    xx = x * x;
+    yy = y * y;
+    zz = z * z;
+    xy = x * y;
+    xz = x * z;
+    yz = y * z;
+    sum[0] += x;
+    sum[1] += y;
+    sum[2] += z;
+    sum[3] += xx;
+    sum[4] += yy;
+    sum[5] += zz;
+    sum[6] += xy;
+    sum[7] += xz;
+    sum[8] += yz;
+    sum[9] += (long long)xx * x;
+    sum[10] += (long long)yy * y;
+    sum[11] += (long long)zz * z;
+    sum[12] += (long long)xx * y;
+    sum[13] += (long long)xx * z;
+    sum[14] += (long long)yy * x;
+    sum[15] += (long long)yy * z;
+    sum[16] += (long long)zz * x;
+    sum[17] += (long long)zz * y;
+    sum[18] += (long long)xy * z;
+    sum[19] += (long long)xx * xx;
+    sum[20] += (long long)yy * yy;
+    sum[21] += (long long)zz * zz;
+    sum[22] += (long long)xx * xy;
+    sum[23] += (long long)xx * xz;
+    sum[24] += (long long)yy * xy;
+    sum[25] += (long long)yy * yz;
+    sum[26] += (long long)zz * xz;
+    sum[27] += (long long)zz * yz;
+    sum[28] += (long long)xx * yy;
+    sum[29] += (long long)xx * zz;
+    sum[30] += (long long)yy * zz;
+    sum[31] += (long long)xx * yz;
+    sum[32] += (long long)yy * xz;
+    sum[33] += (long long)zz * xy;
+    return 1;
+}
+
+/**
+ *  @brief      Fit an ellipsoid to the readings added so far.
+ *  The readings are scaled by their RMS distance from the origin, so the
+ *  normal equations' terms are all about 1. They're solved by Cholesky
+ *  decomposition for x'Ax + 2b'x = 1. The center is then -A^-1 b, and
+ *  with k = 1 + b'A^-1 b, (x - c)'(A / k)(x - c) = 1, so A / k's
+ *  eigenvalues are the radii's inverse squares.
+ *  @param[in]  cal     Calibration state.
+ *  @param[out] fit     Correction, and how good it is.
+ *  @return     0 if successful, or one of the MAG_CAL errors.
+ */
+int mag_cal_solve(const struct mag_cal_s *cal, struct mag_cal_fit_s *fit)
+{
+    double mean[MAG_CAL_MOMENTS], norm[45], rhs[9], param[9];
+    double a[3][3], vec[3][3], cov[3][3], center[3];
+    double n, scale, sum, k, radius[3], geo, min_r, max_r, residual;
+    int ii, jj, kk, deg;
+
+    for (ii = 0; ii < 3; ii++) {
+        fit->offset[ii] = 0.f;
+        for (jj = 0; jj < 3; jj++)
+            fit->matrix[ii * 3 + jj] = (ii == jj) ? 1.f : 0.f;
+    }
+    fit->radius = fit->ratio = fit->error = fit->spread = 0.f;
+    if (cal->count < MAG_CAL_MIN_SAMPLES)
+        return MAG_CAL_TOO_FEW;
+
+    /* Mean of each product, of the readings over their RMS size. */
+    n = cal->count;
+    scale = sqrt((double)(cal->sum[3] + cal->sum[4] + cal->sum[5]) / n);
+    if (scale < 1.0)
+        return MAG_CAL_SINGULAR;
+    for (ii = 0; ii < MAG_CAL_MOMENTS; ii++) {
+        deg = moment_exps[ii][0] + moment_exps[ii][1] + moment_exps[ii][2];
+        mean[ii] = (double)cal->sum[ii] / n;
+        for (jj = 0; jj < deg; jj++)
+            mean[ii] /= scale;
+    }
+
+    /* Normal equations, lower triangle packed by rows. */
+    for (ii = 0; ii < 9; ii++) {
+        rhs[ii] = mean[moment_index(term_exps[ii][0], term_exps[ii][1],
+            term_exps[ii][2])];
+        for (jj = 0; jj <= ii; jj++)
+            norm[ii * (ii + 1) / 2 + jj] = mean[moment_index(
+                term_exps[ii][0] + term_exps[jj][0],
+                term_exps[ii][1] + term_exps[jj][1],
+                term_exps[ii][2] + term_exps[jj][2])];
+    }
+
+    /* Cholesky decomposition, in place. */
+    for (ii = 0; ii < 9; ii++) {
+        for (jj = 0; jj <= ii; jj++) {
+            sum = norm[ii * (ii + 1) / 2 + jj];
+            for (kk = 0; kk < jj; kk++)
+                sum -= norm[ii * (ii + 1) / 2 + kk] *
+                    norm[jj * (jj + 1) / 2 + kk];
+            if (ii == jj) {
+                if (sum <= 1e-12 * norm[ii * (ii + 1) / 2 + ii])
+                    return MAG_CAL_SINGULAR;
+                norm[ii * (ii + 1) / 2 + ii] = sqrt(sum);
+            } else
+                norm[ii * (ii + 1) / 2 + jj] =
+                    sum / norm[jj * (jj + 1) / 2 + jj];
+        }
+    }
+    for (ii = 0; ii < 9; ii++) {
+        sum = rhs[ii];
+        for (kk = 0; kk < ii; kk++)
+            sum -= norm[ii * (ii + 1) / 2 + kk] * param[kk];
+        param[ii] = sum / norm[ii * (ii + 1) / 2 + ii];
+    }
+    for (ii = 8; ii >= 0; ii--) {
+        sum = param[ii];
+        for (kk = ii + 1; kk < 9; kk++)
+            sum -= norm[kk * (kk + 1) / 2 + ii] * param[kk];
+        param[ii] = sum / norm[ii * (ii + 1) / 2 + ii];
+    }
+    /* Mean squared residual: at the solution, p'Mp = p'r. */
+    residual = 1.0;
+    for (ii = 0; ii < 9; ii++)
+        residual -= param[ii] * rhs[ii];
+
+    /* A = V diag(l) V', so A^-1 b = V diag(1 / l) V'b. */
+    a[0][0] = param[0];
+    a[1][1] = param[1];
+    a[2][2] = param[2];
+    a[0][1] = a[1][0] = param[3] / 2.0;
+    a[0][2] = a[2][0] = param[4] / 2.0;
+    a[1][2] = a[2][1] = param[5] / 2.0;
+    eigen3(a, vec);
+    for (ii = 0; ii < 3; ii++) {
+        if (a[ii][ii] == 0.0)
+            return MAG_CAL_NOT_ELLIPSOID;
+    }
+    for (ii = 0; ii < 3; ii++) {
+        center[ii] = 0.0;
+        for (jj = 0; jj < 3; jj++) {
+            sum = 0.0;
+            for (kk = 0; kk < 3; kk++)
+                sum += vec[kk][jj] * param[6 + kk] / 2.0;
+            center[ii] -= vec[ii][jj] * sum / a[jj][jj];
+        }
+    }
+    k = 1.0;
+    for (ii = 0; ii < 3; ii++)
+        k -= center[ii] * param[6 + ii] / 2.0;
+    for (ii = 0; ii < 3; ii++) {
+        if (a[ii][ii] / k <= 0.0)
+            return MAG_CAL_NOT_ELLIPSOID;
+        radius[ii] = sqrt(k / a[ii][ii]);
+    }
+    geo = cbrt(radius[0] * radius[1] * radius[2]);
+    min_r = max_r = radius[0];
+    for (ii = 1; ii < 3; ii++) {
+        if (radius[ii] < min_r)
+            min_r = radius[ii];
+        if (radius[ii] > max_r)
+            max_r = radius[ii];
+    }
+
+    /* Squash each axis of the ellipsoid to the mean radius. */
+    for (ii = 0; ii < 3; ii++) {
+        fit->offset[ii] = (float)(center[ii] * scale);
+        for (jj = 0; jj < 3; jj++) {
+            sum = 0.0;
+            for (kk = 0; kk < 3; kk++)
+                sum += vec[ii][kk] * vec[jj][kk] * geo / radius[kk];
+            fit->matrix[ii * 3 + jj] = (float)sum;
+        }
+    }
+    fit->radius = (float)(geo * scale);
+    fit->ratio = (float)(max_r / min_r);
+    /* A reading d from the surface is off by about 2 k d / radius. */
+    fit->error = (float)(sqrt(residual > 0.0 ? residual : 0.0) /
+        (2.0 * fabs(k)));
+
+    /* The readings' covariance, for how much of the sphere they cover. */
+    for (ii = 0; ii < 3; ii++) {
+        for (jj = 0; jj < 3; jj++) {
+            cov[ii][jj] = mean[moment_index(
+                (ii == 0) + (jj == 0), (ii == 1) + (jj == 1),
+                (ii == 2) + (jj == 2))] - mean[ii] * mean[jj];
+        }
+    }
+    eigen3(cov, vec);
+    sum = cov[0][0];
+    for (ii = 1; ii < 3; ii++) {
+        if (cov[ii][ii] < sum)
+            sum = cov[ii][ii];
+    }
+    fit->spread = (float)(sqrt(sum > 0.0 ? sum : 0.0) / geo);
+
+    if ((min_r * scale < MAG_CAL_MIN_RADIUS) ||
+        (max_r * scale > MAG_CAL_MAX_RADIUS) ||
+        (fit->ratio > MAG_CAL_MAX_RATIO))
+        return MAG_CAL_BAD_SHAPE;
+    if (fit->error > MAG_CAL_MAX_ERROR)
+        return MAG_CAL_BAD_FIT;
+    if (fit->spread < MAG_CAL_MIN_SPREAD)
+        return MAG_CAL_NARROW;
+    return 0;
+}
@@ -0,0 +1,99 @@
+/******************************************************************************
+mag_cal.h - MPU-9250 Digital Motion Processor Arduino Library
+Online hard- and soft-iron calibration of the magnetometer
+
+Iron on the board adds a fixed field to every reading (hard iron), and
+bends the field it's in (soft iron), so as the board turns, the readings
+trace an ellipsoid off the origin instead of a sphere around it. This fits
+that ellipsoid, x'Ax + 2b'x = 1, by least squares, and gives the correction
+that turns it back into a sphere:
+
+    corrected = matrix * (reading - offset)
+
+The fit only needs sums of the readings' products up to the fourth power,
+so readings are added to those as they come (34 64-bit sums, 25 multiplies
+per reading), and none are stored. Solving them is a 9x9 system and a 3x3
+eigen decomposition in double precision, once every few dozen readings.
+Readings within min_step of the last one added are skipped, so a board
+sitting still doesn't outweigh the rest of the sphere, and after
+MAG_CAL_MAX_SAMPLES the sums are halved, so old readings fade out.
+
+The matrix keeps the geometric mean of the ellipsoid's radii, so corrected
+readings stay in counts, at about the same scale.
+
+Supported Platforms:
+- ATSAMD21 (Arduino Zero, SparkFun SAMD21 Breakouts)
+******************************************************************************/
+#ifndef _MAG_CAL_H_
+#define _MAG_CAL_H_
+
+#define MAG_CAL_MOMENTS         (34)
+
+/* Default distance (|dx| + |dy| + |dz|, counts) from the last reading added
+ * for the next one to be added: about 3 uT.
+ */
+#define MAG_CAL_MIN_STEP        (20)
+
+/* Readings needed for a fit. */
+#define MAG_CAL_MIN_SAMPLES     (200)
+
+/* The sums are halved when they hold this many readings. Readings are at
+ * most 2^11 counts, so the fourth-power sums stay within 2^57.
+ */
+#define MAG_CAL_MAX_SAMPLES     (4096)
+
+/* Fits are rejected if... */
+#define MAG_CAL_MIN_RADIUS      (100.f)     /* a radius is under 15 uT, */
+#define MAG_CAL_MAX_RADIUS      (700.f)     /* or over 105 uT (counts), */
+#define MAG_CAL_MAX_RATIO       (1.5f)      /* the radii differ by more, */
+#define MAG_CAL_MAX_ERROR       (0.05f)     /* the RMS distance from the
+                                             * ellipsoid, over the radius,
+                                             * is more, */
+#define MAG_CAL_MIN_SPREAD      (0.25f)     /* or the readings' standard
+                                             * deviation along some axis,
+                                             * over the radius, is less:
+                                             * they don't cover enough of
+                                             * the sphere (a full sphere
+                                             * has 0.58).
+                                             */
+
+/* Errors from mag_cal_solve. */
+#define MAG_CAL_TOO_FEW         (-1)
+#define MAG_CAL_SINGULAR        (-2)
+#define MAG_CAL_NOT_ELLIPSOID   (-3)
+#define MAG_CAL_BAD_SHAPE       (-4)
+#define MAG_CAL_BAD_FIT         (-5)
+#define MAG_CAL_NARROW          (-6)
+
+struct mag_cal_s {
+    long long sum[MAG_CAL_MOMENTS]; /* Sums of x^i y^j z^k, 0 < i+j+k <= 4 */
+    unsigned short count;           /* Readings in the sums */
+    unsigned short min_step;
+    short last[3];                  /* Last reading added */
+};
+
+struct mag_cal_fit_s {
+    float offset[3];        /* Center of the ellipsoid, counts */
+    float matrix[9];        /* Row major */
+    float radius;           /* Geometric mean of the radii, counts */
+    float ratio;            /* Largest radius over the smallest */
+    float error;            /* RMS distance from the ellipsoid / radius */
+    float spread;           /* Smallest standard deviation / radius */
+};
+
+/* Forget every reading. Readings closer than min_step (counts) to the last
+ * one added will be skipped.
+ */
+void mag_cal_reset(struct mag_cal_s *cal, unsigned short min_step);
+
+/* Add a reading (counts, any axes). Returns 1 if it was added, 0 if it
+ * was skipped, or out of range (over 2^11 counts).
+ */
+int mag_cal_add(struct mag_cal_s *cal, const short *mag);
+
+/* Fit the readings added so far. Returns 0, or one of the errors above,
+ * and fills in fit either way, as far as it got.
+ */
+int mag_cal_solve(const struct mag_cal_s *cal, struct mag_cal_fit_s *fit);
+
+#endif /* _MAG_CAL_H_ */
@@ -0,0 +1,176 @@
+/******************************************************************************
+mag_fusion.c - MPU-9250 Digital Motion Processor Arduino Library
+9-axis fusion of the DMP's 6-axis quaternion with the magnetometer
+
+Supported Platforms:
+- ATSAMD21 (Arduino Zero, SparkFun SAMD21 Breakouts)
+******************************************************************************/
+#include "mag_fusion.h"
+
+/* Largest yaw drift the integral term takes up, radians per second. The
+ * DMP's yaw drifts well under this once its gyro is calibrated.
+ */
+#define MAX_DRIFT           (0.05f)
+
+/* Readings whose horizontal part (|x| + |y|, counts * 2^8) is smaller than
+ * this carry no heading, e.g. before the first compass read.
+ */
+#define MIN_HORIZONTAL      (256L)
+
+#define PI_Q28              (843314857L)
+
+/* quat = (rotation by yaw about z) * prior */
+static void apply_yaw(struct mag_fusion_s *fusion)
+{
+    const long c = fusion->cos_half, s = fusion->sin_half;
+    const long *p = fusion->prior;
+
+    fusion->quat[0] = fix_mul_q30(c, p[0]) - fix_mul_q30(s, p[3]);
+    fusion->quat[1] = fix_mul_q30(c, p[1]) - fix_mul_q30(s, p[2]);
+    fusion->quat[2] = fix_mul_q30(c, p[2]) + fix_mul_q30(s, p[1]);
+    fusion->quat[3] = fix_mul_q30(c, p[3]) + fix_mul_q30(s, p[0]);
+}
+
+/**
+ *  @brief      Set up the fusion.
+ *  @param[out] fusion  Fusion state.
+ *  @param[in]  kp      Proportional gain, 1/s.
+ *  @param[in]  ki      Integral gain, 1/s^2.
+ *  @param[in]  rate    Compass readings per second.
+ */
+void mag_fusion_init(struct mag_fusion_s *fusion, float kp, float ki,
+    unsigned short rate)
+{
+    fusion->prior[0] = 1L << 30;
+    fusion->prior[1] = fusion->prior[2] = fusion->prior[3] = 0;
+    mag_fusion_set_gains(fusion, kp, ki, rate);
+    mag_fusion_reset(fusion);
+}
+
+/**
+ *  @brief      Set the gains.
+ *  They're kept as the fraction of the error corrected per reading, so a
+ *  reading needs no time step.
+ *  @param[in]  fusion  Fusion state.
+ *  @param[in]  kp      Proportional gain, 1/s.
+ *  @param[in]  ki      Integral gain, 1/s^2.
+ *  @param[in]  rate    Compass readings per second.
+ */
+void mag_fusion_set_gains(struct mag_fusion_s *fusion, float kp, float ki,
+    unsigned short rate)
+{
+    float dt = 1.f / (rate ? rate : 1);
+    float kp_dt = kp * dt, ki_dt = ki * dt * dt;
+
+    /* More than the whole error per reading would overshoot. */
+    fusion->kp = (long)((kp_dt < 1.f ? kp_dt : 1.f) * 1073741824.f);
+    fusion->ki = (long)((ki_dt < 1.f ? ki_dt : 1.f) * 1073741824.f);
+    fusion->drift_limit = (long)(MAX_DRIFT * dt * 268435456.f);
+}
+
+/**
+ *  @brief      Forget the learned yaw and drift.
+ *  @param[in]  fusion  Fusion state.
+ */
+void mag_fusion_reset(struct mag_fusion_s *fusion)
+{
+    fusion->yaw = 0;
+    fusion->cos_half = 1L << 30;
+    fusion->sin_half = 0;
+    fusion->drift = 0;
+    fusion->error = 0;
+    fusion->snap = 1;
+    apply_yaw(fusion);
+}
+
+/**
+ *  @brief      Take a new DMP quaternion.
+ *  @param[in]  fusion  Fusion state.
+ *  @param[in]  quat    w, x, y, z, Q30.
+ */
+void mag_fusion_update_quat(struct mag_fusion_s *fusion, const long *quat)
+{
+    fusion->prior[0] = quat[0];
+    fusion->prior[1] = quat[1];
+    fusion->prior[2] = quat[2];
+    fusion->prior[3] = quat[3];
+    apply_yaw(fusion);
+}
+
+/**
+ *  @brief      Correct the yaw with a compass reading.
+ *  Only the first two rows of the rotation are needed, for the reading's
+ *  horizontal part in the world frame. Like computeEulerAnglesFixed(),
+ *  they're kept in Q29, from Q30 products.
+ *  @param[in]  fusion  Fusion state.
+ *  @param[in]  mag     x, y, z, MPU-9250 axes, up to +/-2^15.
+ *  @return     0 if successful, -1 if the reading was ignored.
+ */
+int mag_fusion_update_mag(struct mag_fusion_s *fusion, const long *mag)
+{
+    const long w = fusion->quat[0], x = fusion->quat[1];
+    const long y = fusion->quat[2], z = fusion->quat[3];
+    long xx = fix_mul_q30(x, x), yy = fix_mul_q30(y, y);
+    long zz = fix_mul_q30(z, z), xy = fix_mul_q30(x, y);
+    long xz = fix_mul_q30(x, z), yz = fix_mul_q30(y, z);
+    long wx = fix_mul_q30(w, x), wy = fix_mul_q30(w, y);
+    long wz = fix_mul_q30(w, z);
+    long hx, hy, error, correction;
+
+    /* Horizontal part of the reading in the world frame, counts * 2^8 */
+    hx = (long)(((long long)((1L << 29) - (yy + zz)) * mag[0] +
+        (long long)(xy - wz) * mag[1] + (long long)(xz + wy) * mag[2]) >> 21);
+    hy = (long)(((long long)(xy + wz) * mag[0] +
+        (long long)((1L << 29) - (xx + zz)) * mag[1] +
+        (long long)(yz - wx) * mag[2]) >> 21);
+    if (((hx < 0 ? -hx : hx) + (hy < 0 ? -hy : hy)) < MIN_HORIZONTAL)
+        return -1;
+
+    /* Turning the yaw by -error would put north on the x axis. */
+    error = fix_atan2(hy, hx);
+    if (fusion->snap) {
+        correction = error << 12;
+        fusion->snap = 0;
+    } else {
+        fusion->drift += (long)(((long long)error * fusion->ki) >> 18);
+        if (fusion->drift > fusion->drift_limit)
+            fusion->drift = fusion->drift_limit;
+        else if (fusion->drift < -fusion->drift_limit)
+            fusion->drift = -fusion->drift_limit;
+        correction = (long)(((long long)error * fusion->kp) >> 18) +
+            fusion->drift;
+    }
+    fusion->error = error;
+
+    /* Both are within +/-pi, so their difference fits in Q28. */
+    fusion->yaw -= correction;
+    if (fusion->yaw > PI_Q28)
+        fusion->yaw -= 2 * PI_Q28;
+    else if (fusion->yaw < -PI_Q28)
+        fusion->yaw += 2 * PI_Q28;
+
+    fix_sincos((fusion->yaw + (1L << 12)) >> 13, &fusion->sin_half,
+        &fusion->cos_half);
+    apply_yaw(fusion);
+    return 0;
+}
+
+/**
+ *  @brief      Compass heading.
+ *  The MPU-9250's x axis is (r00, r10) in the world frame. Heading turns
+ *  clockwise, toward east (-y), where yaw turns counterclockwise.
+ *  @param[in]  fusion  Fusion state.
+ *  @return     Heading in degrees, Q16, in [0, 360).
+ */
+long mag_fusion_heading(const struct mag_fusion_s *fusion)
+{
+    const long w = fusion->quat[0], x = fusion->quat[1];
+    const long y = fusion->quat[2], z = fusion->quat[3];
+    long r00 = (1L << 29) - (fix_mul_q30(y, y) + fix_mul_q30(z, z));
+    long r10 = fix_mul_q30(x, y) + fix_mul_q30(w, z);
+    long heading = fix_rad_to_deg(fix_atan2(-r10, r00));
+
+    if (heading < 0)
+        heading += FIX_360_Q16;
+    return heading;
+}
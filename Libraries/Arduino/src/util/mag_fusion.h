@@ -0,0 +1,77 @@
+/******************************************************************************
+mag_fusion.h - MPU-9250 Digital Motion Processor Arduino Library
+9-axis fusion of the DMP's 6-axis quaternion with the magnetometer
+
+The DMP's 6-axis quaternion has its tilt corrected by gravity, but nothing
+corrects its yaw, which drifts. This keeps a rotation about the vertical
+that, applied to the DMP's quaternion, points the world x axis at magnetic
+north. Each compass reading is turned into the world frame with the fused
+quaternion, and the angle of its horizontal part from the x axis is the
+yaw error. That feeds a proportional-integral correction (Mahony's filter,
+reduced to the one axis the DMP leaves open): the proportional term pulls
+the yaw toward the compass with a time constant of 1 / kp, and the
+integral term learns the DMP's yaw drift rate, so it stops pulling once
+that's taken up.
+
+Everything is fixed point, with no divides. A DMP quaternion costs eight
+64-bit multiplies. A compass reading costs another 25, a CORDIC arc tangent
+and a CORDIC sine and cosine, and a heading four and an arc tangent.
+
+The fused world frame is x north, y west, z up, with the DMP's quaternion
+convention: it turns the MPU-9250's axes into the world's.
+
+Supported Platforms:
+- ATSAMD21 (Arduino Zero, SparkFun SAMD21 Breakouts)
+******************************************************************************/
+#ifndef _MAG_FUSION_H_
+#define _MAG_FUSION_H_
+
+#include "fixed_math.h"
+
+/* Default gains: the yaw follows the compass with a 2 s time constant,
+ * filtering out its noise, and the drift rate is learned in about 10 s.
+ */
+#define MAG_FUSION_KP   (0.5f)      /* 1/s */
+#define MAG_FUSION_KI   (0.05f)     /* 1/s^2 */
+
+struct mag_fusion_s {
+    long quat[4];           /* Fused quaternion, w, x, y, z, Q30 */
+    long prior[4];          /* Last DMP quaternion, Q30 */
+    long yaw;               /* Correction about z, radians, Q28 */
+    long cos_half, sin_half;    /* Of yaw / 2, Q30 */
+    long drift;             /* Learned yaw drift, radians per reading, Q28 */
+    long drift_limit;
+    long error;             /* Last yaw error, radians, Q16 */
+    long kp, ki;            /* Per reading, Q30 */
+    unsigned char snap;     /* The next reading sets the yaw outright */
+};
+
+/* Start with an identity quaternion, gains kp (1/s) and ki (1/s^2), for
+ * compass readings at rate Hz. The first reading sets the yaw.
+ */
+void mag_fusion_init(struct mag_fusion_s *fusion, float kp, float ki,
+    unsigned short rate);
+
+/* Change the gains, or the rate compass readings come at. */
+void mag_fusion_set_gains(struct mag_fusion_s *fusion, float kp, float ki,
+    unsigned short rate);
+
+/* Forget the yaw and drift learned so far. The next reading sets the yaw. */
+void mag_fusion_reset(struct mag_fusion_s *fusion);
+
+/* Take a new DMP quaternion (w, x, y, z, Q30), and update quat. */
+void mag_fusion_update_quat(struct mag_fusion_s *fusion, const long *quat);
+
+/* Correct the yaw with a compass reading, in the MPU-9250's axes (not the
+ * AK8963's), in counts or any other common scale up to +/-2^15. Call once
+ * per new reading, after the DMP quaternion it goes with.
+ * Returns 0, or -1 (and ignores the reading) if it has no horizontal part.
+ */
+int mag_fusion_update_mag(struct mag_fusion_s *fusion, const long *mag);
+
+/* Compass heading of the MPU-9250's x axis, from quat: degrees clockwise
+ * from magnetic north, Q16, in [0, 360).
+ */
+long mag_fusion_heading(const struct mag_fusion_s *fusion);
+
+#endif /* _MAG_FUSION_H_ */